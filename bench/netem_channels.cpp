@@ -0,0 +1,171 @@
+/**
+ \file 		netem_channels.cpp
+ \copyright	ABY - A Framework for Efficient Mixed-protocol Secure Two-party Computation
+			Copyright (C) 2019 ENCRYPTO Group, TU Darmstadt
+			This program is free software: you can redistribute it and/or modify
+            it under the terms of the GNU Lesser General Public License as published
+            by the Free Software Foundation, either version 3 of the License, or
+            (at your option) any later version.
+            ABY is distributed in the hope that it will be useful,
+            but WITHOUT ANY WARRANTY; without even the implied warranty of
+            MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+            GNU Lesser General Public License for more details.
+            You should have received a copy of the GNU Lesser General Public License
+            along with this program. If not, see <http://www.gnu.org/licenses/>.
+ \brief		Channel benchmarks over emulated LAN and WAN links
+ */
+
+#include <ENCRYPTO_utils/channel.h>
+#include <ENCRYPTO_utils/connection.h>
+#include <ENCRYPTO_utils/netem_transport.h>
+#include <ENCRYPTO_utils/parse_options.h>
+#include <ENCRYPTO_utils/rcvthread.h>
+#include <ENCRYPTO_utils/sndthread.h>
+#include <ENCRYPTO_utils/socket.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+
+using bench_clock = std::chrono::steady_clock;
+
+struct bench_profile {
+	const char* name;
+	netem_options options;
+};
+
+// one side of the connection with its send and receive thread
+struct party {
+	std::unique_ptr<CSocket> sock;
+	CLock lock;
+	std::unique_ptr<RcvThread> rcv;
+	std::unique_ptr<SndThread> snd;
+	std::unique_ptr<channel> chan;
+};
+
+// each receive thread ends with the other party's end signal, so both send threads stop first
+static void teardown(party* parties) {
+	for (int i = 0; i < 2; i++) {
+		parties[i].chan.reset();
+		parties[i].snd.reset();
+	}
+	for (int i = 0; i < 2; i++) {
+		parties[i].rcv.reset();
+	}
+}
+
+static double seconds_since(bench_clock::time_point begin) {
+	return std::chrono::duration<double>(bench_clock::now() - begin).count();
+}
+
+// runs server(parties[0]) and client(parties[1]) concurrently, returns the time of the client
+template<typename S, typename C>
+static double run_pattern(party* parties, S server, C client) {
+	std::thread t([&] { server(*parties[0].chan); });
+	auto begin = bench_clock::now();
+	client(*parties[1].chan);
+	double seconds = seconds_since(begin);
+	t.join();
+	return seconds;
+}
+
+int main(int argc, char** argv) {
+	uint32_t rounds = 50, megabytes = 64, port = 7950;
+	parsing_ctx options[] = {
+		{(void*) &rounds, T_NUM, "r", "Rounds of the round-trip patterns, default: 50", false, false},
+		{(void*) &megabytes, T_NUM, "s", "MiB transferred in the bulk pattern, default: 64", false, false},
+		{(void*) &port, T_NUM, "p", "First port to use, default: 7950", false, false},
+	};
+	if (!parse_options(&argc, &argv, options, sizeof(options) / sizeof(parsing_ctx)) || rounds == 0
+			|| megabytes == 0) {
+		print_usage(argv[0], options, sizeof(options) / sizeof(parsing_ctx));
+		return EXIT_FAILURE;
+	}
+	const uint64_t bulk_msg = 1 << 20;
+	const uint64_t round_msg = 16 << 10;
+	uint64_t nbytes = (uint64_t) megabytes << 20;
+
+	std::vector<bench_profile> profiles = {
+		{"none", netem_options::from_profile(NETEM_PROFILE_NONE)},
+		{"lan", netem_options::from_profile(NETEM_PROFILE_LAN)},
+		{"wan", netem_options::from_profile(NETEM_PROFILE_WAN)},
+		{"intercontinental", netem_options::from_profile(NETEM_PROFILE_INTERCONTINENTAL)},
+		{"mobile", netem_options::from_profile(NETEM_PROFILE_MOBILE)},
+	};
+
+	std::printf("%-18s %14s %16s %14s\n", "profile", "ping-pong ms", "16KiB rounds ms", "bulk Mbit/s");
+	for (auto& p : profiles) {
+		p.options.seed = 1;
+		party parties[2];
+		uint16_t cur_port = static_cast<uint16_t>(port++);
+		std::thread t([&] { parties[0].sock = Listen("127.0.0.1", cur_port); });
+		parties[1].sock = Connect("127.0.0.1", cur_port);
+		t.join();
+		if (!parties[0].sock || !parties[1].sock) {
+			std::fprintf(stderr, "could not connect on port %u\n", cur_port);
+			return EXIT_FAILURE;
+		}
+		for (auto& pt : parties) {
+			pt.sock = EmulateNetwork(std::move(pt.sock), p.options);
+			pt.rcv = std::make_unique<RcvThread>(pt.sock.get(), &pt.lock);
+			pt.snd = std::make_unique<SndThread>(pt.sock.get(), &pt.lock);
+			pt.rcv->Start();
+			pt.snd->Start();
+			pt.chan = std::make_unique<channel>(1, pt.rcv.get(), pt.snd.get());
+		}
+
+		// strictly sequential small messages, bound by the RTT
+		double pingpong = run_pattern(parties, [&](channel& c) {
+			uint8_t msg[64];
+			for (uint32_t i = 0; i < rounds; i++) {
+				c.blocking_receive(msg, sizeof(msg));
+				c.send(msg, sizeof(msg));
+			}
+		}, [&](channel& c) {
+			uint8_t msg[64] = {0};
+			for (uint32_t i = 0; i < rounds; i++) {
+				c.send(msg, sizeof(msg));
+				c.blocking_receive(msg, sizeof(msg));
+			}
+		});
+
+		// both parties send, then wait for the other's message, as in a layer of an interactive protocol
+		auto exchange = [&](channel& c) {
+			std::vector<uint8_t> out(round_msg, 0x55), in(round_msg);
+			for (uint32_t i = 0; i < rounds; i++) {
+				c.send(out.data(), out.size());
+				c.blocking_receive(in.data(), in.size());
+			}
+		};
+		double exchanges = run_pattern(parties, exchange, exchange);
+
+		// one-way transfer, timed until the receiver acknowledged the last byte
+		double bulk = run_pattern(parties, [&](channel& c) {
+			std::vector<uint8_t> buf(bulk_msg);
+			for (uint64_t received = 0; received < nbytes; received += bulk_msg) {
+				c.blocking_receive(buf.data(), buf.size());
+			}
+			uint8_t ack = 1;
+			c.send(&ack, 1);
+		}, [&](channel& c) {
+			std::vector<uint8_t> buf(bulk_msg, 0xAA);
+			for (uint64_t sent = 0; sent < nbytes; sent += bulk_msg) {
+				c.send(buf.data(), buf.size());
+			}
+			uint8_t ack;
+			c.blocking_receive(&ack, 1);
+		});
+
+		std::thread fin([&] { parties[0].chan->synchronize_end(); });
+		parties[1].chan->synchronize_end();
+		fin.join();
+		teardown(parties);
+
+		std::printf("%-18s %14.3f %16.3f %14.0f\n", p.name, pingpong * 1e3 / rounds, exchanges * 1e3 / rounds,
+			nbytes * 8 / bulk / 1e6);
+		std::fflush(stdout);
+	}
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,336 @@
+/**
+ \file 		network_suite.cpp
+ \copyright	ABY - A Framework for Efficient Mixed-protocol Secure Two-party Computation
+			Copyright (C) 2019 ENCRYPTO Group, TU Darmstadt
+			This program is free software: you can redistribute it and/or modify
+            it under the terms of the GNU Lesser General Public License as published
+            by the Free Software Foundation, either version 3 of the License, or
+            (at your option) any later version.
+            ABY is distributed in the hope that it will be useful,
+            but WITHOUT ANY WARRANTY; without even the implied warranty of
+            MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+            GNU Lesser General Public License for more details.
+            You should have received a copy of the GNU Lesser General Public License
+            along with this program. If not, see <http://www.gnu.org/licenses/>.
+ \brief		Latency, throughput and CPU cost of CSocket, channel and the connection helpers over loopback
+ */
+
+#include <ENCRYPTO_utils/channel.h>
+#include <ENCRYPTO_utils/connection.h>
+#include <ENCRYPTO_utils/rcvthread.h>
+#include <ENCRYPTO_utils/sndthread.h>
+#include <ENCRYPTO_utils/socket.h>
+
+#include <benchmark/benchmark.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <memory>
+#include <thread>
+#include <vector>
+
+using bench_clock = std::chrono::steady_clock;
+
+// every benchmark run uses its own channels, both parties live in this process
+static uint16_t base_port = 7960;
+static uint32_t next_channel_id = 1;
+static const uint64_t batch_bytes = 16 << 20; // payload per throughput iteration, unless a message is larger
+static const uint64_t batch_max_msgs = 1 << 16; // bounds the iteration time of tiny messages
+
+// two parties connected over loopback, each with its own send and receive thread
+struct loopback {
+	struct party {
+		std::unique_ptr<CSocket> sock;
+		CLock lock;
+		std::unique_ptr<RcvThread> rcv;
+		std::unique_ptr<SndThread> snd;
+	};
+	party parties[2];
+
+	bool connect(uint16_t port) {
+		std::thread t([&] { parties[0].sock = Listen("127.0.0.1", port); });
+		parties[1].sock = Connect("127.0.0.1", port);
+		t.join();
+		if (!parties[0].sock || !parties[1].sock) {
+			return false;
+		}
+		for (auto& p : parties) {
+			p.rcv = std::make_unique<RcvThread>(p.sock.get(), &p.lock);
+			p.snd = std::make_unique<SndThread>(p.sock.get(), &p.lock);
+			p.rcv->Start();
+			p.snd->Start();
+		}
+		return true;
+	}
+
+	// each receive thread ends with the other party's end signal, so both send threads stop first
+	~loopback() {
+		for (auto& p : parties) {
+			p.snd.reset();
+		}
+		for (auto& p : parties) {
+			p.rcv.reset();
+		}
+	}
+};
+
+static loopback* shared_link = nullptr;
+static std::unique_ptr<CSocket> raw_server, raw_client;
+
+// a pair of channels with the same fresh id, [0] at the server and [1] at the client
+struct channel_pair {
+	std::unique_ptr<channel> server, client;
+
+	channel_pair() {
+		if (next_channel_id == ADMIN_CHANNEL) {
+			next_channel_id++;
+		}
+		uint32_t id = next_channel_id++;
+		server = std::make_unique<channel>(id, shared_link->parties[0].rcv.get(), shared_link->parties[0].snd.get());
+		client = std::make_unique<channel>(id, shared_link->parties[1].rcv.get(), shared_link->parties[1].snd.get());
+	}
+
+	// both sides have to synchronize concurrently, as each waits for the other's end signal
+	~channel_pair() {
+		std::thread t([this] { server->synchronize_end(); });
+		client->synchronize_end();
+		t.join();
+	}
+};
+
+// CPU time of all threads of the process, i.e. of both parties including their send and receive threads
+static double process_cpu_seconds() {
+	timespec ts;
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// the per-iteration round-trip times as counters, the reported time is their mean
+static void report_latency(benchmark::State& state, std::vector<double>& rtts) {
+	if (rtts.empty()) {
+		return;
+	}
+	std::sort(rtts.begin(), rtts.end());
+	auto percentile = [&](double p) {
+		return rtts[std::min(rtts.size() - 1, static_cast<size_t>(p * rtts.size()))] * 1e6;
+	};
+	state.counters["p50_us"] = percentile(0.5);
+	state.counters["p90_us"] = percentile(0.9);
+	state.counters["p99_us"] = percentile(0.99);
+	state.counters["p999_us"] = percentile(0.999);
+	state.counters["max_us"] = rtts.back() * 1e6;
+}
+
+static void report_throughput(benchmark::State& state, uint64_t bytes, double cpu_seconds) {
+	state.SetBytesProcessed(static_cast<int64_t>(bytes));
+	state.counters["cpu_ns_per_byte"] = bytes ? cpu_seconds * 1e9 / bytes : 0;
+}
+
+// number of messages of the given size per throughput iteration
+static uint64_t batch_msgs(uint64_t msgsize) {
+	return std::min(std::max<uint64_t>(batch_bytes / msgsize, 1), batch_max_msgs);
+}
+
+static void BM_SocketPingPong(benchmark::State& state) {
+	std::vector<uint8_t> msg(state.range(0));
+	std::thread echo([&] {
+		std::vector<uint8_t> buf(msg.size());
+		for (benchmark::IterationCount i = 0; i < state.max_iterations; i++) {
+			raw_server->Receive(buf.data(), buf.size());
+			raw_server->Send(buf.data(), buf.size());
+		}
+	});
+	std::vector<double> rtts;
+	rtts.reserve(state.max_iterations);
+	for (auto _ : state) {
+		auto begin = bench_clock::now();
+		raw_client->Send(msg.data(), msg.size());
+		raw_client->Receive(msg.data(), msg.size());
+		double rtt = std::chrono::duration<double>(bench_clock::now() - begin).count();
+		state.SetIterationTime(rtt);
+		rtts.push_back(rtt);
+	}
+	echo.join();
+	report_latency(state, rtts);
+}
+BENCHMARK(BM_SocketPingPong)->Arg(16)->Arg(1 << 10)->Arg(64 << 10)->UseManualTime();
+
+static void BM_ChannelPingPong(benchmark::State& state) {
+	channel_pair chans;
+	std::vector<uint8_t> msg(state.range(0));
+	std::thread echo([&] {
+		std::vector<uint8_t> buf(msg.size());
+		for (benchmark::IterationCount i = 0; i < state.max_iterations; i++) {
+			chans.server->blocking_receive(buf.data(), buf.size());
+			chans.server->send(buf.data(), buf.size());
+		}
+	});
+	std::vector<double> rtts;
+	rtts.reserve(state.max_iterations);
+	for (auto _ : state) {
+		auto begin = bench_clock::now();
+		chans.client->send(msg.data(), msg.size());
+		chans.client->blocking_receive(msg.data(), msg.size());
+		double rtt = std::chrono::duration<double>(bench_clock::now() - begin).count();
+		state.SetIterationTime(rtt);
+		rtts.push_back(rtt);
+	}
+	echo.join();
+	report_latency(state, rtts);
+}
+BENCHMARK(BM_ChannelPingPong)->Arg(16)->Arg(1 << 10)->Arg(64 << 10)->UseManualTime();
+
+// one-way transfer, every iteration waits until the receiver acknowledged its last byte
+static void BM_SocketThroughput(benchmark::State& state) {
+	uint64_t msgsize = state.range(0), nmsgs = batch_msgs(msgsize);
+	std::vector<uint8_t> msg(msgsize, 0xAA);
+	std::thread sink([&] {
+		std::vector<uint8_t> buf(msgsize);
+		uint8_t ack = 1;
+		for (benchmark::IterationCount i = 0; i < state.max_iterations; i++) {
+			for (uint64_t j = 0; j < nmsgs; j++) {
+				raw_server->Receive(buf.data(), msgsize);
+			}
+			raw_server->Send(&ack, 1);
+		}
+	});
+	double cpu = process_cpu_seconds();
+	for (auto _ : state) {
+		for (uint64_t j = 0; j < nmsgs; j++) {
+			raw_client->Send(msg.data(), msgsize);
+		}
+		uint8_t ack;
+		raw_client->Receive(&ack, 1);
+	}
+	cpu = process_cpu_seconds() - cpu;
+	sink.join();
+	report_throughput(state, state.iterations() * nmsgs * msgsize, cpu);
+}
+BENCHMARK(BM_SocketThroughput)->RangeMultiplier(16)->Range(16, 1 << 30)->UseRealTime();
+
+static void BM_ChannelThroughput(benchmark::State& state) {
+	channel_pair chans;
+	uint64_t msgsize = state.range(0), nmsgs = batch_msgs(msgsize);
+	std::vector<uint8_t> msg(msgsize, 0xAA);
+	std::thread sink([&] {
+		std::vector<uint8_t> buf(msgsize);
+		uint8_t ack = 1;
+		for (benchmark::IterationCount i = 0; i < state.max_iterations; i++) {
+			for (uint64_t j = 0; j < nmsgs; j++) {
+				chans.server->blocking_receive(buf.data(), msgsize);
+			}
+			chans.server->send(&ack, 1);
+		}
+	});
+	double cpu = process_cpu_seconds();
+	for (auto _ : state) {
+		for (uint64_t j = 0; j < nmsgs; j++) {
+			chans.client->send(msg.data(), msgsize);
+		}
+		uint8_t ack;
+		chans.client->blocking_receive(&ack, 1);
+	}
+	cpu = process_cpu_seconds() - cpu;
+	sink.join();
+	report_throughput(state, state.iterations() * nmsgs * msgsize, cpu);
+}
+BENCHMARK(BM_ChannelThroughput)->RangeMultiplier(16)->Range(16, 1 << 30)->UseRealTime();
+
+// many channels send into one connection concurrently, each is drained by its own thread at the receiver
+static void BM_ChannelFanIn(benchmark::State& state) {
+	const uint64_t msgsize = 16 << 10;
+	size_t nchannels = state.range(0);
+	uint64_t nmsgs = std::max<uint64_t>(batch_bytes / msgsize / nchannels, 1); // per channel and iteration
+	std::vector<std::unique_ptr<channel_pair>> chans;
+	for (size_t c = 0; c < nchannels; c++) {
+		chans.push_back(std::make_unique<channel_pair>());
+	}
+	std::vector<std::thread> sinks;
+	for (size_t c = 0; c < nchannels; c++) {
+		sinks.emplace_back([&, c] {
+			std::vector<uint8_t> buf(msgsize);
+			uint8_t ack = 1;
+			for (benchmark::IterationCount i = 0; i < state.max_iterations; i++) {
+				for (uint64_t j = 0; j < nmsgs; j++) {
+					chans[c]->server->blocking_receive(buf.data(), msgsize);
+				}
+				chans[c]->server->send(&ack, 1);
+			}
+		});
+	}
+	std::vector<uint8_t> msg(msgsize, 0x55);
+	double cpu = process_cpu_seconds();
+	for (auto _ : state) {
+		// interleaved, such that all channels compete in the send thread at the same time
+		for (uint64_t j = 0; j < nmsgs; j++) {
+			for (auto& c : chans) {
+				c->client->send(msg.data(), msgsize);
+			}
+		}
+		for (auto& c : chans) {
+			uint8_t ack;
+			c->client->blocking_receive(&ack, 1);
+		}
+	}
+	cpu = process_cpu_seconds() - cpu;
+	for (auto& t : sinks) {
+		t.join();
+	}
+	report_throughput(state, state.iterations() * nchannels * nmsgs * msgsize, cpu);
+}
+BENCHMARK(BM_ChannelFanIn)->RangeMultiplier(4)->Range(1, 256)->UseRealTime();
+
+// connection establishment with the handshake of the connection helpers
+static void BM_ConnectListen(benchmark::State& state) {
+	size_t nsockets = state.range(0);
+	uint16_t port = base_port + 2;
+	connection_options options;
+	connection_report client_report, server_report;
+	double connect_ms = 0, handshake_ms = 0;
+	for (auto _ : state) {
+		std::vector<std::unique_ptr<CSocket>> client(nsockets);
+		std::vector<std::vector<std::unique_ptr<CSocket>>> server(2);
+		server[0].resize(nsockets);
+		server[1].resize(nsockets);
+		std::thread t([&] { Listen("127.0.0.1", port, server, nsockets, 0, options, &server_report); });
+		bool ok = Connect("127.0.0.1", port, client, 1, options, &client_report);
+		t.join();
+		if (!ok || !server[1][nsockets - 1]) {
+			state.SkipWithError("could not connect");
+			break;
+		}
+		connect_ms += client_report.connect_ms;
+		handshake_ms += client_report.handshake_ms;
+	}
+	state.counters["connect_ms"] = benchmark::Counter(connect_ms, benchmark::Counter::kAvgIterations);
+	state.counters["handshake_ms"] = benchmark::Counter(handshake_ms, benchmark::Counter::kAvgIterations);
+}
+BENCHMARK(BM_ConnectListen)->Arg(1)->Arg(4)->Arg(16)->UseRealTime();
+
+int main(int argc, char** argv) {
+	benchmark::Initialize(&argc, argv);
+	if (argc > 2 || (argc == 2 && std::atoi(argv[1]) <= 0)) {
+		std::fprintf(stderr, "usage: %s [benchmark options] [first port, default: %u]\n", argv[0], base_port);
+		return EXIT_FAILURE;
+	}
+	if (argc == 2) {
+		base_port = static_cast<uint16_t>(std::atoi(argv[1]));
+	}
+
+	loopback channels;
+	std::thread t([&] { raw_server = Listen("127.0.0.1", base_port + 1); });
+	raw_client = Connect("127.0.0.1", base_port + 1);
+	t.join();
+	if (!channels.connect(base_port) || !raw_server || !raw_client) {
+		std::fprintf(stderr, "could not connect on ports %u and %u\n", base_port, base_port + 1);
+		return EXIT_FAILURE;
+	}
+	shared_link = &channels;
+
+	benchmark::RunSpecifiedBenchmarks();
+	benchmark::Shutdown();
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,147 @@
+/**
+ \file 		socket_profiles.cpp
+ \copyright	ABY - A Framework for Efficient Mixed-protocol Secure Two-party Computation
+			Copyright (C) 2019 ENCRYPTO Group, TU Darmstadt
+			This program is free software: you can redistribute it and/or modify
+            it under the terms of the GNU Lesser General Public License as published
+            by the Free Software Foundation, either version 3 of the License, or
+            (at your option) any later version.
+            ABY is distributed in the hope that it will be useful,
+            but WITHOUT ANY WARRANTY; without even the implied warranty of
+            MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+            GNU Lesser General Public License for more details.
+            You should have received a copy of the GNU Lesser General Public License
+            along with this program. If not, see <http://www.gnu.org/licenses/>.
+ \brief		Loopback benchmark of the socket tuning options and profiles
+ */
+
+#include <ENCRYPTO_utils/connection.h>
+#include <ENCRYPTO_utils/parse_options.h>
+#include <ENCRYPTO_utils/socket.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+
+using bench_clock = std::chrono::steady_clock;
+
+struct bench_config {
+	const char* name;
+	socket_options options;
+};
+
+struct bench_result {
+	double rtt_median_us;
+	double rtt_p99_us;
+	double throughput_mbps;
+};
+
+// connects two sockets over loopback with the given options
+static bool connect_pair(uint16_t port, const socket_options& sockopts,
+		std::unique_ptr<CSocket>& server, std::unique_ptr<CSocket>& client) {
+	connection_options options;
+	options.socket = sockopts;
+	std::thread t([&] { server = Listen("127.0.0.1", port, options); });
+	client = Connect("127.0.0.1", port, options);
+	t.join();
+	return server && client;
+}
+
+static bench_result run(uint16_t port, const socket_options& options, uint32_t pingpongs,
+		uint64_t nbytes, uint64_t sendsize) {
+	bench_result result = {};
+	std::unique_ptr<CSocket> server, client;
+	if (!connect_pair(port, options, server, client)) {
+		std::fprintf(stderr, "could not connect on port %u\n", port);
+		std::exit(EXIT_FAILURE);
+	}
+
+	// ping-pong of small messages
+	std::thread echo([&] {
+		uint8_t msg[64];
+		for (uint32_t i = 0; i < pingpongs; i++) {
+			server->Receive(msg, sizeof(msg));
+			server->Send(msg, sizeof(msg));
+		}
+	});
+	std::vector<double> rtts(pingpongs);
+	uint8_t msg[64] = {0};
+	for (uint32_t i = 0; i < pingpongs; i++) {
+		auto begin = bench_clock::now();
+		client->Send(msg, sizeof(msg));
+		client->Receive(msg, sizeof(msg));
+		rtts[i] = std::chrono::duration<double, std::micro>(bench_clock::now() - begin).count();
+	}
+	echo.join();
+	std::sort(rtts.begin(), rtts.end());
+	result.rtt_median_us = rtts[rtts.size() / 2];
+	result.rtt_p99_us = rtts[rtts.size() * 99 / 100];
+
+	// bulk transfer, timed until the receiver acknowledged the last byte
+	std::thread sink([&] {
+		std::vector<uint8_t> buf(sendsize);
+		for (uint64_t received = 0; received < nbytes; received += sendsize) {
+			server->Receive(buf.data(), sendsize);
+		}
+		uint8_t ack = 1;
+		server->Send(&ack, 1);
+	});
+	std::vector<uint8_t> buf(sendsize, 0xAA);
+	auto begin = bench_clock::now();
+	for (uint64_t sent = 0; sent < nbytes; sent += sendsize) {
+		client->Send(buf.data(), sendsize);
+	}
+	uint8_t ack;
+	client->Receive(&ack, 1);
+	double seconds = std::chrono::duration<double>(bench_clock::now() - begin).count();
+	sink.join();
+	result.throughput_mbps = nbytes * 8 / seconds / 1e6;
+	return result;
+}
+
+int main(int argc, char** argv) {
+	uint32_t pingpongs = 20000, megabytes = 1024, sendmegabytes = 16, port = 7900;
+	parsing_ctx options[] = {
+		{(void*) &pingpongs, T_NUM, "n", "Number of 64 byte round trips, default: 20000", false, false},
+		{(void*) &megabytes, T_NUM, "s", "MiB transferred in the throughput test, default: 1024", false, false},
+		{(void*) &sendmegabytes, T_NUM, "c", "MiB per send call in the throughput test, default: 16", false, false},
+		{(void*) &port, T_NUM, "p", "First port to use, default: 7900", false, false},
+	};
+	if (!parse_options(&argc, &argv, options, sizeof(options) / sizeof(parsing_ctx)) || pingpongs == 0
+			|| sendmegabytes == 0) {
+		print_usage(argv[0], options, sizeof(options) / sizeof(parsing_ctx));
+		return EXIT_FAILURE;
+	}
+	uint64_t sendsize = (uint64_t) sendmegabytes << 20;
+	uint64_t nbytes = std::max<uint64_t>((uint64_t) megabytes << 20, sendsize) / sendsize * sendsize;
+
+	std::vector<bench_config> configs;
+	configs.push_back({"default", socket_options::from_profile(SOCKET_PROFILE_DEFAULT)});
+	// every option on its own
+	socket_options opt;
+	opt.sndbuf = opt.rcvbuf = 4 << 20;
+	configs.push_back({"buffers 4MiB", opt});
+	opt = socket_options();
+	opt.busy_poll_us = 50;
+	configs.push_back({"busy poll 50us", opt});
+	opt = socket_options();
+	opt.quickack = true;
+	configs.push_back({"quickack", opt});
+	opt = socket_options();
+	opt.zerocopy_min_bytes = 1 << 20;
+	configs.push_back({"zerocopy >=1MiB", opt});
+	// the presets
+	configs.push_back({"profile latency", socket_options::from_profile(SOCKET_PROFILE_LATENCY)});
+	configs.push_back({"profile throughput", socket_options::from_profile(SOCKET_PROFILE_THROUGHPUT)});
+	configs.push_back({"profile wan", socket_options::from_profile(SOCKET_PROFILE_WAN)});
+
+	std::printf("%-20s %12s %12s %14s\n", "config", "rtt p50 us", "rtt p99 us", "Mbit/s");
+	for (const auto& c : configs) {
+		bench_result r = run(static_cast<uint16_t>(port++), c.options, pingpongs, nbytes, sendsize);
+		std::printf("%-20s %12.2f %12.2f %14.0f\n", c.name, r.rtt_median_us, r.rtt_p99_us, r.throughput_mbps);
+	}
+	return EXIT_SUCCESS;
+}
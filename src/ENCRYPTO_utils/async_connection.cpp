@@ -0,0 +1,456 @@
+/**
+ \file 		async_connection.cpp
+ \copyright	ABY - A Framework for Efficient Mixed-protocol Secure Two-party Computation
+			Copyright (C) 2019 ENCRYPTO Group, TU Darmstadt
+			This program is free software: you can redistribute it and/or modify
+            it under the terms of the GNU Lesser General Public License as published
+            by the Free Software Foundation, either version 3 of the License, or
+            (at your option) any later version.
+            ABY is distributed in the hope that it will be useful,
+            but WITHOUT ANY WARRANTY; without even the implied warranty of
+            MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+            GNU Lesser General Public License for more details.
+            You should have received a copy of the GNU Lesser General Public License
+            along with this program. If not, see <http://www.gnu.org/licenses/>.
+ \brief		Asynchronous channel communication driven by a shared event loop
+ */
+
+#include "async_connection.h"
+#include "channel_map.h"
+#include "compression.h"
+#include "constants.h"
+#include "frame.h"
+#include "socket.h"
+
+#include <array>
+#include <atomic>
+#include <cassert>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <new>
+#include <queue>
+#include <stdexcept>
+#include <thread>
+#include <sys/socket.h>
+
+#include <boost/asio/bind_executor.hpp>
+#include <boost/asio/executor_work_guard.hpp>
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/io_context_strand.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/asio/read.hpp>
+#include <boost/asio/write.hpp>
+using boost::asio::ip::tcp;
+
+// buffers sized by the other party, false if they cannot be allocated
+static bool resize_received(std::vector<uint8_t>& buf, uint64_t size) {
+	try {
+		buf.resize(size);
+	} catch (const std::bad_alloc&) {
+		return false;
+	} catch (const std::length_error&) {
+		return false;
+	}
+	return true;
+}
+
+struct AsyncIOContext::AsyncIOContextImpl {
+	AsyncIOContextImpl()
+		: work(boost::asio::make_work_guard(io_context))
+	{}
+	boost::asio::io_context io_context;
+	boost::asio::executor_work_guard<boost::asio::io_context::executor_type> work;
+	std::vector<std::thread> threads;
+};
+
+AsyncIOContext::AsyncIOContext()
+	: impl_(std::make_unique<AsyncIOContextImpl>())
+{}
+
+AsyncIOContext::~AsyncIOContext() {
+	stop();
+}
+
+void AsyncIOContext::run(size_t nthreads) {
+	if (impl_->io_context.stopped()) {
+		impl_->io_context.restart();
+	}
+	for (size_t i = 0; i < nthreads; i++) {
+		impl_->threads.emplace_back([this] { impl_->io_context.run(); });
+	}
+}
+
+void AsyncIOContext::stop() {
+	impl_->io_context.stop();
+	for (auto& t : impl_->threads) {
+		t.join();
+	}
+	impl_->threads.clear();
+}
+
+
+struct AsyncConnection::AsyncConnectionImpl
+	: std::enable_shared_from_this<AsyncConnectionImpl> {
+
+	struct out_frame {
+		uint32_t channelid;
+		std::array<uint8_t, FRAME_HEADER_MAX_SIZE> header;
+		size_t headerlen;
+		std::vector<uint8_t> payload;
+		send_handler handler;
+	};
+
+	struct channel_state {
+		std::queue<std::vector<uint8_t>> messages;
+		std::queue<receive_handler> waiting;
+		std::vector<uint8_t> partial; // fragments of a message that is not complete yet
+		std::atomic<bool> finished{false};
+	};
+
+	AsyncConnectionImpl(boost::asio::io_context& io_context, int fd)
+		: strand(io_context), socket(io_context), snd_cnt(0), rcv_cnt(0),
+		failed(false), fin_sent(false), fin_received(false), close_requested(false)
+	{
+		sockaddr_storage addr;
+		socklen_t addrlen = sizeof(addr);
+		bool v6 = getsockname(fd, reinterpret_cast<sockaddr*>(&addr), &addrlen) == 0 && addr.ss_family == AF_INET6;
+		boost::system::error_code ec;
+		socket.assign(v6 ? tcp::v6() : tcp::v4(), fd, ec);
+		failed = static_cast<bool>(ec);
+	}
+
+	void send(uint32_t channelid, std::vector<uint8_t> payload, send_handler handler) {
+		out_frame frame;
+		frame.channelid = channelid;
+		frame.headerlen = write_frame_header(frame.header.data(), channelid, payload.size());
+		frame.payload = std::move(payload);
+		frame.handler = std::move(handler);
+		boost::asio::post(strand, [self = shared_from_this(), frame = std::move(frame)]() mutable {
+			if (self->failed || self->fin_sent) {
+				if (frame.handler) {
+					frame.handler(false);
+				}
+				return;
+			}
+			if (frame.channelid == ADMIN_CHANNEL) {
+				self->fin_sent = true;
+			}
+			self->send_queue.push_back(std::move(frame));
+			if (self->send_queue.size() == 1) {
+				self->write_front();
+			}
+		});
+	}
+
+	// the front of send_queue is the frame that is currently written
+	void write_front() {
+		out_frame& frame = send_queue.front();
+		std::array<boost::asio::const_buffer, 2> buffers = {
+			boost::asio::buffer(frame.header.data(), frame.headerlen), boost::asio::buffer(frame.payload)
+		};
+		boost::asio::async_write(socket, buffers, boost::asio::bind_executor(strand,
+			[self = shared_from_this()](const boost::system::error_code& ec, size_t bytes_transferred) {
+				self->snd_cnt += bytes_transferred;
+				auto handler = std::move(self->send_queue.front().handler);
+				self->send_queue.pop_front();
+				if (handler) {
+					handler(!ec);
+				}
+				if (ec) {
+					self->fail();
+				} else if (!self->send_queue.empty()) {
+					self->write_front();
+				} else {
+					self->close_if_done();
+				}
+			}));
+	}
+
+	void read_header() {
+		boost::asio::async_read(socket, boost::asio::buffer(rcv_header), boost::asio::bind_executor(strand,
+			[self = shared_from_this()](const boost::system::error_code& ec, size_t bytes_transferred) {
+				self->rcv_cnt += bytes_transferred;
+				if (ec) {
+					self->fail();
+					return;
+				}
+				uint64_t bytelen;
+				memcpy(&bytelen, self->rcv_header.data() + 1, sizeof(bytelen));
+				if (self->rcv_header[0] == FRAME_ID_EXTENDED) {
+					self->read_extended_id(frame_id_decoder(), bytelen);
+					return;
+				}
+				self->read_payload(self->rcv_header[0], bytelen);
+			}));
+	}
+
+	// the varint channel id that follows an extended header, one byte at a time
+	void read_extended_id(frame_id_decoder decoder, uint64_t bytelen) {
+		boost::asio::async_read(socket, boost::asio::buffer(&rcv_id_byte, 1), boost::asio::bind_executor(strand,
+			[self = shared_from_this(), decoder, bytelen](const boost::system::error_code& ec, size_t bytes_transferred) mutable {
+				self->rcv_cnt += bytes_transferred;
+				bool done;
+				if (ec || !decoder.add(self->rcv_id_byte, &done)) {
+					self->fail();
+				} else if (!done) {
+					self->read_extended_id(decoder, bytelen);
+				} else {
+					self->read_payload(decoder.id, bytelen);
+				}
+			}));
+	}
+
+	// bytelen is the length field of the frame header, including its flags
+	void read_payload(uint32_t channelid, uint64_t bytelen) {
+		bool compressed = bytelen & FRAME_FLAG_COMPRESSED;
+		bool more = bytelen & FRAME_FLAG_MORE;
+		auto payload = std::make_shared<std::vector<uint8_t>>();
+		if (!resize_received(*payload, bytelen & FRAME_LEN_MASK)) {
+			fail();
+			return;
+		}
+		boost::asio::async_read(socket, boost::asio::buffer(*payload), boost::asio::bind_executor(strand,
+			[self = shared_from_this(), channelid, payload, compressed, more](const boost::system::error_code& ec, size_t bytes_transferred) {
+				self->rcv_cnt += bytes_transferred;
+				if (ec) {
+					self->fail();
+					return;
+				}
+				if (!compressed) {
+					self->on_message(channelid, std::move(*payload), more);
+					return;
+				}
+				uint64_t rawlen;
+				std::vector<uint8_t> raw;
+				if (!zrle_decompressed_size(payload->data(), payload->size(), &rawlen) || rawlen == 0
+						|| !resize_received(raw, rawlen)
+						|| !zrle_decompress(payload->data(), payload->size(), raw.data(), rawlen)) {
+					self->fail();
+					return;
+				}
+				self->on_message(channelid, std::move(raw), more);
+			}));
+	}
+
+	// more is set for all but the last fragment of a message
+	void on_message(uint32_t channelid, std::vector<uint8_t>&& msg, bool more) {
+		if (channelid != ADMIN_CHANNEL) {
+			channel_state& c = state(channelid);
+			if (more || !c.partial.empty()) {
+				try {
+					c.partial.insert(c.partial.end(), msg.begin(), msg.end());
+				} catch (const std::bad_alloc&) {
+					// fragments of a message the other party never completes
+					fail();
+					return;
+				}
+			}
+			if (more) {
+				read_header();
+				return;
+			}
+			if (!c.partial.empty()) {
+				msg = std::move(c.partial);
+				c.partial.clear();
+			}
+		}
+		if (channelid == ADMIN_CHANNEL) {
+			if (msg.empty() || msg[0] == ADMIN_FIN) {
+				// the other party will not send anything anymore
+				fin_received = true;
+				finish_all_channels();
+				close_if_done();
+				return;
+			}
+			// other admin messages (credit grants) are not used by async connections
+		} else if (msg.empty()) {
+			finish_channel(state(channelid));
+		} else {
+			channel_state& c = state(channelid);
+			if (c.waiting.empty()) {
+				c.messages.push(std::move(msg));
+			} else {
+				auto handler = std::move(c.waiting.front());
+				c.waiting.pop();
+				handler(true, std::move(msg));
+			}
+		}
+		read_header();
+	}
+
+	void receive(uint32_t channelid, receive_handler handler) {
+		boost::asio::post(strand, [self = shared_from_this(), channelid, handler = std::move(handler)]() mutable {
+			channel_state& c = self->state(channelid);
+			if (!c.messages.empty()) {
+				auto msg = std::move(c.messages.front());
+				c.messages.pop();
+				handler(true, std::move(msg));
+			} else if (c.finished || self->all_finished || self->failed) {
+				handler(false, {});
+			} else {
+				c.waiting.push(std::move(handler));
+			}
+		});
+	}
+
+	channel_state& state(uint32_t channelid) {
+		std::lock_guard<std::mutex> lock(channels_mutex);
+		return channels[channelid];
+	}
+
+	// the handlers run without channels_mutex, they may call is_finished()
+	void finish_all_channels() {
+		std::vector<std::queue<receive_handler>> waiting;
+		{
+			std::lock_guard<std::mutex> lock(channels_mutex);
+			all_finished = true;
+			channels.for_each([&waiting](uint32_t, channel_state& c) {
+				c.finished = true;
+				waiting.push_back(std::move(c.waiting));
+				c.waiting = {};
+			});
+		}
+		for (auto& handlers : waiting) {
+			cancel(handlers);
+		}
+	}
+
+	void finish_channel(channel_state& c) {
+		c.finished = true;
+		std::queue<receive_handler> waiting = std::move(c.waiting);
+		c.waiting = {};
+		cancel(waiting);
+	}
+
+	static void cancel(std::queue<receive_handler>& waiting) {
+		while (!waiting.empty()) {
+			auto handler = std::move(waiting.front());
+			waiting.pop();
+			handler(false, {});
+		}
+	}
+
+	void fail() {
+		if (failed) {
+			return;
+		}
+		failed = true;
+		finish_all_channels();
+		// the frame in flight (if any) is completed by its write handler
+		while (send_queue.size() > 1) {
+			auto handler = std::move(send_queue.back().handler);
+			send_queue.pop_back();
+			if (handler) {
+				handler(false);
+			}
+		}
+		boost::system::error_code ec;
+		socket.close(ec);
+	}
+
+	void close_if_done() {
+		if (fin_sent && fin_received && send_queue.empty()) {
+			boost::system::error_code ec;
+			socket.close(ec);
+		}
+	}
+
+	boost::asio::io_context::strand strand;
+	tcp::socket socket;
+	std::atomic<uint64_t> snd_cnt;
+	std::atomic<uint64_t> rcv_cnt;
+
+	// the following members are only accessed from within the strand
+	std::deque<out_frame> send_queue;
+	std::array<uint8_t, FRAME_HEADER_SIZE> rcv_header;
+	uint8_t rcv_id_byte;
+	// entries are only created within the strand, the mutex protects lookups by is_finished()
+	mutable std::mutex channels_mutex;
+	channel_map<channel_state> channels;
+	std::atomic<bool> all_finished{false}; //also covers channels that have no state yet
+	bool failed;
+	bool fin_sent;
+	bool fin_received;
+	bool close_requested;
+};
+
+
+AsyncConnection::AsyncConnection(AsyncIOContext& context, std::unique_ptr<CSocket> sock)
+	: impl_(std::make_shared<AsyncConnectionImpl>(context.impl_->io_context, sock->ReleaseNativeHandle()))
+{
+	boost::asio::post(impl_->strand, [self = impl_] {
+		if (!self->failed) {
+			self->read_header();
+		}
+	});
+}
+
+AsyncConnection::~AsyncConnection() {
+	// pending operations keep the implementation alive until the other party has shut down as well
+	close();
+}
+
+void AsyncConnection::async_send(uint32_t channelid, const uint8_t* buf, uint64_t nbytes, send_handler handler) {
+	assert(channelid != ADMIN_CHANNEL);
+	impl_->send(channelid, std::vector<uint8_t>(buf, buf + nbytes), std::move(handler));
+}
+
+std::future<void> AsyncConnection::async_send(uint32_t channelid, const uint8_t* buf, uint64_t nbytes) {
+	auto promise = std::make_shared<std::promise<void>>();
+	async_send(channelid, buf, nbytes, [promise](bool success) {
+		if (success) {
+			promise->set_value();
+		} else {
+			promise->set_exception(std::make_exception_ptr(std::runtime_error("AsyncConnection: send failed")));
+		}
+	});
+	return promise->get_future();
+}
+
+void AsyncConnection::async_receive(uint32_t channelid, receive_handler handler) {
+	assert(channelid != ADMIN_CHANNEL);
+	impl_->receive(channelid, std::move(handler));
+}
+
+std::future<std::vector<uint8_t>> AsyncConnection::async_receive(uint32_t channelid) {
+	auto promise = std::make_shared<std::promise<std::vector<uint8_t>>>();
+	async_receive(channelid, [promise](bool success, std::vector<uint8_t> data) {
+		if (success) {
+			promise->set_value(std::move(data));
+		} else {
+			promise->set_exception(std::make_exception_ptr(std::runtime_error("AsyncConnection: channel closed")));
+		}
+	});
+	return promise->get_future();
+}
+
+void AsyncConnection::signal_end(uint32_t channelid) {
+	assert(channelid != ADMIN_CHANNEL);
+	impl_->send(channelid, {}, nullptr);
+}
+
+bool AsyncConnection::is_finished(uint32_t channelid) const {
+	std::lock_guard<std::mutex> lock(impl_->channels_mutex);
+	auto* c = impl_->channels.find(channelid);
+	return impl_->all_finished || (c != nullptr && c->finished);
+}
+
+void AsyncConnection::close() {
+	boost::asio::post(impl_->strand, [self = impl_] {
+		if (self->close_requested) {
+			return;
+		}
+		self->close_requested = true;
+		self->send(ADMIN_CHANNEL, {ADMIN_FIN}, nullptr);
+	});
+}
+
+uint64_t AsyncConnection::getSndCnt() const {
+	return impl_->snd_cnt;
+}
+
+uint64_t AsyncConnection::getRcvCnt() const {
+	return impl_->rcv_cnt;
+}
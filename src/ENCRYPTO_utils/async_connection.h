@@ -0,0 +1,90 @@
+/**
+ \file 		async_connection.h
+ \copyright	ABY - A Framework for Efficient Mixed-protocol Secure Two-party Computation
+			Copyright (C) 2019 ENCRYPTO Group, TU Darmstadt
+			This program is free software: you can redistribute it and/or modify
+            it under the terms of the GNU Lesser General Public License as published
+            by the Free Software Foundation, either version 3 of the License, or
+            (at your option) any later version.
+            ABY is distributed in the hope that it will be useful,
+            but WITHOUT ANY WARRANTY; without even the implied warranty of
+            MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+            GNU Lesser General Public License for more details.
+            You should have received a copy of the GNU Lesser General Public License
+            along with this program. If not, see <http://www.gnu.org/licenses/>.
+ \brief		Asynchronous channel communication driven by a shared event loop
+ */
+
+#ifndef ASYNC_CONNECTION_H_
+#define ASYNC_CONNECTION_H_
+
+#include <cstdint>
+#include <functional>
+#include <future>
+#include <memory>
+#include <vector>
+
+class CSocket;
+
+/**
+ * Event loop that performs the I/O of any number of AsyncConnections on a fixed pool of threads,
+ * instead of one send and one receive thread per socket.
+ */
+class AsyncIOContext {
+public:
+	AsyncIOContext();
+	~AsyncIOContext();
+
+	// start nthreads threads that process the completions of all connections on this context
+	void run(size_t nthreads = 1);
+
+	// stop processing and join all threads
+	void stop();
+
+private:
+	friend class AsyncConnection;
+	struct AsyncIOContextImpl;
+	std::unique_ptr<AsyncIOContextImpl> impl_;
+};
+
+/**
+ * Non-blocking counterpart of SndThread/RcvThread and channel. It uses the same wire format,
+ * so the other party may use either interface. Handlers are called from the threads of the
+ * AsyncIOContext and must not block.
+ * Credit-based flow control (channel::set_flow_control) is not supported on async connections.
+ */
+class AsyncConnection {
+public:
+	using send_handler = std::function<void(bool success)>;
+	// data holds one complete message, as returned by channel::blocking_receive()
+	using receive_handler = std::function<void(bool success, std::vector<uint8_t> data)>;
+
+	AsyncConnection(AsyncIOContext& context, std::unique_ptr<CSocket> sock);
+	~AsyncConnection();
+
+	// buf is copied before the call returns
+	void async_send(uint32_t channelid, const uint8_t* buf, uint64_t nbytes, send_handler handler);
+	std::future<void> async_send(uint32_t channelid, const uint8_t* buf, uint64_t nbytes);
+
+	// receive the next message on channelid, handlers are served in the order of the calls
+	void async_receive(uint32_t channelid, receive_handler handler);
+	std::future<std::vector<uint8_t>> async_receive(uint32_t channelid);
+
+	// equivalent of channel::signal_end()
+	void signal_end(uint32_t channelid);
+
+	// true once the other party signaled the end of channelid and all its messages were received
+	bool is_finished(uint32_t channelid) const;
+
+	// shut down the receiver on the other side and close the socket after all queued sends
+	void close();
+
+	uint64_t getSndCnt() const;
+	uint64_t getRcvCnt() const;
+
+private:
+	struct AsyncConnectionImpl;
+	std::shared_ptr<AsyncConnectionImpl> impl_;
+};
+
+#endif /* ASYNC_CONNECTION_H_ */
@@ -21,49 +21,62 @@
 #include "typedefs.h"
 #include "rcvthread.h"
 #include "sndthread.h"
+#include <algorithm>
 #include <cassert>
 #include <cstring>
 
 
-channel::channel(uint8_t channelid, RcvThread* rcver, SndThread* snder)
-	: m_bChannelID(channelid), m_cRcver(rcver), m_cSnder(snder),
+channel::channel(uint32_t channelid, RcvThread* rcver, SndThread* snder)
+	: m_nChannelID(channelid), m_cRcver(rcver), m_cSnder(snder),
 	m_eRcved(std::make_unique<CEvent>()), m_eFin(std::make_unique<CEvent>()),
 	m_bSndAlive(true), m_bRcvAlive(true),
 	m_qRcvedBlocks(rcver->add_listener(channelid, m_eRcved.get(), m_eFin.get())),
-	m_qRcvedBlocks_mutex_(rcver->get_listener_mutex(channelid))
+	m_qRcvedBlocks_mutex_(rcver->get_listener_mutex(channelid)),
+	m_qPostedBufs(rcver->get_posted_buffers(channelid)),
+	m_nFrontBlockOffset(0), m_nCreditWindow(0), m_nUngrantedBytes(0)
 {
 	assert(rcver->getlock() == snder->getlock());
 }
 
 channel::~channel() {
 	if(m_bRcvAlive) {
-		m_cRcver->remove_listener(m_bChannelID);
+		m_cRcver->remove_listener(m_nChannelID);
 	}
+	m_cRcver->release_listener(m_nChannelID);
+	m_cSnder->release_channel(m_nChannelID);
 }
 
 void channel::send(uint8_t* buf, uint64_t nbytes) {
 	assert(m_bSndAlive);
-	m_cSnder->add_snd_task(m_bChannelID, nbytes, buf);
+	m_cSnder->add_snd_task(m_nChannelID, nbytes, buf);
 }
 
 
 void channel::blocking_send(CEvent* eventcaller, uint8_t* buf, uint64_t nbytes) {
 	assert(m_bSndAlive);
-	m_cSnder->add_event_snd_task(eventcaller, m_bChannelID, nbytes, buf);
+	m_cSnder->add_event_snd_task(eventcaller, m_nChannelID, nbytes, buf);
 	eventcaller->Wait();
 }
 
 void channel::send_id_len(uint8_t* buf, uint64_t nbytes, uint64_t id, uint64_t len) {
 	assert(m_bSndAlive);
-	m_cSnder->add_snd_task_start_len(m_bChannelID, nbytes, buf, id, len);
+	m_cSnder->add_snd_task_start_len(m_nChannelID, nbytes, buf, id, len);
 }
 
 void channel::blocking_send_id_len(CEvent* eventcaller, uint8_t* buf, uint64_t nbytes, uint64_t id, uint64_t len) {
 	assert(m_bSndAlive);
-	m_cSnder->add_event_snd_task_start_len(eventcaller, m_bChannelID, nbytes, buf, id, len);
+	m_cSnder->add_event_snd_task_start_len(eventcaller, m_nChannelID, nbytes, buf, id, len);
 	eventcaller->Wait();
 }
 
+void channel::send_chunked(uint8_t* buf, uint64_t nbytes, uint64_t chunksize) {
+	assert(m_bSndAlive);
+	assert(chunksize > 0);
+	for(uint64_t offset = 0; offset < nbytes; offset += chunksize) {
+		m_cSnder->add_snd_task(m_nChannelID, std::min(chunksize, nbytes - offset), buf + offset);
+	}
+}
+
 //buf needs to be freed, data contains the payload
 uint8_t* channel::blocking_receive_id_len(uint8_t** data, uint64_t* id, uint64_t* len) {
 	uint8_t* buf = blocking_receive();
@@ -82,56 +95,118 @@ bool channel::queue_empty() const {
 	return qempty;
 }
 
-uint8_t* channel::blocking_receive() {
-	assert(m_bRcvAlive);
+void channel::wait_for_data() {
 	while(queue_empty())
 		m_eRcved->Wait();
+}
+
+uint8_t* channel::blocking_receive() {
+	uint64_t nbytes;
+	return blocking_receive_chunk(&nbytes);
+}
+
+uint8_t* channel::blocking_receive_chunk(uint64_t* nbytes) {
+	assert(m_bRcvAlive);
+	wait_for_data();
 	rcv_ctx* ret = nullptr;
-	uint8_t* ret_block = nullptr;
+	bool now_empty;
 	{
 		std::lock_guard<std::mutex> lock(m_qRcvedBlocks_mutex_);
-		ret = (rcv_ctx*) m_qRcvedBlocks->front();
-		ret_block = ret->buf;
+		ret = m_qRcvedBlocks->front();
 		m_qRcvedBlocks->pop();
+		now_empty = m_qRcvedBlocks->empty();
+	}
+	dequeued(ret->rcvbytes, now_empty);
+	uint8_t* ret_block = ret->buf;
+	*nbytes = ret->rcvbytes - m_nFrontBlockOffset;
+	if(m_nFrontBlockOffset > 0) {
+		//the block was partially consumed by blocking_receive(rcvbuf, rcvsize), the caller expects the payload at the start of buf
+		memmove(ret_block, ret_block + m_nFrontBlockOffset, *nbytes);
+		m_nFrontBlockOffset = 0;
 	}
 	free(ret);
 
 	return ret_block;
 }
 
-void channel::blocking_receive(uint8_t* rcvbuf, uint64_t rcvsize) {
-	assert(m_bRcvAlive);
-	while(queue_empty())
-		m_eRcved->Wait();
+uint64_t channel::receive_from_front(uint8_t* dst, uint64_t maxbytes) {
+	wait_for_data();
 
 	std::unique_lock<std::mutex> lock(m_qRcvedBlocks_mutex_);
-	rcv_ctx* ret = (rcv_ctx*) m_qRcvedBlocks->front();
-	uint8_t* ret_block = ret->buf;
-	uint64_t rcved_this_call = ret->rcvbytes;
-	if(rcved_this_call == rcvsize) {
-		m_qRcvedBlocks->pop();
-		lock.unlock();
-		free(ret);
-	} else if(rcvsize < rcved_this_call) {
-		//if the block contains too much data, copy only the receive size
-		ret->rcvbytes -= rcvsize;
-		uint8_t* newbuf = (uint8_t*) malloc(ret->rcvbytes);
-		memcpy(newbuf, ret->buf+rcvsize, ret->rcvbytes);
-		ret->buf = newbuf;
-		lock.unlock();
-		rcved_this_call = rcvsize;
-	} else {
-		//I want to receive more data than are in that block. Perform recursive call (might become troublesome for too many recursion steps)
-		m_qRcvedBlocks->pop();
+	rcv_ctx* ret = m_qRcvedBlocks->front();
+	uint64_t available = ret->rcvbytes - m_nFrontBlockOffset;
+	uint8_t* src = ret->buf + m_nFrontBlockOffset;
+	if(maxbytes < available) {
+		//only consume the beginning of the block and remember where the remainder starts
 		lock.unlock();
-		free(ret);
-		uint8_t* new_rcvbuf_start = rcvbuf + rcved_this_call;
-		uint64_t new_rcvsize = rcvsize -rcved_this_call;
+		memcpy(dst, src, maxbytes);
+		m_nFrontBlockOffset += maxbytes;
+		return maxbytes;
+	}
+	m_qRcvedBlocks->pop();
+	bool now_empty = m_qRcvedBlocks->empty();
+	lock.unlock();
+	memcpy(dst, src, available);
+	m_nFrontBlockOffset = 0;
+	dequeued(ret->rcvbytes, now_empty);
+	free(ret->buf);
+	free(ret);
+	return available;
+}
+
+void channel::dequeued(uint64_t nbytes, bool queue_now_empty) {
+	m_cRcver->account_dequeue(m_nChannelID, nbytes);
+	if(m_nCreditWindow == 0) {
+		return;
+	}
+	m_nUngrantedBytes += nbytes;
+	//batch grants, but never keep credit back when the queue ran empty, the sender might wait for it
+	if(m_nUngrantedBytes >= m_nCreditWindow / 4 || queue_now_empty) {
+		m_cSnder->grant_credit(m_nChannelID, m_nUngrantedBytes);
+		m_nUngrantedBytes = 0;
+	}
+}
 
-		blocking_receive(new_rcvbuf_start, new_rcvsize);
+void channel::blocking_receive(uint8_t* rcvbuf, uint64_t rcvsize) {
+	post_receive(rcvbuf, rcvsize);
+	wait_for_posted();
+}
+
+void channel::post_receive(uint8_t* rcvbuf, uint64_t rcvsize) {
+	assert(m_bRcvAlive);
+	uint64_t rcved = 0;
+	while(rcved < rcvsize) {
+		{
+			std::lock_guard<std::mutex> lock(m_qRcvedBlocks_mutex_);
+			//the receive thread only queues messages while no buffer is posted, so the order is kept
+			if(m_qRcvedBlocks->empty()) {
+				m_qPostedBufs->push_back({rcvbuf + rcved, rcvsize - rcved, 0, m_nCreditWindow > 0});
+				return;
+			}
+		}
+		rcved += receive_from_front(rcvbuf + rcved, rcvsize - rcved);
+	}
+}
+
+bool channel::posted_complete() const {
+	std::lock_guard<std::mutex> lock(m_qRcvedBlocks_mutex_);
+	return m_qPostedBufs->empty();
+}
+
+void channel::wait_for_posted() {
+	while(!posted_complete())
+		m_eRcved->Wait();
+}
+
+void channel::blocking_receive_chunked(uint8_t* rcvbuf, uint64_t rcvsize,
+		const std::function<void(uint8_t*, uint64_t, uint64_t)>& on_chunk) {
+	assert(m_bRcvAlive);
+	uint64_t rcved = 0;
+	while(rcved < rcvsize) {
+		uint64_t nbytes = receive_from_front(rcvbuf + rcved, rcvsize - rcved);
+		on_chunk(rcvbuf + rcved, rcved, nbytes);
+		rcved += nbytes;
 	}
-	memcpy(rcvbuf, ret_block, rcved_this_call);
-	free(ret_block);
 }
 
 
@@ -144,7 +219,7 @@ bool channel::data_available() {
 }
 
 void channel::signal_end() {
-	m_cSnder->signal_end(m_bChannelID);
+	m_cSnder->signal_end(m_nChannelID);
 	m_bSndAlive = false;
 }
 
@@ -156,9 +231,53 @@ void channel::wait_for_fin() {
 void channel::synchronize_end() {
 	if(m_bSndAlive)
 		signal_end();
-	if(m_bRcvAlive)
-		m_cRcver->flush_queue(m_bChannelID);
+	if(m_bRcvAlive) {
+		m_cRcver->flush_queue(m_nChannelID);
+		m_nFrontBlockOffset = 0;
+	}
 	if(m_bRcvAlive)
 		wait_for_fin();
 
-}
\ No newline at end of file
+}
+
+void channel::set_flow_control(uint64_t window) {
+	m_nCreditWindow = window;
+	m_cRcver->set_credit_receiver(m_cSnder);
+	m_cSnder->enable_credits(m_nChannelID, window);
+}
+
+channel_flow_stats channel::get_flow_stats() const {
+	channel_flow_stats stats;
+	stats.rcv_queued_bytes = m_cRcver->get_queued_bytes(m_nChannelID);
+	stats.rcv_queued_msgs = m_cRcver->get_queued_msgs(m_nChannelID);
+	stats.rcv_peak_queued_bytes = m_cRcver->get_peak_queued_bytes(m_nChannelID);
+	stats.snd_stall_ns = m_cSnder->get_stall_ns(m_nChannelID);
+	stats.snd_credit = m_cSnder->get_available_credit(m_nChannelID);
+	snd_queue_stats queue = m_cSnder->get_queue_stats(m_nChannelID);
+	stats.snd_msgs = queue.msgs;
+	stats.snd_queue_delay_ns = queue.delay_ns;
+	stats.snd_max_queue_delay_ns = queue.max_delay_ns;
+	return stats;
+}
+
+void channel::set_priority(uint8_t priority, uint32_t weight) {
+	m_cSnder->set_priority(m_nChannelID, priority, weight);
+}
+
+void channel::set_compression(uint64_t min_bytes) {
+	m_cSnder->set_compression(m_nChannelID, min_bytes);
+}
+
+channel_compression_stats channel::get_compression_stats() const {
+	channel_compression_stats stats;
+	stats.snd = m_cSnder->get_compression_stats(m_nChannelID);
+	stats.rcv = m_cRcver->get_decompression_stats(m_nChannelID);
+	return stats;
+}
+
+channel_traffic_stats channel::get_traffic() const {
+	channel_traffic_stats stats;
+	stats.snd = m_cSnder->get_traffic(m_nChannelID);
+	stats.rcv = m_cRcver->get_traffic(m_nChannelID);
+	return stats;
+}
@@ -19,7 +19,12 @@
 #ifndef CHANNEL_H_
 #define CHANNEL_H_
 
+#include "compression.h"
+#include "constants.h"
+#include "traffic.h"
 #include <cstdint>
+#include <deque>
+#include <functional>
 #include <memory>
 #include <mutex>
 #include <queue>
@@ -27,12 +32,40 @@
 class RcvThread;
 class SndThread;
 struct rcv_ctx;
+struct posted_rcv;
 class CEvent;
 class CLock;
 
+struct channel_flow_stats {
+	uint64_t rcv_queued_bytes; //received but not yet consumed by blocking_receive
+	uint64_t rcv_queued_msgs;
+	uint64_t rcv_peak_queued_bytes;
+	uint64_t snd_stall_ns; //time send calls on this channel were blocked by flow control
+	int64_t snd_credit; //bytes that may still be sent before the other party has to grant new credit
+	uint64_t snd_msgs; //messages whose transmission started
+	uint64_t snd_queue_delay_ns; //sum of the times these messages waited behind other channels in the send thread
+	uint64_t snd_max_queue_delay_ns;
+};
+
+struct channel_compression_stats {
+	compression_stats snd; //messages compressed before sending on this channel
+	compression_stats rcv; //messages decompressed after receiving on this channel
+};
+
+struct channel_traffic_stats {
+	traffic_counters snd; //frames sent on this channel, including end signals
+	traffic_counters rcv; //frames received on this channel
+};
+
 class channel {
 public:
-	channel(uint8_t channelid, RcvThread* rcver, SndThread* snder);
+	/**
+	 * Any 32 bit id except ADMIN_CHANNEL may be used, ids below 254 have the smallest frame header.
+	 * Registering is cheap and the state of the channel is released on destruction, so short-lived
+	 * channels may be created per task. Each id may only be used by one channel at a time, and
+	 * channels have to be destroyed before rcver and snder.
+	 */
+	channel(uint32_t channelid, RcvThread* rcver, SndThread* snder);
 
 	~channel();
 
@@ -44,6 +77,9 @@ public:
 
 	void blocking_send_id_len(CEvent* eventcaller, uint8_t* buf, uint64_t nbytes, uint64_t id, uint64_t len);
 
+	//splits buf into messages of at most chunksize bytes, such that the receiver can process the first chunks while the rest is still in flight
+	void send_chunked(uint8_t* buf, uint64_t nbytes, uint64_t chunksize = CHANNEL_CHUNK_SIZE);
+
 	//buf needs to be freed, data contains the payload
 	uint8_t* blocking_receive_id_len(uint8_t** data, uint64_t* id, uint64_t* len);
 
@@ -51,8 +87,28 @@ public:
 
 	uint8_t* blocking_receive();
 
+	//posts rcvbuf and waits until it is filled, see post_receive
 	void blocking_receive(uint8_t* rcvbuf, uint64_t rcvsize);
 
+	/**
+	 * Register rcvbuf as destination of the next rcvsize bytes received on this channel, without waiting.
+	 * Data that is already queued is copied, the rest is written into rcvbuf by the receive thread as it
+	 * arrives, without staging it in a heap buffer. Compressed messages are decompressed and then copied.
+	 * Several buffers may be posted, they are filled in order and before any later message is queued.
+	 * rcvbuf must not be accessed until wait_for_posted() returned.
+	 */
+	void post_receive(uint8_t* rcvbuf, uint64_t rcvsize);
+
+	//blocks until all posted buffers are filled
+	void wait_for_posted();
+
+	//returns the (remainder of the) next received message without copying it, its size is written to nbytes. buf needs to be freed
+	uint8_t* blocking_receive_chunk(uint64_t* nbytes);
+
+	//receives rcvsize bytes into rcvbuf and calls on_chunk(rcvbuf + offset, offset, nbytes) as soon as each message has arrived
+	void blocking_receive_chunked(uint8_t* rcvbuf, uint64_t rcvsize,
+			const std::function<void(uint8_t*, uint64_t, uint64_t)>& on_chunk);
+
 	bool is_alive();
 
 	bool data_available();
@@ -63,8 +119,47 @@ public:
 
 	void synchronize_end();
 
+	/**
+	 * Enable credit-based flow control: at most window bytes sent on this channel may be queued
+	 * at the receiver, sending blocks until the receiving channel has consumed enough data.
+	 * Both parties need to enable it with the same window before the first message is sent.
+	 */
+	void set_flow_control(uint64_t window);
+
+	channel_flow_stats get_flow_stats() const;
+
+	/**
+	 * Send this channel's messages in a strict priority class, 0 is served first. Within a class
+	 * channels share the bandwidth by deficit round-robin in proportion to their weight. Large
+	 * messages are fragmented, so a message on a higher class waits for at most one batch of
+	 * fragments. Only affects the sending party.
+	 */
+	void set_priority(uint8_t priority, uint32_t weight = 1);
+
+	/**
+	 * Compress messages of at least min_bytes with a zero-run length codec before sending (0 disables it).
+	 * Worthwhile for sparse or zero-padded data on slow links, the costs are reported by get_compression_stats().
+	 * Only the sending party needs to enable it.
+	 */
+	void set_compression(uint64_t min_bytes);
+
+	channel_compression_stats get_compression_stats() const;
+
+	//wire bytes and frames of this channel so far. Lock-free, the difference of two samples attributes the traffic in between
+	channel_traffic_stats get_traffic() const;
+
 private:
-	uint8_t m_bChannelID;
+	void wait_for_data();
+
+	bool posted_complete() const;
+
+	//copies at most maxbytes from the front of the receive queue into dst and returns the number of copied bytes
+	uint64_t receive_from_front(uint8_t* dst, uint64_t maxbytes);
+
+	//bookkeeping after a block of nbytes has been removed from the receive queue
+	void dequeued(uint64_t nbytes, bool queue_now_empty);
+
+	uint32_t m_nChannelID;
 	RcvThread* m_cRcver;
 	SndThread* m_cSnder;
 	std::unique_ptr<CEvent> m_eRcved;
@@ -73,6 +168,12 @@ private:
 	bool m_bRcvAlive;
 	std::queue<rcv_ctx*>* m_qRcvedBlocks;
 	std::mutex& m_qRcvedBlocks_mutex_;
+	std::deque<posted_rcv>* m_qPostedBufs; //guarded by m_qRcvedBlocks_mutex_
+	//number of bytes of the front block that have already been consumed by blocking_receive
+	uint64_t m_nFrontBlockOffset;
+	uint64_t m_nCreditWindow;
+	//consumed bytes that have not been granted to the sender yet
+	uint64_t m_nUngrantedBytes;
 };
 
 
@@ -0,0 +1,147 @@
+/**
+ \file 		channel_map.h
+ \copyright	ABY - A Framework for Efficient Mixed-protocol Secure Two-party Computation
+			Copyright (C) 2019 ENCRYPTO Group, TU Darmstadt
+			This program is free software: you can redistribute it and/or modify
+            it under the terms of the GNU Lesser General Public License as published
+            by the Free Software Foundation, either version 3 of the License, or
+            (at your option) any later version.
+            ABY is distributed in the hope that it will be useful,
+            but WITHOUT ANY WARRANTY; without even the implied warranty of
+            MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+            GNU Lesser General Public License for more details.
+            You should have received a copy of the GNU Lesser General Public License
+            along with this program. If not, see <http://www.gnu.org/licenses/>.
+ \brief		Sparse table of per-channel state
+ */
+
+#ifndef CHANNEL_MAP_H_
+#define CHANNEL_MAP_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+/**
+ * Open-addressing hash map (linear probing, backward-shift deletion) from channel ids to T.
+ * Only channels that are in use occupy memory, so ids may be spread over the whole 32 bit range.
+ * Values are allocated individually and keep their address until they are erased, such that
+ * they may hold mutexes and atomics and be referenced by the channel they belong to.
+ * Not thread-safe, the owner serializes accesses.
+ */
+template<typename T>
+class channel_map {
+public:
+	channel_map() : slots(16), count(0), shift(64 - 4) {}
+
+	T* find(uint32_t id) const {
+		for(size_t i = home(id); slots[i].value; i = next(i)) {
+			if(slots[i].id == id) {
+				return slots[i].value.get();
+			}
+		}
+		return nullptr;
+	}
+
+	//returns the value of id, a default constructed one is inserted if there is none
+	T& operator[](uint32_t id) {
+		size_t i = home(id);
+		for(; slots[i].value; i = next(i)) {
+			if(slots[i].id == id) {
+				return *slots[i].value;
+			}
+		}
+		if(2 * (count + 1) > slots.size()) {
+			grow();
+			for(i = home(id); slots[i].value; i = next(i)) {}
+		}
+		slots[i].id = id;
+		slots[i].value = std::make_unique<T>();
+		count++;
+		return *slots[i].value;
+	}
+
+	bool erase(uint32_t id) {
+		size_t i = home(id);
+		for(; slots[i].value; i = next(i)) {
+			if(slots[i].id == id) {
+				break;
+			}
+		}
+		if(!slots[i].value) {
+			return false;
+		}
+		slots[i].value.reset();
+		count--;
+		//move later entries of the probe sequence into the gap, such that lookups need no tombstones
+		for(size_t j = next(i); slots[j].value; j = next(j)) {
+			size_t k = home(slots[j].id);
+			bool reachable = i <= j ? (i < k && k <= j) : (i < k || k <= j);
+			if(!reachable) {
+				slots[i] = std::move(slots[j]);
+				i = j;
+			}
+		}
+		return true;
+	}
+
+	size_t size() const {
+		return count;
+	}
+
+	//calls f(id, value) for every entry, f must not insert or erase
+	template<typename F>
+	void for_each(F f) {
+		for(auto& s : slots) {
+			if(s.value) {
+				f(s.id, *s.value);
+			}
+		}
+	}
+
+	template<typename F>
+	void for_each(F f) const {
+		for(const auto& s : slots) {
+			if(s.value) {
+				f(s.id, static_cast<const T&>(*s.value));
+			}
+		}
+	}
+
+private:
+	struct slot {
+		uint32_t id;
+		std::unique_ptr<T> value; //nullptr if the slot is empty
+	};
+
+	//Fibonacci hashing, consecutive ids are spread over the table
+	size_t home(uint32_t id) const {
+		return static_cast<size_t>((id * UINT64_C(0x9E3779B97F4A7C15)) >> shift);
+	}
+
+	size_t next(size_t i) const {
+		return (i + 1) & (slots.size() - 1);
+	}
+
+	void grow() {
+		std::vector<slot> old(slots.size() * 2);
+		old.swap(slots);
+		shift--;
+		for(auto& s : old) {
+			if(s.value) {
+				size_t i = home(s.id);
+				while(slots[i].value) {
+					i = next(i);
+				}
+				slots[i] = std::move(s);
+			}
+		}
+	}
+
+	std::vector<slot> slots; //a power of two, at most half full
+	size_t count;
+	unsigned shift; //64 - log2(slots.size())
+};
+
+#endif /* CHANNEL_MAP_H_ */
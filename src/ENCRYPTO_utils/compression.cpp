@@ -0,0 +1,118 @@
+/**
+ \file 		compression.cpp
+ \copyright	ABY - A Framework for Efficient Mixed-protocol Secure Two-party Computation
+			Copyright (C) 2019 ENCRYPTO Group, TU Darmstadt
+			This program is free software: you can redistribute it and/or modify
+            it under the terms of the GNU Lesser General Public License as published
+            by the Free Software Foundation, either version 3 of the License, or
+            (at your option) any later version.
+            ABY is distributed in the hope that it will be useful,
+            but WITHOUT ANY WARRANTY; without even the implied warranty of
+            MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+            GNU Lesser General Public License for more details.
+            You should have received a copy of the GNU Lesser General Public License
+            along with this program. If not, see <http://www.gnu.org/licenses/>.
+ \brief		Zero-run length codec for wire compression of channel messages
+ */
+
+#include "compression.h"
+#include <cstring>
+
+static void put_varint(std::vector<uint8_t>& out, uint64_t v) {
+	while(v >= 0x80) {
+		out.push_back(static_cast<uint8_t>(v) | 0x80);
+		v >>= 7;
+	}
+	out.push_back(static_cast<uint8_t>(v));
+}
+
+static bool get_varint(const uint8_t* in, uint64_t n, uint64_t& pos, uint64_t& v) {
+	v = 0;
+	for(uint32_t shift = 0; shift < 64; shift += 7) {
+		if(pos >= n) {
+			return false;
+		}
+		uint8_t b = in[pos++];
+		v |= static_cast<uint64_t>(b & 0x7F) << shift;
+		if(!(b & 0x80)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+//returns the end of the zero run starting at pos
+static uint64_t zero_run_end(const uint8_t* in, uint64_t n, uint64_t pos) {
+	uint64_t word;
+	while(pos + sizeof(word) <= n) {
+		memcpy(&word, in + pos, sizeof(word));
+		if(word != 0) {
+			break;
+		}
+		pos += sizeof(word);
+	}
+	while(pos < n && in[pos] == 0) {
+		pos++;
+	}
+	return pos;
+}
+
+uint64_t zrle_compress(const uint8_t* in, uint64_t n, std::vector<uint8_t>& out) {
+	out.clear();
+	out.reserve(n);
+	put_varint(out, n);
+
+	uint64_t lit_start = 0, pos = 0;
+	while(pos < n) {
+		const void* zero = memchr(in + pos, 0, n - pos);
+		if(zero == nullptr) {
+			break;
+		}
+		pos = static_cast<const uint8_t*>(zero) - in;
+		uint64_t run_end = zero_run_end(in, n, pos);
+		if(run_end - pos >= ZRLE_MIN_ZERO_RUN) {
+			put_varint(out, pos - lit_start);
+			out.insert(out.end(), in + lit_start, in + pos);
+			put_varint(out, run_end - pos);
+			lit_start = run_end;
+			if(out.size() >= n) {
+				return 0;
+			}
+		}
+		pos = run_end;
+	}
+	if(lit_start < n) {
+		put_varint(out, n - lit_start);
+		out.insert(out.end(), in + lit_start, in + n);
+		put_varint(out, 0);
+	}
+	return out.size() < n ? out.size() : 0;
+}
+
+bool zrle_decompressed_size(const uint8_t* in, uint64_t n, uint64_t* outlen) {
+	uint64_t pos = 0;
+	return get_varint(in, n, pos, *outlen);
+}
+
+bool zrle_decompress(const uint8_t* in, uint64_t n, uint8_t* out, uint64_t outlen) {
+	uint64_t pos = 0, written = 0, total, len;
+	if(!get_varint(in, n, pos, total) || total != outlen) {
+		return false;
+	}
+	while(pos < n) {
+		//literal bytes
+		if(!get_varint(in, n, pos, len) || len > n - pos || len > outlen - written) {
+			return false;
+		}
+		memcpy(out + written, in + pos, len);
+		pos += len;
+		written += len;
+		//zero run
+		if(!get_varint(in, n, pos, len) || len > outlen - written) {
+			return false;
+		}
+		memset(out + written, 0, len);
+		written += len;
+	}
+	return written == outlen;
+}
@@ -0,0 +1,53 @@
+/**
+ \file 		compression.h
+ \copyright	ABY - A Framework for Efficient Mixed-protocol Secure Two-party Computation
+			Copyright (C) 2019 ENCRYPTO Group, TU Darmstadt
+			This program is free software: you can redistribute it and/or modify
+            it under the terms of the GNU Lesser General Public License as published
+            by the Free Software Foundation, either version 3 of the License, or
+            (at your option) any later version.
+            ABY is distributed in the hope that it will be useful,
+            but WITHOUT ANY WARRANTY; without even the implied warranty of
+            MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+            GNU Lesser General Public License for more details.
+            You should have received a copy of the GNU Lesser General Public License
+            along with this program. If not, see <http://www.gnu.org/licenses/>.
+ \brief		Zero-run length codec for wire compression of channel messages
+ */
+
+#ifndef COMPRESSION_H_
+#define COMPRESSION_H_
+
+#include <cstdint>
+#include <vector>
+
+//zero runs shorter than this are kept as literals, since their encoding would not save anything
+#define ZRLE_MIN_ZERO_RUN 8
+
+/**
+ * Compression statistics of one direction of a channel
+ */
+struct compression_stats {
+	uint64_t raw_bytes; //payload bytes of all compressed messages
+	uint64_t wire_bytes; //bytes of these messages on the wire
+	uint64_t cpu_ns; //time spent compressing or decompressing
+};
+
+/**
+ * Encodes in as [varint n] followed by tokens [varint literal length][literal bytes][varint zero run length].
+ * Returns the size of the encoding in out, or 0 if it would not be smaller than n (out is unspecified then).
+ */
+uint64_t zrle_compress(const uint8_t* in, uint64_t n, std::vector<uint8_t>& out);
+
+/**
+ * Reads the uncompressed size from the header of an encoding. Returns false if the header is malformed.
+ */
+bool zrle_decompressed_size(const uint8_t* in, uint64_t n, uint64_t* outlen);
+
+/**
+ * Decodes an encoding produced by zrle_compress into out, which must hold outlen bytes as
+ * returned by zrle_decompressed_size. Returns false if the encoding is malformed.
+ */
+bool zrle_decompress(const uint8_t* in, uint64_t n, uint8_t* out, uint64_t outlen);
+
+#endif /* COMPRESSION_H_ */
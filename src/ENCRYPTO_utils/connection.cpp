@@ -20,98 +20,281 @@
 #include "constants.h"
 #include "socket.h"
 #include "utils.h"
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <chrono>
 #include <iostream>
 #include <limits>
+#include <mutex>
+#include <random>
+#include <thread>
+
+using connection_clock = std::chrono::steady_clock;
+
+static double elapsed_ms(connection_clock::time_point begin, connection_clock::time_point end) {
+	return std::chrono::duration<double, std::milli>(end - begin).count();
+}
+
+// deadline of connection_options::timeout_ms, time_point::max() for none
+static connection_clock::time_point deadline_after(connection_clock::time_point begin, uint32_t timeout_ms) {
+	if (timeout_ms == 0) {
+		return connection_clock::time_point::max();
+	}
+	return begin + std::chrono::milliseconds(timeout_ms);
+}
+
+// milliseconds until deadline, 0 if it has passed and -1 if there is no deadline
+static int remaining_ms(connection_clock::time_point deadline) {
+	if (deadline == connection_clock::time_point::max()) {
+		return -1;
+	}
+	auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - connection_clock::now()).count();
+	return static_cast<int>(std::max<int64_t>(remaining, 0));
+}
+
+// atomically raise max to value
+static void update_max(std::atomic<double>& max, double value) {
+	double cur = max.load();
+	while (value > cur && !max.compare_exchange_weak(cur, value)) {
+	}
+}
+
+// retries with jittered exponential backoff, so that many sockets waiting for the same
+// listener neither hammer it nor all retry at the same time
+static std::unique_ptr<CSocket> connect_with_backoff(const std::string& address, uint16_t port,
+		const connection_options& options, connection_clock::time_point deadline, uint32_t& attempts) {
+	thread_local std::mt19937 rng(std::random_device{}());
+	auto socket = std::make_unique<CSocket>(options.type);
+	socket->SetOptions(options.socket);
+	uint32_t backoff = std::max<uint32_t>(options.initial_backoff_ms, 1);
+	while (true) {
+		attempts++;
+		if (socket->Connect(address, port)) {
+			return socket;
+		}
+		int remaining = remaining_ms(deadline);
+		if (remaining == 0) {
+			return nullptr;
+		}
+		std::uniform_int_distribution<uint32_t> jitter(backoff / 2, backoff);
+		int delay = jitter(rng);
+		std::this_thread::sleep_for(std::chrono::milliseconds(remaining < 0 ? delay : std::min(delay, remaining)));
+		backoff = std::min(backoff * 2, std::max(options.max_backoff_ms, backoff));
+	}
+}
+
+static void print_report(const char* side, const connection_report& report) {
+#ifndef BATCH
+	std::cout << side << " took " << report.total_ms << " ms (listen " << report.listen_ms
+			<< " ms, connect " << report.connect_ms << " ms, handshake " << report.handshake_ms
+			<< " ms, " << report.attempts << " attempts)" << std::endl;
+#else
+	(void) side;
+	(void) report;
+#endif
+}
 
 bool Connect(const std::string& address, uint16_t port,
-		std::vector<std::unique_ptr<CSocket>> &sockets, uint32_t id) {
+		std::vector<std::unique_ptr<CSocket>> &sockets, uint32_t id,
+		const connection_options& options, connection_report* report) {
 #ifndef BATCH
 	std::cout << "Connecting party "<< id <<": " << address << ", " << port << std::endl;
 #endif
 	assert(sockets.size() <= std::numeric_limits<uint32_t>::max());
+	auto begin = connection_clock::now();
+	auto deadline = deadline_after(begin, options.timeout_ms);
+	std::atomic<uint32_t> attempts(0);
+	std::atomic<double> connect_ms(0), handshake_ms(0);
+	std::atomic<bool> success(true), timed_out(false);
+
+	std::vector<std::thread> threads;
 	for (size_t j = 0; j < sockets.size(); j++) {
-		sockets[j] = Connect(address, port);
-		if (sockets[j]) {
+		threads.emplace_back([&, j] {
+			auto sock_begin = connection_clock::now();
+			uint32_t sock_attempts = 0;
+			auto sock = connect_with_backoff(address, port, options, deadline, sock_attempts);
+			attempts += sock_attempts;
+			auto connected = connection_clock::now();
+			update_max(connect_ms, elapsed_ms(sock_begin, connected));
+			if (!sock) {
+				success = false;
+				timed_out = true;
+				return;
+			}
 			// handshake
-			sockets[j]->Send(&id, sizeof(id));
 			uint32_t index = static_cast<uint32_t>(j);
-			sockets[j]->Send(&index, sizeof(index));
-		}
-		else {
-			return false;
-		}
+			if (sock->Send(&id, sizeof(id)) != sizeof(id) || sock->Send(&index, sizeof(index)) != sizeof(index)) {
+				success = false;
+				return;
+			}
+			update_max(handshake_ms, elapsed_ms(connected, connection_clock::now()));
+			sockets[j] = std::move(sock);
+		});
+	}
+	for (auto& t : threads) {
+		t.join();
+	}
+
+	connection_report rep;
+	rep.connect_ms = connect_ms;
+	rep.handshake_ms = handshake_ms;
+	rep.total_ms = elapsed_ms(begin, connection_clock::now());
+	rep.attempts = attempts;
+	rep.timed_out = timed_out;
+	if (report) {
+		*report = rep;
 	}
+	if (!success) {
+		std::cerr << "Error: could not connect all sockets"
+				<< (rep.timed_out ? " before the deadline" : "") << "\n";
+		return false;
+	}
+	print_report("Connecting", rep);
 	return true;
 }
 
 bool Listen(const std::string& address, uint16_t port,
 		std::vector<std::vector<std::unique_ptr<CSocket>>> &sockets,
-		size_t numConnections, uint32_t myID) {
+		size_t numConnections, uint32_t myID,
+		const connection_options& options, connection_report* report) {
+	auto begin = connection_clock::now();
+	auto deadline = deadline_after(begin, options.timeout_ms);
+	connection_report rep;
 
-	auto listen_socket = std::make_unique<CSocket>();
+	auto listen_socket = std::make_unique<CSocket>(options.type);
+	listen_socket->SetOptions(options.socket);
 
 	if (!listen_socket->Bind(address, port)) {
 		std::cerr << "Error: a socket could not be bound\n";
 		return false;
 	}
-	if (!listen_socket->Listen()) {
+	if (!listen_socket->Listen(static_cast<int>(std::max<size_t>(5, numConnections)))) {
 		std::cerr << "Error: could not listen on the socket \n";
 		return false;
 	}
+	auto listening = connection_clock::now();
+	rep.listen_ms = elapsed_ms(begin, listening);
 
-	for (size_t i = 0; i < numConnections; i++)
-	{
-		auto sock = listen_socket->Accept();
-		if (!sock) {
-			std::cerr << "Error: could not accept connection\n";
-			return false;
-		}
+	std::mutex sockets_mutex;
+	std::atomic<size_t> placed(0);
+	std::atomic<double> connect_ms(0), handshake_ms(0);
+	std::vector<std::thread> handshakes;
+
+	auto handshake = [&](std::unique_ptr<CSocket> sock) {
+		auto accepted = connection_clock::now();
 		// receive initial pid when connected
 		uint32_t nID;
 		uint32_t conID; //a mix of threadID and role - depends on the application
-		sock->Receive(&nID, sizeof(nID));
-		sock->Receive(&conID, sizeof(conID));
-
-		if (nID >= sockets.size()) //Not more than two parties currently allowed
-				{
-			sock->Close();
-			i--;  // try same index again
-			continue;
+		if (!sock->Poll(remaining_ms(deadline))
+				|| sock->Receive(&nID, sizeof(nID)) != sizeof(nID)
+				|| sock->Receive(&conID, sizeof(conID)) != sizeof(conID)) {
+			return;
 		}
-		if (conID >= sockets[myID].size()) {
-			sock->Close();
-			i--;  // try same index again
-			continue;
+		update_max(handshake_ms, elapsed_ms(accepted, connection_clock::now()));
+
+		std::lock_guard<std::mutex> lock(sockets_mutex);
+		//Not more than two parties currently allowed, invalid or duplicate connections are dropped
+		if (nID >= sockets.size() || conID >= sockets[myID].size() || conID >= sockets[nID].size()
+				|| sockets[nID][conID]) {
+			return;
 		}
 		// locate the socket appropriately
 		sockets[nID][conID] = std::move(sock);
+		placed++;
+	};
+
+	while (placed < numConnections) {
+		int remaining = remaining_ms(deadline);
+		if (remaining == 0) {
+			break;
+		}
+		// wake up regularly to notice when the outstanding handshakes have completed
+		auto sock = listen_socket->Accept(remaining < 0 ? 10 : std::min(remaining, 10));
+		if (!sock) {
+			continue;
+		}
+		update_max(connect_ms, elapsed_ms(listening, connection_clock::now()));
+		rep.attempts++;
+		handshakes.emplace_back(handshake, std::move(sock));
+	}
+	for (auto& t : handshakes) {
+		t.join();
+	}
+
+	rep.connect_ms = connect_ms;
+	rep.handshake_ms = handshake_ms;
+	rep.total_ms = elapsed_ms(begin, connection_clock::now());
+	rep.timed_out = placed < numConnections;
+	if (report) {
+		*report = rep;
+	}
+	if (rep.timed_out) {
+		std::cerr << "Error: could not accept all connections before the deadline\n";
+		return false;
 	}
 
 #ifndef BATCH
 	std::cout << "Listening finished" << std::endl;
 #endif
+	print_report("Listening", rep);
 	return true;
 }
 
-std::unique_ptr<CSocket> Connect(const std::string& address, uint16_t port) {
-	auto socket = std::make_unique<CSocket>();
-	for (int i = 0; i < RETRY_CONNECT; i++) {
-		if (socket->Connect(address, port))
-			return socket;
-		SleepMiliSec(10);
+bool Connect(const std::string& address, uint16_t port,
+		std::vector<std::unique_ptr<CSocket>> &sockets, uint32_t id, transport_type type) {
+	connection_options options;
+	options.type = type;
+	return Connect(address, port, sockets, id, options);
+}
+
+bool Listen(const std::string& address, uint16_t port,
+		std::vector<std::vector<std::unique_ptr<CSocket>>> &sockets,
+		size_t numConnections, uint32_t myID, transport_type type) {
+	connection_options options;
+	options.type = type;
+	options.timeout_ms = 0;
+	return Listen(address, port, sockets, numConnections, myID, options);
+}
+
+std::unique_ptr<CSocket> Connect(const std::string& address, uint16_t port,
+		const connection_options& options) {
+	uint32_t attempts = 0;
+	auto socket = connect_with_backoff(address, port, options,
+			deadline_after(connection_clock::now(), options.timeout_ms), attempts);
+	if (!socket) {
+		std::cerr << "Connect failed due to timeout!\n";
 	}
-	std::cerr << "Connect failed due to timeout!\n";
-	return nullptr;
+	return socket;
 }
 
-std::unique_ptr<CSocket> Listen(const std::string& address, uint16_t port) {
-	auto listen_socket = std::make_unique<CSocket>();
+std::unique_ptr<CSocket> Listen(const std::string& address, uint16_t port,
+		const connection_options& options) {
+	auto deadline = deadline_after(connection_clock::now(), options.timeout_ms);
+	auto listen_socket = std::make_unique<CSocket>(options.type);
+	listen_socket->SetOptions(options.socket);
 	if (!listen_socket->Bind(address, port)) {
 		return nullptr;
 	}
 	if (!listen_socket->Listen()) {
 		return nullptr;
 	}
-	return listen_socket->Accept();
+	auto socket = listen_socket->Accept(remaining_ms(deadline));
+	if (!socket) {
+		std::cerr << "Listen failed due to timeout!\n";
+	}
+	return socket;
+}
+
+std::unique_ptr<CSocket> Connect(const std::string& address, uint16_t port, transport_type type) {
+	connection_options options;
+	options.type = type;
+	return Connect(address, port, options);
+}
+
+std::unique_ptr<CSocket> Listen(const std::string& address, uint16_t port, transport_type type) {
+	connection_options options;
+	options.type = type;
+	options.timeout_ms = 0;
+	return Listen(address, port, options);
 }
@@ -20,21 +20,72 @@
 #ifndef __CONNECTION_H__
 #define __CONNECTION_H__
 
+#include "socket.h"
 #include "typedefs.h"
 #include <memory>
 #include <string>
 #include <vector>
 
-// forward declaration
-class CSocket;
+/**
+ * Parameters of connection establishment. Failed connection attempts are retried after a
+ * random delay in [d/2, d], where d starts at initial_backoff_ms and doubles up to max_backoff_ms.
+ */
+struct connection_options {
+	// with TRANSPORT_SHM the address is ignored and both parties have to be on the same host
+	transport_type type = TRANSPORT_TCP;
+	// TCP tuning, e.g. socket_options::from_profile(SOCKET_PROFILE_THROUGHPUT)
+	socket_options socket;
+	uint32_t initial_backoff_ms = 1;
+	uint32_t max_backoff_ms = 256;
+	// overall deadline for establishing all connections, 0 waits without a deadline
+	uint32_t timeout_ms = CONNECT_TIMEO_MILISEC;
+};
+
+/**
+ * Time spent in the phases of connection establishment. Sockets are set up concurrently,
+ * so connect_ms and handshake_ms are the maxima over all sockets.
+ */
+struct connection_report {
+	double listen_ms = 0; // bind and listen, only on the listening side
+	double connect_ms = 0; // until a socket was connected or accepted
+	double handshake_ms = 0; // exchange of party and connection ids
+	double total_ms = 0;
+	uint32_t attempts = 0; // connection attempts of all sockets
+	bool timed_out = false;
+};
+
+/**
+ * Connect all sockets concurrently and send the handshake (id and socket index) on each.
+ */
+bool Connect(const std::string& address, uint16_t port,
+		std::vector<std::unique_ptr<CSocket>> &sockets, uint32_t id,
+		const connection_options& options, connection_report* report = nullptr);
+/**
+ * Accept connections until numConnections of them passed the handshake and were placed at
+ * sockets[id][index]. Handshakes run concurrently with accepting further connections.
+ */
+bool Listen(const std::string& address, uint16_t port,
+		std::vector<std::vector<std::unique_ptr<CSocket>>> &sockets,
+		size_t numConnections, uint32_t myID,
+		const connection_options& options, connection_report* report = nullptr);
 
 bool Connect(const std::string& address, uint16_t port,
-		std::vector<std::unique_ptr<CSocket>> &sockets, uint32_t id);
+		std::vector<std::unique_ptr<CSocket>> &sockets, uint32_t id,
+		transport_type type = TRANSPORT_TCP);
+// waits for the peers without a deadline
 bool Listen(const std::string& address, uint16_t port,
 		std::vector<std::vector<std::unique_ptr<CSocket>>> &sockets,
-		size_t numConnections, uint32_t myID);
+		size_t numConnections, uint32_t myID, transport_type type = TRANSPORT_TCP);
+
+std::unique_ptr<CSocket> Connect(const std::string& address, uint16_t port,
+		const connection_options& options);
+std::unique_ptr<CSocket> Listen(const std::string& address, uint16_t port,
+		const connection_options& options);
 
-std::unique_ptr<CSocket> Connect(const std::string& address, uint16_t port);
-std::unique_ptr<CSocket> Listen(const std::string& address, uint16_t port);
+std::unique_ptr<CSocket> Connect(const std::string& address, uint16_t port,
+		transport_type type = TRANSPORT_TCP);
+// waits for the peer without a deadline
+std::unique_ptr<CSocket> Listen(const std::string& address, uint16_t port,
+		transport_type type = TRANSPORT_TCP);
 
 #endif
\ No newline at end of file
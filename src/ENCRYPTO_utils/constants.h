@@ -38,8 +38,27 @@
 #define SHA256_OUT_BYTES 32
 #define SHA512_OUT_BYTES 64
 
-#define MAX_NUM_COMM_CHANNELS 256
+#define MAX_NUM_COMM_CHANNELS 256 //channel ids are 32 bit, ids below this one have lock-free traffic counters
 #define ADMIN_CHANNEL MAX_NUM_COMM_CHANNELS-1
+#define CHANNEL_CHUNK_SIZE (1 << 20) //default message size used by channel::send_chunked
+#define SND_BATCH_MAX_FRAMES 64 //frames the send thread writes with a single system call
+#define SND_BATCH_MAX_BYTES (1 << 20) //payload bytes after which a batch is closed
+#define SND_FRAGMENT_SIZE (1 << 18) //larger messages are sent in fragments, such that other channels can be served in between
+#define SND_NUM_PRIORITIES 4 //strict priority classes of the send thread, class 0 is served first
+#define SND_DEFAULT_PRIORITY 1 //priority class of channels that did not set one
+#define SND_DRR_QUANTUM (1 << 18) //bytes a channel of weight 1 may send per deficit round-robin turn within its class
+#define FRAME_HEADER_SIZE (sizeof(uint8_t) + sizeof(uint64_t)) //channel id and payload length that precede every message on channels below FRAME_ID_EXTENDED
+#define FRAME_ID_EXTENDED 0xFE //first header byte of frames on channels >= 0xFE (except ADMIN_CHANNEL), the id follows the length as varint
+#define FRAME_HEADER_MAX_SIZE (FRAME_HEADER_SIZE + 5) //header with the longest varint of a 32 bit channel id
+#define FRAME_FLAG_COMPRESSED ((uint64_t) 1 << 63) //set in the length field of a frame whose payload is zrle compressed
+#define FRAME_FLAG_MORE ((uint64_t) 1 << 62) //set in the length field of every fragment of a message except the last one
+#define FRAME_LEN_MASK (~(FRAME_FLAG_COMPRESSED | FRAME_FLAG_MORE))
+
+//first payload byte of a message on the ADMIN_CHANNEL
+enum admin_msg_type : uint8_t {
+	ADMIN_FIN = 0, //shut down the receiver thread
+	ADMIN_CREDIT = 1, //grant send credit on a channel: [uint32_t channelid][uint64_t bytes]
+};
 
 enum field_type {P_FIELD, ECC_FIELD, FIELD_LAST};
 
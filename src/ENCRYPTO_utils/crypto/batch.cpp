@@ -0,0 +1,360 @@
+/**
+ \file 		batch.cpp
+ \copyright	ABY - A Framework for Efficient Mixed-protocol Secure Two-party Computation
+			Copyright (C) 2019 ENCRYPTO Group, TU Darmstadt
+			This program is free software: you can redistribute it and/or modify
+            it under the terms of the GNU Lesser General Public License as published
+            by the Free Software Foundation, either version 3 of the License, or
+            (at your option) any later version.
+            ABY is distributed in the hope that it will be useful,
+            but WITHOUT ANY WARRANTY; without even the implied warranty of
+            MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+            GNU Lesser General Public License for more details.
+            You should have received a copy of the GNU Lesser General Public License
+            along with this program. If not, see <http://www.gnu.org/licenses/>.
+ \brief		Thread pool, PRG and randomizer precomputation for batched public key operations
+ */
+
+#include "batch.h"
+#include "keyfile.h"
+#include "../utils.h"
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <pthread.h>
+#include <sched.h>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+
+//bytes of key stream that batch_prg generates at once
+#define BATCH_PRG_BUFFER 4096
+
+//number of chunks per thread that a parallel_for is split into, for load balancing
+#define BATCH_CHUNKS_PER_THREAD 8
+
+//the pool whose loop the calling thread runs, and its worker number there
+static thread_local const thread_pool* t_pLoopPool = nullptr;
+static thread_local unsigned t_nLoopWorker = 0;
+
+thread_pool::thread_pool(unsigned threads)
+	: m_nGeneration(0), m_nBusy(0), m_bStop(false), m_fLoop(nullptr), m_nCount(0), m_nChunk(1), m_nNext(0) {
+	if (threads == 0) {
+		threads = std::max(1u, std::thread::hardware_concurrency());
+	}
+	m_nThreads = threads;
+	for (unsigned i = 1; i < threads; i++) {
+		m_vWorkers.emplace_back(&thread_pool::run, this, i);
+	}
+}
+
+thread_pool::~thread_pool() {
+	{
+		std::lock_guard<std::mutex> lock(m_mState);
+		m_bStop = true;
+	}
+	m_cvStart.notify_all();
+	for (auto& t : m_vWorkers) {
+		t.join();
+	}
+}
+
+void thread_pool::parallel_for(size_t n, const std::function<void(unsigned, size_t, size_t)>& f) {
+	if (n == 0) {
+		return;
+	}
+	if (m_vWorkers.empty()) {
+		f(0, 0, n);
+		return;
+	}
+	if (t_pLoopPool == this) {
+		//a loop nested in one of this pool would wait for itself, the thread runs it on its own
+		f(t_nLoopWorker, 0, n);
+		return;
+	}
+	std::lock_guard<std::mutex> loop(m_mLoop);
+	{
+		std::lock_guard<std::mutex> lock(m_mState);
+		m_fLoop = &f;
+		m_nCount = n;
+		m_nChunk = std::max<size_t>(1, n / (size_t(m_nThreads) * BATCH_CHUNKS_PER_THREAD));
+		m_nNext = 0;
+		m_nBusy = m_vWorkers.size();
+		m_nGeneration++;
+	}
+	m_cvStart.notify_all();
+	work(0);
+	std::unique_lock<std::mutex> lock(m_mState);
+	m_cvDone.wait(lock, [this] { return m_nBusy == 0; });
+	m_fLoop = nullptr;
+}
+
+void thread_pool::work(unsigned worker) {
+	const thread_pool* outer_pool = t_pLoopPool;
+	unsigned outer_worker = t_nLoopWorker;
+	t_pLoopPool = this;
+	t_nLoopWorker = worker;
+	for (;;) {
+		size_t begin = m_nNext.fetch_add(m_nChunk);
+		if (begin >= m_nCount) {
+			break;
+		}
+		(*m_fLoop)(worker, begin, std::min(begin + m_nChunk, m_nCount));
+	}
+	t_pLoopPool = outer_pool;
+	t_nLoopWorker = outer_worker;
+}
+
+void thread_pool::run(unsigned worker) {
+	uint64_t generation = 0;
+	for (;;) {
+		{
+			std::unique_lock<std::mutex> lock(m_mState);
+			m_cvStart.wait(lock, [&] { return m_bStop || m_nGeneration != generation; });
+			if (m_bStop) {
+				return;
+			}
+			generation = m_nGeneration;
+		}
+		work(worker);
+		std::lock_guard<std::mutex> lock(m_mState);
+		if (--m_nBusy == 0) {
+			m_cvDone.notify_one();
+		}
+	}
+}
+
+batch_prg::batch_prg() : m_vBuf() {
+	uint8_t seed[32];
+	int furandom = open("/dev/urandom", O_RDONLY);
+	size_t len = 0;
+	while (furandom >= 0 && len < sizeof(seed)) {
+		ssize_t result = read(furandom, seed + len, sizeof(seed) - len);
+		if (result <= 0) {
+			break;
+		}
+		len += result;
+	}
+	if (furandom < 0 || len < sizeof(seed)) {
+		std::cerr << "Error in seeding from /dev/urandom: batch.cpp:batch_prg()" << std::endl;
+		exit(1);
+	}
+	close(furandom);
+
+	//the first half is the key, the second the initial counter
+	m_ctx = EVP_CIPHER_CTX_new();
+	EVP_EncryptInit_ex(m_ctx, EVP_aes_128_ctr(), nullptr, seed, seed + 16);
+	memset(seed, 0, sizeof(seed));
+}
+
+batch_prg::~batch_prg() {
+	EVP_CIPHER_CTX_free(m_ctx);
+}
+
+void batch_prg::gen(uint8_t* buf, size_t len) {
+	while (len > 0) {
+		if (m_vBuf.empty()) {
+			//encrypting zeros yields the key stream
+			std::vector<uint8_t> zero(BATCH_PRG_BUFFER, 0);
+			m_vBuf.resize(BATCH_PRG_BUFFER);
+			int outl = 0;
+			EVP_EncryptUpdate(m_ctx, m_vBuf.data(), &outl, zero.data(), BATCH_PRG_BUFFER);
+		}
+		size_t n = std::min(len, m_vBuf.size());
+		memcpy(buf, m_vBuf.data() + m_vBuf.size() - n, n);
+		m_vBuf.resize(m_vBuf.size() - n);
+		buf += n;
+		len -= n;
+	}
+}
+
+void batch_prg::gen_mpz(mpz_t rnd, mp_bitcnt_t bits) {
+	size_t bytes = (bits + 7) / 8;
+	uint8_t stackbuf[512];
+	std::vector<uint8_t> heapbuf;
+	uint8_t* data = stackbuf;
+	if (bytes > sizeof(stackbuf)) {
+		heapbuf.resize(bytes);
+		data = heapbuf.data();
+	}
+	gen(data, bytes);
+	mpz_import(rnd, bytes, 1, 1, 0, 0, data);
+	mpz_tdiv_r_2exp(rnd, rnd, bits);
+}
+
+randomizer_pool::randomizer_pool(const mpz_t base, const mpz_t mod, size_t rbits, const randomizer_pool_options& options)
+	: m_cTable(base, mod, rbits), m_nRandomBits(rbits), m_nCapacity(options.capacity), m_bRefill(options.refill),
+	  m_nStarted(0), m_nPending(0), m_nRunning(0), m_bStop(false) {
+	unsigned threads = options.threads;
+	if (threads == 0) {
+		threads = std::max(1u, std::thread::hardware_concurrency());
+	}
+	m_nRunning = threads;
+	for (unsigned i = 0; i < threads; i++) {
+		m_vThreads.emplace_back(&randomizer_pool::produce, this, options.idle_priority);
+	}
+}
+
+randomizer_pool::~randomizer_pool() {
+	{
+		std::lock_guard<std::mutex> lock(m_mValues);
+		m_bStop = true;
+	}
+	m_cvSpace.notify_all();
+	for (auto& t : m_vThreads) {
+		t.join();
+	}
+}
+
+void randomizer_pool::produce(bool idle_priority) {
+#ifdef __linux__
+	if (idle_priority) {
+		sched_param param;
+		param.sched_priority = 0;
+		pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+	}
+#else
+	(void) idle_priority;
+#endif
+	batch_prg prg;
+	auto r = std::make_unique<value>();
+	std::unique_lock<std::mutex> lock(m_mValues);
+	for (;;) {
+		m_cvSpace.wait(lock, [this] {
+			return m_bStop || !m_bRefill || m_qReady.size() + m_nPending < m_nCapacity;
+		});
+		if (m_bStop || (!m_bRefill && m_nStarted == m_nCapacity)) {
+			break;
+		}
+		m_nStarted++;
+		m_nPending++;
+		lock.unlock();
+
+		prg.gen_mpz(r->v, m_nRandomBits);
+		m_cTable.pow(r->v, r->v);
+
+		lock.lock();
+		m_nPending--;
+		m_qReady.push_back(std::move(r));
+		r = std::make_unique<value>();
+		m_cvValues.notify_all();
+	}
+	if (--m_nRunning == 0) {
+		m_cvValues.notify_all();
+	}
+}
+
+bool randomizer_pool::take(mpz_t out) {
+	std::unique_ptr<value> r;
+	{
+		std::lock_guard<std::mutex> lock(m_mValues);
+		if (m_qReady.empty()) {
+			return false;
+		}
+		r = std::move(m_qReady.front());
+		m_qReady.pop_front();
+	}
+	m_cvSpace.notify_one();
+	mpz_swap(out, r->v);
+	return true;
+}
+
+void randomizer_pool::get(mpz_t out) {
+	if (!take(out)) {
+		aby_prng(out, m_nRandomBits);
+		m_cTable.pow(out, out);
+	}
+}
+
+size_t randomizer_pool::available() {
+	std::lock_guard<std::mutex> lock(m_mValues);
+	return m_qReady.size();
+}
+
+void randomizer_pool::wait() {
+	std::unique_lock<std::mutex> lock(m_mValues);
+	m_cvValues.wait(lock, [this] { return m_nRunning == 0 || m_qReady.size() >= m_nCapacity; });
+}
+
+/*
+ * Randomizer files hold the modulus and base with mpz_out_raw, the exponent length and number of
+ * randomizers as uint64_t, followed by the randomizers with mpz_out_raw.
+ */
+
+bool randomizer_pool::store(const char* path) {
+	std::deque<std::unique_ptr<value>> values;
+	{
+		std::lock_guard<std::mutex> lock(m_mValues);
+		values.swap(m_qReady);
+	}
+	m_cvSpace.notify_all();
+
+	//write to a temporary file first, such that a crash never leaves a partial file at path.
+	//The randomizers remove the blinding of every ciphertext they are used for, only the owner may read them
+	std::string tmppath = std::string(path) + ".tmp";
+	FILE* fp = keyfile_create_private(tmppath.c_str());
+	if (!fp) {
+		std::cerr << "Error opening " << tmppath << " for writing randomizers" << std::endl;
+		return false;
+	}
+	uint64_t header[2] = {m_nRandomBits, values.size()};
+	bool ok = mpz_out_raw(fp, m_cTable.get_mod()) && mpz_out_raw(fp, m_cTable.get_base())
+			&& fwrite(header, sizeof(header), 1, fp) == 1;
+	for (size_t i = 0; ok && i < values.size(); i++) {
+		ok = mpz_out_raw(fp, values[i]->v) != 0;
+	}
+	ok = (fclose(fp) == 0) && ok;
+	if (!ok || rename(tmppath.c_str(), path) != 0) {
+		std::cerr << "Error writing randomizers to " << path << std::endl;
+		unlink(tmppath.c_str());
+		return false;
+	}
+	return true;
+}
+
+bool randomizer_pool::load(const char* path) {
+	FILE* fp = fopen(path, "rb");
+	if (!fp) {
+		return false;
+	}
+	struct stat st;
+	if (fstat(fileno(fp), &st) != 0 || (st.st_mode & (S_IRWXG | S_IRWXO))) {
+		std::cerr << "Randomizers in " << path << " are accessible by other users and not used" << std::endl;
+		fclose(fp);
+		return false;
+	}
+	mpz_t mod, base;
+	mpz_inits(mod, base, NULL);
+	uint64_t header[2];
+	bool ok = mpz_inp_raw(mod, fp) && mpz_inp_raw(base, fp) && fread(header, sizeof(header), 1, fp) == 1;
+	bool other_key = ok && (mpz_cmp(mod, m_cTable.get_mod()) || mpz_cmp(base, m_cTable.get_base()) || header[0] != m_nRandomBits);
+	std::deque<std::unique_ptr<value>> values;
+	for (uint64_t i = 0; ok && !other_key && i < header[1]; i++) {
+		values.push_back(std::make_unique<value>());
+		ok = mpz_inp_raw(values.back()->v, fp) != 0;
+	}
+	fclose(fp);
+	mpz_clears(mod, base, NULL);
+	if (other_key) {
+		std::cerr << "Randomizers in " << path << " belong to another key" << std::endl;
+		return false;
+	}
+	if (!ok) {
+		std::cerr << "Error reading randomizers from " << path << std::endl;
+		return false;
+	}
+	//the randomizers must not be loaded again
+	if (remove(path) != 0) {
+		std::cerr << "Error removing " << path << ", its randomizers are not used" << std::endl;
+		return false;
+	}
+
+	std::lock_guard<std::mutex> lock(m_mValues);
+	for (auto& v : values) {
+		m_qReady.push_back(std::move(v));
+	}
+	m_cvValues.notify_all();
+	return true;
+}
@@ -0,0 +1,210 @@
+/**
+ \file 		batch.h
+ \copyright	ABY - A Framework for Efficient Mixed-protocol Secure Two-party Computation
+			Copyright (C) 2019 ENCRYPTO Group, TU Darmstadt
+			This program is free software: you can redistribute it and/or modify
+            it under the terms of the GNU Lesser General Public License as published
+            by the Free Software Foundation, either version 3 of the License, or
+            (at your option) any later version.
+            ABY is distributed in the hope that it will be useful,
+            but WITHOUT ANY WARRANTY; without even the implied warranty of
+            MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+            GNU Lesser General Public License for more details.
+            You should have received a copy of the GNU Lesser General Public License
+            along with this program. If not, see <http://www.gnu.org/licenses/>.
+ \brief		Thread pool, PRG and randomizer precomputation for batched public key operations
+ */
+
+#ifndef BATCH_H_
+#define BATCH_H_
+
+#include "../powmod.h"
+#include <openssl/evp.h>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <gmp.h>
+
+/**
+ * Fixed set of worker threads for data-parallel loops. The calling thread takes part in every
+ * loop as worker 0, thus a pool of one thread runs loops serially without synchronization.
+ */
+class thread_pool {
+public:
+	//threads = 0 uses one thread per hardware thread
+	explicit thread_pool(unsigned threads = 0);
+	~thread_pool();
+
+	thread_pool(const thread_pool&) = delete;
+	thread_pool& operator=(const thread_pool&) = delete;
+
+	unsigned size() const {
+		return m_nThreads;
+	}
+
+	/**
+	 * calls f(worker, begin, end) for consecutive chunks of [0, n) and returns once all were
+	 * processed. worker < size() identifies the thread, e.g. to index per-thread scratch space.
+	 * Loops of concurrent callers are run one after the other. A loop started from within a loop
+	 * of the same pool is run by the calling thread alone, with the worker number it has there.
+	 */
+	void parallel_for(size_t n, const std::function<void(unsigned worker, size_t begin, size_t end)>& f);
+
+private:
+	void run(unsigned worker);
+	void work(unsigned worker);
+
+	unsigned m_nThreads;
+	std::vector<std::thread> m_vWorkers;
+	std::mutex m_mLoop; //serializes parallel_for callers
+	std::mutex m_mState;
+	std::condition_variable m_cvStart;
+	std::condition_variable m_cvDone;
+	uint64_t m_nGeneration;
+	unsigned m_nBusy;
+	bool m_bStop;
+	//the current loop
+	const std::function<void(unsigned, size_t, size_t)>* m_fLoop;
+	size_t m_nCount;
+	size_t m_nChunk;
+	std::atomic<size_t> m_nNext;
+};
+
+//pool if it is given, otherwise a new pool with one thread per hardware thread that is kept in own
+inline thread_pool& pool_or_default(thread_pool* pool, std::unique_ptr<thread_pool>& own) {
+	if (!pool) {
+		own = std::make_unique<thread_pool>();
+		pool = own.get();
+	}
+	return *pool;
+}
+
+/**
+ * AES-128 in counter mode, seeded once from /dev/urandom. Produces random exponents without a
+ * system call per value. Not thread-safe, every thread uses its own instance.
+ */
+class batch_prg {
+public:
+	batch_prg();
+	~batch_prg();
+
+	batch_prg(const batch_prg&) = delete;
+	batch_prg& operator=(const batch_prg&) = delete;
+
+	void gen(uint8_t* buf, size_t len);
+	//rnd = uniformly random number of at most bits bits, like aby_prng
+	void gen_mpz(mpz_t rnd, mp_bitcnt_t bits);
+
+private:
+	EVP_CIPHER_CTX* m_ctx;
+	std::vector<uint8_t> m_vBuf;
+};
+
+struct randomizer_pool_options {
+	size_t capacity = 1024; //number of randomizers that are kept ready
+	unsigned threads = 1; //background threads, 0 uses one per hardware thread
+	bool refill = true; //replace taken randomizers, otherwise stop after capacity randomizers
+	bool idle_priority = true; //run the background threads only when the CPU is idle (SCHED_IDLE, Linux only)
+};
+
+/**
+ * Precomputes randomizers base^r mod mod for random r of rbits bits in background threads, e.g.
+ * h^r for DGK or h_s^r for DJN encryptions. These do not depend on the plaintext, thus they can be
+ * computed during idle time and an online encryption only needs one multiplication.
+ * Every randomizer is handed out once. The pool does not check that it belongs to the key it is
+ * used with, it has to be created with the generator and modulus of that key.
+ */
+class randomizer_pool {
+public:
+	randomizer_pool(const mpz_t base, const mpz_t mod, size_t rbits, const randomizer_pool_options& options);
+	virtual ~randomizer_pool();
+
+	randomizer_pool(const randomizer_pool&) = delete;
+	randomizer_pool& operator=(const randomizer_pool&) = delete;
+
+	/**
+	 * moves a precomputed randomizer to out. Does not wait for the background threads, returns
+	 * false if no randomizer is ready, the caller then has to compute one itself.
+	 */
+	bool take(mpz_t out);
+
+	//takes a randomizer if one is ready, otherwise computes one on the calling thread
+	void get(mpz_t out);
+
+	//number of randomizers that are ready
+	size_t available();
+
+	//blocks until the pool is full, or until all randomizers were computed if it does not refill
+	void wait();
+
+	/**
+	 * moves all ready randomizers to the file at path, e.g. before the process exits. They are
+	 * removed from the pool, such that they are not used twice. The file is only accessible by
+	 * its owner. Returns false on errors.
+	 */
+	bool store(const char* path);
+
+	/**
+	 * adds the randomizers stored in the file at path and removes the file, such that they are not
+	 * used twice. Returns false if the file is missing, broken, accessible by other users, or
+	 * belongs to another base, modulus or exponent length.
+	 */
+	bool load(const char* path);
+
+private:
+	struct value {
+		value() {
+			mpz_init(v);
+		}
+		~value() {
+			mpz_clear(v);
+		}
+		mpz_t v;
+	};
+
+	void produce(bool idle_priority);
+
+	FixedBasePowmod m_cTable;
+	size_t m_nRandomBits;
+	size_t m_nCapacity;
+	bool m_bRefill;
+	std::vector<std::thread> m_vThreads;
+	std::mutex m_mValues;
+	std::condition_variable m_cvSpace; //signaled when randomizers are taken
+	std::condition_variable m_cvValues; //signaled when randomizers were added
+	std::deque<std::unique_ptr<value>> m_qReady;
+	size_t m_nStarted; //randomizers that were started, only counted without refill
+	size_t m_nPending; //randomizers that are being computed
+	unsigned m_nRunning;
+	bool m_bStop;
+};
+
+/**
+ * A randomizer_pool that computes count randomizers as soon as it is constructed, i.e. ahead of
+ * the time the plaintexts are known, and then stops.
+ */
+class randomizer_pipeline : public randomizer_pool {
+public:
+	randomizer_pipeline(const mpz_t base, const mpz_t mod, size_t rbits, size_t count, unsigned threads = 1)
+		: randomizer_pool(base, mod, rbits, options(count, threads)) {
+	}
+
+private:
+	static randomizer_pool_options options(size_t count, unsigned threads) {
+		randomizer_pool_options o;
+		o.capacity = count;
+		o.threads = threads;
+		o.refill = false;
+		o.idle_priority = false;
+		return o;
+	}
+};
+
+#endif /* BATCH_H_ */
@@ -25,22 +25,99 @@
  */
 
 #include "dgk.h"
+#include "batch.h"
+#include "keyfile.h"
+#include "prime_search.h"
 #include "../powmod.h"
 #include "../utils.h"
+#include <algorithm>
+#include <atomic>
 #include <cstdlib>
 #include <cstring>
+#include <iostream>
+#include <memory>
+#include <unordered_map>
+#include <vector>
 
 #define DGK_CHECKSIZE 0
 
 // number of test encryptions and decryptions that are performed to verify a generated key. This will take time, but more are better.
 #define KEYTEST_ITERATIONS 1000
 
+// plaintext spaces of up to this many bits are decrypted with a single lookup in a table of all plaintexts
+#define DGK_DECRYPT_TABLE_BITS 18
+
+// bits that are recovered per lookup for larger plaintext spaces
+#define DGK_DECRYPT_WINDOW 8
+
 //array holding the powers of two
 mpz_t* powtwo;
 
 //array for holding temporary values
 mpz_t* gvpvqp;
 
+/*
+ * Tables for dgk_decrypt of the key that was generated or read last. With G = g^vp mod p of order
+ * 2^lbits, a ciphertext c of m yields y = c^vp = G^m mod p. m is recovered in windows of window
+ * bits from the least significant end (Pohlig-Hellman): for the window at bit pos, z = G^(m - known)
+ * is raised to 2^(lbits - pos - window) by successive squarings, which leaves an element of the
+ * subgroup of order 2^window that is looked up in digits. Then z is multiplied with
+ * G^(-digit*2^pos) from inverse. With window = lbits this is a single lookup in a table of all
+ * plaintexts.
+ */
+struct dgk_decrypt_tables {
+	dgk_decrypt_tables() {
+		mpz_init(p);
+	}
+	~dgk_decrypt_tables() {
+		clear();
+		mpz_clear(p);
+	}
+
+	void clear() {
+		for (size_t i = 0; i < ninverse; i++) {
+			mpz_clear(inverse[i]);
+		}
+		free(inverse);
+		inverse = nullptr;
+		ninverse = 0;
+		digits.clear();
+		lbits = 0;
+		mpz_clear(p);
+		mpz_init(p);
+	}
+
+	//whether the tables were built for the key with prime p
+	bool match(dgk_pubkey_t* pub, dgk_prvkey_t* prv) const {
+		return lbits == pub->lbits && mpz_cmp(p, prv->p) == 0;
+	}
+
+	mpz_t p;
+	unsigned lbits = 0;
+	unsigned window = 0;
+	//least significant limb of G^(j*2^(lbits-window)) mod p -> j. Collisions among the at most
+	//2^DGK_DECRYPT_TABLE_BITS values are negligible for limbs of 64 bits.
+	std::unordered_map<mp_limb_t, uint32_t> digits;
+	//G^(-d*2^(k*window)) mod p at k*2^window + d, for all but the last window
+	mpz_t* inverse = nullptr;
+	size_t ninverse = 0;
+};
+
+static dgk_decrypt_tables decrypt_tables;
+
+static void dgk_build_decrypt_tables(dgk_decrypt_tables& t, dgk_pubkey_t* pub, dgk_prvkey_t* prv);
+static bool dgk_generate(unsigned int modulusbits, unsigned int lbits, dgk_pubkey_t** pub, dgk_prvkey_t** prv,
+		const keygen_options& options);
+static void dgk_install_tables(dgk_pubkey_t* pub, dgk_prvkey_t* prv);
+static void dgk_encrypt_batch_tables(mpz_t* res, dgk_pubkey_t* pub, dgk_prvkey_t* prv, mpz_t* pt, size_t n,
+		thread_pool* pool, randomizer_pool* randomizers, const FixedBasePowmod* fb_g, const FixedBasePowmod* fb_h);
+static void dgk_decrypt_batch_tables(mpz_t* res, dgk_pubkey_t* pub, dgk_prvkey_t* prv, mpz_t* ct, size_t n,
+		thread_pool* pool, const dgk_decrypt_tables* t);
+static bool dgk_store_keyfile(const char* path, dgk_pubkey_t* pub, dgk_prvkey_t* prv, const dgk_decrypt_tables* t,
+		const FixedBasePowmod* fb_g, const FixedBasePowmod* fb_h);
+static bool dgk_load_keyfile(const char* path, dgk_pubkey_t** pub, dgk_prvkey_t** prv, dgk_decrypt_tables* t,
+		bool bitwise, std::unique_ptr<FixedBasePowmod>* fb_g, std::unique_ptr<FixedBasePowmod>* fb_h);
+
 void dgk_complete_pubkey(unsigned int modulusbits, unsigned int lbits, dgk_pubkey_t** pub, mpz_t n, mpz_t g, mpz_t h) {
 	*pub = (dgk_pubkey_t*) malloc(sizeof(dgk_pubkey_t));
 
@@ -59,9 +136,24 @@ void dgk_complete_pubkey(unsigned int modulusbits, unsigned int lbits, dgk_pubke
 }
 
 void dgk_keygen(unsigned int modulusbits, unsigned int lbits, dgk_pubkey_t** pub, dgk_prvkey_t** prv) {
+	keygen_options options;
+	dgk_keygen(modulusbits, lbits, pub, prv, options);
+}
+
+bool dgk_keygen(unsigned int modulusbits, unsigned int lbits, dgk_pubkey_t** pub, dgk_prvkey_t** prv, const keygen_options& options) {
+	if (!dgk_generate(modulusbits, lbits, pub, prv, options)) {
+		return false;
+	}
+	dgk_install_tables(*pub, *prv);
+	return true;
+}
+
+//the keys of dgk_keygen, without the tables of the last key
+static bool dgk_generate(unsigned int modulusbits, unsigned int lbits, dgk_pubkey_t** pub, dgk_prvkey_t** prv,
+		const keygen_options& options) {
 	mpz_t tmp, tmp2, f1, f2, exp1, exp2, exp3, xp, xq;
 
-	unsigned int found = 0, i;
+	unsigned int found = 0;
 
 	//printf("Keygen %u %u\n", modulusbits, lbits);
 
@@ -103,29 +195,20 @@ void dgk_keygen(unsigned int modulusbits, unsigned int lbits, dgk_pubkey_t** pub
 	// u = 2^lbits. u is NOT a prime (different from original DGK to allow full and easy decryption. See Blanton/Gasti Paper for details).
 	mpz_setbit((*pub)->u, lbits);
 
-	// p
-	while (!found) {
-		aby_prng(f1, modulusbits / 2 - 160 - lbits);
-		mpz_nextprime(f1, f1);
-
-		mpz_mul((*prv)->p, (*pub)->u, (*prv)->vp);
-		mpz_mul((*prv)->p, f1, (*prv)->p);
-		mpz_add_ui((*prv)->p, (*prv)->p, 1);
-		found = mpz_probab_prime_p((*prv)->p, 50);
-	}
-	found = 0;
-
-	// q
-	while (!found) {
-		aby_prng(f2, modulusbits / 2 - 159 - lbits);
-		mpz_nextprime(f2, f2);
-
-		mpz_mul((*prv)->q, (*pub)->u, (*prv)->vq);
-		mpz_mul((*prv)->q, f2, (*prv)->q);
-		mpz_add_ui((*prv)->q, (*prv)->q, 1);
-		found = mpz_probab_prime_p((*prv)->q, 50);
+	// p = u*vp*f1 + 1 and q = u*vq*f2 + 1 for random primes f1 and f2
+	prime_search search(options);
+	mpz_mul(tmp, (*pub)->u, (*prv)->vp);
+	bool ok = search.prime_dgk((*prv)->p, f1, tmp, modulusbits / 2 - 160 - lbits, "p");
+	mpz_mul(tmp, (*pub)->u, (*prv)->vq);
+	ok = ok && search.prime_dgk((*prv)->q, f2, tmp, modulusbits / 2 - 159 - lbits, "q");
+	if (!ok) {
+		mpz_clears(tmp, tmp2, f1, f2, exp1, exp2, exp3, xp, xq, NULL);
+		dgk_freepubkey(*pub);
+		dgk_freeprvkey(*prv);
+		*pub = nullptr;
+		*prv = nullptr;
+		return false;
 	}
-	found = 0;
 
 	// p-1, q-1 - this is currently not used
 	mpz_sub_ui((*prv)->p_minusone, (*prv)->p, 1);
@@ -213,6 +296,17 @@ void dgk_keygen(unsigned int modulusbits, unsigned int lbits, dgk_pubkey_t** pub
 	mpz_mul(tmp, tmp, (*pub)->u);
 	mpz_powm((*pub)->h, (*pub)->h, tmp, (*pub)->n); // h = h^tmp % n
 
+	/* clear temporary integers */
+	mpz_clears(tmp, tmp2, f1, f2, exp1, exp2, exp3, xp, xq, NULL);
+	return true;
+}
+
+//sets powtwo, gvpvqp and the decryption tables to the ones of the given key
+static void dgk_install_tables(dgk_pubkey_t* pub, dgk_prvkey_t* prv) {
+	unsigned int i, lbits = pub->lbits;
+	mpz_t gvp, tmp;
+	mpz_inits(gvp, tmp, NULL);
+
 	powtwo = (mpz_t*) malloc(sizeof(mpz_t) * lbits);
 	gvpvqp = (mpz_t*) malloc(sizeof(mpz_t) * lbits);
 
@@ -222,18 +316,19 @@ void dgk_keygen(unsigned int modulusbits, unsigned int lbits, dgk_pubkey_t** pub
 		mpz_setbit(powtwo[i], i);
 	}
 
-	mpz_powm(f1, (*pub)->g, (*prv)->vp, (*prv)->p); // gvpvq
+	mpz_powm(gvp, pub->g, prv->vp, prv->p); // gvpvq
 
-	mpz_sub_ui(tmp2, (*pub)->u, 1); // tmp1 = u - 1
+	mpz_sub_ui(tmp, pub->u, 1); // tmp = u - 1
 
 	for (i = 0; i < lbits; i++) {
 		mpz_init(gvpvqp[i]);
-		mpz_powm(gvpvqp[i], f1, powtwo[i], (*prv)->p);
-		mpz_powm(gvpvqp[i], gvpvqp[i], tmp2, (*prv)->p);
+		mpz_powm(gvpvqp[i], gvp, powtwo[i], prv->p);
+		mpz_powm(gvpvqp[i], gvpvqp[i], tmp, prv->p);
 	}
 
-	/* clear temporary integers */
-	mpz_clears(tmp, tmp2, f1, f2, exp1, exp2, exp3, xp, xq, NULL);
+	dgk_precompute_decrypt(pub, prv);
+
+	mpz_clears(gvp, tmp, NULL);
 }
 
 void dgk_encrypt_db(mpz_t res, dgk_pubkey_t* pub, mpz_t plaintext) {
@@ -249,14 +344,16 @@ void dgk_encrypt_db(mpz_t res, dgk_pubkey_t* pub, mpz_t plaintext) {
 #endif
 
 	/* pick random blinding factor r */
-	aby_prng(r, 400); // 2.5 * 160 = 400 bit
+	aby_prng(r, DGK_RANDOM_BITS);
 
 	dbpowmod(res, pub->h, r, pub->g, plaintext, pub->n);
 
 	mpz_clear(r);
 }
 
-void dgk_encrypt_fb(mpz_t res, dgk_pubkey_t* pub, mpz_t plaintext) {
+//fixed-base encryption with the given tables or the ones of fbpowmod_init_* if they are null
+static void dgk_encrypt_fb_table(mpz_t res, dgk_pubkey_t* pub, const FixedBasePowmod* fb_g, const FixedBasePowmod* fb_h,
+		mpz_t plaintext) {
 	mpz_t r;
 	mpz_init(r);
 
@@ -269,9 +366,14 @@ void dgk_encrypt_fb(mpz_t res, dgk_pubkey_t* pub, mpz_t plaintext) {
 #endif
 
 	/* pick random blinding factor r */
-	aby_prng(r, 400); // 2.5 * 160 = 400 bit
-	fbpowmod_h(r, r); //r = h^r
-	fbpowmod_g(res, plaintext); //res = g^plaintext
+	aby_prng(r, DGK_RANDOM_BITS);
+	if (fb_g) {
+		fb_h->pow(r, r); //r = h^r
+		fb_g->pow(res, plaintext); //res = g^plaintext
+	} else {
+		fbpowmod_h(r, r); //r = h^r
+		fbpowmod_g(res, plaintext); //res = g^plaintext
+	}
 
 	mpz_mul(res, res, r);
 	mpz_mod(res, res, pub->n);
@@ -279,6 +381,14 @@ void dgk_encrypt_fb(mpz_t res, dgk_pubkey_t* pub, mpz_t plaintext) {
 	mpz_clear(r);
 }
 
+void dgk_encrypt_fb(mpz_t res, dgk_pubkey_t* pub, mpz_t plaintext) {
+	dgk_encrypt_fb_table(res, pub, nullptr, nullptr, plaintext);
+}
+
+void dgk_encrypt_fb(mpz_t res, dgk_pubkey_t* pub, const FixedBasePowmod& fb_g, const FixedBasePowmod& fb_h, mpz_t plaintext) {
+	dgk_encrypt_fb_table(res, pub, &fb_g, &fb_h, plaintext);
+}
+
 void dgk_encrypt_plain(mpz_t res, dgk_pubkey_t* pub, mpz_t plaintext) {
 	mpz_t r;
 	mpz_init(r);
@@ -292,7 +402,7 @@ void dgk_encrypt_plain(mpz_t res, dgk_pubkey_t* pub, mpz_t plaintext) {
 #endif
 
 	/* pick random blinding factor r */
-	aby_prng(r, 400); // 2.5 * 160 = 400 bit
+	aby_prng(r, DGK_RANDOM_BITS);
 	mpz_powm(r, pub->h, r, pub->n);
 	mpz_powm(res, pub->g, plaintext, pub->n);
 
@@ -316,7 +426,7 @@ void dgk_encrypt_crt_db(mpz_t res, dgk_pubkey_t * pub, dgk_prvkey_t * prv, mpz_t
 
 	/* pick random blinding factor r */
 	//mpz_urandomb(r, rnd, 400); // 2.5 * 160 = 400 bit
-	aby_prng(r, 400);
+	aby_prng(r, DGK_RANDOM_BITS);
 	dbpowmod(ep, pub->h, r, pub->g, plaintext, prv->p);
 
 	mpz_mul(res, ep, prv->q);
@@ -335,20 +445,8 @@ void dgk_encrypt_crt_db(mpz_t res, dgk_pubkey_t * pub, dgk_prvkey_t * prv, mpz_t
 	mpz_clears(r, ep, NULL);
 }
 
-void dgk_encrypt_crt(mpz_t res, dgk_pubkey_t * pub, dgk_prvkey_t * prv, mpz_t plaintext) {
-	mpz_t r, ep, eq;
-	mpz_inits(r, ep, eq, NULL);
-
-#if DGK_CHECKSIZE
-	mpz_setbit(r, (pub->lbits-2)/2);
-	if (mpz_cmp(plaintext, r) >= 0) {
-		gmp_printf("m: %Zd\nmax:%Zd\n", plaintext, r);
-		printf("DGK WARNING: m too big!\n");
-	}
-#endif
-
-	/* pick random blinding factor r */
-	aby_prng(r, 400); // 2.5 * 160 = 400 bit
+//res = h^r * g^plaintext mod n, computed modulo p and q. ep and eq are temporaries
+static void dgk_encrypt_crt_r(mpz_t res, dgk_pubkey_t* pub, dgk_prvkey_t* prv, mpz_t plaintext, mpz_t r, mpz_t ep, mpz_t eq) {
 	// ep = h^r * g^plaintext % p
 	mpz_powm(ep, pub->h, r, prv->p);
 	mpz_powm(res, pub->g, plaintext, prv->p);
@@ -371,11 +469,162 @@ void dgk_encrypt_crt(mpz_t res, dgk_pubkey_t * pub, dgk_prvkey_t * prv, mpz_t pl
 
 	mpz_add(res, res, ep);
 	mpz_mod(res, res, pub->n);
+}
+
+void dgk_encrypt_crt(mpz_t res, dgk_pubkey_t * pub, dgk_prvkey_t * prv, mpz_t plaintext) {
+	mpz_t r, ep, eq;
+	mpz_inits(r, ep, eq, NULL);
+
+#if DGK_CHECKSIZE
+	mpz_setbit(r, (pub->lbits-2)/2);
+	if (mpz_cmp(plaintext, r) >= 0) {
+		gmp_printf("m: %Zd\nmax:%Zd\n", plaintext, r);
+		printf("DGK WARNING: m too big!\n");
+	}
+#endif
+
+	/* pick random blinding factor r */
+	aby_prng(r, DGK_RANDOM_BITS);
+	dgk_encrypt_crt_r(res, pub, prv, plaintext, r, ep, eq);
 
 	mpz_clears(r, ep, eq, NULL);
 }
 
-void dgk_decrypt(mpz_t res, dgk_pubkey_t* pub, dgk_prvkey_t* prv, mpz_t ciphertext) {
+void dgk_encrypt_pool(mpz_t res, dgk_pubkey_t* pub, randomizer_pool& randomizers, mpz_t plaintext) {
+	mpz_t r;
+	mpz_init(r);
+
+#if DGK_CHECKSIZE
+	mpz_setbit(r, (pub->lbits-2)/2);
+	if (mpz_cmp(plaintext, r) >= 0) {
+		gmp_printf("m: %Zd\nmax:%Zd\n", plaintext, r);
+		printf("DGK WARNING: m too big!\n");
+	}
+#endif
+
+	randomizers.get(r); //r = h^r
+	mpz_powm(res, pub->g, plaintext, pub->n); //res = g^plaintext
+
+	mpz_mul(res, res, r);
+	mpz_mod(res, res, pub->n);
+
+	mpz_clear(r);
+}
+
+void dgk_encrypt_batch(mpz_t* res, dgk_pubkey_t* pub, dgk_prvkey_t* prv, mpz_t* pt, size_t n, thread_pool* pool,
+		randomizer_pool* randomizers) {
+	dgk_encrypt_batch_tables(res, pub, prv, pt, n, pool, randomizers, nullptr, nullptr);
+}
+
+/*
+ * dgk_encrypt_batch with the given fixed-base tables. Without tables, the blinding factors are
+ * computed with CRT if prv is given, otherwise with a table of h. The table of g is built only if
+ * it is used, i.e. without CRT or to combine g^plaintext with precomputed randomizers.
+ */
+static void dgk_encrypt_batch_tables(mpz_t* res, dgk_pubkey_t* pub, dgk_prvkey_t* prv, mpz_t* pt, size_t n,
+		thread_pool* pool, randomizer_pool* randomizers, const FixedBasePowmod* fb_g, const FixedBasePowmod* fb_h) {
+	std::unique_ptr<thread_pool> own_pool;
+	pool = &pool_or_default(pool, own_pool);
+	std::unique_ptr<FixedBasePowmod> own_g, own_h;
+	if (fb_h) {
+		prv = nullptr;
+	} else if (!prv) {
+		own_h = std::make_unique<FixedBasePowmod>(pub->h, pub->n, DGK_RANDOM_BITS);
+		fb_h = own_h.get();
+	}
+	// g^plaintext is taken from the table of g unless every ciphertext is computed with CRT
+	if (!fb_g && (!prv || randomizers)) {
+		own_g = std::make_unique<FixedBasePowmod>(pub->g, pub->n, pub->lbits);
+		fb_g = own_g.get();
+	}
+
+	// per-thread PRG, blinding factor and temporaries
+	std::vector<std::unique_ptr<batch_prg>> prgs(pool->size());
+	mpz_t* tmp = (mpz_t*) malloc(sizeof(mpz_t) * 3 * pool->size());
+	for (unsigned i = 0; i < 3 * pool->size(); i++) {
+		mpz_init(tmp[i]);
+	}
+
+	pool->parallel_for(n, [&](unsigned worker, size_t begin, size_t end) {
+		if (!prgs[worker]) {
+			prgs[worker] = std::make_unique<batch_prg>();
+		}
+		mpz_t* r = tmp + 3 * worker;
+		for (size_t i = begin; i < end; i++) {
+			if (randomizers && randomizers->take(*r)) {
+				fb_g->pow(res[i], pt[i]);
+			} else {
+				prgs[worker]->gen_mpz(*r, DGK_RANDOM_BITS);
+				if (prv) {
+					dgk_encrypt_crt_r(res[i], pub, prv, pt[i], *r, r[1], r[2]);
+					continue;
+				}
+				fb_h->pow(*r, *r);
+				fb_g->pow(res[i], pt[i]);
+			}
+			mpz_mul(res[i], res[i], *r);
+			mpz_mod(res[i], res[i], pub->n);
+		}
+	});
+
+	for (unsigned i = 0; i < 3 * pool->size(); i++) {
+		mpz_clear(tmp[i]);
+	}
+	free(tmp);
+}
+
+void dgk_precompute_decrypt(dgk_pubkey_t* pub, dgk_prvkey_t* prv) {
+	dgk_build_decrypt_tables(decrypt_tables, pub, prv);
+}
+
+static void dgk_build_decrypt_tables(dgk_decrypt_tables& t, dgk_pubkey_t* pub, dgk_prvkey_t* prv) {
+	t.clear();
+	mpz_set(t.p, prv->p);
+	t.lbits = pub->lbits;
+	t.window = pub->lbits <= DGK_DECRYPT_TABLE_BITS ? pub->lbits : DGK_DECRYPT_WINDOW;
+
+	mpz_t gvp, x, step;
+	mpz_inits(gvp, x, step, NULL);
+	mpz_powm(gvp, pub->g, prv->vp, prv->p); // G = g^vp, of order 2^lbits
+
+	// digits of the subgroup of order 2^window, generated by G^(2^(lbits-window))
+	mpz_set_ui(step, 0);
+	mpz_setbit(step, t.lbits - t.window);
+	mpz_powm(step, gvp, step, prv->p);
+	size_t entries = size_t(1) << t.window;
+	t.digits.reserve(entries);
+	mpz_set_ui(x, 1);
+	for (size_t j = 0; j < entries; j++) {
+		t.digits.emplace(mpz_getlimbn(x, 0), j);
+		mpz_mul(x, x, step);
+		mpz_mod(x, x, prv->p);
+	}
+
+	// inverse powers that remove a recovered digit, not needed for the last window
+	size_t windows = (t.lbits + t.window - 1) / t.window;
+	t.ninverse = (windows - 1) * entries;
+	t.inverse = (mpz_t*) malloc(sizeof(mpz_t) * std::max<size_t>(t.ninverse, 1));
+	mpz_invert(step, gvp, prv->p);
+	for (size_t k = 0; k + 1 < windows; k++) {
+		mpz_t* row = t.inverse + k * entries;
+		mpz_init_set_ui(row[0], 1);
+		for (size_t d = 1; d < entries; d++) {
+			mpz_init(row[d]);
+			mpz_mul(row[d], row[d - 1], step);
+			mpz_mod(row[d], row[d], prv->p);
+		}
+		// step = G^(-2^((k+1)*window))
+		for (unsigned i = 0; i < t.window; i++) {
+			mpz_mul(step, step, step);
+			mpz_mod(step, step, prv->p);
+		}
+	}
+
+	mpz_clears(gvp, x, step, NULL);
+}
+
+// the original decryption, one exponentiation per plaintext bit
+static void dgk_decrypt_bitwise(mpz_t res, dgk_pubkey_t* pub, dgk_prvkey_t* prv, mpz_t ciphertext) {
 	mpz_t y, yi;
 	mpz_inits(y, yi, NULL);
 
@@ -408,6 +657,134 @@ void dgk_decrypt(mpz_t res, dgk_pubkey_t* pub, dgk_prvkey_t* prv, mpz_t cipherte
 	mpz_clears(y, yi, NULL);
 }
 
+//res = plaintext of ciphertext with the decryption tables t, y and z are temporaries
+static void dgk_decrypt_table(mpz_t res, const dgk_decrypt_tables& t, dgk_prvkey_t* prv, mpz_t ciphertext, mpz_t y, mpz_t z) {
+	mpz_powm(y, ciphertext, prv->vp, prv->p); // y = G^m
+
+	mpz_set_ui(res, 0);
+	for (unsigned pos = 0, k = 0; pos < t.lbits; pos += t.window, k++) {
+		unsigned width = std::min(t.window, t.lbits - pos);
+		// z = y^(2^(lbits-pos-width)) = (G^(2^(lbits-width)))^digit
+		mpz_set(z, y);
+		for (unsigned i = pos + width; i < t.lbits; i++) {
+			mpz_mul(z, z, z);
+			mpz_mod(z, z, prv->p);
+		}
+		auto it = t.digits.find(mpz_getlimbn(z, 0));
+		if (it == t.digits.end()) {
+			// not a valid ciphertext of this key, return an arbitrary plaintext
+			return;
+		}
+		// a last window that is shorter than window bits is looked up scaled by 2^(window-width)
+		uint32_t digit = it->second >> (t.window - width);
+		if (digit == 0) {
+			continue;
+		}
+		mpz_set_ui(z, digit);
+		mpz_mul_2exp(z, z, pos);
+		mpz_add(res, res, z);
+		if (pos + width < t.lbits) {
+			mpz_mul(y, y, t.inverse[(size_t(k) << t.window) + digit]);
+			mpz_mod(y, y, prv->p);
+		}
+	}
+}
+
+void dgk_decrypt(mpz_t res, dgk_pubkey_t* pub, dgk_prvkey_t* prv, mpz_t ciphertext) {
+	if (!decrypt_tables.match(pub, prv)) {
+		dgk_decrypt_bitwise(res, pub, prv, ciphertext);
+		return;
+	}
+	mpz_t y, z;
+	mpz_inits(y, z, NULL);
+	dgk_decrypt_table(res, decrypt_tables, prv, ciphertext, y, z);
+	mpz_clears(y, z, NULL);
+}
+
+void dgk_decrypt_batch(mpz_t* res, dgk_pubkey_t* pub, dgk_prvkey_t* prv, mpz_t* ct, size_t n, thread_pool* pool) {
+	dgk_decrypt_batch_tables(res, pub, prv, ct, n, pool, decrypt_tables.match(pub, prv) ? &decrypt_tables : nullptr);
+}
+
+//dgk_decrypt_batch with the tables t, or bitwise if t is null
+static void dgk_decrypt_batch_tables(mpz_t* res, dgk_pubkey_t* pub, dgk_prvkey_t* prv, mpz_t* ct, size_t n,
+		thread_pool* pool, const dgk_decrypt_tables* t) {
+	std::unique_ptr<thread_pool> own_pool;
+	pool = &pool_or_default(pool, own_pool);
+	if (!t) {
+		pool->parallel_for(n, [&](unsigned, size_t begin, size_t end) {
+			for (size_t i = begin; i < end; i++) {
+				dgk_decrypt_bitwise(res[i], pub, prv, ct[i]);
+			}
+		});
+		return;
+	}
+
+	// per-thread temporaries
+	mpz_t* tmp = (mpz_t*) malloc(sizeof(mpz_t) * 2 * pool->size());
+	for (unsigned i = 0; i < 2 * pool->size(); i++) {
+		mpz_init(tmp[i]);
+	}
+	pool->parallel_for(n, [&](unsigned worker, size_t begin, size_t end) {
+		for (size_t i = begin; i < end; i++) {
+			dgk_decrypt_table(res[i], *t, prv, ct[i], tmp[2 * worker], tmp[2 * worker + 1]);
+		}
+	});
+	for (unsigned i = 0; i < 2 * pool->size(); i++) {
+		mpz_clear(tmp[i]);
+	}
+	free(tmp);
+}
+
+//y is a temporary
+static bool dgk_is_zero_tmp(dgk_prvkey_t* prv, mpz_t ciphertext, mpz_t y) {
+	// the plaintext part g^(vp*m) vanishes only for m = 0, h^(r*vp) is always 1 mod p
+	mpz_powm(y, ciphertext, prv->vp, prv->p);
+	return mpz_cmp_ui(y, 1) == 0;
+}
+
+bool dgk_is_zero(dgk_pubkey_t*, dgk_prvkey_t* prv, mpz_t ciphertext) {
+	mpz_t y;
+	mpz_init(y);
+	bool zero = dgk_is_zero_tmp(prv, ciphertext, y);
+	mpz_clear(y);
+	return zero;
+}
+
+void dgk_is_zero_batch(bool* res, dgk_pubkey_t*, dgk_prvkey_t* prv, mpz_t* ct, size_t n, thread_pool* pool) {
+	std::unique_ptr<thread_pool> own_pool;
+	pool = &pool_or_default(pool, own_pool);
+	pool->parallel_for(n, [&](unsigned, size_t begin, size_t end) {
+		mpz_t y;
+		mpz_init(y);
+		for (size_t i = begin; i < end; i++) {
+			res[i] = dgk_is_zero_tmp(prv, ct[i], y);
+		}
+		mpz_clear(y);
+	});
+}
+
+bool dgk_any_zero(dgk_pubkey_t*, dgk_prvkey_t* prv, mpz_t* ct, size_t n, thread_pool* pool, size_t* index) {
+	std::unique_ptr<thread_pool> own_pool;
+	pool = &pool_or_default(pool, own_pool);
+	std::atomic<bool> found(false);
+	std::atomic<size_t> position(n);
+	pool->parallel_for(n, [&](unsigned, size_t begin, size_t end) {
+		mpz_t y;
+		mpz_init(y);
+		for (size_t i = begin; i < end && !found.load(std::memory_order_relaxed); i++) {
+			if (dgk_is_zero_tmp(prv, ct[i], y)) {
+				position = i;
+				found = true;
+			}
+		}
+		mpz_clear(y);
+	});
+	if (found && index) {
+		*index = position;
+	}
+	return found;
+}
+
 void dgk_freepubkey(dgk_pubkey_t* pub) {
 	mpz_clears(pub->n, pub->u, pub->g, pub->h, NULL);
 	free(pub);
@@ -456,12 +833,6 @@ void dgk_storekey(unsigned int modulusbits, unsigned int lbits, dgk_pubkey_t* pu
 }
 
 void dgk_readkey(unsigned int modulusbits, unsigned int lbits, dgk_pubkey_t** pub, dgk_prvkey_t** prv) {
-	unsigned int i;
-
-	mpz_t f1, tmp;
-
-	mpz_inits(f1, tmp, NULL);
-
 	char smod[5];
 	char slbit[4];
 	char name[40] = "dgk_key_";
@@ -524,23 +895,7 @@ void dgk_readkey(unsigned int modulusbits, unsigned int lbits, dgk_pubkey_t** pu
 	(*pub)->bits = modulusbits;
 	(*pub)->lbits = lbits;
 
-	powtwo = (mpz_t*) malloc(sizeof(mpz_t) * lbits);
-	gvpvqp = (mpz_t*) malloc(sizeof(mpz_t) * lbits);
-
-	// array holding powers of two
-	for (i = 0; i < lbits; i++) {
-		mpz_init(powtwo[i]);
-		mpz_setbit(powtwo[i], i);
-	}
-
-	mpz_powm(f1, (*pub)->g, (*prv)->vp, (*prv)->p); //gvpvq
-	mpz_sub_ui(tmp, (*pub)->u, 1); // tmp1 = u - 1
-
-	for (i = 0; i < lbits; i++) {
-		mpz_init(gvpvqp[i]);
-		mpz_powm(gvpvqp[i], f1, powtwo[i], (*prv)->p);
-		mpz_powm(gvpvqp[i], gvpvqp[i], tmp, (*prv)->p);
-	}
+	dgk_install_tables(*pub, *prv);
 
 	/*
 	 // debug output
@@ -557,6 +912,254 @@ void dgk_readkey(unsigned int modulusbits, unsigned int lbits, dgk_pubkey_t** pu
 	 */
 }
 
+/*
+ * sections of DGK key files, the public key and the fixed-base tables are always present, the
+ * others only with a private key
+ */
+enum dgk_keyfile_section : uint32_t {
+	DGK_SECTION_PARAMS = 1, //bits, lbits
+	DGK_SECTION_PUB, //n, u, g, h
+	DGK_SECTION_PRV, //p, q, vp, vq, pinv, qinv
+	DGK_SECTION_BITWISE, //gvpvqp
+	DGK_SECTION_DECRYPT_PARAMS, //window
+	DGK_SECTION_DIGITS, //limbs of the table digits, in the order of the digits
+	DGK_SECTION_INVERSE, //inverse of the decryption tables
+	DGK_SECTION_FB_G, //and DGK_SECTION_FB_G + 1
+	DGK_SECTION_FB_H = DGK_SECTION_FB_G + 2 //and DGK_SECTION_FB_H + 1
+};
+
+bool dgk_write_keyfile(const char* path, dgk_pubkey_t* pub, dgk_prvkey_t* prv) {
+	// the tables of the last key are reused, other keys get their own
+	return dgk_store_keyfile(path, pub, prv, prv && decrypt_tables.match(pub, prv) ? &decrypt_tables : nullptr, nullptr, nullptr);
+}
+
+//dgk_write_keyfile with the given tables, missing ones are built
+static bool dgk_store_keyfile(const char* path, dgk_pubkey_t* pub, dgk_prvkey_t* prv, const dgk_decrypt_tables* t,
+		const FixedBasePowmod* fb_g, const FixedBasePowmod* fb_h) {
+	keyfile_writer file(KEYFILE_DGK);
+	file.add(DGK_SECTION_PARAMS, std::vector<uint64_t> { pub->bits, pub->lbits });
+	file.add(DGK_SECTION_PUB, { pub->n, pub->u, pub->g, pub->h });
+
+	if (prv) {
+		file.add(DGK_SECTION_PRV, { prv->p, prv->q, prv->vp, prv->vq, prv->pinv, prv->qinv });
+
+		// gvpvqp[i] = (g^vp)^((u-1)*2^i) mod p, as in dgk_keygen
+		mpz_t* bitwise = (mpz_t*) malloc(sizeof(mpz_t) * pub->lbits);
+		mpz_t tmp;
+		mpz_init(tmp);
+		mpz_sub_ui(tmp, pub->u, 1);
+		mpz_init(bitwise[0]);
+		mpz_powm(bitwise[0], pub->g, prv->vp, prv->p);
+		mpz_powm(bitwise[0], bitwise[0], tmp, prv->p);
+		for (unsigned int i = 1; i < pub->lbits; i++) {
+			mpz_init(bitwise[i]);
+			mpz_mul(bitwise[i], bitwise[i - 1], bitwise[i - 1]);
+			mpz_mod(bitwise[i], bitwise[i], prv->p);
+		}
+		file.add(DGK_SECTION_BITWISE, bitwise, pub->lbits);
+		for (unsigned int i = 0; i < pub->lbits; i++) {
+			mpz_clear(bitwise[i]);
+		}
+		free(bitwise);
+		mpz_clear(tmp);
+
+		dgk_decrypt_tables own;
+		if (!t) {
+			dgk_build_decrypt_tables(own, pub, prv);
+			t = &own;
+		}
+		file.add(DGK_SECTION_DECRYPT_PARAMS, std::vector<uint64_t> { t->window });
+		std::vector<mp_limb_t> digits(t->digits.size());
+		for (auto& it : t->digits) {
+			digits[it.second] = it.first;
+		}
+		file.add(DGK_SECTION_DIGITS, digits.data(), digits.size());
+		file.add(DGK_SECTION_INVERSE, t->inverse, t->ninverse);
+	}
+
+	std::unique_ptr<FixedBasePowmod> own_g, own_h;
+	if (!fb_g) {
+		own_g = std::make_unique<FixedBasePowmod>(pub->g, pub->n, pub->lbits);
+		fb_g = own_g.get();
+	}
+	if (!fb_h) {
+		own_h = std::make_unique<FixedBasePowmod>(pub->h, pub->n, DGK_RANDOM_BITS);
+		fb_h = own_h.get();
+	}
+	file.add(DGK_SECTION_FB_G, *fb_g);
+	file.add(DGK_SECTION_FB_H, *fb_h);
+	return file.write(path);
+}
+
+bool dgk_read_keyfile(const char* path, dgk_pubkey_t** pub, dgk_prvkey_t** prv, std::unique_ptr<FixedBasePowmod>* fb_g,
+		std::unique_ptr<FixedBasePowmod>* fb_h) {
+	return dgk_load_keyfile(path, pub, prv, &decrypt_tables, true, fb_g, fb_h);
+}
+
+//dgk_read_keyfile into the decryption tables t, which also installs powtwo and gvpvqp if bitwise is set
+static bool dgk_load_keyfile(const char* path, dgk_pubkey_t** pub, dgk_prvkey_t** prv, dgk_decrypt_tables* t,
+		bool bitwise, std::unique_ptr<FixedBasePowmod>* fb_g, std::unique_ptr<FixedBasePowmod>* fb_h) {
+	keyfile_reader file;
+	if (!file.open(path, KEYFILE_DGK)) {
+		return false;
+	}
+	unsigned int lbits = file.get_ui(DGK_SECTION_PARAMS, 1);
+	bool has_prv = file.count(DGK_SECTION_PRV) == 6;
+	uint64_t window = file.get_ui(DGK_SECTION_DECRYPT_PARAMS, 0);
+	if (file.count(DGK_SECTION_PARAMS) != 2 || file.count(DGK_SECTION_PUB) != 4 || lbits == 0
+			|| (has_prv && (file.count(DGK_SECTION_BITWISE) != lbits || window == 0 || window > DGK_DECRYPT_TABLE_BITS))) {
+		std::cerr << "Key file " << path << " holds no valid DGK key" << std::endl;
+		return false;
+	}
+	// the sizes of the decryption tables follow from the window, which is in range now
+	size_t entries = has_prv ? size_t(1) << window : 0;
+	size_t windows = has_prv ? (lbits + window - 1) / window : 0;
+	size_t ndigits = 0;
+	const mp_limb_t* digits = file.limbs(DGK_SECTION_DIGITS, &ndigits);
+	if (has_prv && (file.count(DGK_SECTION_DIGITS) != 1 || ndigits != entries
+			|| file.count(DGK_SECTION_INVERSE) != (windows - 1) * entries)) {
+		std::cerr << "Key file " << path << " holds no valid DGK key" << std::endl;
+		return false;
+	}
+
+	*pub = (dgk_pubkey_t*) malloc(sizeof(dgk_pubkey_t));
+	mpz_inits((*pub)->n, (*pub)->u, (*pub)->g, (*pub)->h, NULL);
+	file.get(DGK_SECTION_PUB, 0, (*pub)->n);
+	file.get(DGK_SECTION_PUB, 1, (*pub)->u);
+	file.get(DGK_SECTION_PUB, 2, (*pub)->g);
+	file.get(DGK_SECTION_PUB, 3, (*pub)->h);
+	(*pub)->bits = file.get_ui(DGK_SECTION_PARAMS, 0);
+	(*pub)->lbits = lbits;
+
+	*prv = nullptr;
+	if (has_prv) {
+		*prv = (dgk_prvkey_t*) malloc(sizeof(dgk_prvkey_t));
+		mpz_inits((*prv)->p, (*prv)->q, (*prv)->vp, (*prv)->vq, (*prv)->pinv, (*prv)->qinv, (*prv)->p_minusone,
+				(*prv)->q_minusone, NULL);
+		file.get(DGK_SECTION_PRV, 0, (*prv)->p);
+		file.get(DGK_SECTION_PRV, 1, (*prv)->q);
+		file.get(DGK_SECTION_PRV, 2, (*prv)->vp);
+		file.get(DGK_SECTION_PRV, 3, (*prv)->vq);
+		file.get(DGK_SECTION_PRV, 4, (*prv)->pinv);
+		file.get(DGK_SECTION_PRV, 5, (*prv)->qinv);
+		mpz_sub_ui((*prv)->p_minusone, (*prv)->p, 1);
+		mpz_sub_ui((*prv)->q_minusone, (*prv)->q, 1);
+
+		if (bitwise) {
+			powtwo = (mpz_t*) malloc(sizeof(mpz_t) * lbits);
+			gvpvqp = (mpz_t*) malloc(sizeof(mpz_t) * lbits);
+			for (unsigned int i = 0; i < lbits; i++) {
+				mpz_init(powtwo[i]);
+				mpz_setbit(powtwo[i], i);
+				mpz_init(gvpvqp[i]);
+				file.get(DGK_SECTION_BITWISE, i, gvpvqp[i]);
+			}
+		}
+
+		t->clear();
+		mpz_set(t->p, (*prv)->p);
+		t->lbits = lbits;
+		t->window = window;
+		t->digits.reserve(entries);
+		for (size_t j = 0; j < entries; j++) {
+			t->digits.emplace(digits[j], j);
+		}
+		t->ninverse = file.count(DGK_SECTION_INVERSE);
+		t->inverse = (mpz_t*) malloc(sizeof(mpz_t) * std::max<size_t>(t->ninverse, 1));
+		for (size_t i = 0; i < t->ninverse; i++) {
+			mpz_init(t->inverse[i]);
+			file.get(DGK_SECTION_INVERSE, i, t->inverse[i]);
+		}
+	}
+
+	// files of other writers may lack the tables, then they are computed
+	if (fb_g) {
+		*fb_g = file.get_fixed_base(DGK_SECTION_FB_G, (*pub)->g, (*pub)->n);
+		if (!*fb_g) {
+			*fb_g = std::make_unique<FixedBasePowmod>((*pub)->g, (*pub)->n, lbits);
+		}
+	}
+	if (fb_h) {
+		*fb_h = file.get_fixed_base(DGK_SECTION_FB_H, (*pub)->h, (*pub)->n);
+		if (!*fb_h) {
+			*fb_h = std::make_unique<FixedBasePowmod>((*pub)->h, (*pub)->n, DGK_RANDOM_BITS);
+		}
+	}
+	return true;
+}
+
+dgk_context::dgk_context(dgk_pubkey_t* pub, dgk_prvkey_t* prv)
+	: dgk_context(pub, prv, std::make_unique<FixedBasePowmod>(pub->g, pub->n, pub->lbits),
+			std::make_unique<FixedBasePowmod>(pub->h, pub->n, DGK_RANDOM_BITS), nullptr) {
+	if (prv) {
+		m_pDecrypt = std::make_unique<dgk_decrypt_tables>();
+		dgk_build_decrypt_tables(*m_pDecrypt, pub, prv);
+	}
+}
+
+dgk_context::dgk_context(dgk_pubkey_t* pub, dgk_prvkey_t* prv, std::unique_ptr<FixedBasePowmod> fb_g,
+		std::unique_ptr<FixedBasePowmod> fb_h, std::unique_ptr<dgk_decrypt_tables> decrypt)
+	: m_pPub(pub), m_pPrv(prv), m_pFbG(std::move(fb_g)), m_pFbH(std::move(fb_h)), m_pDecrypt(std::move(decrypt)) {
+}
+
+dgk_context::~dgk_context() {
+	dgk_freepubkey(m_pPub);
+	if (m_pPrv) {
+		dgk_freeprvkey(m_pPrv);
+	}
+}
+
+std::unique_ptr<dgk_context> dgk_context::keygen(unsigned int modulusbits, unsigned int lbits) {
+	keygen_options options;
+	return keygen(modulusbits, lbits, options);
+}
+
+std::unique_ptr<dgk_context> dgk_context::keygen(unsigned int modulusbits, unsigned int lbits, const keygen_options& options) {
+	dgk_pubkey_t* pub;
+	dgk_prvkey_t* prv;
+	if (!dgk_generate(modulusbits, lbits, &pub, &prv, options)) {
+		return nullptr;
+	}
+	return std::make_unique<dgk_context>(pub, prv);
+}
+
+std::unique_ptr<dgk_context> dgk_context::read_keyfile(const char* path) {
+	dgk_pubkey_t* pub;
+	dgk_prvkey_t* prv;
+	std::unique_ptr<FixedBasePowmod> fb_g, fb_h;
+	auto decrypt = std::make_unique<dgk_decrypt_tables>();
+	if (!dgk_load_keyfile(path, &pub, &prv, decrypt.get(), false, &fb_g, &fb_h)) {
+		return nullptr;
+	}
+	if (!prv) {
+		decrypt.reset();
+	}
+	return std::unique_ptr<dgk_context>(new dgk_context(pub, prv, std::move(fb_g), std::move(fb_h), std::move(decrypt)));
+}
+
+bool dgk_context::write_keyfile(const char* path) const {
+	return dgk_store_keyfile(path, m_pPub, m_pPrv, m_pDecrypt.get(), m_pFbG.get(), m_pFbH.get());
+}
+
+void dgk_context::encrypt(mpz_t res, mpz_t pt) const {
+	dgk_encrypt_fb_table(res, m_pPub, m_pFbG.get(), m_pFbH.get(), pt);
+}
+
+void dgk_context::encrypt_batch(mpz_t* res, mpz_t* pt, size_t n, thread_pool* pool, randomizer_pool* randomizers) const {
+	dgk_encrypt_batch_tables(res, m_pPub, nullptr, pt, n, pool, randomizers, m_pFbG.get(), m_pFbH.get());
+}
+
+void dgk_context::decrypt(mpz_t res, mpz_t ct) const {
+	mpz_t y, z;
+	mpz_inits(y, z, NULL);
+	dgk_decrypt_table(res, *m_pDecrypt, m_pPrv, ct, y, z);
+	mpz_clears(y, z, NULL);
+}
+
+void dgk_context::decrypt_batch(mpz_t* res, mpz_t* ct, size_t n, thread_pool* pool) const {
+	dgk_decrypt_batch_tables(res, m_pPub, m_pPrv, ct, n, pool, m_pDecrypt.get());
+}
+
 void createKeys() {
 	dgk_pubkey_t * pub;
 	dgk_prvkey_t * prv;
@@ -28,6 +28,13 @@
 #ifndef _DGK_H_
 #define _DGK_H_
 #include <gmp.h>
+#include "../powmod.h"
+#include <cstddef>
+#include <memory>
+
+class thread_pool;
+class randomizer_pool;
+struct keygen_options;
 
 /*
  This represents a DGK public key.
@@ -56,6 +63,9 @@ struct dgk_prvkey_t {
 	mpz_t qinv;
 };
 
+// bit length of the random blinding exponent r, 2.5 * t for t = 160
+#define DGK_RANDOM_BITS 400
+
 extern mpz_t* powtwo;
 extern mpz_t* gvpvqp;
 
@@ -71,6 +81,13 @@ extern mpz_t* gvpvqp;
  */
 void dgk_keygen(unsigned int modulusbits, unsigned int lbits, dgk_pubkey_t** pub, dgk_prvkey_t** prv);
 
+/**
+ * same as above, with a sieved prime search on options.threads threads (see prime_search.h)
+ * that reports its progress to options.progress. Returns false and sets *pub and *prv to null
+ * if the key generation was cancelled through options.cancel.
+ */
+bool dgk_keygen(unsigned int modulusbits, unsigned int lbits, dgk_pubkey_t** pub, dgk_prvkey_t** prv, const keygen_options& options);
+
 /**
  * encrypt with public key only and double-base encryption - unfortunately not efficient due to different sized exponents, therefore deactivated
  */
@@ -80,6 +97,12 @@ void dgk_keygen(unsigned int modulusbits, unsigned int lbits, dgk_pubkey_t** pub
  */
 void dgk_encrypt_fb(mpz_t res, dgk_pubkey_t* pub, mpz_t pt);
 
+/**
+ * fixed-base encryption with the given tables, created as FixedBasePowmod(pub->g, pub->n, pub->lbits)
+ * and FixedBasePowmod(pub->h, pub->n, DGK_RANDOM_BITS). Allows to use several keys at once.
+ */
+void dgk_encrypt_fb(mpz_t res, dgk_pubkey_t* pub, const FixedBasePowmod& fb_g, const FixedBasePowmod& fb_h, mpz_t pt);
+
 /**
  * encrypt with public key only, no further optimization (slower than fixed-base encryption)
  */
@@ -90,15 +113,66 @@ void dgk_encrypt_plain(mpz_t res, dgk_pubkey_t* pub, mpz_t pt);
  */
 void dgk_encrypt_crt(mpz_t res, dgk_pubkey_t* pub, dgk_prvkey_t* prv, mpz_t pt);
 
+/**
+ * encryption with a precomputed randomizer h^r from randomizers, created as
+ * randomizer_pool(pub->h, pub->n, DGK_RANDOM_BITS, options). If the pool has a randomizer ready,
+ * only g^pt with the short plaintext as exponent is computed, otherwise h^r is computed with the
+ * table of the pool.
+ */
+void dgk_encrypt_pool(mpz_t res, dgk_pubkey_t* pub, randomizer_pool& randomizers, mpz_t pt);
+
+/**
+ * Encrypts the n plaintexts pt to the n initialized values res in parallel. Uses CRT if prv is given
+ * and fixed-base tables of g and h otherwise. Work is spread across pool, or across one thread per
+ * hardware thread if it is null, and every thread draws its blinding factors from its own PRG.
+ * While randomizers has precomputed values ready, these are used instead of computing h^r,
+ * it has to be created for h modulo n with DGK_RANDOM_BITS bits, e.g. as
+ * randomizer_pipeline(pub->h, pub->n, DGK_RANDOM_BITS, count).
+ */
+void dgk_encrypt_batch(mpz_t* res, dgk_pubkey_t* pub, dgk_prvkey_t* prv, mpz_t* pt, size_t n,
+		thread_pool* pool = nullptr, randomizer_pool* randomizers = nullptr);
+
 /**
  * use CRT and double base combined - unfortunately not efficient due to different sized exponents, therefore deactivated
  */
 // void dgk_encrypt_crt_db(mpz_t res, dgk_pubkey_t* pub, dgk_prvkey_t* prv, mpz_t pt);
 /**
  * DGK decryption
+ * uses the tables of dgk_precompute_decrypt: one lookup for plaintext spaces of up to 18 bits,
+ * otherwise one lookup per 8 bits after successive squarings
  */
 void dgk_decrypt(mpz_t res, dgk_pubkey_t* pub, dgk_prvkey_t* prv, mpz_t ct);
 
+/**
+ * decrypts the n ciphertexts ct to the n initialized values res in parallel on pool, or on one
+ * thread per hardware thread if it is null
+ */
+void dgk_decrypt_batch(mpz_t* res, dgk_pubkey_t* pub, dgk_prvkey_t* prv, mpz_t* ct, size_t n, thread_pool* pool = nullptr);
+
+/**
+ * tests whether ct encrypts zero, which only needs ct^vp mod p == 1 instead of a full decryption
+ */
+bool dgk_is_zero(dgk_pubkey_t* pub, dgk_prvkey_t* prv, mpz_t ct);
+
+/**
+ * zero tests of the n ciphertexts ct to res in parallel on pool, or on one thread per hardware
+ * thread if it is null
+ */
+void dgk_is_zero_batch(bool* res, dgk_pubkey_t* pub, dgk_prvkey_t* prv, mpz_t* ct, size_t n, thread_pool* pool = nullptr);
+
+/**
+ * tests whether any of the n ciphertexts ct encrypts zero and stops at the first one found.
+ * If index is given, it is set to the position of that ciphertext. With several threads this is
+ * not necessarily the first zero in ct.
+ */
+bool dgk_any_zero(dgk_pubkey_t* pub, dgk_prvkey_t* prv, mpz_t* ct, size_t n, thread_pool* pool = nullptr, size_t* index = nullptr);
+
+/**
+ * builds the decryption tables for the given key, called by dgk_keygen and dgk_readkey.
+ * Like powtwo and gvpvqp, only the tables of the last key are kept.
+ */
+void dgk_precompute_decrypt(dgk_pubkey_t* pub, dgk_prvkey_t* prv);
+
 /**
  * stores a generated key pair to disc
  */
@@ -109,6 +183,23 @@ void dgk_storekey(unsigned int modulusbits, unsigned int lbits, dgk_pubkey_t* pu
  */
 void dgk_readkey(unsigned int modulusbits, unsigned int lbits, dgk_pubkey_t** pub, dgk_prvkey_t** prv);
 
+/**
+ * writes a key file (see keyfile.h) with pub, prv and all tables that would otherwise be computed
+ * when the key is loaded: the decryption tables and, as fb_g and fb_h of dgk_encrypt_fb, the
+ * fixed-base tables of g and h. prv may be null to write a file with the public key only.
+ * Returns false on errors.
+ */
+bool dgk_write_keyfile(const char* path, dgk_pubkey_t* pub, dgk_prvkey_t* prv);
+
+/**
+ * reads a file of dgk_write_keyfile and installs its decryption tables like dgk_readkey, without
+ * any exponentiation. *prv is set to null if the file holds no private key. If fb_g and fb_h are
+ * given, they are set to the fixed-base tables for dgk_encrypt_fb. Returns false and leaves no
+ * keys allocated if the file is missing, of another version, or corrupted.
+ */
+bool dgk_read_keyfile(const char* path, dgk_pubkey_t** pub, dgk_prvkey_t** prv,
+		std::unique_ptr<FixedBasePowmod>* fb_g = nullptr, std::unique_ptr<FixedBasePowmod>* fb_h = nullptr);
+
 /*
  These free the structures allocated and returned by various
  functions within library and should be used when the structures are
@@ -122,6 +213,62 @@ void dgk_freeprvkey(dgk_prvkey_t* prv);
  */
 void dgk_complete_pubkey(unsigned int modulusbits, unsigned int lbits, dgk_pubkey_t** pub, mpz_t n, mpz_t g, mpz_t h);
 
+struct dgk_decrypt_tables;
+
+/**
+ * A DGK key that owns all of its precomputed tables: the fixed-base tables of g and h and, with a
+ * private key, the decryption tables. The functions above keep the decryption tables of the last
+ * key that was generated or read in process-wide state, contexts are independent of each other
+ * and of that state, so a process can serve several keys at once. A context is not modified after
+ * its construction, thus it can be shared by any number of threads.
+ * Functions that need no tables, e.g. dgk_is_zero or dgk_any_zero, are called with pub() and prv().
+ */
+class dgk_context {
+public:
+	//takes ownership of pub and prv, prv may be null for a context that only encrypts
+	dgk_context(dgk_pubkey_t* pub, dgk_prvkey_t* prv);
+	~dgk_context();
+
+	dgk_context(const dgk_context&) = delete;
+	dgk_context& operator=(const dgk_context&) = delete;
+
+	/**
+	 * a new key pair as of dgk_keygen, which is not installed in the process-wide state.
+	 * Returns nullptr if the key generation was cancelled.
+	 */
+	static std::unique_ptr<dgk_context> keygen(unsigned int modulusbits, unsigned int lbits);
+	static std::unique_ptr<dgk_context> keygen(unsigned int modulusbits, unsigned int lbits, const keygen_options& options);
+
+	//loads a file of dgk_write_keyfile, nullptr on errors
+	static std::unique_ptr<dgk_context> read_keyfile(const char* path);
+	bool write_keyfile(const char* path) const;
+
+	dgk_pubkey_t* pub() const {
+		return m_pPub;
+	}
+	//nullptr for a public key
+	dgk_prvkey_t* prv() const {
+		return m_pPrv;
+	}
+
+	void encrypt(mpz_t res, mpz_t pt) const;
+	void encrypt_batch(mpz_t* res, mpz_t* pt, size_t n, thread_pool* pool = nullptr, randomizer_pool* randomizers = nullptr) const;
+
+	//decryption requires a private key
+	void decrypt(mpz_t res, mpz_t ct) const;
+	void decrypt_batch(mpz_t* res, mpz_t* ct, size_t n, thread_pool* pool = nullptr) const;
+
+private:
+	dgk_context(dgk_pubkey_t* pub, dgk_prvkey_t* prv, std::unique_ptr<FixedBasePowmod> fb_g,
+			std::unique_ptr<FixedBasePowmod> fb_h, std::unique_ptr<dgk_decrypt_tables> decrypt);
+
+	dgk_pubkey_t* m_pPub;
+	dgk_prvkey_t* m_pPrv;
+	std::unique_ptr<FixedBasePowmod> m_pFbG;
+	std::unique_ptr<FixedBasePowmod> m_pFbH;
+	std::unique_ptr<dgk_decrypt_tables> m_pDecrypt;
+};
+
 /**
  * -------------------------------
  * the following are internal functions, that should not be called from the outside unless you really know what they do, hence commented out
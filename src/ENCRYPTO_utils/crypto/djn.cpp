@@ -22,13 +22,23 @@
  */
 
 #include "djn.h"
+#include "batch.h"
+#include "keyfile.h"
+#include "prime_search.h"
 #include "../powmod.h"
 #include "../utils.h"
 #include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <vector>
 
 #define DJN_DEBUG 0
 #define DJN_CHECKSIZE 0
 
+static void djn_encrypt_batch_table(mpz_t* res, djn_pubkey_t* pub, djn_prvkey_t* prv, mpz_t* pt, size_t n,
+		thread_pool* pool, randomizer_pool* randomizers, const FixedBasePowmod* fb_hs);
+static bool djn_store_keyfile(const char* path, djn_pubkey_t* pub, djn_prvkey_t* prv, const FixedBasePowmod* fb_hs);
+
 void djn_complete_pubkey(unsigned int modulusbits, djn_pubkey_t** pub, mpz_t n, mpz_t h) {
 	*pub = (djn_pubkey_t*) malloc(sizeof(djn_pubkey_t));
 
@@ -48,6 +58,11 @@ void djn_complete_pubkey(unsigned int modulusbits, djn_pubkey_t** pub, mpz_t n,
 }
 
 void djn_keygen(unsigned int modulusbits, djn_pubkey_t** pub, djn_prvkey_t** prv) {
+	keygen_options options;
+	djn_keygen(modulusbits, pub, prv, options);
+}
+
+bool djn_keygen(unsigned int modulusbits, djn_pubkey_t** pub, djn_prvkey_t** prv, const keygen_options& options) {
 	mpz_t test, x;
 
 	/* allocate the new key structures */
@@ -75,23 +90,11 @@ void djn_keygen(unsigned int modulusbits, djn_pubkey_t** pub, djn_prvkey_t** prv
 	mpz_init(test);
 	mpz_init(x);
 
+	// p and q are random primes with p mod 4 = 3 of modulusbits / 2 + 1 bits, with the highest bit set
+	prime_search search(options);
+	bool ok = search.prime_3mod4((*prv)->p, modulusbits / 2, "p");
 	do {
-		// choose bits of p and q randomly
-		aby_prng((*prv)->p, modulusbits / 2);
-		aby_prng((*prv)->q, modulusbits / 2);
-
-		// set highest bit to 1 to ensure high length
-		mpz_setbit((*prv)->p, modulusbits / 2);
-		mpz_setbit((*prv)->q, modulusbits / 2);
-
-		//find next primes
-		do {
-			mpz_nextprime((*prv)->p, (*prv)->p);
-		} while (!mpz_tstbit((*prv)->p, 1)); //make sure p mod 4 = 3
-
-		do {
-			mpz_nextprime((*prv)->q, (*prv)->q);
-		} while (!mpz_cmp((*prv)->p, (*prv)->q) || !mpz_tstbit((*prv)->q, 1)); //make sure p!=q and q mod 4 = 3
+		ok = ok && search.prime_3mod4((*prv)->q, modulusbits / 2, "q");
 
 		/* p-1 and q-1 */
 		mpz_sub_ui((*prv)->p_minusone, (*prv)->p, 1);
@@ -99,7 +102,16 @@ void djn_keygen(unsigned int modulusbits, djn_pubkey_t** pub, djn_prvkey_t** prv
 
 		mpz_gcd(test, (*prv)->p_minusone, (*prv)->q_minusone);
 
-	} while (mpz_cmp_ui(test, 2)); // make sure gcd(p-1,q-1)=2
+	} while (ok && (!mpz_cmp((*prv)->p, (*prv)->q) || mpz_cmp_ui(test, 2))); // make sure p!=q and gcd(p-1,q-1)=2
+
+	if (!ok) {
+		mpz_clears(x, test, NULL);
+		djn_freepubkey(*pub);
+		djn_freeprvkey(*prv);
+		*pub = nullptr;
+		*prv = nullptr;
+		return false;
+	}
 
 	//} while((mpz_cmp_ui(test,2) || !mpz_tstbit((*pub)->n, modulusbits - 1) ); // make sure gcd(p-1,q-1)=2 and first bit of n is set
 
@@ -169,6 +181,7 @@ void djn_keygen(unsigned int modulusbits, djn_pubkey_t** pub, djn_prvkey_t** prv
 
 	/* clear temporary integers */
 	mpz_clears(x, test, NULL);
+	return true;
 }
 
 /**
@@ -236,9 +249,9 @@ void djn_encrypt_crt(mpz_t res, djn_pubkey_t* pub, djn_prvkey_t* prv, mpz_t plai
 }
 
 /**
- * mpz_t version of encrypt_crt
+ * mpz_t version of encrypt_crt, with the table fb_hs or the one of fbpowmod_init_g if it is null
  */
-void djn_encrypt_fb(mpz_t res, djn_pubkey_t* pub, mpz_t plaintext) {
+static void djn_encrypt_fb_table(mpz_t res, djn_pubkey_t* pub, const FixedBasePowmod* fb_hs, mpz_t plaintext) {
 	mpz_t r;
 	mpz_init(r);
 
@@ -260,7 +273,11 @@ void djn_encrypt_fb(mpz_t res, djn_pubkey_t* pub, mpz_t plaintext) {
 	mpz_mod(res, res, pub->n_squared);
 
 	// r = h_s ^ r
-	fbpowmod_g(r, r);
+	if (fb_hs) {
+		fb_hs->pow(r, r);
+	} else {
+		fbpowmod_g(r, r);
+	}
 
 	mpz_mul(res, res, r);
 	mpz_mod(res, res, pub->n_squared);
@@ -268,6 +285,92 @@ void djn_encrypt_fb(mpz_t res, djn_pubkey_t* pub, mpz_t plaintext) {
 	mpz_clear(r);
 }
 
+void djn_encrypt_fb(mpz_t res, djn_pubkey_t* pub, mpz_t plaintext) {
+	djn_encrypt_fb_table(res, pub, nullptr, plaintext);
+}
+
+void djn_encrypt_fb(mpz_t res, djn_pubkey_t* pub, const FixedBasePowmod& fb_hs, mpz_t plaintext) {
+	djn_encrypt_fb_table(res, pub, &fb_hs, plaintext);
+}
+
+void djn_encrypt_pool(mpz_t res, djn_pubkey_t* pub, randomizer_pool& randomizers, mpz_t plaintext) {
+	mpz_t r;
+	mpz_init(r);
+
+#if DJN_CHECKSIZE
+	if (mpz_cmp(plaintext, pub->n) >= 0) {
+		printf("WARNING: m>=N!\n");
+	}
+#endif
+
+	randomizers.get(r);
+
+	mpz_mul(res, plaintext, pub->n);
+	mpz_add_ui(res, res, 1);
+	mpz_mod(res, res, pub->n_squared);
+
+	mpz_mul(res, res, r);
+	mpz_mod(res, res, pub->n_squared);
+
+	mpz_clear(r);
+}
+
+void djn_encrypt_batch(mpz_t* res, djn_pubkey_t* pub, djn_prvkey_t* prv, mpz_t* pt, size_t n, thread_pool* pool,
+		randomizer_pool* randomizers) {
+	djn_encrypt_batch_table(res, pub, prv, pt, n, pool, randomizers, nullptr);
+}
+
+/**
+ * djn_encrypt_batch with the table fb_hs, which is used instead of CRT if it is given
+ */
+static void djn_encrypt_batch_table(mpz_t* res, djn_pubkey_t* pub, djn_prvkey_t* prv, mpz_t* pt, size_t n,
+		thread_pool* pool, randomizer_pool* randomizers, const FixedBasePowmod* fb_hs) {
+	std::unique_ptr<thread_pool> own_pool;
+	pool = &pool_or_default(pool, own_pool);
+	std::unique_ptr<FixedBasePowmod> own_hs;
+	if (fb_hs) {
+		prv = nullptr;
+	} else if (!prv) {
+		own_hs = std::make_unique<FixedBasePowmod>(pub->h_s, pub->n_squared, pub->rbits);
+		fb_hs = own_hs.get();
+	}
+
+	// per-thread PRG and blinding factor
+	std::vector<std::unique_ptr<batch_prg>> prgs(pool->size());
+	mpz_t* r = (mpz_t*) malloc(sizeof(mpz_t) * pool->size());
+	for (unsigned i = 0; i < pool->size(); i++) {
+		mpz_init(r[i]);
+	}
+
+	pool->parallel_for(n, [&](unsigned worker, size_t begin, size_t end) {
+		if (!prgs[worker]) {
+			prgs[worker] = std::make_unique<batch_prg>();
+		}
+		for (size_t i = begin; i < end; i++) {
+			if (!randomizers || !randomizers->take(r[worker])) {
+				prgs[worker]->gen_mpz(r[worker], pub->rbits);
+				if (prv) {
+					djn_pow_mod_n_squared_crt(r[worker], pub->h_s, r[worker], pub, prv);
+				} else {
+					fb_hs->pow(r[worker], r[worker]);
+				}
+			}
+
+			mpz_mul(res[i], pt[i], pub->n);
+			mpz_add_ui(res[i], res[i], 1);
+			mpz_mod(res[i], res[i], pub->n_squared);
+
+			mpz_mul(res[i], res[i], r[worker]);
+			mpz_mod(res[i], res[i], pub->n_squared);
+		}
+	});
+
+	for (unsigned i = 0; i < pool->size(); i++) {
+		mpz_clear(r[i]);
+	}
+	free(r);
+}
+
 /**
  * decrypt, using CRT, assumes res to be initialized
  */
@@ -293,6 +396,80 @@ void djn_decrypt_plain(mpz_t res, djn_pubkey_t* pub, djn_prvkey_t* prv, mpz_t ci
 	mpz_mod(res, res, pub->n);
 }
 
+// sections of DJN key files
+enum djn_keyfile_section : uint32_t {
+	DJN_SECTION_PARAMS = 1, //bits, rbits
+	DJN_SECTION_PUB, //n, n_squared, h, h_s
+	DJN_SECTION_PRV, //lambda, lambda_inverse, p, q, p_squared, q_squared, q_inverse, q_squared_inverse,
+	                 //p_minusone, q_minusone, ordpsq, ordqsq
+	DJN_SECTION_FB_HS //and DJN_SECTION_FB_HS + 1
+};
+
+bool djn_write_keyfile(const char* path, djn_pubkey_t* pub, djn_prvkey_t* prv) {
+	return djn_store_keyfile(path, pub, prv, nullptr);
+}
+
+/**
+ * djn_write_keyfile with the table fb_hs, which is computed if it is null
+ */
+static bool djn_store_keyfile(const char* path, djn_pubkey_t* pub, djn_prvkey_t* prv, const FixedBasePowmod* fb_hs) {
+	keyfile_writer file(KEYFILE_DJN);
+	file.add(DJN_SECTION_PARAMS, std::vector<uint64_t> { uint64_t(pub->bits), uint64_t(pub->rbits) });
+	file.add(DJN_SECTION_PUB, { pub->n, pub->n_squared, pub->h, pub->h_s });
+	if (prv) {
+		file.add(DJN_SECTION_PRV, { prv->lambda, prv->lambda_inverse, prv->p, prv->q, prv->p_squared, prv->q_squared,
+				prv->q_inverse, prv->q_squared_inverse, prv->p_minusone, prv->q_minusone, prv->ordpsq, prv->ordqsq });
+	}
+	std::unique_ptr<FixedBasePowmod> own_hs;
+	if (!fb_hs) {
+		own_hs = std::make_unique<FixedBasePowmod>(pub->h_s, pub->n_squared, pub->rbits);
+		fb_hs = own_hs.get();
+	}
+	file.add(DJN_SECTION_FB_HS, *fb_hs);
+	return file.write(path);
+}
+
+bool djn_read_keyfile(const char* path, djn_pubkey_t** pub, djn_prvkey_t** prv, std::unique_ptr<FixedBasePowmod>* fb_hs) {
+	keyfile_reader file;
+	if (!file.open(path, KEYFILE_DJN)) {
+		return false;
+	}
+	if (file.count(DJN_SECTION_PARAMS) != 2 || file.count(DJN_SECTION_PUB) != 4
+			|| (file.has(DJN_SECTION_PRV) && file.count(DJN_SECTION_PRV) != 12)) {
+		std::cerr << "Key file " << path << " holds no valid DJN key" << std::endl;
+		return false;
+	}
+
+	*pub = (djn_pubkey_t*) malloc(sizeof(djn_pubkey_t));
+	mpz_ptr pubvals[] = { (*pub)->n, (*pub)->n_squared, (*pub)->h, (*pub)->h_s };
+	for (size_t i = 0; i < 4; i++) {
+		mpz_init(pubvals[i]);
+		file.get(DJN_SECTION_PUB, i, pubvals[i]);
+	}
+	(*pub)->bits = file.get_ui(DJN_SECTION_PARAMS, 0);
+	(*pub)->rbits = file.get_ui(DJN_SECTION_PARAMS, 1);
+
+	*prv = nullptr;
+	if (file.has(DJN_SECTION_PRV)) {
+		*prv = (djn_prvkey_t*) malloc(sizeof(djn_prvkey_t));
+		mpz_ptr prvvals[] = { (*prv)->lambda, (*prv)->lambda_inverse, (*prv)->p, (*prv)->q, (*prv)->p_squared,
+				(*prv)->q_squared, (*prv)->q_inverse, (*prv)->q_squared_inverse, (*prv)->p_minusone, (*prv)->q_minusone,
+				(*prv)->ordpsq, (*prv)->ordqsq };
+		for (size_t i = 0; i < 12; i++) {
+			mpz_init(prvvals[i]);
+			file.get(DJN_SECTION_PRV, i, prvvals[i]);
+		}
+	}
+
+	if (fb_hs) {
+		*fb_hs = file.get_fixed_base(DJN_SECTION_FB_HS, (*pub)->h_s, (*pub)->n_squared);
+		if (!*fb_hs) {
+			*fb_hs = std::make_unique<FixedBasePowmod>((*pub)->h_s, (*pub)->n_squared, (*pub)->rbits);
+		}
+	}
+	return true;
+}
+
 void djn_freepubkey(djn_pubkey_t* pub) {
 	mpz_clear(pub->n);
 	mpz_clear(pub->h);
@@ -355,4 +532,157 @@ void djn_pow_mod_n_squared_crt(mpz_t res, const mpz_t base, const mpz_t exp, con
 	mpz_mod(res, cq, pub->n_squared);
 
 	mpz_clears(cp, cq, temp, NULL);
-}
\ No newline at end of file
+}
+
+djn_context::djn_context(djn_pubkey_t* pub, djn_prvkey_t* prv)
+	: djn_context(pub, prv, std::make_unique<FixedBasePowmod>(pub->h_s, pub->n_squared, pub->rbits)) {
+}
+
+djn_context::djn_context(djn_pubkey_t* pub, djn_prvkey_t* prv, std::unique_ptr<FixedBasePowmod> fb_hs)
+	: m_pPub(pub), m_pPrv(prv), m_pFbHs(std::move(fb_hs)) {
+}
+
+djn_context::~djn_context() {
+	djn_freepubkey(m_pPub);
+	if (m_pPrv) {
+		djn_freeprvkey(m_pPrv);
+	}
+}
+
+std::unique_ptr<djn_context> djn_context::keygen(unsigned int modulusbits) {
+	keygen_options options;
+	return keygen(modulusbits, options);
+}
+
+std::unique_ptr<djn_context> djn_context::keygen(unsigned int modulusbits, const keygen_options& options) {
+	djn_pubkey_t* pub;
+	djn_prvkey_t* prv;
+	if (!djn_keygen(modulusbits, &pub, &prv, options)) {
+		return nullptr;
+	}
+	return std::make_unique<djn_context>(pub, prv);
+}
+
+std::unique_ptr<djn_context> djn_context::read_keyfile(const char* path) {
+	djn_pubkey_t* pub;
+	djn_prvkey_t* prv;
+	std::unique_ptr<FixedBasePowmod> fb_hs;
+	if (!djn_read_keyfile(path, &pub, &prv, &fb_hs)) {
+		return nullptr;
+	}
+	return std::unique_ptr<djn_context>(new djn_context(pub, prv, std::move(fb_hs)));
+}
+
+bool djn_context::write_keyfile(const char* path) const {
+	return djn_store_keyfile(path, m_pPub, m_pPrv, m_pFbHs.get());
+}
+
+void djn_context::encrypt(mpz_t res, mpz_t pt) const {
+	djn_encrypt_fb(res, m_pPub, *m_pFbHs, pt);
+}
+
+void djn_context::encrypt_batch(mpz_t* res, mpz_t* pt, size_t n, thread_pool* pool, randomizer_pool* randomizers) const {
+	djn_encrypt_batch_table(res, m_pPub, nullptr, pt, n, pool, randomizers, m_pFbHs.get());
+}
+
+void djn_context::decrypt(mpz_t res, mpz_t ct) const {
+	djn_decrypt(res, m_pPub, m_pPrv, ct);
+}
+
+djn_evaluator::djn_evaluator(djn_pubkey_t* pub, const FixedBasePowmod* fb_hs)
+	: m_pPub(pub), m_cMod(pub->n_squared), m_pFbHs(fb_hs) {
+	if (!m_pFbHs) {
+		m_pOwnHs = std::make_unique<FixedBasePowmod>(pub->h_s, pub->n_squared, pub->rbits);
+		m_pFbHs = m_pOwnHs.get();
+	}
+}
+
+djn_evaluator::djn_evaluator(const djn_context& ctx)
+	: djn_evaluator(ctx.pub(), &ctx.get_fb_hs()) {
+}
+
+void djn_evaluator::import_ct(mp_limb_t* r, const mpz_t ct) const {
+	m_cMod.import(r, ct);
+}
+
+void djn_evaluator::import_ct(mp_limb_t* r, const mpz_t* ct, size_t n) const {
+	for (size_t i = 0; i < n; i++) {
+		m_cMod.import(r + i * limbs(), ct[i]);
+	}
+}
+
+void djn_evaluator::export_ct(mpz_t ct, const mp_limb_t* a) const {
+	m_cMod.to_mpz(ct, a);
+}
+
+void djn_evaluator::export_ct(mpz_t* ct, const mp_limb_t* a, size_t n) const {
+	for (size_t i = 0; i < n; i++) {
+		m_cMod.to_mpz(ct[i], a + i * limbs());
+	}
+}
+
+void djn_evaluator::add(mp_limb_t* r, const mp_limb_t* a, const mp_limb_t* b) const {
+	std::vector<mp_limb_t> tmp(m_cMod.tmp_limbs());
+	m_cMod.mul(r, a, b, tmp.data());
+}
+
+void djn_evaluator::sub(mp_limb_t* r, const mp_limb_t* a, const mp_limb_t* b) const {
+	mpz_t inv;
+	mpz_init(inv);
+	m_cMod.to_mpz(inv, b);
+	mpz_invert(inv, inv, m_pPub->n_squared);
+	std::vector<mp_limb_t> binv(limbs()), tmp(m_cMod.tmp_limbs());
+	m_cMod.import(binv.data(), inv);
+	m_cMod.mul(r, a, binv.data(), tmp.data());
+	mpz_clear(inv);
+}
+
+void djn_evaluator::add_plain(mp_limb_t* r, const mp_limb_t* a, const mpz_t m) const {
+	// (1 + n)^m = 1 + m*n mod n^2
+	mpz_t g;
+	mpz_init(g);
+	mpz_mod(g, m, m_pPub->n);
+	mpz_mul(g, g, m_pPub->n);
+	mpz_add_ui(g, g, 1);
+	std::vector<mp_limb_t> gm(limbs()), tmp(m_cMod.tmp_limbs());
+	m_cMod.import(gm.data(), g);
+	m_cMod.mul(r, a, gm.data(), tmp.data());
+	mpz_clear(g);
+}
+
+void djn_evaluator::scalar_mul(mp_limb_t* r, const mp_limb_t* a, const mpz_t k) const {
+	// c^(k + j*n) only differs from c^k by an encryption of 0, thus k can be reduced modulo n
+	mpz_t e;
+	mpz_init(e);
+	mpz_mod(e, k, m_pPub->n);
+	m_cMod.pow(r, a, e);
+	mpz_clear(e);
+}
+
+void djn_evaluator::rerandomize(mp_limb_t* r, const mp_limb_t* a, randomizer_pool* randomizers) const {
+	mpz_t s;
+	mpz_init(s);
+	if (randomizers) {
+		randomizers->get(s);
+	} else {
+		aby_prng(s, m_pPub->rbits);
+		m_pFbHs->pow(s, s);
+	}
+	std::vector<mp_limb_t> hs(limbs()), tmp(m_cMod.tmp_limbs());
+	m_cMod.import(hs.data(), s);
+	m_cMod.mul(r, a, hs.data(), tmp.data());
+	mpz_clear(s);
+}
+
+void djn_evaluator::inner_product(mp_limb_t* r, const mp_limb_t* cts, const mpz_t* k, size_t n, thread_pool* pool) const {
+	mpz_t* e = (mpz_t*) malloc(sizeof(mpz_t) * n);
+	for (size_t i = 0; i < n; i++) {
+		mpz_init(e[i]);
+		mpz_mod(e[i], k[i], m_pPub->n);
+	}
+	m_cMod.pow_product(r, cts, e, n, pool);
+	for (size_t i = 0; i < n; i++) {
+		mpz_clear(e[i]);
+	}
+	free(e);
+}
@@ -24,6 +24,14 @@
 #ifndef _DJN_H_
 #define _DJN_H_
 #include <gmp.h>
+#include "../powmod.h"
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+class thread_pool;
+class randomizer_pool;
+struct keygen_options;
 
 /*
  On memory handling:
@@ -99,6 +107,13 @@ typedef void (*djn_get_rand_t)(void* buf, int len);
  */
 void djn_keygen(unsigned int modulusbits, djn_pubkey_t** pub, djn_prvkey_t** prv);
 
+/*
+ Same as above, with a sieved prime search on options.threads threads (see prime_search.h)
+ that reports its progress to options.progress. Returns false and sets *pub and *prv to
+ null if the key generation was cancelled through options.cancel.
+ */
+bool djn_keygen(unsigned int modulusbits, djn_pubkey_t** pub, djn_prvkey_t** prv, const keygen_options& options);
+
 /*
  Encrypt the given plaintext with the given public key using
  randomness from get_rand for blinding. If res is not null, its
@@ -120,6 +135,30 @@ void djn_encrypt_crt(mpz_t res, djn_pubkey_t* pub, djn_prvkey_t* prv, mpz_t pt);
  */
 void djn_encrypt_fb(mpz_t res, djn_pubkey_t* pub, mpz_t plaintext);
 
+/**
+ * fixed base encryption with the given table of h_s, created as
+ * FixedBasePowmod(pub->h_s, pub->n_squared, pub->rbits). Allows to use several keys at once.
+ */
+void djn_encrypt_fb(mpz_t res, djn_pubkey_t* pub, const FixedBasePowmod& fb_hs, mpz_t plaintext);
+
+/**
+ * encryption with a precomputed randomizer h_s^r from randomizers, created as
+ * randomizer_pool(pub->h_s, pub->n_squared, pub->rbits, options). Only needs one multiplication
+ * if the pool has a randomizer ready, otherwise h_s^r is computed with the table of the pool.
+ */
+void djn_encrypt_pool(mpz_t res, djn_pubkey_t* pub, randomizer_pool& randomizers, mpz_t plaintext);
+
+/**
+ * Encrypts the n plaintexts pt to the n initialized values res in parallel. Uses CRT if prv is given
+ * and a fixed-base table of h_s otherwise. Work is spread across pool, or across one thread per
+ * hardware thread if it is null, and every thread draws its blinding factors from its own PRG.
+ * While randomizers has precomputed values ready, these are used instead of computing h_s^r,
+ * it has to be created for h_s modulo n_squared with pub->rbits bits, e.g. as
+ * randomizer_pipeline(pub->h_s, pub->n_squared, pub->rbits, count).
+ */
+void djn_encrypt_batch(mpz_t* res, djn_pubkey_t* pub, djn_prvkey_t* prv, mpz_t* pt, size_t n,
+		thread_pool* pool = nullptr, randomizer_pool* randomizers = nullptr);
+
 /*
  Decrypt the given ciphertext with the given key pair. If res is not
  null, its contents will be overwritten with the result. Otherwise, a
@@ -143,6 +182,123 @@ char* djn_prvkey_to_hex(djn_prvkey_t* prv);
 djn_pubkey_t* djn_pubkey_from_hex(char* str);
 djn_prvkey_t* djn_prvkey_from_hex(char* str, djn_pubkey_t* pub);
 
+/*
+ Write or read a key file (see keyfile.h) with the key and the table
+ of djn_encrypt_fb, such that loading a key needs no exponentiation.
+ prv may be null to write the public key only, reading then sets *prv
+ to null. If fb_hs is given, it is set to the table of h_s. Both return
+ false on errors, reading then leaves no keys allocated.
+ */
+bool djn_write_keyfile(const char* path, djn_pubkey_t* pub, djn_prvkey_t* prv);
+bool djn_read_keyfile(const char* path, djn_pubkey_t** pub, djn_prvkey_t** prv,
+		std::unique_ptr<FixedBasePowmod>* fb_hs = nullptr);
+
+/*
+ A DJN key that owns its table of h_s. Unlike djn_encrypt_fb without a table, which uses the
+ table of the process-wide fbpowmod_init_g, contexts are independent of each other, so a process
+ can serve several keys at once. A context is not modified after its construction and can be
+ shared by any number of threads. Functions that need no table, e.g. djn_encrypt_crt, are called
+ with pub() and prv().
+ */
+class djn_context {
+public:
+	//takes ownership of pub and prv, prv may be null for a context that only encrypts
+	djn_context(djn_pubkey_t* pub, djn_prvkey_t* prv);
+	~djn_context();
+
+	djn_context(const djn_context&) = delete;
+	djn_context& operator=(const djn_context&) = delete;
+
+	//a new key pair as of djn_keygen, nullptr if the key generation was cancelled
+	static std::unique_ptr<djn_context> keygen(unsigned int modulusbits);
+	static std::unique_ptr<djn_context> keygen(unsigned int modulusbits, const keygen_options& options);
+
+	//loads a file of djn_write_keyfile, nullptr on errors
+	static std::unique_ptr<djn_context> read_keyfile(const char* path);
+	bool write_keyfile(const char* path) const;
+
+	djn_pubkey_t* pub() const {
+		return m_pPub;
+	}
+	//nullptr for a public key
+	djn_prvkey_t* prv() const {
+		return m_pPrv;
+	}
+
+	void encrypt(mpz_t res, mpz_t pt) const;
+	void encrypt_batch(mpz_t* res, mpz_t* pt, size_t n, thread_pool* pool = nullptr, randomizer_pool* randomizers = nullptr) const;
+
+	//requires a private key
+	void decrypt(mpz_t res, mpz_t ct) const;
+
+	//the table of h_s, e.g. for djn_evaluator
+	const FixedBasePowmod& get_fb_hs() const {
+		return *m_pFbHs;
+	}
+
+private:
+	djn_context(djn_pubkey_t* pub, djn_prvkey_t* prv, std::unique_ptr<FixedBasePowmod> fb_hs);
+
+	djn_pubkey_t* m_pPub;
+	djn_prvkey_t* m_pPrv;
+	std::unique_ptr<FixedBasePowmod> m_pFbHs;
+};
+
+/*
+ Homomorphic operations on DJN ciphertexts modulo n^2. Ciphertexts are arrays of limbs() limbs in
+ Montgomery form (see MontgomeryContext), which are created by import_ct and turned back into
+ ciphertexts by export_ct. All operations in between work on this form with mpn_ functions and
+ need no division. Arrays of n ciphertexts are stored one after another, e.g. in alloc(n).
+ Operations are const and may be used from several threads at once. Result arrays may alias
+ the arguments.
+ */
+class djn_evaluator {
+public:
+	//fb_hs is the table of h_s for rerandomize, as in djn_encrypt_fb. It is created if null.
+	explicit djn_evaluator(djn_pubkey_t* pub, const FixedBasePowmod* fb_hs = nullptr);
+	explicit djn_evaluator(const djn_context& ctx);
+
+	djn_evaluator(const djn_evaluator&) = delete;
+	djn_evaluator& operator=(const djn_evaluator&) = delete;
+
+	size_t limbs() const {
+		return m_cMod.limbs();
+	}
+	//space for n ciphertexts
+	std::vector<mp_limb_t> alloc(size_t n) const {
+		return std::vector<mp_limb_t>(n * limbs());
+	}
+
+	void import_ct(mp_limb_t* r, const mpz_t ct) const;
+	void import_ct(mp_limb_t* r, const mpz_t* ct, size_t n) const;
+	void export_ct(mpz_t ct, const mp_limb_t* a) const;
+	void export_ct(mpz_t* ct, const mp_limb_t* a, size_t n) const;
+
+	//r = Enc(m_a + m_b)
+	void add(mp_limb_t* r, const mp_limb_t* a, const mp_limb_t* b) const;
+	//r = Enc(m_a - m_b mod n), needs an inversion modulo n^2
+	void sub(mp_limb_t* r, const mp_limb_t* a, const mp_limb_t* b) const;
+	//r = Enc(m_a + m) without fresh randomness
+	void add_plain(mp_limb_t* r, const mp_limb_t* a, const mpz_t m) const;
+	//r = Enc(k * m_a), k is taken modulo n
+	void scalar_mul(mp_limb_t* r, const mp_limb_t* a, const mpz_t k) const;
+	//r = a * h_s^s for a random s, taken from randomizers if it is given
+	void rerandomize(mp_limb_t* r, const mp_limb_t* a, randomizer_pool* randomizers = nullptr) const;
+
+	/**
+	 * r = Enc(sum k[i] * m_i) for the n ciphertexts at cts, computed as one multi-exponentiation
+	 * that shares the squarings of all n exponentiations (see MontgomeryContext::pow_product), on
+	 * the threads of pool if it is given. The k[i] are taken modulo n.
+	 */
+	void inner_product(mp_limb_t* r, const mp_limb_t* cts, const mpz_t* k, size_t n, thread_pool* pool = nullptr) const;
+
+private:
+	djn_pubkey_t* m_pPub;
+	MontgomeryContext m_cMod;
+	std::unique_ptr<FixedBasePowmod> m_pOwnHs;
+	const FixedBasePowmod* m_pFbHs;
+};
+
 /********
  CLEANUP
  ********/
@@ -260,41 +260,16 @@ prime_field::~prime_field() {
 }
 
 gmp_brickexp::~gmp_brickexp() {
-	for (uint32_t i = 0; i < m_numberOfElements; i++)
-		mpz_clear(m_table[i]);
-	free(m_table);
 }
 ;
 
 void gmp_brickexp::init(fe* g, prime_field* pfield) {
 	field = pfield;
-
-	m_numberOfElements = field->get_field_size();
-
-	m_table = (mpz_t*) malloc(sizeof(mpz_t) * m_numberOfElements);
-	for (uint32_t i = 0; i < m_numberOfElements; i++) {
-		mpz_init(m_table[i]);
-	}
-
-	mpz_set(m_table[0], *((gmp_fe*) g)->get_val());
-	for (unsigned u = 1; u < m_numberOfElements; ++u) {
-		mpz_mul(m_table[u], m_table[u - 1], m_table[u - 1]);
-		mpz_mod(m_table[u], m_table[u], *field->get_p());
-	}
+	m_table = std::make_unique<FixedBasePowmod>(*((gmp_fe*) g)->get_val(), *field->get_p(), field->get_field_size());
 }
 
 void gmp_brickexp::pow(fe* result, num* e) {
-	mpz_t* res = ((gmp_fe*) result)->get_val();
-	mpz_t* exp = ((gmp_num*) e)->get_val();
-	uint32_t u;
-
-	mpz_set_ui(*res, 1);
-	for (u = 0; u < m_numberOfElements; u++) {
-		if (mpz_tstbit(*exp, u)) {
-			mpz_mul(*res, *res, m_table[u]);
-			mpz_mod(*res, *res, *field->get_p());
-		}
-	}
+	m_table->pow(*((gmp_fe*) result)->get_val(), *((gmp_num*) e)->get_val());
 }
 
 // mpz_export does not fill leading zeros, thus a prepending of leading 0s is required
@@ -21,8 +21,10 @@
 #define GMP_PK_CRYPTO_H_
 
 #include "pk-crypto.h"
+#include "../powmod.h"
 #include "../utils.h"
 #include <gmp.h>
+#include <memory>
 
 class prime_field;
 class gmp_fe;
@@ -129,12 +131,15 @@ public:
 	;
 	~gmp_brickexp();
 
+	gmp_brickexp(const gmp_brickexp&) = delete;
+	gmp_brickexp& operator=(const gmp_brickexp&) = delete;
+
 	void pow(fe* result, num* e);
+	//replaces the table of a previous init
 	void init(fe* g, prime_field* pfield);
 
 private:
-	uint32_t m_numberOfElements;
-	mpz_t* m_table;
+	std::unique_ptr<FixedBasePowmod> m_table;
 	prime_field* field;
 };
 
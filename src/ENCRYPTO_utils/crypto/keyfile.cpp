@@ -0,0 +1,281 @@
+/**
+ \file 		keyfile.cpp
+ \copyright	ABY - A Framework for Efficient Mixed-protocol Secure Two-party Computation
+			Copyright (C) 2019 ENCRYPTO Group, TU Darmstadt
+			This program is free software: you can redistribute it and/or modify
+            it under the terms of the GNU Lesser General Public License as published
+            by the Free Software Foundation, either version 3 of the License, or
+            (at your option) any later version.
+            ABY is distributed in the hope that it will be useful,
+            but WITHOUT ANY WARRANTY; without even the implied warranty of
+            MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+            GNU Lesser General Public License for more details.
+            You should have received a copy of the GNU Lesser General Public License
+            along with this program. If not, see <http://www.gnu.org/licenses/>.
+ \brief		Versioned binary files for keys and their precomputed tables
+ */
+
+#include "keyfile.h"
+#include <openssl/evp.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static const char keyfile_magic[8] = { 'A', 'B', 'Y', 'K', 'E', 'Y', 0, 0 };
+
+static size_t keyfile_align(size_t offset) {
+	return (offset + KEYFILE_ALIGNMENT - 1) / KEYFILE_ALIGNMENT * KEYFILE_ALIGNMENT;
+}
+
+static void keyfile_checksum(uint8_t* out, const uint8_t* data, size_t len) {
+	unsigned int outl = 0;
+	EVP_Digest(data, len, out, &outl, EVP_sha256(), nullptr);
+}
+
+void keyfile_writer::add(uint32_t id, const mpz_t* values, size_t n) {
+	std::vector<mpz_srcptr> v(n);
+	for (size_t i = 0; i < n; i++) {
+		v[i] = values[i];
+	}
+	add(id, v);
+}
+
+void keyfile_writer::add(uint32_t id, const std::vector<mpz_srcptr>& values) {
+	section& s = m_mSections[id];
+	s.count = values.size();
+	s.limbs = 1;
+	for (mpz_srcptr v : values) {
+		s.limbs = std::max<uint64_t>(s.limbs, mpz_size(v));
+	}
+	s.data.assign(s.count * s.limbs, 0);
+	for (size_t i = 0; i < values.size(); i++) {
+		std::copy(mpz_limbs_read(values[i]), mpz_limbs_read(values[i]) + mpz_size(values[i]), s.data.begin() + i * s.limbs);
+	}
+}
+
+void keyfile_writer::add(uint32_t id, const std::vector<uint64_t>& values) {
+	section& s = m_mSections[id];
+	s.count = values.size();
+	s.limbs = 1;
+	s.data.assign(values.begin(), values.end());
+}
+
+void keyfile_writer::add(uint32_t id, const mp_limb_t* limbs, size_t n) {
+	section& s = m_mSections[id];
+	s.count = 1;
+	s.limbs = n;
+	s.data.assign(limbs, limbs + n);
+}
+
+void keyfile_writer::add(uint32_t id, const FixedBasePowmod& fb) {
+	add(id, std::vector<uint64_t> { fb.get_bitsize(), fb.get_window(), fb.get_blocks() });
+	add(id + 1, fb.get_table(), fb.get_table_size());
+}
+
+bool keyfile_writer::write(const char* path) const {
+	//layout: header, directory, aligned sections
+	size_t offset = keyfile_align(sizeof(keyfile_header) + m_mSections.size() * sizeof(keyfile_section));
+	std::vector<keyfile_section> directory;
+	for (auto& it : m_mSections) {
+		keyfile_section d;
+		memset(&d, 0, sizeof(d));
+		d.id = it.first;
+		d.count = it.second.count;
+		d.limbs = it.second.limbs;
+		d.offset = offset;
+		directory.push_back(d);
+		offset = keyfile_align(offset + it.second.data.size() * sizeof(mp_limb_t));
+	}
+
+	std::vector<uint8_t> file(offset, 0);
+	keyfile_header* header = (keyfile_header*) file.data();
+	memcpy(header->magic, keyfile_magic, sizeof(keyfile_magic));
+	header->version = KEYFILE_VERSION;
+	header->type = m_eType;
+	header->limb_bytes = sizeof(mp_limb_t);
+	header->byte_order = 0x01020304;
+	header->sections = directory.size();
+	header->size = file.size();
+	if (!directory.empty()) {
+		memcpy(file.data() + sizeof(keyfile_header), directory.data(), directory.size() * sizeof(keyfile_section));
+	}
+	size_t i = 0;
+	for (auto& it : m_mSections) {
+		if (!it.second.data.empty()) {
+			memcpy(file.data() + directory[i].offset, it.second.data.data(), it.second.data.size() * sizeof(mp_limb_t));
+		}
+		i++;
+	}
+	keyfile_checksum(header->checksum, file.data() + sizeof(keyfile_header), file.size() - sizeof(keyfile_header));
+
+	//the private key is only readable by the owner, from the creation of the temporary file on
+	std::string tmppath = std::string(path) + ".tmp";
+	FILE* fp = keyfile_create_private(tmppath.c_str());
+	if (!fp) {
+		std::cerr << "Error opening " << tmppath << " for writing the key" << std::endl;
+		return false;
+	}
+	bool ok = fwrite(file.data(), file.size(), 1, fp) == 1;
+	ok = (fclose(fp) == 0) && ok;
+	if (!ok || rename(tmppath.c_str(), path) != 0) {
+		std::cerr << "Error writing the key to " << path << std::endl;
+		unlink(tmppath.c_str());
+		return false;
+	}
+	return true;
+}
+
+FILE* keyfile_create_private(const char* path) {
+	int fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+	if (fd < 0 && errno == EEXIST && unlink(path) == 0) {
+		//only the stale file is removed, a file created in between makes the second attempt fail
+		fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+	}
+	if (fd < 0) {
+		return nullptr;
+	}
+	FILE* fp = fdopen(fd, "wb");
+	if (!fp) {
+		close(fd);
+		unlink(path);
+	}
+	return fp;
+}
+
+keyfile_reader::keyfile_reader() :
+		m_pData(nullptr), m_nSize(0), m_pSections(nullptr), m_nSections(0) {
+}
+
+keyfile_reader::~keyfile_reader() {
+	close();
+}
+
+void keyfile_reader::close() {
+	if (m_pData) {
+		munmap((void*) m_pData, m_nSize);
+	}
+	m_pData = nullptr;
+	m_nSize = 0;
+	m_pSections = nullptr;
+	m_nSections = 0;
+}
+
+bool keyfile_reader::open(const char* path, keyfile_type type) {
+	close();
+	int fd = ::open(path, O_RDONLY);
+	if (fd < 0) {
+		std::cerr << "Error opening key file " << path << std::endl;
+		return false;
+	}
+	struct stat st;
+	void* addr = MAP_FAILED;
+	if (fstat(fd, &st) == 0 && st.st_size >= (off_t) sizeof(keyfile_header)) {
+		addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	}
+	::close(fd);
+	if (addr == MAP_FAILED) {
+		std::cerr << "Error mapping key file " << path << std::endl;
+		return false;
+	}
+	m_pData = (const uint8_t*) addr;
+	m_nSize = st.st_size;
+
+	const keyfile_header* header = (const keyfile_header*) m_pData;
+	const char* error = nullptr;
+	if (memcmp(header->magic, keyfile_magic, sizeof(keyfile_magic)) != 0) {
+		error = "is no key file";
+	} else if (header->version != KEYFILE_VERSION) {
+		error = "has an unsupported version";
+	} else if (header->type != type) {
+		error = "holds another type of key";
+	} else if (header->limb_bytes != sizeof(mp_limb_t) || header->byte_order != 0x01020304) {
+		error = "was written on an incompatible machine";
+	} else if (header->size != m_nSize
+			|| sizeof(keyfile_header) + uint64_t(header->sections) * sizeof(keyfile_section) > m_nSize) {
+		error = "is truncated";
+	} else {
+		uint8_t checksum[32];
+		keyfile_checksum(checksum, m_pData + sizeof(keyfile_header), m_nSize - sizeof(keyfile_header));
+		if (memcmp(checksum, header->checksum, sizeof(checksum)) != 0) {
+			error = "is corrupted";
+		}
+	}
+	if (!error) {
+		m_pSections = (const keyfile_section*) (m_pData + sizeof(keyfile_header));
+		m_nSections = header->sections;
+		for (size_t i = 0; i < m_nSections && !error; i++) {
+			const keyfile_section& s = m_pSections[i];
+			if (s.offset % KEYFILE_ALIGNMENT || s.offset > m_nSize || s.limbs == 0
+					|| s.count > (m_nSize - s.offset) / sizeof(mp_limb_t) / s.limbs) {
+				error = "has an invalid section";
+			}
+		}
+	}
+	if (error) {
+		std::cerr << "Key file " << path << " " << error << std::endl;
+		close();
+		return false;
+	}
+	return true;
+}
+
+const keyfile_section* keyfile_reader::find(uint32_t id) const {
+	for (size_t i = 0; i < m_nSections; i++) {
+		if (m_pSections[i].id == id) {
+			return m_pSections + i;
+		}
+	}
+	return nullptr;
+}
+
+size_t keyfile_reader::count(uint32_t id) const {
+	const keyfile_section* s = find(id);
+	return s ? s->count : 0;
+}
+
+bool keyfile_reader::get(uint32_t id, size_t i, mpz_t res) const {
+	const keyfile_section* s = find(id);
+	if (!s || i >= s->count) {
+		return false;
+	}
+	const mp_limb_t* src = (const mp_limb_t*) (m_pData + s->offset) + i * s->limbs;
+	mp_limb_t* dst = mpz_limbs_write(res, s->limbs);
+	std::copy(src, src + s->limbs, dst);
+	mpz_limbs_finish(res, s->limbs);
+	return true;
+}
+
+uint64_t keyfile_reader::get_ui(uint32_t id, size_t i) const {
+	const keyfile_section* s = find(id);
+	if (!s || i >= s->count) {
+		return 0;
+	}
+	return ((const mp_limb_t*) (m_pData + s->offset))[i * s->limbs];
+}
+
+const mp_limb_t* keyfile_reader::limbs(uint32_t id, size_t* n) const {
+	const keyfile_section* s = find(id);
+	if (!s) {
+		return nullptr;
+	}
+	*n = s->count * s->limbs;
+	return (const mp_limb_t*) (m_pData + s->offset);
+}
+
+std::unique_ptr<FixedBasePowmod> keyfile_reader::get_fixed_base(uint32_t id, const mpz_t base, const mpz_t mod) const {
+	size_t n = 0;
+	const mp_limb_t* table = limbs(id + 1, &n);
+	uint64_t bitsize = get_ui(id, 0), window = get_ui(id, 1), blocks = get_ui(id, 2);
+	if (!table || count(id) != 3 || window == 0 || window > 16 || blocks == 0
+			|| n != (blocks << window) * mpz_size(mod)) {
+		return nullptr;
+	}
+	return std::make_unique<FixedBasePowmod>(base, mod, bitsize, window, blocks, table);
+}
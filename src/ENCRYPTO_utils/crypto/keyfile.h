@@ -0,0 +1,151 @@
+/**
+ \file 		keyfile.h
+ \copyright	ABY - A Framework for Efficient Mixed-protocol Secure Two-party Computation
+			Copyright (C) 2019 ENCRYPTO Group, TU Darmstadt
+			This program is free software: you can redistribute it and/or modify
+            it under the terms of the GNU Lesser General Public License as published
+            by the Free Software Foundation, either version 3 of the License, or
+            (at your option) any later version.
+            ABY is distributed in the hope that it will be useful,
+            but WITHOUT ANY WARRANTY; without even the implied warranty of
+            MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+            GNU Lesser General Public License for more details.
+            You should have received a copy of the GNU Lesser General Public License
+            along with this program. If not, see <http://www.gnu.org/licenses/>.
+ \brief		Versioned binary files for keys and their precomputed tables
+ */
+
+#ifndef KEYFILE_H_
+#define KEYFILE_H_
+
+#include "../powmod.h"
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <memory>
+#include <vector>
+#include <gmp.h>
+
+/*
+ * A key file starts with a keyfile_header, followed by the section directory and the sections.
+ * Every section is an array of count values of limbs limbs each, in the limb order of GMP, and
+ * starts at a multiple of KEYFILE_ALIGNMENT bytes. Thus a mapped file can be used without parsing,
+ * e.g. the tables of FixedBasePowmod are copied as they are. The checksum is SHA-256 over all
+ * bytes after the header. Files are only read on machines with the same limb size and byte order.
+ */
+
+#define KEYFILE_VERSION 1
+#define KEYFILE_ALIGNMENT 64
+
+enum keyfile_type : uint32_t {
+	KEYFILE_DGK = 1, KEYFILE_DJN = 2
+};
+
+struct keyfile_header {
+	char magic[8]; //"ABYKEY" padded with zeros
+	uint32_t version;
+	uint32_t type; //keyfile_type
+	uint32_t limb_bytes; //sizeof(mp_limb_t)
+	uint32_t byte_order; //0x01020304 in the byte order of the writer
+	uint32_t sections;
+	uint32_t reserved;
+	uint64_t size; //of the whole file
+	uint8_t checksum[32];
+};
+
+struct keyfile_section {
+	uint32_t id;
+	uint32_t reserved;
+	uint64_t count;
+	uint64_t limbs; //per value
+	uint64_t offset; //from the start of the file
+};
+
+/**
+ * Collects the sections of a key file and writes them at once.
+ */
+class keyfile_writer {
+public:
+	explicit keyfile_writer(keyfile_type type) :
+			m_eType(type) {
+	}
+
+	//section of n values, padded to the size of the largest one
+	void add(uint32_t id, const mpz_t* values, size_t n);
+	void add(uint32_t id, const std::vector<mpz_srcptr>& values);
+	//section of small integers, one limb each
+	void add(uint32_t id, const std::vector<uint64_t>& values);
+	//section of raw limbs, a single value
+	void add(uint32_t id, const mp_limb_t* limbs, size_t n);
+	//sections id (bitsize, window and blocks) and id + 1 (the table) of fb
+	void add(uint32_t id, const FixedBasePowmod& fb);
+
+	/**
+	 * writes the file to a temporary file first and renames it to path, such that readers never
+	 * see a partial file. Returns false on errors.
+	 */
+	bool write(const char* path) const;
+
+private:
+	struct section {
+		uint64_t count;
+		uint64_t limbs;
+		std::vector<mp_limb_t> data;
+	};
+
+	keyfile_type m_eType;
+	std::map<uint32_t, section> m_mSections;
+};
+
+/**
+ * Maps a key file read-only and checks its header and checksum.
+ */
+class keyfile_reader {
+public:
+	keyfile_reader();
+	~keyfile_reader();
+
+	keyfile_reader(const keyfile_reader&) = delete;
+	keyfile_reader& operator=(const keyfile_reader&) = delete;
+
+	//returns false if the file can not be mapped, is of another type or version, or corrupted
+	bool open(const char* path, keyfile_type type);
+
+	bool has(uint32_t id) const {
+		return find(id) != nullptr;
+	}
+
+	//number of values of section id, 0 if it is missing
+	size_t count(uint32_t id) const;
+
+	//res = value i of section id, returns false if it is missing
+	bool get(uint32_t id, size_t i, mpz_t res) const;
+
+	//small integer i of section id, 0 if it is missing
+	uint64_t get_ui(uint32_t id, size_t i) const;
+
+	//the limbs of section id, nullptr if it is missing, n is set to their number
+	const mp_limb_t* limbs(uint32_t id, size_t* n) const;
+
+	//the table stored by keyfile_writer::add(id, fb) for base and mod, nullptr if it is missing
+	std::unique_ptr<FixedBasePowmod> get_fixed_base(uint32_t id, const mpz_t base, const mpz_t mod) const;
+
+private:
+	const keyfile_section* find(uint32_t id) const;
+
+	void close();
+
+	const uint8_t* m_pData;
+	size_t m_nSize;
+	const keyfile_section* m_pSections;
+	size_t m_nSections;
+};
+
+/**
+ * Creates path for writing secrets, readable and writable by the owner only. A file left at path
+ * by an interrupted write is replaced, the new file is always created with O_EXCL. nullptr on errors.
+ */
+FILE* keyfile_create_private(const char* path);
+
+#endif /* KEYFILE_H_ */
@@ -0,0 +1,223 @@
+/**
+ \file 		prime_search.cpp
+ \copyright	ABY - A Framework for Efficient Mixed-protocol Secure Two-party Computation
+			Copyright (C) 2019 ENCRYPTO Group, TU Darmstadt
+			This program is free software: you can redistribute it and/or modify
+            it under the terms of the GNU Lesser General Public License as published
+            by the Free Software Foundation, either version 3 of the License, or
+            (at your option) any later version.
+            ABY is distributed in the hope that it will be useful,
+            but WITHOUT ANY WARRANTY; without even the implied warranty of
+            MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+            GNU Lesser General Public License for more details.
+            You should have received a copy of the GNU Lesser General Public License
+            along with this program. If not, see <http://www.gnu.org/licenses/>.
+ \brief		Parallel sieved prime search for DJN and DGK key generation
+ */
+
+#include "prime_search.h"
+#include "batch.h"
+#include "../utils.h"
+#include <mutex>
+#include <vector>
+
+//candidates are sieved with all primes below this bound before Miller-Rabin tests
+#define PRIME_SIEVE_BOUND (1 << 16)
+
+//candidates k of a stream that are sieved at once
+#define PRIME_SIEVE_WINDOW 4096
+
+//most numbers that have to be prime at the same k
+#define PRIME_MAX_FORMS 2
+
+//Miller-Rabin repetitions, as used by mpz_nextprime and dgk_keygen
+#define PRIME_REPS_DJN 25
+#define PRIME_REPS_DGK 50
+
+static const std::vector<uint32_t>& small_primes() {
+	static const std::vector<uint32_t> primes = [] {
+		std::vector<uint32_t> res;
+		std::vector<bool> composite(PRIME_SIEVE_BOUND, false);
+		for (uint32_t i = 2; i < PRIME_SIEVE_BOUND; i++) {
+			if (!composite[i]) {
+				res.push_back(i);
+				for (uint32_t j = i * i; j < PRIME_SIEVE_BOUND; j += i) {
+					composite[j] = true;
+				}
+			}
+		}
+		return res;
+	}();
+	return primes;
+}
+
+//a^-1 mod s for a prime s that does not divide a
+static uint32_t invert_small(uint32_t a, uint32_t s) {
+	int64_t t = 0, newt = 1, r = s, newr = a;
+	while (newr != 0) {
+		int64_t q = r / newr;
+		t -= q * newt;
+		std::swap(t, newt);
+		r -= q * newr;
+		std::swap(r, newr);
+	}
+	return t < 0 ? t + s : t;
+}
+
+prime_search::prime_search(const keygen_options& options)
+	: m_cOptions(options), m_pPool(new thread_pool(options.threads)), m_tStart(std::chrono::steady_clock::now()) {
+}
+
+prime_search::~prime_search() = default;
+
+bool prime_search::prime_3mod4(mpz_t p, unsigned topbit, const char* stage) {
+	mpz_t x[1];
+	mpz_init(x[0]);
+	bool found = search(1, [topbit](mpz_t* a, mpz_t* d) {
+		aby_prng(a[0], topbit);
+		mpz_setbit(a[0], topbit);
+		mpz_setbit(a[0], 0);
+		mpz_setbit(a[0], 1);
+		mpz_set_ui(d[0], 4);
+	}, x, PRIME_REPS_DJN, stage);
+	if (found) {
+		mpz_swap(p, x[0]);
+	}
+	mpz_clear(x[0]);
+	return found;
+}
+
+bool prime_search::prime_dgk(mpz_t p, mpz_t f, const mpz_t m, unsigned fbits, const char* stage) {
+	//f = a + 2k and p = m*a + 1 + 2m*k. f is tested first, it is the smaller number
+	mpz_t x[2];
+	mpz_init(x[0]);
+	mpz_init(x[1]);
+	bool found = search(2, [m, fbits](mpz_t* a, mpz_t* d) {
+		aby_prng(a[0], fbits);
+		mpz_setbit(a[0], 0);
+		mpz_set_ui(d[0], 2);
+		mpz_mul(a[1], m, a[0]);
+		mpz_add_ui(a[1], a[1], 1);
+		mpz_mul_2exp(d[1], m, 1);
+	}, x, PRIME_REPS_DGK, stage);
+	if (found) {
+		mpz_swap(f, x[0]);
+		mpz_swap(p, x[1]);
+	}
+	mpz_clear(x[0]);
+	mpz_clear(x[1]);
+	return found;
+}
+
+void prime_search::report(const char* stage, uint64_t candidates, uint64_t tests, bool done) {
+	if (!m_cOptions.progress) {
+		return;
+	}
+	keygen_progress progress;
+	progress.stage = stage;
+	progress.candidates = candidates;
+	progress.tests = tests;
+	progress.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - m_tStart).count();
+	progress.done = done;
+	m_cOptions.progress(progress);
+}
+
+bool prime_search::search(size_t forms, const std::function<void(mpz_t* a, mpz_t* d)>& init, mpz_t* x, int reps, const char* stage) {
+	const std::vector<uint32_t>& primes = small_primes();
+	std::atomic<bool> stop(false);
+	std::atomic<uint64_t> candidates(0), tests(0);
+	std::mutex mfound;
+	bool found = false;
+	auto interval = std::chrono::milliseconds(m_cOptions.progress_interval_ms);
+	auto next_report = std::chrono::steady_clock::now() + interval;
+
+	m_pPool->parallel_for(m_pPool->size(), [&](unsigned worker, size_t, size_t) {
+		mpz_t a[PRIME_MAX_FORMS], d[PRIME_MAX_FORMS], cand[PRIME_MAX_FORMS];
+		for (size_t j = 0; j < forms; j++) {
+			mpz_inits(a[j], d[j], cand[j], NULL);
+		}
+		//offset of the next k in the current window for which form j is divisible by prime i
+		std::vector<uint32_t> next(forms * primes.size());
+		const uint32_t never = UINT32_MAX;
+		std::vector<uint8_t> sieve(PRIME_SIEVE_WINDOW);
+		bool fresh = true;
+		uint64_t base = 0;
+
+		while (!stop && !cancelled()) {
+			if (fresh) {
+				//a new random stream, streams of different threads do not overlap in practice
+				init(a, d);
+				fresh = false;
+				base = 0;
+				for (size_t i = 0; i < primes.size() && !fresh; i++) {
+					for (size_t j = 0; j < forms; j++) {
+						uint32_t s = primes[i];
+						uint32_t r = mpz_fdiv_ui(a[j], s);
+						uint32_t step = mpz_fdiv_ui(d[j], s);
+						if (step == 0) {
+							//every candidate is divisible by s, or none
+							fresh = (r == 0);
+							next[j * primes.size() + i] = never;
+						} else {
+							next[j * primes.size() + i] = (uint64_t) ((s - r) % s) * invert_small(step, s) % s;
+						}
+					}
+				}
+				continue;
+			}
+
+			std::fill(sieve.begin(), sieve.end(), 0);
+			for (size_t idx = 0; idx < next.size(); idx++) {
+				if (next[idx] == never) {
+					continue;
+				}
+				uint32_t s = primes[idx % primes.size()];
+				uint32_t k = next[idx];
+				for (; k < PRIME_SIEVE_WINDOW; k += s) {
+					sieve[k] = 1;
+				}
+				next[idx] = k - PRIME_SIEVE_WINDOW;
+			}
+
+			for (uint32_t k = 0; k < PRIME_SIEVE_WINDOW && !stop && !cancelled(); k++) {
+				if (sieve[k]) {
+					continue;
+				}
+				bool prime = true;
+				for (size_t j = 0; j < forms && prime; j++) {
+					mpz_set(cand[j], a[j]);
+					mpz_addmul_ui(cand[j], d[j], base + k);
+					prime = mpz_probab_prime_p(cand[j], reps) != 0;
+					tests++;
+				}
+				if (prime) {
+					std::lock_guard<std::mutex> lock(mfound);
+					if (!found) {
+						found = true;
+						for (size_t j = 0; j < forms; j++) {
+							mpz_swap(x[j], cand[j]);
+						}
+					}
+					stop = true;
+				}
+			}
+			base += PRIME_SIEVE_WINDOW;
+			candidates += PRIME_SIEVE_WINDOW;
+
+			//the calling thread reports, such that the callback needs no synchronization
+			if (worker == 0 && m_cOptions.progress && std::chrono::steady_clock::now() >= next_report) {
+				report(stage, candidates, tests, false);
+				next_report = std::chrono::steady_clock::now() + interval;
+			}
+		}
+
+		for (size_t j = 0; j < forms; j++) {
+			mpz_clears(a[j], d[j], cand[j], NULL);
+		}
+	});
+
+	if (found) {
+		report(stage, candidates, tests, true);
+	}
+	return found;
+}
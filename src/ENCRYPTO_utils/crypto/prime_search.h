@@ -0,0 +1,85 @@
+/**
+ \file 		prime_search.h
+ \copyright	ABY - A Framework for Efficient Mixed-protocol Secure Two-party Computation
+			Copyright (C) 2019 ENCRYPTO Group, TU Darmstadt
+			This program is free software: you can redistribute it and/or modify
+            it under the terms of the GNU Lesser General Public License as published
+            by the Free Software Foundation, either version 3 of the License, or
+            (at your option) any later version.
+            ABY is distributed in the hope that it will be useful,
+            but WITHOUT ANY WARRANTY; without even the implied warranty of
+            MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+            GNU Lesser General Public License for more details.
+            You should have received a copy of the GNU Lesser General Public License
+            along with this program. If not, see <http://www.gnu.org/licenses/>.
+ \brief		Parallel sieved prime search for DJN and DGK key generation
+ */
+
+#ifndef PRIME_SEARCH_H_
+#define PRIME_SEARCH_H_
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <gmp.h>
+
+class thread_pool;
+
+struct keygen_progress {
+	const char* stage; //the prime that is searched, e.g. "p" or "q"
+	uint64_t candidates; //candidates of this stage that were sieved
+	uint64_t tests; //candidates that passed the sieve and were tested with Miller-Rabin
+	double seconds; //time since the start of the key generation
+	bool done; //reported once at the end of every stage
+};
+
+struct keygen_options {
+	unsigned threads = 0; //0 uses one thread per hardware thread
+	const std::atomic<bool>* cancel = nullptr; //set to true to abort the key generation
+	std::function<void(const keygen_progress&)> progress; //called periodically and after every stage
+	uint32_t progress_interval_ms = 1000;
+};
+
+/**
+ * Prime search of one key generation. Keeps the threads and the start time for the progress
+ * reports over all stages.
+ */
+class prime_search {
+public:
+	explicit prime_search(const keygen_options& options);
+	~prime_search();
+
+	/**
+	 * p = random prime with p = 3 mod 4, of the form r + 2^topbit for a random r of topbit bits
+	 * like the candidates of djn_keygen. Returns false if the search was cancelled.
+	 */
+	bool prime_3mod4(mpz_t p, unsigned topbit, const char* stage);
+
+	/**
+	 * random primes f of at most fbits bits and p = m*f + 1 for an even m, as in dgk_keygen.
+	 * Returns false if the search was cancelled.
+	 */
+	bool prime_dgk(mpz_t p, mpz_t f, const mpz_t m, unsigned fbits, const char* stage);
+
+	bool cancelled() const {
+		return m_cOptions.cancel && m_cOptions.cancel->load();
+	}
+
+private:
+	/**
+	 * Every thread picks random streams of candidates k = 0, 1, ... of the forms x_j = a_j + d_j*k,
+	 * with (a_j, d_j) set by init, and sieves them with small primes. The first k for which all
+	 * forms are probable primes is returned in x.
+	 */
+	bool search(size_t forms, const std::function<void(mpz_t* a, mpz_t* d)>& init, mpz_t* x, int reps, const char* stage);
+
+	void report(const char* stage, uint64_t candidates, uint64_t tests, bool done);
+
+	const keygen_options& m_cOptions;
+	std::unique_ptr<thread_pool> m_pPool;
+	std::chrono::steady_clock::time_point m_tStart;
+};
+
+#endif /* PRIME_SEARCH_H_ */
@@ -0,0 +1,81 @@
+/**
+ \file 		frame.h
+ \copyright	ABY - A Framework for Efficient Mixed-protocol Secure Two-party Computation
+			Copyright (C) 2019 ENCRYPTO Group, TU Darmstadt
+			This program is free software: you can redistribute it and/or modify
+            it under the terms of the GNU Lesser General Public License as published
+            by the Free Software Foundation, either version 3 of the License, or
+            (at your option) any later version.
+            ABY is distributed in the hope that it will be useful,
+            but WITHOUT ANY WARRANTY; without even the implied warranty of
+            MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+            GNU Lesser General Public License for more details.
+            You should have received a copy of the GNU Lesser General Public License
+            along with this program. If not, see <http://www.gnu.org/licenses/>.
+ \brief		Encoding of the frame headers that precede every message on the wire
+ */
+
+#ifndef FRAME_H_
+#define FRAME_H_
+
+#include "constants.h"
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+/*
+ * A frame header is [uint8_t id][uint64_t len] for channels below FRAME_ID_EXTENDED and the
+ * ADMIN_CHANNEL. Every other channel id is sent as [FRAME_ID_EXTENDED][uint64_t len][varint id],
+ * the id in LEB128 with seven bits per byte. Small ids thus keep their 9 byte header.
+ */
+
+inline bool frame_id_is_extended(uint32_t channelid) {
+	return channelid >= FRAME_ID_EXTENDED && channelid != ADMIN_CHANNEL;
+}
+
+inline size_t frame_header_size(uint32_t channelid) {
+	size_t size = FRAME_HEADER_SIZE;
+	if(frame_id_is_extended(channelid)) {
+		do {
+			size++;
+			channelid >>= 7;
+		} while(channelid > 0);
+	}
+	return size;
+}
+
+//writes the header to buf, which has to hold FRAME_HEADER_MAX_SIZE bytes, and returns its size
+inline size_t write_frame_header(uint8_t* buf, uint32_t channelid, uint64_t len) {
+	memcpy(buf + sizeof(uint8_t), &len, sizeof(len));
+	if(!frame_id_is_extended(channelid)) {
+		buf[0] = static_cast<uint8_t>(channelid);
+		return FRAME_HEADER_SIZE;
+	}
+	buf[0] = FRAME_ID_EXTENDED;
+	size_t size = FRAME_HEADER_SIZE;
+	while(channelid >= 0x80) {
+		buf[size++] = static_cast<uint8_t>(channelid | 0x80);
+		channelid >>= 7;
+	}
+	buf[size++] = static_cast<uint8_t>(channelid);
+	return size;
+}
+
+//decodes the varint of an extended channel id, fed one byte at a time
+struct frame_id_decoder {
+	uint32_t id = 0;
+	unsigned shift = 0;
+
+	//returns false if the encoding is longer than a 32 bit id allows, sets done after the last byte
+	bool add(uint8_t byte, bool* done) {
+		if(shift > 28 || (shift == 28 && (byte & 0x70))) {
+			return false;
+		}
+		id |= static_cast<uint32_t>(byte & 0x7F) << shift;
+		shift += 7;
+		*done = !(byte & 0x80);
+		return true;
+	}
+};
+
+#endif /* FRAME_H_ */
@@ -0,0 +1,266 @@
+/**
+ \file 		netem_transport.cpp
+ \copyright	ABY - A Framework for Efficient Mixed-protocol Secure Two-party Computation
+			Copyright (C) 2019 ENCRYPTO Group, TU Darmstadt
+			This program is free software: you can redistribute it and/or modify
+            it under the terms of the GNU Lesser General Public License as published
+            by the Free Software Foundation, either version 3 of the License, or
+            (at your option) any later version.
+            ABY is distributed in the hope that it will be useful,
+            but WITHOUT ANY WARRANTY; without even the implied warranty of
+            MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+            GNU Lesser General Public License for more details.
+            You should have received a copy of the GNU Lesser General Public License
+            along with this program. If not, see <http://www.gnu.org/licenses/>.
+ \brief		In-process network emulation on top of a connected CSocket
+ */
+
+#include "netem_transport.h"
+#include "socket.h"
+#include "transport.h"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <vector>
+
+#define NETEM_MAX_BATCH 64 //due chunks handed to the wrapped socket in one SendV
+
+netem_options netem_options::from_profile(netem_profile profile) {
+	netem_options options;
+	switch (profile) {
+	case NETEM_PROFILE_LAN:
+		options.rtt_us = 200;
+		options.bandwidth_bps = 1000000000;
+		break;
+	case NETEM_PROFILE_WAN:
+		options.rtt_us = 50000;
+		options.bandwidth_bps = 100000000;
+		options.jitter_us = 1000;
+		break;
+	case NETEM_PROFILE_INTERCONTINENTAL:
+		options.rtt_us = 150000;
+		options.bandwidth_bps = 100000000;
+		options.jitter_us = 5000;
+		options.max_queued_bytes = 8 << 20;
+		break;
+	case NETEM_PROFILE_MOBILE:
+		options.rtt_us = 80000;
+		options.bandwidth_bps = 20000000;
+		options.jitter_us = 10000;
+		options.reorder_probability = 0.01;
+		break;
+	case NETEM_PROFILE_NONE:
+		break;
+	}
+	return options;
+}
+
+namespace {
+
+using netem_clock = std::chrono::steady_clock;
+
+/**
+ * Sent data is cut into chunks that are scheduled for delivery when they are sent and
+ * written to the wrapped socket by a delivery thread once they are due.
+ */
+class NetemTransport : public CTransport {
+public:
+	NetemTransport(std::unique_ptr<CSocket> socket, const netem_options& options, bool verbose)
+		: socket_(std::move(socket)), options_(options), verbose_(verbose),
+		rng_(options.seed ? options.seed : std::random_device{}())
+	{
+		options_.chunk_size = std::max<uint32_t>(options_.chunk_size, 1);
+		if (options_.reorder_delay_us == 0) {
+			options_.reorder_delay_us = options_.rtt_us;
+		}
+		link_free_ = last_due_ = netem_clock::now();
+		thread_ = std::thread([this] { DeliveryMain(); });
+	}
+
+	~NetemTransport() override {
+		Close();
+	}
+
+	size_t Send(const void* buf, size_t bytes) override {
+		iovec iov = {const_cast<void*>(buf), bytes};
+		return SendV(&iov, 1);
+	}
+
+	size_t SendV(const iovec* iov, int iovcnt) override {
+		size_t sent = 0;
+		int i = 0;
+		size_t offset = 0; //into iov[i]
+		while (true) {
+			// gather the next chunk, small buffers are combined as they would be in a TCP segment
+			std::vector<uint8_t> data;
+			data.reserve(options_.chunk_size);
+			while (i < iovcnt && data.size() < options_.chunk_size) {
+				size_t n = std::min<size_t>(iov[i].iov_len - offset, options_.chunk_size - data.size());
+				const uint8_t* src = static_cast<const uint8_t*>(iov[i].iov_base) + offset;
+				data.insert(data.end(), src, src + n);
+				offset += n;
+				if (offset == iov[i].iov_len) {
+					i++;
+					offset = 0;
+				}
+			}
+			if (data.empty()) {
+				return sent;
+			}
+
+			std::unique_lock<std::mutex> lock(mtx_);
+			space_.wait(lock, [this, &data] {
+				return failed_ || queued_bytes_ == 0 || queued_bytes_ + data.size() <= options_.max_queued_bytes;
+			});
+			if (failed_) {
+				return sent;
+			}
+			sent += data.size();
+			queued_bytes_ += data.size();
+			queue_.push_back({schedule(data.size()), std::move(data)});
+			lock.unlock();
+			due_.notify_one();
+		}
+	}
+
+	size_t Receive(void* buf, size_t bytes) override {
+		return socket_->Receive(buf, bytes);
+	}
+
+	bool Poll(int timeout_ms) override {
+		return socket_->Poll(timeout_ms);
+	}
+
+	void Close() override {
+		{
+			std::lock_guard<std::mutex> lock(mtx_);
+			closing_ = true;
+		}
+		due_.notify_one();
+		// the data in flight is delivered before the connection is closed
+		if (thread_.joinable()) {
+			thread_.join();
+		}
+		socket_->Close();
+	}
+
+	std::string GetIP() const override {
+		return socket_->GetIP();
+	}
+
+	uint16_t GetPort() const override {
+		return socket_->GetPort();
+	}
+
+	void SetOptions(const socket_options& options) override {
+		socket_->SetOptions(options);
+	}
+
+private:
+	struct chunk {
+		netem_clock::time_point due;
+		std::vector<uint8_t> data;
+	};
+
+	// delivery time of the next len bytes, called with mtx_ held
+	netem_clock::time_point schedule(size_t len) {
+		auto now = netem_clock::now();
+		if (options_.bandwidth_bps > 0) {
+			// the chunk occupies the link after everything sent before it
+			link_free_ = std::max(link_free_, now) + std::chrono::nanoseconds(
+				static_cast<uint64_t>(len * 8 * 1e9 / options_.bandwidth_bps));
+		} else {
+			link_free_ = now;
+		}
+		uint64_t delay_us = options_.rtt_us / 2;
+		if (options_.jitter_us > 0) {
+			delay_us += std::uniform_int_distribution<uint32_t>(0, options_.jitter_us)(rng_);
+		}
+		if (options_.reorder_probability > 0
+				&& std::bernoulli_distribution(options_.reorder_probability)(rng_)) {
+			delay_us += options_.reorder_delay_us;
+		}
+		// the stream is ordered, a chunk cannot overtake an earlier, late one
+		last_due_ = std::max(last_due_, link_free_ + std::chrono::microseconds(delay_us));
+		return last_due_;
+	}
+
+	void DeliveryMain() {
+		std::vector<chunk> batch;
+		std::vector<iovec> iovs;
+		std::unique_lock<std::mutex> lock(mtx_);
+		while (true) {
+			due_.wait(lock, [this] { return closing_ || !queue_.empty(); });
+			if (queue_.empty()) {
+				break; // closing and everything was delivered
+			}
+			// later chunks are never due earlier, the front decides how long to wait
+			auto due = queue_.front().due;
+			if (netem_clock::now() < due) {
+				due_.wait_until(lock, due);
+				continue;
+			}
+			auto now = netem_clock::now();
+			while (!queue_.empty() && queue_.front().due <= now && batch.size() < NETEM_MAX_BATCH) {
+				batch.push_back(std::move(queue_.front()));
+				queue_.pop_front();
+			}
+			lock.unlock();
+
+			size_t bytes = 0;
+			for (auto& c : batch) {
+				iovs.push_back({c.data.data(), c.data.size()});
+				bytes += c.data.size();
+			}
+			bool ok = socket_->SendV(iovs.data(), static_cast<int>(iovs.size())) == bytes;
+			if (!ok && verbose_) {
+				std::cerr << "netem: delivery to the wrapped socket failed\n";
+			}
+			batch.clear();
+			iovs.clear();
+
+			lock.lock();
+			queued_bytes_ -= bytes;
+			if (!ok) {
+				failed_ = true;
+				queue_.clear();
+				queued_bytes_ = 0;
+			}
+			space_.notify_all();
+		}
+	}
+
+	std::unique_ptr<CSocket> socket_;
+	netem_options options_;
+	bool verbose_;
+
+	std::mutex mtx_;
+	std::condition_variable due_; //new chunks or closing, for the delivery thread
+	std::condition_variable space_; //queued bytes were delivered, for senders
+	std::deque<chunk> queue_;
+	uint64_t queued_bytes_ = 0;
+	bool closing_ = false;
+	bool failed_ = false;
+	std::mt19937_64 rng_;
+	netem_clock::time_point link_free_; //when the emulated link finished serializing the last chunk
+	netem_clock::time_point last_due_;
+	std::thread thread_;
+};
+
+} // namespace
+
+std::unique_ptr<CSocket> EmulateNetwork(std::unique_ptr<CSocket> socket, const netem_options& options,
+		bool verbose) {
+	if (!socket) {
+		return nullptr;
+	}
+	return std::make_unique<CSocket>(std::make_unique<NetemTransport>(std::move(socket), options, verbose),
+		verbose);
+}
@@ -0,0 +1,61 @@
+/**
+ \file 		netem_transport.h
+ \copyright	ABY - A Framework for Efficient Mixed-protocol Secure Two-party Computation
+			Copyright (C) 2019 ENCRYPTO Group, TU Darmstadt
+			This program is free software: you can redistribute it and/or modify
+            it under the terms of the GNU Lesser General Public License as published
+            by the Free Software Foundation, either version 3 of the License, or
+            (at your option) any later version.
+            ABY is distributed in the hope that it will be useful,
+            but WITHOUT ANY WARRANTY; without even the implied warranty of
+            MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+            GNU Lesser General Public License for more details.
+            You should have received a copy of the GNU Lesser General Public License
+            along with this program. If not, see <http://www.gnu.org/licenses/>.
+ \brief		In-process network emulation on top of a connected CSocket
+ */
+
+#ifndef NETEM_TRANSPORT_H_
+#define NETEM_TRANSPORT_H_
+
+#include <cstdint>
+#include <memory>
+
+class CSocket;
+
+enum netem_profile {
+	NETEM_PROFILE_NONE, //no emulation, only the decorator overhead
+	NETEM_PROFILE_LAN, //1 Gbit/s, 0.2 ms RTT
+	NETEM_PROFILE_WAN, //100 Mbit/s, 50 ms RTT, 1 ms jitter
+	NETEM_PROFILE_INTERCONTINENTAL, //100 Mbit/s, 150 ms RTT, 5 ms jitter
+	NETEM_PROFILE_MOBILE //20 Mbit/s, 80 ms RTT, 10 ms jitter, 1% late chunks
+};
+
+/**
+ * Link properties of the emulated direction. Both endpoints have to be wrapped, each delays
+ * what it sends by half the RTT.
+ * The emulated connection stays an ordered byte stream: a jittered or reordered chunk holds
+ * back the chunks sent after it, as head-of-line blocking in TCP would.
+ */
+struct netem_options {
+	uint32_t rtt_us = 0; //round-trip time, half of it is added to every chunk
+	uint64_t bandwidth_bps = 0; //bits per second, 0 for unlimited
+	uint32_t jitter_us = 0; //uniformly distributed extra delay per chunk
+	double reorder_probability = 0; //chance that a chunk arrives late, e.g. after a loss and retransmit
+	uint32_t reorder_delay_us = 0; //extra delay of a late chunk, defaults to one RTT if 0
+	uint32_t chunk_size = 16384; //granularity in which sent data is delayed
+	uint64_t max_queued_bytes = 4 << 20; //Send blocks while this much data is in flight, like a full send buffer
+	uint64_t seed = 0; //seed of the jitter and reordering decisions, 0 for a random one
+
+	static netem_options from_profile(netem_profile profile);
+};
+
+/**
+ * Wrap a connected socket such that everything sent through the returned socket arrives with the
+ * configured delays and bandwidth. Receives are passed through unchanged. Closing the returned
+ * socket first delivers the data still in flight.
+ */
+std::unique_ptr<CSocket> EmulateNetwork(std::unique_ptr<CSocket> socket, const netem_options& options,
+		bool verbose = false);
+
+#endif /* NETEM_TRANSPORT_H_ */
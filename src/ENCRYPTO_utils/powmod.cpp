@@ -18,82 +18,498 @@
  */
 
 #include "powmod.h"
+#include "crypto/batch.h"
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
 #include <cstdlib>
+#include <memory>
 
 #define POWMOD_DEBUG 0
 
+//largest windows of MontgomeryContext::pow_product, Straus keeps 2^window powers of every base and
+//Pippenger 2^window buckets per thread
+#define POWMOD_MAX_STRAUS_WINDOW 5
+#define POWMOD_MAX_PIPPENGER_WINDOW 14
+
 #if POWMOD_DEBUG
 #include <cstdio>
 #endif
 
-mpz_t* m_table_g;
-mpz_t* m_table_h;
-mpz_t* m_prod;
-mpz_t m_mod;
-size_t m_numberOfElements_g, m_numberOfElements_h;
 
-void fbpowmod_init_g(const mpz_t base, const mpz_t mod, size_t bitsize) {
-	m_numberOfElements_g = bitsize;
-	mpz_init(m_mod);
-	mpz_set(m_mod, mod);
-	m_table_g = (mpz_t*) malloc(sizeof(mpz_t) * bitsize);
-	for (size_t i = 0; i < bitsize; i++) {
-		mpz_init(m_table_g[i]);
+//process-wide instances behind the fbpowmod_* functions
+static std::unique_ptr<FixedBasePowmod> m_fb_g;
+static std::unique_ptr<FixedBasePowmod> m_fb_h;
+static std::unique_ptr<DoubleBasePowmod> m_db;
+
+MontgomeryContext::MontgomeryContext(const mpz_t mod) {
+	assert(mpz_sgn(mod) > 0);
+	mpz_init_set(m_zMod, mod);
+	m_nLimbs = mpz_size(mod);
+	m_bMontgomery = mpz_odd_p(mod);
+	m_nInv = 0;
+
+	mpz_t t;
+	mpz_init(t);
+	m_vOne.assign(m_nLimbs, 0);
+	m_vR2.assign(m_nLimbs, 0);
+	if (m_bMontgomery) {
+		//Newton iteration for mod^-1 mod 2^GMP_NUMB_BITS, each step doubles the number of correct bits
+		mp_limb_t m0 = mpz_getlimbn(mod, 0);
+		mp_limb_t inv = m0; //correct in the lowest 3 bits, since m0*m0 = 1 mod 8 for odd m0
+		for (int i = 0; i < 6; i++) {
+			inv *= 2 - m0 * inv;
+		}
+		m_nInv = -inv;
+
+		mpz_setbit(t, m_nLimbs * GMP_NUMB_BITS);
+		mpz_mod(t, t, mod);
+		std::copy(mpz_limbs_read(t), mpz_limbs_read(t) + mpz_size(t), m_vOne.begin());
+		mpz_set_ui(t, 0);
+		mpz_setbit(t, 2 * m_nLimbs * GMP_NUMB_BITS);
+		mpz_mod(t, t, mod);
+		std::copy(mpz_limbs_read(t), mpz_limbs_read(t) + mpz_size(t), m_vR2.begin());
+	} else {
+		mpz_set_ui(t, 1);
+		mpz_mod(t, t, mod);
+		std::copy(mpz_limbs_read(t), mpz_limbs_read(t) + mpz_size(t), m_vOne.begin());
 	}
+	mpz_clear(t);
+}
+
+MontgomeryContext::~MontgomeryContext() {
+	mpz_clear(m_zMod);
+}
 
-	mpz_set(m_table_g[0], base);
-	for (size_t u = 1; u < bitsize; u++) {
-		mpz_mul(m_table_g[u], m_table_g[u - 1], m_table_g[u - 1]);
-		mpz_mod(m_table_g[u], m_table_g[u], mod);
+void MontgomeryContext::reduce(mp_limb_t* r, mp_limb_t* tmp) const {
+	const mp_limb_t* m = mpz_limbs_read(m_zMod);
+	size_t n = m_nLimbs;
+	if (m_bMontgomery) {
+		//word-wise Montgomery reduction of the 2n limbs in tmp. The carries of the rows all belong
+		//to the upper half, so they are collected in the lower half and added at the end.
+		for (size_t i = 0; i < n; i++) {
+			mp_limb_t q = tmp[i] * m_nInv;
+			tmp[i] = mpn_addmul_1(tmp + i, m, n, q);
+		}
+		mp_limb_t cy = mpn_add_n(r, tmp + n, tmp, n);
+		if (cy || mpn_cmp(r, m, n) >= 0) {
+			mpn_sub_n(r, r, m, n);
+		}
+	} else {
+		mp_limb_t* q = tmp + 2 * n;
+		mpn_tdiv_qr(q, r, 0, tmp, 2 * n, m, n);
 	}
 }
 
-void fbpowmod_init_h(const mpz_t base, const mpz_t mod, size_t bitsize) {
-	m_numberOfElements_h = bitsize;
-	mpz_init(m_mod);
-	mpz_set(m_mod, mod);
-	m_table_h = (mpz_t*) malloc(sizeof(mpz_t) * bitsize);
-	for (size_t i = 0; i < bitsize; i++) {
-		mpz_init(m_table_h[i]);
+void MontgomeryContext::mul(mp_limb_t* r, const mp_limb_t* a, const mp_limb_t* b, mp_limb_t* tmp) const {
+	if (a == b) {
+		mpn_sqr(tmp, a, m_nLimbs);
+	} else {
+		mpn_mul_n(tmp, a, b, m_nLimbs);
 	}
+	reduce(r, tmp);
+}
+
+void MontgomeryContext::sqr(mp_limb_t* r, const mp_limb_t* a, mp_limb_t* tmp) const {
+	mpn_sqr(tmp, a, m_nLimbs);
+	reduce(r, tmp);
+}
 
-	mpz_set(m_table_h[0], base);
-	for (size_t u = 1; u < bitsize; u++) {
-		mpz_mul(m_table_h[u], m_table_h[u - 1], m_table_h[u - 1]);
-		mpz_mod(m_table_h[u], m_table_h[u], mod);
+void MontgomeryContext::import(mp_limb_t* r, const mpz_t x) const {
+	mpz_t t;
+	mpz_init(t);
+	mpz_mod(t, x, m_zMod);
+	size_t size = mpz_size(t);
+	std::copy(mpz_limbs_read(t), mpz_limbs_read(t) + size, r);
+	std::fill(r + size, r + m_nLimbs, 0);
+	mpz_clear(t);
+	if (m_bMontgomery) {
+		std::vector<mp_limb_t> tmp(tmp_limbs());
+		mul(r, r, m_vR2.data(), tmp.data());
 	}
 }
 
-void fbpowmod_g(mpz_t result, const mpz_t exp) {
-	auto top = mpz_sizeinbase(exp, 2);
-	if (top <= m_numberOfElements_g) {
-		mpz_set_ui(result, 1);
+void MontgomeryContext::to_mpz(mpz_t res, const mp_limb_t* a) const {
+	size_t n = m_nLimbs;
+	mp_limb_t* r = mpz_limbs_write(res, n);
+	if (m_bMontgomery) {
+		//leave Montgomery form by reducing a * 1
+		std::vector<mp_limb_t> tmp(tmp_limbs());
+		std::copy(a, a + n, tmp.begin());
+		reduce(r, tmp.data());
+	} else {
+		std::copy(a, a + n, r);
+	}
+	mpz_limbs_finish(res, n);
+}
+
+//window size for exponents of bits bits, with 2^(window-1) odd powers per base
+static unsigned pow_window(size_t bits) {
+	return bits <= 24 ? 1 : bits <= 80 ? 3 : bits <= 240 ? 4 : bits <= 672 ? 5 : 6;
+}
+
+void MontgomeryContext::pow(mp_limb_t* r, const mp_limb_t* a, const mpz_t e) const {
+	assert(mpz_sgn(e) >= 0);
+	size_t n = m_nLimbs;
+	size_t bits = mpz_sizeinbase(e, 2);
+	if (mpz_sgn(e) == 0) {
+		std::copy(m_vOne.begin(), m_vOne.end(), r);
+		return;
+	}
+	std::vector<mp_limb_t> tmp(tmp_limbs());
+	unsigned window = pow_window(bits);
+	//odd powers a^1, a^3, ..., a^(2^window - 1)
+	std::vector<mp_limb_t> powers((size_t(1) << (window - 1)) * n);
+	std::vector<mp_limb_t> sq(n);
+	std::copy(a, a + n, powers.begin());
+	sqr(sq.data(), a, tmp.data());
+	for (size_t i = 1; i < (size_t(1) << (window - 1)); i++) {
+		mul(powers.data() + i * n, powers.data() + (i - 1) * n, sq.data(), tmp.data());
+	}
 
-		for (size_t u = 0; u < top; u++) {
-			if (mpz_tstbit(exp, u)) {
-				mpz_mul(result, result, m_table_g[u]);
-				mpz_mod(result, result, m_mod);
+	std::vector<mp_limb_t> acc(n);
+	bool is_one = true;
+	for (ssize_t i = bits - 1; i >= 0;) {
+		if (!mpz_tstbit(e, i)) {
+			if (!is_one) {
+				sqr(acc.data(), acc.data(), tmp.data());
 			}
+			i--;
+			continue;
 		}
-	} else {
-		printf("(g) Exponent too big for pre-computed fixed-base powmod! %zu %zu\n", top, m_numberOfElements_g);
+		//the longest window e[i..j] that ends in a set bit
+		ssize_t j = std::max<ssize_t>(i - window + 1, 0);
+		while (!mpz_tstbit(e, j)) {
+			j++;
+		}
+		size_t digit = 0;
+		for (ssize_t k = i; k >= j; k--) {
+			digit = (digit << 1) | mpz_tstbit(e, k);
+			if (!is_one) {
+				sqr(acc.data(), acc.data(), tmp.data());
+			}
+		}
+		const mp_limb_t* p = powers.data() + (digit >> 1) * n;
+		if (is_one) {
+			std::copy(p, p + n, acc.begin());
+			is_one = false;
+		} else {
+			mul(acc.data(), acc.data(), p, tmp.data());
+		}
+		i = j - 1;
 	}
+	std::copy(acc.begin(), acc.end(), r);
 }
 
-void fbpowmod_h(mpz_t result, const mpz_t exp) {
-	auto top = mpz_sizeinbase(exp, 2);
-	if (top <= m_numberOfElements_h) {
-		mpz_set_ui(result, 1);
+//the width bits of e starting at bit pos, width < GMP_NUMB_BITS
+static size_t pow_digit(const mpz_t e, size_t pos, unsigned width) {
+	const mp_limb_t* l = mpz_limbs_read(e);
+	size_t size = mpz_size(e);
+	size_t i = pos / GMP_NUMB_BITS, shift = pos % GMP_NUMB_BITS;
+	if (i >= size) {
+		return 0;
+	}
+	mp_limb_t d = l[i] >> shift;
+	if (shift + width > GMP_NUMB_BITS && i + 1 < size) {
+		d |= l[i + 1] << (GMP_NUMB_BITS - shift);
+	}
+	return d & ((mp_limb_t(1) << width) - 1);
+}
+
+//multiplications of pow_straus and pow_pippenger for n exponents of bits bits
+static double straus_cost(size_t n, size_t bits, unsigned window) {
+	return double(n) * ((1 << window) - 2) + bits + double(n) * bits / window;
+}
+
+static double pippenger_cost(size_t n, size_t bits, unsigned window) {
+	return double((bits + window - 1) / window) * (n + (size_t(2) << window)) + bits;
+}
+
+void MontgomeryContext::pow_product(mp_limb_t* r, const mp_limb_t* bases, const mpz_t* exps, size_t count, thread_pool* pool) const {
+	size_t bits = 0;
+	for (size_t i = 0; i < count; i++) {
+		assert(mpz_sgn(exps[i]) >= 0);
+		bits = std::max(bits, mpz_sizeinbase(exps[i], 2));
+	}
+	if (bits == 0) {
+		std::copy(m_vOne.begin(), m_vOne.end(), r);
+		return;
+	}
+
+	unsigned straus = 1, pippenger = 1;
+	for (unsigned w = 2; w <= POWMOD_MAX_STRAUS_WINDOW; w++) {
+		if (straus_cost(count, bits, w) < straus_cost(count, bits, straus)) {
+			straus = w;
+		}
+	}
+	for (unsigned w = 2; w <= POWMOD_MAX_PIPPENGER_WINDOW; w++) {
+		if (pippenger_cost(count, bits, w) < pippenger_cost(count, bits, pippenger)) {
+			pippenger = w;
+		}
+	}
+	if (pippenger_cost(count, bits, pippenger) < straus_cost(count, bits, straus)) {
+		pow_pippenger(r, bases, exps, count, bits, pippenger, pool);
+		return;
+	}
+
+	size_t parts = pool ? std::min<size_t>(pool->size(), count) : 1;
+	if (parts <= 1) {
+		pow_straus(r, bases, exps, count, bits, straus);
+		return;
+	}
+	//every thread takes a range of the bases, the partial products are multiplied at the end
+	size_t n = m_nLimbs;
+	std::vector<mp_limb_t> partial(parts * n);
+	pool->parallel_for(parts, [&](unsigned, size_t begin, size_t end) {
+		for (size_t p = begin; p < end; p++) {
+			size_t from = count * p / parts, to = count * (p + 1) / parts;
+			pow_straus(partial.data() + p * n, bases + from * n, exps + from, to - from, bits, straus);
+		}
+	});
+	std::vector<mp_limb_t> tmp(tmp_limbs());
+	std::copy(partial.begin(), partial.begin() + n, r);
+	for (size_t p = 1; p < parts; p++) {
+		mul(r, r, partial.data() + p * n, tmp.data());
+	}
+}
+
+void MontgomeryContext::pow_straus(mp_limb_t* r, const mp_limb_t* bases, const mpz_t* exps, size_t count, size_t bits,
+		unsigned window) const {
+	size_t n = m_nLimbs;
+	std::vector<mp_limb_t> tmp(tmp_limbs());
+	size_t entries = size_t(1) << window;
+	//powers[i * entries + d] = bases[i]^d
+	std::vector<mp_limb_t> powers(count * entries * n);
+	for (size_t i = 0; i < count; i++) {
+		mp_limb_t* p = powers.data() + i * entries * n;
+		std::copy(m_vOne.begin(), m_vOne.end(), p);
+		std::copy(bases + i * n, bases + (i + 1) * n, p + n);
+		for (size_t d = 2; d < entries; d++) {
+			mul(p + d * n, p + (d - 1) * n, bases + i * n, tmp.data());
+		}
+	}
+
+	std::vector<mp_limb_t> acc(m_vOne);
+	bool is_one = true;
+	for (size_t w = (bits + window - 1) / window; w-- > 0;) {
+		if (!is_one) {
+			for (unsigned k = 0; k < window; k++) {
+				sqr(acc.data(), acc.data(), tmp.data());
+			}
+		}
+		for (size_t i = 0; i < count; i++) {
+			size_t digit = pow_digit(exps[i], w * window, window);
+			if (digit) {
+				const mp_limb_t* p = powers.data() + (i * entries + digit) * n;
+				if (is_one) {
+					std::copy(p, p + n, acc.begin());
+					is_one = false;
+				} else {
+					mul(acc.data(), acc.data(), p, tmp.data());
+				}
+			}
+		}
+	}
+	std::copy(acc.begin(), acc.end(), r);
+}
 
-		for (size_t u = 0; u < top; u++) {
-			if (mpz_tstbit(exp, u)) {
-				mpz_mul(result, result, m_table_h[u]);
-				mpz_mod(result, result, m_mod);
+void MontgomeryContext::pow_pippenger(mp_limb_t* r, const mp_limb_t* bases, const mpz_t* exps, size_t count, size_t bits,
+		unsigned window, thread_pool* pool) const {
+	size_t n = m_nLimbs;
+	size_t windows = (bits + window - 1) / window;
+	size_t entries = size_t(1) << window;
+	//sums[w] = prod bases[i]^digit(exps[i], w), the windows are independent of each other
+	std::vector<mp_limb_t> sums(windows * n);
+
+	auto run = [&](unsigned, size_t begin, size_t end) {
+		std::vector<mp_limb_t> buckets(entries * n), running(n), tmp(tmp_limbs());
+		std::vector<uint8_t> used(entries);
+		for (size_t w = begin; w < end; w++) {
+			//bucket d collects the bases with digit d
+			std::fill(used.begin(), used.end(), 0);
+			for (size_t i = 0; i < count; i++) {
+				size_t d = pow_digit(exps[i], w * window, window);
+				if (!d) {
+					continue;
+				}
+				if (used[d]) {
+					mul(buckets.data() + d * n, buckets.data() + d * n, bases + i * n, tmp.data());
+				} else {
+					std::copy(bases + i * n, bases + (i + 1) * n, buckets.begin() + d * n);
+					used[d] = 1;
+				}
+			}
+			//prod bucket[d]^d = prod over d of the running product of the buckets >= d
+			mp_limb_t* sum = sums.data() + w * n;
+			bool run_one = true, sum_one = true;
+			for (size_t d = entries - 1; d > 0; d--) {
+				if (used[d]) {
+					if (run_one) {
+						std::copy(buckets.begin() + d * n, buckets.begin() + (d + 1) * n, running.begin());
+						run_one = false;
+					} else {
+						mul(running.data(), running.data(), buckets.data() + d * n, tmp.data());
+					}
+				}
+				if (!run_one) {
+					if (sum_one) {
+						std::copy(running.begin(), running.end(), sum);
+						sum_one = false;
+					} else {
+						mul(sum, sum, running.data(), tmp.data());
+					}
+				}
+			}
+			if (sum_one) {
+				std::copy(m_vOne.begin(), m_vOne.end(), sum);
 			}
 		}
+	};
+	if (pool) {
+		pool->parallel_for(windows, run);
 	} else {
-		printf("Exponent too big for pre-computed fixed-base powmod! %zu %zu\n", top, m_numberOfElements_h);
+		run(0, 0, windows);
+	}
+
+	//r = sum of the windows, weighted by 2^(w*window)
+	std::vector<mp_limb_t> acc(sums.end() - n, sums.end()), tmp(tmp_limbs());
+	for (size_t w = windows - 1; w-- > 0;) {
+		for (unsigned k = 0; k < window; k++) {
+			sqr(acc.data(), acc.data(), tmp.data());
+		}
+		mul(acc.data(), acc.data(), sums.data() + w * n, tmp.data());
+	}
+	std::copy(acc.begin(), acc.end(), r);
+}
+
+FixedBasePowmod::FixedBasePowmod(const mpz_t base, const mpz_t mod, size_t bitsize, unsigned window, unsigned blocks)
+	: m_cMod(mod) {
+	init(base, bitsize, window, blocks);
+
+	size_t entries = size_t(1) << m_nWindow;
+	m_vTable.assign(m_nBlocks * entries * m_nLimbs, 0);
+	std::vector<mp_limb_t> tmp(m_cMod.tmp_limbs());
+	std::vector<mp_limb_t> cur(m_nLimbs);
+
+	//entry(b, 2^j) = base^(2^(j*rowbits + b*blockbits)), found by squaring in order of the exponent
+	m_cMod.import(cur.data(), m_zBase);
+	for (size_t j = 0; j < m_nWindow; j++) {
+		for (size_t b = 0; b < m_nBlocks; b++) {
+			std::copy(cur.begin(), cur.end(), entry(b, size_t(1) << j));
+			size_t from = std::min(b * m_nBlockBits, m_nRowBits);
+			size_t to = (b + 1 < m_nBlocks) ? std::min((b + 1) * m_nBlockBits, m_nRowBits) : m_nRowBits;
+			for (size_t i = from; i < to; i++) {
+				m_cMod.sqr(cur.data(), cur.data(), tmp.data());
+			}
+		}
+	}
+	//every other subset is the product of its lowest row and the remaining rows
+	for (size_t b = 0; b < m_nBlocks; b++) {
+		std::copy(m_cMod.one(), m_cMod.one() + m_nLimbs, entry(b, 0));
+		for (size_t s = 3; s < entries; s++) {
+			size_t low = s & (~s + 1);
+			if (low != s) {
+				m_cMod.mul(entry(b, s), entry(b, s ^ low), entry(b, low), tmp.data());
+			}
+		}
+	}
+}
+
+FixedBasePowmod::FixedBasePowmod(const mpz_t base, const mpz_t mod, size_t bitsize, unsigned window, unsigned blocks,
+		const mp_limb_t* table)
+	: m_cMod(mod) {
+	assert(window > 0);
+	init(base, bitsize, window, blocks);
+	m_vTable.assign(table, table + (m_nBlocks << m_nWindow) * m_nLimbs);
+}
+
+void FixedBasePowmod::init(const mpz_t base, size_t bitsize, unsigned window, unsigned blocks) {
+	assert(blocks > 0);
+	if (bitsize == 0) {
+		bitsize = 1;
 	}
+	if (window == 0) {
+		window = bitsize <= 64 ? 4 : bitsize <= 256 ? 6 : 8;
+	}
+	mpz_init(m_zBase);
+	mpz_mod(m_zBase, base, m_cMod.get_mod());
+
+	m_nBitsize = bitsize;
+	m_nWindow = window;
+	m_nBlocks = blocks;
+	m_nRowBits = (bitsize + window - 1) / window;
+	m_nBlockBits = (m_nRowBits + blocks - 1) / blocks;
+	m_nLimbs = m_cMod.limbs();
+}
+
+FixedBasePowmod::~FixedBasePowmod() {
+	mpz_clear(m_zBase);
+}
+
+void FixedBasePowmod::pow(mpz_t result, const mpz_t exp) const {
+	if (mpz_sgn(exp) < 0 || mpz_sizeinbase(exp, 2) > m_nBitsize) {
+		mpz_powm(result, m_zBase, exp, m_cMod.get_mod());
+		return;
+	}
+
+	size_t n = m_nLimbs;
+	std::vector<mp_limb_t> tmp(m_cMod.tmp_limbs());
+	std::vector<mp_limb_t> acc(n);
+	const mp_limb_t* e = mpz_limbs_read(exp);
+	size_t elimbs = mpz_size(exp);
+	auto bit = [e, elimbs](size_t i) -> size_t {
+		size_t l = i / GMP_NUMB_BITS;
+		return l < elimbs ? (e[l] >> (i % GMP_NUMB_BITS)) & 1 : 0;
+	};
+
+	bool is_one = true;
+	for (size_t i = m_nBlockBits; i-- > 0;) {
+		if (!is_one) {
+			m_cMod.sqr(acc.data(), acc.data(), tmp.data());
+		}
+		for (size_t b = m_nBlocks; b-- > 0;) {
+			size_t col = b * m_nBlockBits + i;
+			if (col >= m_nRowBits) {
+				continue;
+			}
+			size_t subset = 0;
+			for (size_t j = 0; j < m_nWindow; j++) {
+				subset |= bit(j * m_nRowBits + col) << j;
+			}
+			if (subset == 0) {
+				continue;
+			}
+			if (is_one) {
+				std::copy(entry(b, subset), entry(b, subset) + n, acc.begin());
+				is_one = false;
+			} else {
+				m_cMod.mul(acc.data(), acc.data(), entry(b, subset), tmp.data());
+			}
+		}
+	}
+
+	if (is_one) {
+		mpz_set_ui(result, 1);
+		mpz_mod(result, result, m_cMod.get_mod());
+		return;
+	}
+	m_cMod.to_mpz(result, acc.data());
+}
+
+void fbpowmod_init_g(const mpz_t base, const mpz_t mod, size_t bitsize) {
+	m_fb_g = std::make_unique<FixedBasePowmod>(base, mod, bitsize);
+}
+
+void fbpowmod_init_h(const mpz_t base, const mpz_t mod, size_t bitsize) {
+	m_fb_h = std::make_unique<FixedBasePowmod>(base, mod, bitsize);
+}
+
+void fbpowmod_g(mpz_t result, const mpz_t exp) {
+	m_fb_g->pow(result, exp);
+}
+
+void fbpowmod_h(mpz_t result, const mpz_t exp) {
+	m_fb_h->pow(result, exp);
 }
 
 void dbpowmod(mpz_t ret, const mpz_t b1, const mpz_t e1, const mpz_t b2, const mpz_t e2, const mpz_t mod) {
@@ -141,22 +557,20 @@ void dbpowmod(mpz_t ret, const mpz_t b1, const mpz_t e1, const mpz_t b2, const m
 	mpz_clears(prod[0], prod[1], prod[2], NULL);
 }
 
-void fbdbpowmod_init(const mpz_t b1, const mpz_t b2, const mpz_t mod, size_t) {
-
-	mpz_init(m_mod);
-	mpz_set(m_mod, mod);
-
-	m_prod = (mpz_t*) malloc(sizeof(mpz_t) * 3);
-
-	mpz_init_set(m_prod[0], b1);
-	mpz_init_set(m_prod[1], b2);
-	mpz_init(m_prod[2]);
-	mpz_mul(m_prod[2], b1, b2);
-	mpz_mod(m_prod[2], m_prod[2], mod);
+DoubleBasePowmod::DoubleBasePowmod(const mpz_t b1, const mpz_t b2, const mpz_t mod) {
+	mpz_init_set(m_zMod, mod);
+	mpz_init_set(m_zProd[0], b1);
+	mpz_init_set(m_zProd[1], b2);
+	mpz_init(m_zProd[2]);
+	mpz_mul(m_zProd[2], b1, b2);
+	mpz_mod(m_zProd[2], m_zProd[2], mod);
 }
 
-void fbdbpowmod(mpz_t ret, const mpz_t e1, const mpz_t e2) {
+DoubleBasePowmod::~DoubleBasePowmod() {
+	mpz_clears(m_zProd[0], m_zProd[1], m_zProd[2], m_zMod, NULL);
+}
 
+void DoubleBasePowmod::pow(mpz_t ret, const mpz_t e1, const mpz_t e2) const {
 	unsigned char index;
 
 	auto size = (mpz_cmp(e1, e2) > 0) ? mpz_sizeinbase(e1, 2) : mpz_sizeinbase(e2, 2);
@@ -166,11 +580,29 @@ void fbdbpowmod(mpz_t ret, const mpz_t e1, const mpz_t e2) {
 		index = (mpz_tstbit(e2, i) << 1) + mpz_tstbit(e1, i);
 
 		mpz_mul(ret, ret, ret);
-		mpz_mod(ret, ret, m_mod);
+		mpz_mod(ret, ret, m_zMod);
 
 		if (index) {
-			mpz_mul(ret, m_prod[index - 1], ret);
-			mpz_mod(ret, ret, m_mod);
+			mpz_mul(ret, m_zProd[index - 1], ret);
+			mpz_mod(ret, ret, m_zMod);
 		}
 	}
-}
\ No newline at end of file
+}
+
+void multipowmod(mpz_t ret, const mpz_t* b, const mpz_t* e, size_t n, const mpz_t mod, thread_pool* pool) {
+	MontgomeryContext mc(mod);
+	std::vector<mp_limb_t> bases(n * mc.limbs()), r(mc.limbs());
+	for (size_t i = 0; i < n; i++) {
+		mc.import(bases.data() + i * mc.limbs(), b[i]);
+	}
+	mc.pow_product(r.data(), bases.data(), e, n, pool);
+	mc.to_mpz(ret, r.data());
+}
+
+void fbdbpowmod_init(const mpz_t b1, const mpz_t b2, const mpz_t mod, size_t) {
+	m_db = std::make_unique<DoubleBasePowmod>(b1, b2, mod);
+}
+
+void fbdbpowmod(mpz_t ret, const mpz_t e1, const mpz_t e2) {
+	m_db->pow(ret, e1, e2);
+}
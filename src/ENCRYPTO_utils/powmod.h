@@ -20,17 +20,190 @@
 #define _POWMOD_H_
 
 #include <gmp.h>
+#include <cstddef>
+#include <vector>
 
-extern mpz_t* m_table_g;
-extern mpz_t* m_table_h;
-extern mpz_t* m_prod;
-extern mpz_t m_mod;
-extern size_t m_numberOfElements_g;
-extern size_t m_numberOfElements_h;
+class thread_pool;
+
+/**
+ * Arithmetic modulo mod on values of limbs() limbs in Montgomery form x*R mod mod, with
+ * R = 2^(limbs()*GMP_NUMB_BITS), using mpn_ primitives. Values stay in this form across any number
+ * of operations and are only converted by import() and to_mpz(), which saves the division of
+ * mpz_mod in every step. Even moduli have no Montgomery form, their values are kept as they are
+ * and reduced with divisions.
+ * The scratch space tmp of the operations holds tmp_limbs() limbs. Instances are not modified after
+ * their construction, thus one instance may be shared by multiple threads.
+ */
+class MontgomeryContext {
+public:
+	explicit MontgomeryContext(const mpz_t mod);
+	~MontgomeryContext();
+
+	MontgomeryContext(const MontgomeryContext&) = delete;
+	MontgomeryContext& operator=(const MontgomeryContext&) = delete;
+
+	size_t limbs() const {
+		return m_nLimbs;
+	}
+	//2*limbs() for products, another limbs() + 1 for the quotient of plain reductions
+	size_t tmp_limbs() const {
+		return 3 * m_nLimbs + 1;
+	}
+	mpz_srcptr get_mod() const {
+		return m_zMod;
+	}
+	//1 in the internal representation
+	const mp_limb_t* one() const {
+		return m_vOne.data();
+	}
+
+	//r = a*b mod mod. r may alias a or b
+	void mul(mp_limb_t* r, const mp_limb_t* a, const mp_limb_t* b, mp_limb_t* tmp) const;
+	void sqr(mp_limb_t* r, const mp_limb_t* a, mp_limb_t* tmp) const;
+	//r = the 2*limbs() limbs at tmp reduced modulo mod and divided by R for Montgomery form
+	void reduce(mp_limb_t* r, mp_limb_t* tmp) const;
+
+	//r = x in the internal representation, for any x
+	void import(mp_limb_t* r, const mpz_t x) const;
+	//res = the value of a
+	void to_mpz(mpz_t res, const mp_limb_t* a) const;
+
+	//r = a^e mod mod for e >= 0 with sliding windows
+	void pow(mp_limb_t* r, const mp_limb_t* a, const mpz_t e) const;
+
+	/**
+	 * r = prod bases[i]^exps[i] mod mod for the n values of limbs() limbs at bases and exponents
+	 * exps >= 0. All exponents share one chain of squarings: few bases use interleaved windows
+	 * (Straus) with a table of powers per base, many bases the bucket method of Pippenger, which
+	 * needs about one multiplication per base and window. The cheaper one is chosen from n and the
+	 * length of the exponents. With a pool, Straus splits the bases and Pippenger the windows
+	 * across its threads, otherwise everything runs on the calling thread.
+	 */
+	void pow_product(mp_limb_t* r, const mp_limb_t* bases, const mpz_t* exps, size_t n, thread_pool* pool = nullptr) const;
+
+private:
+	void pow_straus(mp_limb_t* r, const mp_limb_t* bases, const mpz_t* exps, size_t n, size_t bits, unsigned window) const;
+	void pow_pippenger(mp_limb_t* r, const mp_limb_t* bases, const mpz_t* exps, size_t n, size_t bits, unsigned window,
+			thread_pool* pool) const;
+
+	mpz_t m_zMod;
+	size_t m_nLimbs;
+	bool m_bMontgomery;
+	mp_limb_t m_nInv; //-mod^-1 mod 2^GMP_NUMB_BITS
+	std::vector<mp_limb_t> m_vOne;
+	std::vector<mp_limb_t> m_vR2; //R^2 mod mod, such that mul(x, R^2) = x*R
+};
+
+/**
+ * Fixed-base exponentiation base^exp mod mod with a precomputed Lim-Lee comb table.
+ * The exponent bits are arranged in window rows of ceil(bitsize/window) bits, which are split
+ * into blocks columns. For every block the table holds the products of all subsets of the rows,
+ * such that pow() needs about bitsize/window multiplications and bitsize/(window*blocks)
+ * squarings, from a table of blocks*2^window elements.
+ * Odd moduli (e.g. the DGK n, the DJN n^2 and prime fields) are handled in Montgomery form with
+ * mpn_ primitives, even moduli with plain reductions.
+ * Instances are independent and pow() does not modify the table, thus several keys can be used
+ * at once and one instance may be shared by multiple threads.
+ */
+class FixedBasePowmod {
+public:
+	/**
+	 * precomputes the table of base modulo mod for exponents of up to bitsize bits.
+	 * window = 0 chooses the window size from bitsize, blocks has to be at least 1.
+	 */
+	FixedBasePowmod(const mpz_t base, const mpz_t mod, size_t bitsize, unsigned window = 0, unsigned blocks = 2);
+
+	/**
+	 * takes a table that get_table() of an instance with the same parameters returned, e.g. from a
+	 * key file, instead of computing it. table holds get_table_size() limbs.
+	 */
+	FixedBasePowmod(const mpz_t base, const mpz_t mod, size_t bitsize, unsigned window, unsigned blocks,
+			const mp_limb_t* table);
+	~FixedBasePowmod();
+
+	FixedBasePowmod(const FixedBasePowmod&) = delete;
+	FixedBasePowmod& operator=(const FixedBasePowmod&) = delete;
+
+	/**
+	 * result = base^exp mod mod. Exponents that are negative or longer than bitsize bits are
+	 * computed with mpz_powm instead.
+	 */
+	void pow(mpz_t result, const mpz_t exp) const;
+
+	size_t get_bitsize() const {
+		return m_nBitsize;
+	}
+	unsigned get_window() const {
+		return m_nWindow;
+	}
+
+	unsigned get_blocks() const {
+		return m_nBlocks;
+	}
+
+	//the precomputed table in the internal representation, get_table_size() limbs
+	const mp_limb_t* get_table() const {
+		return m_vTable.data();
+	}
+
+	size_t get_table_size() const {
+		return m_vTable.size();
+	}
+	//base reduced modulo mod
+	mpz_srcptr get_base() const {
+		return m_zBase;
+	}
+	mpz_srcptr get_mod() const {
+		return m_cMod.get_mod();
+	}
+
+private:
+	//sets the parameters and everything but the table
+	void init(const mpz_t base, size_t bitsize, unsigned window, unsigned blocks);
+
+	mp_limb_t* entry(size_t block, size_t subset) {
+		return m_vTable.data() + (block * (size_t(1) << m_nWindow) + subset) * m_nLimbs;
+	}
+	const mp_limb_t* entry(size_t block, size_t subset) const {
+		return m_vTable.data() + (block * (size_t(1) << m_nWindow) + subset) * m_nLimbs;
+	}
+
+	MontgomeryContext m_cMod;
+	mpz_t m_zBase;
+	size_t m_nBitsize;
+	unsigned m_nWindow; //number of rows, i.e. bits per table index
+	unsigned m_nBlocks;
+	size_t m_nRowBits; //ceil(bitsize / window)
+	size_t m_nBlockBits; //ceil(rowbits / blocks)
+	size_t m_nLimbs; //limbs of the modulus
+	std::vector<mp_limb_t> m_vTable; //blocks * 2^window entries of m_nLimbs limbs
+};
+
+/**
+ * Fixed-base double exponentiation b1^e1 * b2^e2 mod mod with the precomputed product b1*b2,
+ * i.e. Shamir's trick with one multiplication per bit. Instances are independent and pow() may be
+ * called from several threads at once.
+ */
+class DoubleBasePowmod {
+public:
+	DoubleBasePowmod(const mpz_t b1, const mpz_t b2, const mpz_t mod);
+	~DoubleBasePowmod();
+
+	DoubleBasePowmod(const DoubleBasePowmod&) = delete;
+	DoubleBasePowmod& operator=(const DoubleBasePowmod&) = delete;
+
+	//ret = b1^e1 * b2^e2 mod mod for non-negative exponents
+	void pow(mpz_t ret, const mpz_t e1, const mpz_t e2) const;
+
+private:
+	mpz_t m_zProd[3]; //b1, b2 and b1*b2
+	mpz_t m_zMod;
+};
 
 /**
  * initialize fixed base multiplication for a given base and a desired exponent bit size
  * identical functionality for either g or h
+ * these set process-wide FixedBasePowmod instances, use the class directly for multiple keys
  */
 void fbpowmod_init_g(const mpz_t base, const mpz_t mod, size_t bitsize);
 void fbpowmod_init_h(const mpz_t base, const mpz_t mod, size_t bitsize);
@@ -44,7 +217,7 @@ void fbpowmod_h(mpz_t result, const mpz_t exp);
 
 /**
  * fixed-base double base encryption
- * requires pre-computed product with fbdbpowmod_init
+ * requires pre-computed product with fbdbpowmod_init, which sets a process-wide DoubleBasePowmod
  */
 void fbdbpowmod(mpz_t ret, const mpz_t e1, const mpz_t e2);
 void fbdbpowmod_init(const mpz_t b1, const mpz_t b2, const mpz_t mod, size_t bitsize);
@@ -54,4 +227,11 @@ void fbdbpowmod_init(const mpz_t b1, const mpz_t b2, const mpz_t mod, size_t bit
  */
 void dbpowmod(mpz_t ret, const mpz_t b1, const mpz_t e1, const mpz_t b2, const mpz_t e2, const mpz_t mod);
 
+/**
+ * multi-exponentiation ret = b[0]^e[0] * ... * b[n-1]^e[n-1] mod mod for exponents e[i] >= 0, e.g.
+ * modulo the DGK n, the DJN n^2 or a prime. See MontgomeryContext::pow_product, which also avoids
+ * the conversion of the bases when these are reused.
+ */
+void multipowmod(mpz_t ret, const mpz_t* b, const mpz_t* e, size_t n, const mpz_t mod, thread_pool* pool = nullptr);
+
 #endif
@@ -21,23 +21,32 @@
 #include "rcvthread.h"
 #include "typedefs.h"
 #include "constants.h"
+#include "frame.h"
+#include "sndthread.h"
 #include "socket.h"
+#include <algorithm>
 #include <cassert>
+#include <chrono>
 #include <cstdlib>
+#include <cstring>
 #include <iostream>
 
 
 RcvThread::RcvThread(CSocket* sock, CLock *glock)
-	:rcvlock(glock),  mysock(sock), listeners()
+	:rcvlock(glock),  mysock(sock), credit_receiver(nullptr), listeners()
 {
 	listeners[ADMIN_CHANNEL].inuse = true;
 }
 
 RcvThread::~RcvThread() {
 	this->Wait();
-	for(size_t i = 0; i < listeners.size(); i++) {
-		flush_queue(i);
-	}
+	listeners.for_each([this](uint32_t channelid, rcv_task&) {
+		flush_queue(channelid);
+	});
+	partials.for_each([](uint32_t, partial_msg& partial) {
+		free(partial.msg->buf);
+		free(partial.msg);
+	});
 	//delete rcvlock;
 }
 
@@ -49,88 +58,354 @@ void RcvThread::setlock(CLock *glock) {
 	rcvlock = glock;
 }
 
-void RcvThread::flush_queue(uint8_t channelid) {
-	std::lock_guard<std::mutex> lock(listeners[channelid].rcv_buf_mutex);
-	while(!listeners[channelid].rcv_buf.empty()) {
-		rcv_ctx* tmp = listeners[channelid].rcv_buf.front();
+RcvThread::rcv_task& RcvThread::listener(uint32_t channelid) {
+	return listeners[channelid];
+}
+
+RcvThread::rcv_task& RcvThread::registered_listener(uint32_t channelid) const {
+	rcvlock->Lock();
+	rcv_task* task = listeners.find(channelid);
+	rcvlock->Unlock();
+	assert(task != nullptr);
+	return *task;
+}
+
+void RcvThread::flush_queue(uint32_t channelid) {
+	rcv_task& task = registered_listener(channelid);
+	std::lock_guard<std::mutex> lock(task.rcv_buf_mutex);
+	while(!task.rcv_buf.empty()) {
+		rcv_ctx* tmp = task.rcv_buf.front();
 		free(tmp->buf);
 		free(tmp);
-		listeners[channelid].rcv_buf.pop();
+		task.rcv_buf.pop();
 	}
+	task.queued_bytes = 0;
+	task.queued_msgs = 0;
 }
 
-void RcvThread::remove_listener(uint8_t channelid) {
+void RcvThread::remove_listener(uint32_t channelid) {
 	rcvlock->Lock();
-	if(listeners[channelid].inuse) {
-		listeners[channelid].fin_event->Set();
-		listeners[channelid].inuse = false;
+	rcv_task& task = listener(channelid);
+	if(task.inuse) {
+		task.fin_event->Set();
+		task.inuse = false;
 
 #ifdef DEBUG_RECEIVE_THREAD
 		std::cout << "Unsetting channel " << (uint32_t) channelid << std::endl;
 #endif
 	} else {
-		listeners[channelid].forward_notify_fin = true;
+		task.forward_notify_fin = true;
 	}
 	rcvlock->Unlock();
 
 }
 
+void RcvThread::release_listener(uint32_t channelid) {
+	std::lock_guard<CLock> lock(*rcvlock);
+	rcv_task* task = listeners.find(channelid);
+	if(task == nullptr || task->inuse || task->forward_notify_fin || channelid == ADMIN_CHANNEL) {
+		return;
+	}
+	bool drained;
+	{
+		std::lock_guard<std::mutex> buflock(task->rcv_buf_mutex);
+		drained = task->rcv_buf.empty();
+	}
+	if(drained) {
+		listeners.erase(channelid);
+		traffic.retire(channelid);
+	}
+}
+
 std::queue<rcv_ctx*>*
-RcvThread::add_listener(uint8_t channelid, CEvent* rcv_event, CEvent* fin_event) {
+RcvThread::add_listener(uint32_t channelid, CEvent* rcv_event, CEvent* fin_event) {
 	rcvlock->Lock();
 #ifdef DEBUG_RECEIVE_THREAD
 	std::cout << "Registering listener on channel " << (uint32_t) channelid << std::endl;
 #endif
+	rcv_task& task = listener(channelid);
 
-	if(listeners[channelid].inuse || channelid == ADMIN_CHANNEL) {
+	if(task.inuse || channelid == ADMIN_CHANNEL) {
 		std::cerr << "A listener has already been registered on channel " << (uint32_t) channelid << std::endl;
-		assert(!listeners[channelid].inuse);
+		assert(!task.inuse);
 		assert(channelid != ADMIN_CHANNEL);
 	}
 
-	//listeners[channelid].rcv_buf = rcv_buf;
-	listeners[channelid].rcv_event = rcv_event;
-	listeners[channelid].fin_event = fin_event;
-	listeners[channelid].inuse = true;
-//		assert(listeners[channelid].rcv_buf->empty());
+	//task.rcv_buf = rcv_buf;
+	task.rcv_event = rcv_event;
+	task.fin_event = fin_event;
+	task.inuse = true;
+//		assert(task.rcv_buf->empty());
 
 	//std::cout << "Successfully registered on channel " << (uint32_t) channelid << std::endl;
 
+	bool notify_fin = task.forward_notify_fin;
+	task.forward_notify_fin = false;
 	rcvlock->Unlock();
 
-	if(listeners[channelid].forward_notify_fin) {
-		listeners[channelid].forward_notify_fin = false;
+	if(notify_fin) {
 		remove_listener(channelid);
 	}
-	return &listeners[channelid].rcv_buf;
+	return &task.rcv_buf;
 }
 
-std::mutex& RcvThread::get_listener_mutex(uint8_t channelid)
+std::mutex& RcvThread::get_listener_mutex(uint32_t channelid)
 {
-	return listeners[channelid].rcv_buf_mutex;
+	return registered_listener(channelid).rcv_buf_mutex;
+}
+
+std::deque<posted_rcv>* RcvThread::get_posted_buffers(uint32_t channelid) {
+	return &registered_listener(channelid).posted;
+}
+
+
+void RcvThread::set_credit_receiver(SndThread* snder) {
+	credit_receiver = snder;
+}
+
+void RcvThread::account_dequeue(uint32_t channelid, uint64_t nbytes) {
+	rcv_task& task = registered_listener(channelid);
+	task.queued_bytes -= nbytes;
+	task.queued_msgs--;
+}
+
+uint64_t RcvThread::get_queued_bytes(uint32_t channelid) const {
+	return registered_listener(channelid).queued_bytes;
+}
+
+uint64_t RcvThread::get_queued_msgs(uint32_t channelid) const {
+	return registered_listener(channelid).queued_msgs;
+}
+
+uint64_t RcvThread::get_peak_queued_bytes(uint32_t channelid) const {
+	return registered_listener(channelid).peak_queued_bytes;
+}
+
+compression_stats RcvThread::get_decompression_stats(uint32_t channelid) {
+	rcv_task& task = registered_listener(channelid);
+	std::lock_guard<std::mutex> lock(task.rcv_buf_mutex);
+	return task.decompression;
+}
+
+traffic_counters RcvThread::get_traffic(uint32_t channelid) const {
+	return traffic.get(channelid);
+}
+
+traffic_counters RcvThread::get_total_traffic() const {
+	return traffic.total();
+}
+
+bool RcvThread::receive_extended_id(uint32_t* channelid) {
+	frame_id_decoder decoder;
+	bool done = false;
+	while(!done) {
+		uint8_t byte;
+		if(mysock->Receive(&byte, sizeof(byte)) != sizeof(byte) || !decoder.add(byte, &done)) {
+			return false;
+		}
+	}
+	*channelid = decoder.id;
+	return true;
+}
+
+rcv_ctx* RcvThread::receive_compressed(uint64_t complen, compression_stats& stats) {
+	compress_buf.resize(complen);
+	if(mysock->Receive(compress_buf.data(), complen) != complen) {
+		return nullptr;
+	}
+
+	auto start = std::chrono::steady_clock::now();
+	uint64_t rcvbytelen;
+	if(!zrle_decompressed_size(compress_buf.data(), complen, &rcvbytelen) || rcvbytelen == 0) {
+		return nullptr;
+	}
+	rcv_ctx* rcv_buf = (rcv_ctx*) malloc(sizeof(rcv_ctx));
+	rcv_buf->buf = (uint8_t*) malloc(rcvbytelen);
+	rcv_buf->rcvbytes = rcvbytelen;
+	if(rcv_buf->buf == nullptr || !zrle_decompress(compress_buf.data(), complen, rcv_buf->buf, rcvbytelen)) {
+		free(rcv_buf->buf);
+		free(rcv_buf);
+		return nullptr;
+	}
+	uint64_t elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now() - start).count();
+
+	stats.raw_bytes += rcvbytelen;
+	stats.wire_bytes += complen;
+	stats.cpu_ns += elapsed;
+	return rcv_buf;
 }
 
+bool RcvThread::receive_posted(uint32_t channelid, uint64_t len, uint64_t* received) {
+	*received = 0;
+	bool completed = false;
+	bool grant = false;
+	while(*received < len) {
+		uint8_t* dst;
+		uint64_t n;
+		{
+			std::lock_guard<CLock> lock(*rcvlock);
+			rcv_task* task = listeners.find(channelid);
+			if(task == nullptr) {
+				break;
+			}
+			std::lock_guard<std::mutex> buflock(task->rcv_buf_mutex);
+			if(task->posted.empty()) {
+				break;
+			}
+			posted_rcv& posted = task->posted.front();
+			dst = posted.buf + posted.filled;
+			n = std::min(len - *received, posted.size - posted.filled);
+			grant = posted.grant_credit;
+		}
+		//the channel only appends buffers, so the front one stays in place while the socket writes into it
+		if(mysock->Receive(dst, n) != n) {
+			return false;
+		}
+		*received += n;
+
+		std::lock_guard<CLock> lock(*rcvlock);
+		rcv_task* task = listeners.find(channelid);
+		if(task == nullptr) {
+			break;
+		}
+		std::lock_guard<std::mutex> buflock(task->rcv_buf_mutex);
+		posted_rcv& posted = task->posted.front();
+		posted.filled += n;
+		if(posted.filled == posted.size) {
+			task->posted.pop_front();
+			completed = true;
+		}
+	}
+	if(grant) {
+		grant_posted(channelid, *received);
+	}
+	if(completed) {
+		rcvlock->Lock();
+		rcv_task* task = listeners.find(channelid);
+		CEvent* rcv_event = task && task->inuse ? task->rcv_event : nullptr;
+		rcvlock->Unlock();
+		if(rcv_event) {
+			rcv_event->Set();
+		}
+	}
+	return true;
+}
+
+uint64_t RcvThread::fill_posted(rcv_task& task, const uint8_t* src, uint64_t len, bool* completed, bool* grant) {
+	uint64_t copied = 0;
+	while(copied < len && !task.posted.empty()) {
+		posted_rcv& posted = task.posted.front();
+		uint64_t n = std::min(len - copied, posted.size - posted.filled);
+		memcpy(posted.buf + posted.filled, src + copied, n);
+		posted.filled += n;
+		copied += n;
+		*grant = posted.grant_credit;
+		if(posted.filled == posted.size) {
+			task.posted.pop_front();
+			*completed = true;
+		}
+	}
+	return copied;
+}
+
+void RcvThread::grant_posted(uint32_t channelid, uint64_t nbytes) {
+	SndThread* snder = credit_receiver;
+	if(snder && nbytes > 0) {
+		snder->grant_credit(channelid, nbytes);
+	}
+}
+
+static void free_rcv_ctx(rcv_ctx* ctx) {
+	if(ctx) {
+		free(ctx->buf);
+		free(ctx);
+	}
+}
+
+rcv_ctx* RcvThread::receive_fragment(rcv_ctx* partial, uint64_t rcvbytelen, compression_stats& stats) {
+	uint64_t wirelen = rcvbytelen & FRAME_LEN_MASK;
+	rcv_ctx* frag = nullptr;
+	if(rcvbytelen & FRAME_FLAG_COMPRESSED) {
+		frag = receive_compressed(wirelen, stats);
+		if(frag == nullptr) {
+			free_rcv_ctx(partial);
+			return nullptr;
+		}
+		if(partial == nullptr) {
+			return frag;
+		}
+	}
+
+	if(partial == nullptr) {
+		partial = (rcv_ctx*) malloc(sizeof(rcv_ctx));
+		partial->buf = nullptr;
+		partial->rcvbytes = 0;
+	}
+	uint64_t fraglen = frag ? frag->rcvbytes : wirelen;
+	uint64_t offset = partial->rcvbytes;
+	uint8_t* buf = (uint8_t*) realloc(partial->buf, offset + fraglen);
+	if(buf == nullptr) {
+		free_rcv_ctx(frag);
+		free_rcv_ctx(partial);
+		return nullptr;
+	}
+	partial->buf = buf;
+	partial->rcvbytes = offset + fraglen;
+	if(frag) {
+		memcpy(partial->buf + offset, frag->buf, fraglen);
+		free_rcv_ctx(frag);
+	} else if(mysock->Receive(partial->buf + offset, wirelen) != wirelen) {
+		free_rcv_ctx(partial);
+		return nullptr;
+	}
+	return partial;
+}
+
+void RcvThread::handle_admin_msg(const std::vector<uint8_t>& msg) {
+	if(msg.size() == 1 + sizeof(uint32_t) + sizeof(uint64_t) && msg[0] == ADMIN_CREDIT) {
+		uint32_t channelid;
+		uint64_t nbytes;
+		memcpy(&channelid, msg.data() + 1, sizeof(uint32_t));
+		memcpy(&nbytes, msg.data() + 1 + sizeof(uint32_t), sizeof(uint64_t));
+		SndThread* snder = credit_receiver;
+		if(snder) {
+			snder->add_credit(channelid, nbytes);
+		}
+	}
+}
 
 void RcvThread::ThreadMain() {
-	uint8_t channelid;
+	uint8_t idbyte;
+	uint32_t channelid;
 	uint64_t rcvbytelen;
 	uint64_t rcv_len;
 	while(true) {
 		//std::cout << "Starting to receive data" << std::endl;
 		rcv_len = 0;
-		rcv_len += mysock->Receive(&channelid, sizeof(uint8_t));
+		rcv_len += mysock->Receive(&idbyte, sizeof(uint8_t));
 		rcv_len += mysock->Receive(&rcvbytelen, sizeof(uint64_t));
+		channelid = idbyte;
+		if(rcv_len == FRAME_HEADER_SIZE && idbyte == FRAME_ID_EXTENDED && !receive_extended_id(&channelid)) {
+			std::cerr << "Received a corrupt frame header" << std::endl;
+			return;
+		}
 
 		if(rcv_len > 0) {
 #ifdef DEBUG_RECEIVE_THREAD
 			std::cout << "Received value on channel " << (uint32_t) channelid << " with " << rcvbytelen <<
 					" bytes length (" << rcv_len << ")" << std::endl;
 #endif
+			traffic.add(channelid, frame_header_size(channelid) + (rcvbytelen & FRAME_LEN_MASK));
 
 			if(channelid == ADMIN_CHANNEL) {
 				std::vector<uint8_t> tmprcvbuf(rcvbytelen);
 				mysock->Receive(tmprcvbuf.data(), rcvbytelen);
 
+				if(rcvbytelen > 0 && tmprcvbuf[0] != ADMIN_FIN) {
+					handle_admin_msg(tmprcvbuf);
+					continue;
+				}
 				//TODO: Right now finish, can be used for other maintenance tasks
 				//std::cout << "Got message on Admin channel, shutting down" << std::endl;
 #ifdef DEBUG_RECEIVE_THREAD
@@ -142,23 +417,81 @@ void RcvThread::ThreadMain() {
 			if(rcvbytelen == 0) {
 				remove_listener(channelid);
 			} else {
-				rcv_ctx* rcv_buf = (rcv_ctx*) malloc(sizeof(rcv_ctx));
-				rcv_buf->buf = (uint8_t*) malloc(rcvbytelen);
-				rcv_buf->rcvbytes = rcvbytelen;
+				partial_msg* partial = partials.find(channelid);
+				if(partial == nullptr && !(rcvbytelen & FRAME_FLAG_COMPRESSED)) {
+					//raw payloads are read straight into the buffers the channel posted, only the rest is queued
+					uint64_t posted;
+					if(!receive_posted(channelid, rcvbytelen & FRAME_LEN_MASK, &posted)) {
+						std::cerr << "Receiving into a posted buffer failed on channel " << (uint32_t) channelid << std::endl;
+						return;
+					}
+					if(posted == (rcvbytelen & FRAME_LEN_MASK)) {
+						continue;
+					}
+					rcvbytelen -= posted;
+				}
 
-				mysock->Receive(rcv_buf->buf, rcvbytelen);
+				//fragments of a large message are reassembled before the message is queued
+				partial_msg frag = partial ? *partial : partial_msg{nullptr, {0, 0, 0}};
+				rcv_ctx* rcv_buf = receive_fragment(frag.msg, rcvbytelen, frag.decompression);
+				if(rcv_buf == nullptr) {
+					//the fragments received so far were released with it
+					if(partial) {
+						partials.erase(channelid);
+					}
+					std::cerr << "Received a corrupt message on channel " << (uint32_t) channelid << std::endl;
+					return;
+				}
+				if(rcvbytelen & FRAME_FLAG_MORE) {
+					partials[channelid] = {rcv_buf, frag.decompression};
+					continue;
+				}
+				if(partial) {
+					partials.erase(channelid);
+				}
+				compression_stats& decompression = frag.decompression;
+				rcvbytelen = rcv_buf->rcvbytes;
 				rcvlock->Lock();
+				//messages for channels that are not registered yet are queued until they are
+				rcv_task& task = listener(channelid);
+				bool notify = true;
+				bool grant = false;
+				uint64_t copied;
 
 				{
-					std::lock_guard<std::mutex> lock(listeners[channelid].rcv_buf_mutex);
-					listeners[channelid].rcv_buf.push(rcv_buf);
+					std::lock_guard<std::mutex> lock(task.rcv_buf_mutex);
+					task.decompression.raw_bytes += decompression.raw_bytes;
+					task.decompression.wire_bytes += decompression.wire_bytes;
+					task.decompression.cpu_ns += decompression.cpu_ns;
+					//buffers may have been posted while the message was received, or it was compressed
+					bool completed = false;
+					copied = fill_posted(task, rcv_buf->buf, rcvbytelen, &completed, &grant);
+					if(copied == rcvbytelen) {
+						free(rcv_buf->buf);
+						free(rcv_buf);
+						notify = completed;
+					} else {
+						if(copied > 0) {
+							rcv_buf->rcvbytes -= copied;
+							memmove(rcv_buf->buf, rcv_buf->buf + copied, rcv_buf->rcvbytes);
+						}
+						uint64_t queued = task.queued_bytes += rcv_buf->rcvbytes;
+						task.queued_msgs++;
+						if(queued > task.peak_queued_bytes) {
+							task.peak_queued_bytes = queued;
+						}
+						task.rcv_buf.push(rcv_buf);
+					}
 				}
 
-				bool cond = listeners[channelid].inuse;
+				CEvent* rcv_event = task.inuse && notify ? task.rcv_event : nullptr;
 				rcvlock->Unlock();
 
-				if(cond)
-					listeners[channelid].rcv_event->Set();
+				if(grant) {
+					grant_posted(channelid, copied);
+				}
+				if(rcv_event)
+					rcv_event->Set();
 			}
 		} else {
 			// We received 0 bytes, probably due to some major error. Just return.
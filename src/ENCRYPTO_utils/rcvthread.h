@@ -19,21 +19,35 @@
 #ifndef RCV_THREAD_H_
 #define RCV_THREAD_H_
 
+#include "channel_map.h"
+#include "compression.h"
 #include "constants.h"
 #include "thread.h"
-#include <array>
+#include "traffic.h"
+#include <atomic>
 #include <cstdint>
+#include <deque>
 #include <memory>
 #include <mutex>
 #include <queue>
+#include <vector>
 
 class CSocket;
+class SndThread;
 
 struct rcv_ctx {
 	uint8_t *buf;
 	uint64_t rcvbytes;
 };
 
+//a destination buffer registered ahead of the data, which the receiver thread fills without a staging copy
+struct posted_rcv {
+	uint8_t* buf;
+	uint64_t size;
+	uint64_t filled;
+	bool grant_credit; //the bytes are consumed once they are written, credit is granted by the receiver thread
+};
+
 
 
 class RcvThread: public CThread {
@@ -45,12 +59,37 @@ public:
 
     void setlock(CLock *glock);
 
-	void flush_queue(uint8_t channelid);
+	void flush_queue(uint32_t channelid);
+
+	void remove_listener(uint32_t channelid);
+
+	//drops the state of a channel that is no longer used, unless messages for it are still queued
+	void release_listener(uint32_t channelid);
+
+	std::queue<rcv_ctx*>* add_listener(uint32_t channelid, CEvent* rcv_event, CEvent* fin_event);
+	std::mutex& get_listener_mutex(uint32_t channelid);
 
-	void remove_listener(uint8_t channelid);
+	/**
+	 * Buffers posted by the channel, guarded by the listener mutex. Received data is written into them in order
+	 * while they are not full and the receive queue is empty. The channel may only append, the receiver thread
+	 * removes a buffer once it is full and then sets the receive event.
+	 */
+	std::deque<posted_rcv>* get_posted_buffers(uint32_t channelid);
 
-	std::queue<rcv_ctx*>* add_listener(uint8_t channelid, CEvent* rcv_event, CEvent* fin_event);
-	std::mutex& get_listener_mutex(uint8_t channelid);
+	//credit grants received from the other party are forwarded to snder
+	void set_credit_receiver(SndThread* snder);
+
+	//called by the channel after it removed nbytes from its receive queue
+	void account_dequeue(uint32_t channelid, uint64_t nbytes);
+
+	uint64_t get_queued_bytes(uint32_t channelid) const;
+	uint64_t get_queued_msgs(uint32_t channelid) const;
+	uint64_t get_peak_queued_bytes(uint32_t channelid) const;
+	compression_stats get_decompression_stats(uint32_t channelid);
+
+	//bytes and frames read from the socket per channel id, lock-free
+	traffic_counters get_traffic(uint32_t channelid) const;
+	traffic_counters get_total_traffic() const;
 
 	void ThreadMain();
 
@@ -64,11 +103,50 @@ private:
 		CEvent* fin_event;
 		bool inuse;
 		bool forward_notify_fin;
+		std::atomic<uint64_t> queued_bytes;
+		std::atomic<uint64_t> queued_msgs;
+		std::atomic<uint64_t> peak_queued_bytes;
+		compression_stats decompression; //guarded by rcv_buf_mutex
+		std::deque<posted_rcv> posted; //guarded by rcv_buf_mutex
 	};
 
+	//the listener of channelid, which is created if it does not exist yet. Requires rcvlock
+	rcv_task& listener(uint32_t channelid);
+
+	//the listener of channelid, which has to be registered
+	rcv_task& registered_listener(uint32_t channelid) const;
+
+	void handle_admin_msg(const std::vector<uint8_t>& msg);
+
+	//reads the varint id of an extended frame header, false if the connection failed or the encoding is invalid
+	bool receive_extended_id(uint32_t* channelid);
+
+	//reads a compressed payload of complen bytes from the socket and returns the decompressed message, nullptr on error
+	rcv_ctx* receive_compressed(uint64_t complen, compression_stats& stats);
+
+	//reads up to len bytes of a raw payload directly into the buffers posted on channelid and sets received, false on error
+	bool receive_posted(uint32_t channelid, uint64_t len, uint64_t* received);
+
+	//copies the beginning of a received message into the posted buffers of task and returns the number of copied bytes. Requires the listener mutex
+	uint64_t fill_posted(rcv_task& task, const uint8_t* src, uint64_t len, bool* completed, bool* grant);
+
+	void grant_posted(uint32_t channelid, uint64_t nbytes);
+
+	//reads the payload of a frame and appends it to partial, which may be nullptr for the first fragment. nullptr on error, partial is freed then
+	rcv_ctx* receive_fragment(rcv_ctx* partial, uint64_t rcvbytelen, compression_stats& stats);
+
 	CLock* rcvlock;
 	CSocket* mysock;
-	std::array<rcv_task, MAX_NUM_COMM_CHANNELS> listeners;
+	std::atomic<SndThread*> credit_receiver;
+	std::vector<uint8_t> compress_buf;
+	channel_map<rcv_task> listeners; //guarded by rcvlock, the entries themselves live until they are released
+	//a message whose remaining fragments have not been received yet
+	struct partial_msg {
+		rcv_ctx* msg;
+		compression_stats decompression;
+	};
+	channel_map<partial_msg> partials; //only accessed by the receiver thread
+	channel_traffic traffic;
 };
 
 
@@ -0,0 +1,621 @@
+/**
+ \file 		resume_transport.cpp
+ \copyright	ABY - A Framework for Efficient Mixed-protocol Secure Two-party Computation
+			Copyright (C) 2019 ENCRYPTO Group, TU Darmstadt
+			This program is free software: you can redistribute it and/or modify
+            it under the terms of the GNU Lesser General Public License as published
+            by the Free Software Foundation, either version 3 of the License, or
+            (at your option) any later version.
+            ABY is distributed in the hope that it will be useful,
+            but WITHOUT ANY WARRANTY; without even the implied warranty of
+            MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+            GNU Lesser General Public License for more details.
+            You should have received a copy of the GNU Lesser General Public License
+            along with this program. If not, see <http://www.gnu.org/licenses/>.
+ \brief		Connections that survive the loss of their TCP connection
+ */
+
+#include "resume_transport.h"
+#include "socket.h"
+#include "transport.h"
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <vector>
+
+#define RESUME_MAGIC 0x31535245 //"ERS1"
+#define RESUME_RECORD_SIZE (1 << 18) //maximum payload of a data record
+#define RESUME_MAX_BATCH 64 //records written in one SendV
+#define RESUME_POLL_MS 50 //how often idle threads check for closing and reconnecting parties
+#define RESUME_HELLO_MS 1000 //how long the listening party waits for the hello of a new connection before it accepts the next one
+#define RESUME_WRITE_FAILURE_MS 1000 //how long a failed write waits for the reader to see the end of the connection
+
+namespace {
+
+using resume_clock = std::chrono::steady_clock;
+
+/*
+ * Every record starts with [uint8_t type][uint64_t value][uint32_t len]:
+ * data records carry len bytes of the stream that start at offset value,
+ * acknowledgements carry the number of bytes the application consumed so far,
+ * a close record ends the session.
+ */
+enum record_type : uint8_t {
+	RECORD_DATA = 1,
+	RECORD_ACK = 2,
+	RECORD_CLOSE = 3
+};
+
+const size_t RECORD_HEADER_SIZE = sizeof(uint8_t) + sizeof(uint64_t) + sizeof(uint32_t);
+const size_t HELLO_SIZE = sizeof(uint32_t) + 3 * sizeof(uint64_t);
+
+using record_header = std::array<uint8_t, RECORD_HEADER_SIZE>;
+
+// sent by both parties on every new connection, the connecting party first
+struct hello {
+	uint64_t session;
+	uint64_t rcv_next; //bytes of the stream received so far, the other party continues from there
+	uint64_t max_unacked;
+};
+
+record_header make_record_header(record_type type, uint64_t value, uint32_t len) {
+	record_header header;
+	header[0] = type;
+	memcpy(header.data() + sizeof(uint8_t), &value, sizeof(value));
+	memcpy(header.data() + sizeof(uint8_t) + sizeof(uint64_t), &len, sizeof(len));
+	return header;
+}
+
+int remaining_ms(resume_clock::time_point deadline) {
+	auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - resume_clock::now()).count();
+	return static_cast<int>(std::max<int64_t>(remaining, 0));
+}
+
+bool send_hello(CSocket& sock, const hello& h) {
+	uint8_t buf[HELLO_SIZE];
+	uint32_t magic = RESUME_MAGIC;
+	memcpy(buf, &magic, sizeof(magic));
+	memcpy(buf + sizeof(uint32_t), &h.session, sizeof(uint64_t));
+	memcpy(buf + sizeof(uint32_t) + sizeof(uint64_t), &h.rcv_next, sizeof(uint64_t));
+	memcpy(buf + sizeof(uint32_t) + 2 * sizeof(uint64_t), &h.max_unacked, sizeof(uint64_t));
+	return sock.Send(buf, HELLO_SIZE) == HELLO_SIZE;
+}
+
+// timeout of the first handshake, a timeout_ms of 0 waits without a deadline as in Connect and Listen
+int hello_timeout(const connection_options& options) {
+	return options.timeout_ms == 0 ? -1 : static_cast<int>(options.timeout_ms);
+}
+
+bool receive_hello(CSocket& sock, hello* h, int timeout_ms) {
+	uint8_t buf[HELLO_SIZE];
+	uint32_t magic;
+	if (!sock.Poll(timeout_ms) || sock.Receive(buf, HELLO_SIZE) != HELLO_SIZE) {
+		return false;
+	}
+	memcpy(&magic, buf, sizeof(magic));
+	memcpy(&h->session, buf + sizeof(uint32_t), sizeof(uint64_t));
+	memcpy(&h->rcv_next, buf + sizeof(uint32_t) + sizeof(uint64_t), sizeof(uint64_t));
+	memcpy(&h->max_unacked, buf + sizeof(uint32_t) + 2 * sizeof(uint64_t), sizeof(uint64_t));
+	return magic == RESUME_MAGIC && h->max_unacked > 0;
+}
+
+/**
+ * A writer thread sends data records from the retransmit buffer and acknowledgements, and
+ * re-establishes the connection when it broke. A reader thread moves received data into the
+ * receive queue and releases acknowledged data from the retransmit buffer.
+ */
+class ResumableTransport : public CTransport {
+public:
+	ResumableTransport(std::unique_ptr<CSocket> sock, std::unique_ptr<CSocket> listener, const std::string& address,
+			uint16_t port, uint64_t session, uint64_t peer_max_unacked, const resume_options& options, bool verbose)
+		: address_(address), port_(port), options_(options), verbose_(verbose), session_(session),
+		listener_(std::move(listener)), sock_(std::move(sock)),
+		socket_options_(options.connection.socket), peer_max_unacked_(peer_max_unacked)
+	{
+		record_size_ = std::max<uint64_t>(std::min<uint64_t>(RESUME_RECORD_SIZE, options_.max_unacked_bytes / 2), 1);
+		writer_ = std::thread([this] { WriterMain(); });
+		reader_ = std::thread([this] { ReaderMain(); });
+	}
+
+	~ResumableTransport() override {
+		Close();
+	}
+
+	size_t Send(const void* buf, size_t bytes) override {
+		iovec iov = {const_cast<void*>(buf), bytes};
+		return SendV(&iov, 1);
+	}
+
+	size_t SendV(const iovec* iov, int iovcnt) override {
+		size_t sent = 0;
+		for (int i = 0; i < iovcnt; i++) {
+			const uint8_t* src = static_cast<const uint8_t*>(iov[i].iov_base);
+			for (size_t offset = 0; offset < iov[i].iov_len;) {
+				size_t len = std::min<size_t>(iov[i].iov_len - offset, record_size_);
+				std::unique_lock<std::mutex> lock(mtx_);
+				state_cv_.wait(lock, [this, len] {
+					uint64_t unacked = snd_next_ - snd_acked_;
+					return failed_ || unacked == 0 || unacked + len <= options_.max_unacked_bytes;
+				});
+				if (failed_) {
+					return sent;
+				}
+				unacked_.push_back({snd_next_, std::vector<uint8_t>(src + offset, src + offset + len)});
+				snd_next_ += len;
+				lock.unlock();
+				writer_cv_.notify_one();
+				offset += len;
+				sent += len;
+			}
+		}
+		return sent;
+	}
+
+	std::string GetIP() const override {
+		return current()->GetIP();
+	}
+
+	uint16_t GetPort() const override {
+		return current()->GetPort();
+	}
+
+	// kept for the connections that replace the current one
+	void SetOptions(const socket_options& options) override {
+		std::shared_ptr<CSocket> sock;
+		{
+			std::lock_guard<std::mutex> lock(mtx_);
+			socket_options_ = options;
+			sock = sock_;
+		}
+		sock->SetOptions(options);
+	}
+
+	size_t Receive(void* buf, size_t bytes) override {
+		uint8_t* dst = static_cast<uint8_t*>(buf);
+		size_t received = 0;
+		std::unique_lock<std::mutex> lock(mtx_);
+		while (received < bytes) {
+			state_cv_.wait(lock, [this] { return !rcvq_.empty() || reader_done_ || failed_; });
+			if (rcvq_.empty()) {
+				break;
+			}
+			// only this thread removes blocks, the reader may append while the front one is copied
+			std::vector<uint8_t>& front = rcvq_.front();
+			size_t n = std::min(bytes - received, front.size() - rcv_front_offset_);
+			lock.unlock();
+			memcpy(dst + received, front.data() + rcv_front_offset_, n);
+			lock.lock();
+			received += n;
+			rcv_front_offset_ += n;
+			if (rcv_front_offset_ == front.size()) {
+				rcvq_.pop_front();
+				rcv_front_offset_ = 0;
+			}
+			consumed_ += n;
+			// the sender blocks once it has peer_max_unacked_ bytes in flight, acknowledge well before
+			if (consumed_ - ack_sent_ >= peer_max_unacked_ / 4) {
+				ack_sent_ = consumed_;
+				ack_pending_ = true;
+				writer_cv_.notify_one();
+			}
+		}
+		return received;
+	}
+
+	bool Poll(int timeout_ms) override {
+		std::unique_lock<std::mutex> lock(mtx_);
+		auto ready = [this] { return !rcvq_.empty() || reader_done_ || failed_; };
+		if (timeout_ms < 0) {
+			state_cv_.wait(lock, ready);
+			return true;
+		}
+		return state_cv_.wait_for(lock, std::chrono::milliseconds(timeout_ms), ready);
+	}
+
+	void Close() override {
+		{
+			std::lock_guard<std::mutex> lock(mtx_);
+			if (closing_) {
+				return;
+			}
+			closing_ = true;
+		}
+		// the writer sends the data still buffered and the close record first
+		writer_cv_.notify_all();
+		state_cv_.notify_all();
+		writer_.join();
+		// the reader stops at the end of the connection
+		sock_->Shutdown();
+		reader_.join();
+		sock_->Close();
+		if (listener_) {
+			listener_->Close();
+		}
+	}
+
+private:
+	std::shared_ptr<CSocket> current() const {
+		std::lock_guard<std::mutex> lock(mtx_);
+		return sock_;
+	}
+
+	struct chunk {
+		uint64_t seq;
+		std::vector<uint8_t> data;
+	};
+
+	// a failure of the connection with number gen, requires mtx_
+	void mark_broken(uint64_t gen) {
+		if (gen != gen_ || failed_) {
+			return;
+		}
+		if (peer_closed_) {
+			// the other party is gone, the failure ends the session
+			failed_ = true;
+		} else {
+			broken_ = true;
+		}
+		state_cv_.notify_all();
+		writer_cv_.notify_one();
+	}
+
+	// removes data the other party has consumed or already received from the retransmit buffer, requires mtx_
+	void release(uint64_t offset) {
+		if (offset <= snd_acked_) {
+			return;
+		}
+		snd_acked_ = offset;
+		while (!unacked_.empty() && unacked_.front().seq + unacked_.front().data.size() <= offset) {
+			unacked_.pop_front();
+		}
+		state_cv_.notify_all();
+	}
+
+	// a new connection, established by this party or offered on the listener, replaces the current one
+	bool Reconnect(std::unique_ptr<CSocket> offered) {
+		auto begin = resume_clock::now();
+		auto deadline = begin + std::chrono::milliseconds(options_.reconnect_timeout_ms);
+		bool accepted_only = offered != nullptr;
+		while (true) {
+			std::unique_ptr<CSocket> sock = std::move(offered);
+			if (!sock) {
+				int remaining = remaining_ms(deadline);
+				if (remaining == 0) {
+					return false;
+				}
+				if (listener_) {
+					sock = listener_->Accept(remaining);
+				} else {
+					connection_options connection = options_.connection;
+					connection.timeout_ms = remaining;
+					{
+						std::lock_guard<std::mutex> lock(mtx_);
+						connection.socket = socket_options_;
+					}
+					sock = Connect(address_, port_, connection);
+				}
+				if (!sock) {
+					continue;
+				}
+			}
+
+			hello mine, peer;
+			{
+				std::lock_guard<std::mutex> lock(mtx_);
+				mine = {session_, rcv_next_, options_.max_unacked_bytes};
+			}
+			int timeout = std::max(remaining_ms(deadline), RESUME_POLL_MS);
+			bool ok;
+			if (listener_) {
+				// a stray connection, e.g. of a port scan, does not hold up the one of the other party.
+				// The connecting party waits longer, its hello may be queued behind such a connection
+				timeout = std::min(timeout, RESUME_HELLO_MS);
+				ok = receive_hello(*sock, &peer, timeout) && peer.session == session_ && send_hello(*sock, mine);
+			} else {
+				ok = send_hello(*sock, mine) && receive_hello(*sock, &peer, timeout) && peer.session == session_;
+			}
+			if (!ok) {
+				if (verbose_) {
+					std::cerr << "resumable session: handshake on a new connection failed\n";
+				}
+				// a connection offered while the current one works does not replace it
+				if (accepted_only) {
+					return true;
+				}
+				continue;
+			}
+
+			std::lock_guard<std::mutex> lock(mtx_);
+			if (peer.rcv_next < snd_acked_ || peer.rcv_next > snd_next_) {
+				std::cerr << "resumable session: the other party resumes at an offset that is no longer buffered\n";
+				return false;
+			}
+			// what the other party received before the connection broke is not sent again
+			release(peer.rcv_next);
+			if (verbose_) {
+				std::cerr << "resumable session: reconnected after " << std::chrono::duration_cast<std::chrono::milliseconds>(
+					resume_clock::now() - begin).count() << " ms, resending " << snd_next_ - peer.rcv_next << " bytes\n";
+			}
+			write_pos_ = peer.rcv_next;
+			peer_max_unacked_ = peer.max_unacked;
+			// wakes up a reader still blocked on the old connection
+			sock_->Shutdown();
+			sock_ = std::move(sock);
+			// options set on the session after the listener was created apply to accepted connections as well
+			sock_->SetOptions(socket_options_);
+			gen_++;
+			broken_ = false;
+			state_cv_.notify_all();
+			return true;
+		}
+	}
+
+	void WriterMain() {
+		std::vector<record_header> headers;
+		std::vector<iovec> iovs;
+		headers.reserve(RESUME_MAX_BATCH + 2);
+		std::unique_lock<std::mutex> lock(mtx_);
+		while (true) {
+			auto work = [this] { return broken_ || failed_ || ack_pending_ || write_pos_ < snd_next_ || closing_; };
+			if (listener_) {
+				// while idle, the listener is checked for a reconnecting party whose old connection broke unnoticed here
+				if (!writer_cv_.wait_for(lock, std::chrono::milliseconds(RESUME_POLL_MS), work)) {
+					lock.unlock();
+					auto offered = listener_->Accept(0);
+					bool ok = !offered || Reconnect(std::move(offered));
+					lock.lock();
+					if (!ok) {
+						failed_ = true;
+						state_cv_.notify_all();
+						break;
+					}
+					continue;
+				}
+			} else {
+				writer_cv_.wait(lock, work);
+			}
+			if (failed_) {
+				break;
+			}
+			if (broken_) {
+				lock.unlock();
+				bool ok = Reconnect(nullptr);
+				lock.lock();
+				if (!ok) {
+					failed_ = true;
+					state_cv_.notify_all();
+					break;
+				}
+				continue;
+			}
+
+			// a batch of records: the acknowledgement, data from write_pos_ on and the close record once everything was sent
+			headers.clear();
+			iovs.clear();
+			size_t total = 0;
+			if (ack_pending_) {
+				headers.push_back(make_record_header(RECORD_ACK, ack_sent_, 0));
+				iovs.push_back({headers.back().data(), RECORD_HEADER_SIZE});
+				total += RECORD_HEADER_SIZE;
+				ack_pending_ = false;
+			}
+			uint64_t pos = write_pos_;
+			for (auto& c : unacked_) {
+				if (headers.size() >= RESUME_MAX_BATCH || total >= (1 << 20)) {
+					break;
+				}
+				if (c.seq + c.data.size() <= pos) {
+					continue;
+				}
+				// the reader never releases data that was not written yet, so the chunk stays while it is written
+				uint64_t offset = pos - c.seq;
+				uint32_t len = static_cast<uint32_t>(c.data.size() - offset);
+				headers.push_back(make_record_header(RECORD_DATA, pos, len));
+				iovs.push_back({headers.back().data(), RECORD_HEADER_SIZE});
+				iovs.push_back({c.data.data() + offset, len});
+				total += RECORD_HEADER_SIZE + len;
+				pos += len;
+			}
+			bool close = closing_ && pos == snd_next_;
+			if (close) {
+				headers.push_back(make_record_header(RECORD_CLOSE, 0, 0));
+				iovs.push_back({headers.back().data(), RECORD_HEADER_SIZE});
+				total += RECORD_HEADER_SIZE;
+			}
+			std::shared_ptr<CSocket> sock = sock_;
+			uint64_t gen = gen_;
+			lock.unlock();
+			bool ok = sock->SendV(iovs.data(), static_cast<int>(iovs.size())) == total;
+			lock.lock();
+
+			if (ok) {
+				write_pos_ = pos;
+				if (close) {
+					break;
+				}
+				continue;
+			}
+			// the reader decides whether the other party closed the session or the connection broke
+			if (!state_cv_.wait_for(lock, std::chrono::milliseconds(RESUME_WRITE_FAILURE_MS),
+					[&] { return broken_ || failed_ || gen_ != gen || reader_done_; })) {
+				mark_broken(gen);
+			}
+			if (reader_done_ && !failed_) {
+				failed_ = true;
+				state_cv_.notify_all();
+			}
+		}
+	}
+
+	// reads records until the connection ends, true if it ended with a close record
+	bool ReadRecords(CSocket& sock) {
+		std::vector<uint8_t> payload;
+		while (true) {
+			if (!sock.Poll(RESUME_POLL_MS)) {
+				std::lock_guard<std::mutex> lock(mtx_);
+				if (closing_) {
+					return false;
+				}
+				continue;
+			}
+			record_header header;
+			if (sock.Receive(header.data(), RECORD_HEADER_SIZE) != RECORD_HEADER_SIZE) {
+				return false;
+			}
+			uint64_t value;
+			uint32_t len;
+			memcpy(&value, header.data() + sizeof(uint8_t), sizeof(value));
+			memcpy(&len, header.data() + sizeof(uint8_t) + sizeof(uint64_t), sizeof(len));
+
+			if (header[0] == RECORD_CLOSE) {
+				return true;
+			} else if (header[0] == RECORD_ACK) {
+				std::lock_guard<std::mutex> lock(mtx_);
+				release(std::min(value, snd_next_));
+				continue;
+			} else if (header[0] != RECORD_DATA) {
+				std::cerr << "resumable session: received a corrupt record\n";
+				return false;
+			}
+
+			// the other party never sends larger records, the length is not trusted for an allocation
+			if (len > RESUME_RECORD_SIZE) {
+				std::cerr << "resumable session: received a corrupt record\n";
+				return false;
+			}
+			payload.resize(len);
+			if (sock.Receive(payload.data(), len) != len) {
+				return false;
+			}
+			std::lock_guard<std::mutex> lock(mtx_);
+			if (value > rcv_next_) {
+				std::cerr << "resumable session: data is missing in the stream\n";
+				return false;
+			}
+			// records resent after a reconnect may overlap what was received before
+			uint64_t duplicate = std::min<uint64_t>(rcv_next_ - value, len);
+			if (duplicate == len) {
+				continue;
+			}
+			rcvq_.emplace_back(payload.begin() + duplicate, payload.end());
+			rcv_next_ += len - duplicate;
+			state_cv_.notify_all();
+		}
+	}
+
+	void ReaderMain() {
+		std::unique_lock<std::mutex> lock(mtx_);
+		while (true) {
+			state_cv_.wait(lock, [this] { return !broken_ || failed_ || closing_; });
+			if (failed_ || closing_) {
+				break;
+			}
+			std::shared_ptr<CSocket> sock = sock_;
+			uint64_t gen = gen_;
+			lock.unlock();
+			bool closed = ReadRecords(*sock);
+			lock.lock();
+			if (closed) {
+				peer_closed_ = true;
+				break;
+			}
+			if (closing_) {
+				break;
+			}
+			if (verbose_ && gen == gen_) {
+				std::cerr << "resumable session: connection lost, reconnecting\n";
+			}
+			mark_broken(gen);
+			state_cv_.wait(lock, [&] { return gen_ != gen || failed_ || closing_; });
+		}
+		reader_done_ = true;
+		state_cv_.notify_all();
+		writer_cv_.notify_one();
+	}
+
+	const std::string address_;
+	const uint16_t port_;
+	const resume_options options_;
+	const bool verbose_;
+	const uint64_t session_;
+	uint64_t record_size_;
+	std::unique_ptr<CSocket> listener_; //only on the listening side, used by the writer thread
+
+	mutable std::mutex mtx_;
+	std::condition_variable writer_cv_; //work for the writer thread
+	std::condition_variable state_cv_; //received data, released buffer space, reconnects and failures
+	std::shared_ptr<CSocket> sock_; //the current connection, replaced by the writer thread
+	socket_options socket_options_; //applied to every new connection, changed by SetOptions
+	uint64_t gen_ = 0; //number of the current connection
+	bool broken_ = false; //the current connection failed, the writer thread reconnects
+	bool failed_ = false; //the session ended because reconnecting failed
+	bool closing_ = false;
+	bool peer_closed_ = false;
+	bool reader_done_ = false;
+
+	std::deque<chunk> unacked_; //the retransmit buffer, sent data that the other party did not consume yet
+	uint64_t snd_acked_ = 0; //stream offset of the first byte that was not acknowledged
+	uint64_t snd_next_ = 0; //stream offset of the next byte to send
+	uint64_t write_pos_ = 0; //stream offset up to which data was written to the current connection
+	uint64_t peer_max_unacked_;
+
+	std::deque<std::vector<uint8_t>> rcvq_;
+	size_t rcv_front_offset_ = 0;
+	uint64_t rcv_next_ = 0; //stream offset of the next byte expected from the other party
+	uint64_t consumed_ = 0; //bytes returned by Receive
+	uint64_t ack_sent_ = 0;
+	bool ack_pending_ = false;
+
+	std::thread writer_;
+	std::thread reader_;
+};
+
+} // namespace
+
+std::unique_ptr<CSocket> ConnectResumable(const std::string& address, uint16_t port, const resume_options& options,
+		bool verbose) {
+	auto sock = Connect(address, port, options.connection);
+	if (!sock) {
+		return nullptr;
+	}
+	std::random_device rd;
+	hello mine = {std::uniform_int_distribution<uint64_t>()(rd), 0, options.max_unacked_bytes};
+	mine.session |= 1; // 0 is never a valid session
+	hello peer;
+	if (!send_hello(*sock, mine) || !receive_hello(*sock, &peer, hello_timeout(options.connection))
+			|| peer.session != mine.session) {
+		std::cerr << "resumable session: handshake failed\n";
+		return nullptr;
+	}
+	return std::make_unique<CSocket>(std::make_unique<ResumableTransport>(std::move(sock), nullptr, address, port,
+		mine.session, peer.max_unacked, options, verbose), verbose);
+}
+
+std::unique_ptr<CSocket> ListenResumable(const std::string& address, uint16_t port, const resume_options& options,
+		bool verbose) {
+	auto listener = std::make_unique<CSocket>(options.connection.type, verbose);
+	listener->SetOptions(options.connection.socket);
+	if (!listener->Bind(address, port) || !listener->Listen()) {
+		return nullptr;
+	}
+	auto sock = listener->Accept();
+	hello peer;
+	if (!sock || !receive_hello(*sock, &peer, hello_timeout(options.connection))) {
+		std::cerr << "resumable session: handshake failed\n";
+		return nullptr;
+	}
+	hello mine = {peer.session, 0, options.max_unacked_bytes};
+	if (!send_hello(*sock, mine)) {
+		return nullptr;
+	}
+	return std::make_unique<CSocket>(std::make_unique<ResumableTransport>(std::move(sock), std::move(listener),
+		address, port, peer.session, peer.max_unacked, options, verbose), verbose);
+}
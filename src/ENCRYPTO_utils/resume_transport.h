@@ -0,0 +1,52 @@
+/**
+ \file 		resume_transport.h
+ \copyright	ABY - A Framework for Efficient Mixed-protocol Secure Two-party Computation
+			Copyright (C) 2019 ENCRYPTO Group, TU Darmstadt
+			This program is free software: you can redistribute it and/or modify
+            it under the terms of the GNU Lesser General Public License as published
+            by the Free Software Foundation, either version 3 of the License, or
+            (at your option) any later version.
+            ABY is distributed in the hope that it will be useful,
+            but WITHOUT ANY WARRANTY; without even the implied warranty of
+            MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+            GNU Lesser General Public License for more details.
+            You should have received a copy of the GNU Lesser General Public License
+            along with this program. If not, see <http://www.gnu.org/licenses/>.
+ \brief		Connections that survive the loss of their TCP connection
+ */
+
+#ifndef RESUME_TRANSPORT_H_
+#define RESUME_TRANSPORT_H_
+
+#include "connection.h"
+#include <cstdint>
+#include <memory>
+#include <string>
+
+class CSocket;
+
+struct resume_options {
+	connection_options connection; //used for the first connection and for every reconnect
+	uint64_t max_unacked_bytes = 64 << 20; //bound of the retransmit buffer, Send blocks while it is full
+	uint32_t reconnect_timeout_ms = 10000; //the session fails if no new connection was established within this time
+};
+
+/**
+ * A resumable session is an ordered byte stream on top of a sequence of TCP connections. Sent data
+ * is carried in sequence-numbered records and kept in a retransmit buffer until the receiving
+ * application consumed it. If the connection breaks, the connecting party reconnects using the
+ * connection helpers, both parties exchange how much they received and the missing data is sent
+ * again. A network outage thus stalls the stream for a reconnect instead of ending it, e.g. an
+ * SndThread/RcvThread pair and its channels on top of it continue unchanged.
+ *
+ * The listening party keeps its listening socket open for the lifetime of the session. Sessions
+ * copy all sent data into the retransmit buffer and all received data into a receive queue, which
+ * is read by a background thread. Only the TCP transports are supported. Receive returns fewer
+ * bytes than requested once the other party closed the session or reconnecting failed.
+ */
+std::unique_ptr<CSocket> ConnectResumable(const std::string& address, uint16_t port, const resume_options& options,
+		bool verbose = false);
+std::unique_ptr<CSocket> ListenResumable(const std::string& address, uint16_t port, const resume_options& options,
+		bool verbose = false);
+
+#endif /* RESUME_TRANSPORT_H_ */
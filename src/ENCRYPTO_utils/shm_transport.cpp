@@ -0,0 +1,373 @@
+/**
+ \file 		shm_transport.cpp
+ \copyright	ABY - A Framework for Efficient Mixed-protocol Secure Two-party Computation
+			Copyright (C) 2019 ENCRYPTO Group, TU Darmstadt
+			This program is free software: you can redistribute it and/or modify
+            it under the terms of the GNU Lesser General Public License as published
+            by the Free Software Foundation, either version 3 of the License, or
+            (at your option) any later version.
+            ABY is distributed in the hope that it will be useful,
+            but WITHOUT ANY WARRANTY; without even the implied warranty of
+            MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+            GNU Lesser General Public License for more details.
+            You should have received a copy of the GNU Lesser General Public License
+            along with this program. If not, see <http://www.gnu.org/licenses/>.
+ \brief		Shared-memory transport for parties on the same host
+ */
+
+#include "shm_transport.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <csignal>
+#include <cstring>
+#include <iostream>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+// number of polls before a waiting side goes to sleep, keeps the latency of ping-pong patterns low
+#define SHM_SPIN_ITERATIONS 4000
+
+// single producer, single consumer byte ring for one direction of a connection
+struct shm_ring {
+	alignas(64) std::atomic<uint64_t> head; // total bytes written
+	alignas(64) std::atomic<uint64_t> tail; // total bytes read
+	alignas(64) std::atomic<uint32_t> data_seq; // futex word, bumped after every write
+	std::atomic<uint32_t> data_waiting;
+	alignas(64) std::atomic<uint32_t> space_seq; // futex word, bumped after every read
+	std::atomic<uint32_t> space_waiting;
+	std::atomic<uint32_t> closed;
+	alignas(64) uint8_t data[SHM_RING_SIZE];
+};
+
+struct shm_connection {
+	shm_ring rings[2]; // [0]: connecting to accepting side, [1]: accepting to connecting side
+};
+
+enum shm_slot_state : uint32_t { SHM_SLOT_PENDING = 0, SHM_SLOT_READY = 1, SHM_SLOT_FAILED = 2 };
+
+struct shm_control {
+	std::atomic<int32_t> owner; // pid of the listening process, 0 while it is being created
+	std::atomic<uint32_t> next_slot;
+	std::atomic<uint32_t> ready_seq;
+	std::atomic<uint32_t> ready_waiting;
+	std::atomic<uint32_t> ready[SHM_MAX_CONNECTIONS];
+};
+
+// the segments are zero-filled by ftruncate, which is a valid initial state for lock-free atomics
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "shared-memory transport requires lock-free atomics");
+static_assert(std::atomic<uint32_t>::is_always_lock_free, "shared-memory transport requires lock-free atomics");
+static_assert(std::atomic<int32_t>::is_always_lock_free, "shared-memory transport requires lock-free atomics");
+
+// sleeps while *addr == expected, at most timeout_ms if it is not negative
+static void futex_wait(std::atomic<uint32_t>* addr, uint32_t expected, int64_t timeout_ms) {
+#ifdef __linux__
+	timespec ts;
+	ts.tv_sec = timeout_ms / 1000;
+	ts.tv_nsec = (timeout_ms % 1000) * 1000000;
+	syscall(SYS_futex, reinterpret_cast<uint32_t*>(addr), FUTEX_WAIT, expected,
+			timeout_ms < 0 ? nullptr : &ts, nullptr, 0);
+#else
+	auto start = std::chrono::steady_clock::now();
+	while (addr->load() == expected && (timeout_ms < 0 ||
+			std::chrono::steady_clock::now() - start < std::chrono::milliseconds(timeout_ms))) {
+		usleep(10);
+	}
+#endif
+}
+
+static void futex_wake(std::atomic<uint32_t>* addr) {
+#ifdef __linux__
+	syscall(SYS_futex, reinterpret_cast<uint32_t*>(addr), FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+#else
+	(void) addr;
+#endif
+}
+
+// wait until ready() holds, spinning first and then sleeping on the futex word seq.
+// Returns false if ready() did not hold within timeout_ms (if not negative).
+template<class Pred>
+static bool shm_wait(std::atomic<uint32_t>& seq, std::atomic<uint32_t>& waiting, Pred ready,
+		int64_t timeout_ms = -1) {
+	for (int i = 0; i < SHM_SPIN_ITERATIONS; i++) {
+		if (ready()) {
+			return true;
+		}
+	}
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+	while (true) {
+		int64_t remaining = -1;
+		if (timeout_ms >= 0) {
+			remaining = std::chrono::duration_cast<std::chrono::milliseconds>(
+					deadline - std::chrono::steady_clock::now()).count();
+			if (remaining <= 0) {
+				return ready();
+			}
+		}
+		uint32_t s = seq.load();
+		waiting.fetch_add(1);
+		if (ready()) {
+			waiting.fetch_sub(1);
+			return true;
+		}
+		futex_wait(&seq, s, remaining);
+		waiting.fetch_sub(1);
+		if (ready()) {
+			return true;
+		}
+	}
+}
+
+static void shm_notify(std::atomic<uint32_t>& seq, std::atomic<uint32_t>& waiting) {
+	seq.fetch_add(1);
+	if (waiting.load() > 0) {
+		futex_wake(&seq);
+	}
+}
+
+static std::string shm_control_name(uint16_t port) {
+	return "/encrypto_utils_shm_" + std::to_string(port);
+}
+
+static std::string shm_connection_name(const std::string& control_name, uint32_t slot) {
+	return control_name + "_" + std::to_string(slot);
+}
+
+// maps a shared memory object of the given size, returns nullptr on error
+static void* shm_map(const std::string& name, int flags, size_t size, bool verbose) {
+	int fd = shm_open(name.c_str(), flags, 0600);
+	if (fd < 0) {
+		if (verbose) {
+			std::cerr << "shm_open " << name << " failed: " << std::strerror(errno) << "\n";
+		}
+		return nullptr;
+	}
+	if (flags & O_CREAT) {
+		if (ftruncate(fd, size) != 0) {
+			if (verbose) {
+				std::cerr << "ftruncate " << name << " failed: " << std::strerror(errno) << "\n";
+			}
+			close(fd);
+			return nullptr;
+		}
+	} else {
+		// the creator might not have set the size yet
+		struct stat st;
+		if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < size) {
+			close(fd);
+			return nullptr;
+		}
+	}
+	void* addr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (addr == MAP_FAILED) {
+		if (verbose) {
+			std::cerr << "mmap " << name << " failed: " << std::strerror(errno) << "\n";
+		}
+		return nullptr;
+	}
+	return addr;
+}
+
+
+class ShmTransport : public CTransport {
+public:
+	ShmTransport(shm_connection* conn, bool accepting_side)
+		: conn_(conn), out_(&conn->rings[accepting_side ? 1 : 0]),
+		in_(&conn->rings[accepting_side ? 0 : 1]), closed_(false)
+	{}
+
+	~ShmTransport() {
+		Close();
+		munmap(conn_, sizeof(shm_connection));
+	}
+
+	size_t Send(const void* buf, size_t bytes) override {
+		const uint8_t* src = static_cast<const uint8_t*>(buf);
+		size_t sent = 0;
+		while (sent < bytes) {
+			// only this side writes head
+			uint64_t head = out_->head.load(std::memory_order_relaxed);
+			uint64_t space = 0;
+			shm_wait(out_->space_seq, out_->space_waiting, [&] {
+				space = SHM_RING_SIZE - (head - out_->tail.load());
+				return space > 0 || out_->closed.load();
+			});
+			if (out_->closed.load()) {
+				return sent;
+			}
+			size_t n = std::min<uint64_t>(space, bytes - sent);
+			size_t pos = head % SHM_RING_SIZE;
+			size_t first = std::min<size_t>(n, SHM_RING_SIZE - pos);
+			memcpy(out_->data + pos, src + sent, first);
+			memcpy(out_->data, src + sent + first, n - first);
+			out_->head.store(head + n);
+			shm_notify(out_->data_seq, out_->data_waiting);
+			sent += n;
+		}
+		return sent;
+	}
+
+	size_t Receive(void* buf, size_t bytes) override {
+		uint8_t* dst = static_cast<uint8_t*>(buf);
+		size_t received = 0;
+		while (received < bytes) {
+			// only this side writes tail
+			uint64_t tail = in_->tail.load(std::memory_order_relaxed);
+			uint64_t available = 0;
+			shm_wait(in_->data_seq, in_->data_waiting, [&] {
+				available = in_->head.load() - tail;
+				return available > 0 || in_->closed.load();
+			});
+			// data written before the other side closed is still delivered
+			if (available == 0) {
+				return received;
+			}
+			size_t n = std::min<uint64_t>(available, bytes - received);
+			size_t pos = tail % SHM_RING_SIZE;
+			size_t first = std::min<size_t>(n, SHM_RING_SIZE - pos);
+			memcpy(dst + received, in_->data + pos, first);
+			memcpy(dst + received + first, in_->data, n - first);
+			in_->tail.store(tail + n);
+			shm_notify(in_->space_seq, in_->space_waiting);
+			received += n;
+		}
+		return received;
+	}
+
+	bool Poll(int timeout_ms) override {
+		uint64_t tail = in_->tail.load(std::memory_order_relaxed);
+		return shm_wait(in_->data_seq, in_->data_waiting, [&] {
+			return in_->head.load() != tail || in_->closed.load();
+		}, timeout_ms);
+	}
+
+	void Close() override {
+		if (closed_) {
+			return;
+		}
+		closed_ = true;
+		for (shm_ring* ring : {out_, in_}) {
+			ring->closed.store(1);
+			shm_notify(ring->data_seq, ring->data_waiting);
+			shm_notify(ring->space_seq, ring->space_waiting);
+		}
+	}
+
+private:
+	shm_connection* conn_;
+	shm_ring* out_;
+	shm_ring* in_;
+	bool closed_;
+};
+
+
+ShmListener::ShmListener(const std::string& name, shm_control* control, bool verbose)
+	: name_(name), control_(control), accepted_(0), verbose_(verbose)
+{}
+
+ShmListener::~ShmListener() {
+	// slots that were claimed but never accepted still have their segments
+	uint32_t claimed = std::min<uint32_t>(control_->next_slot.load(), SHM_MAX_CONNECTIONS);
+	for (uint32_t slot = accepted_; slot < claimed; slot++) {
+		shm_unlink(shm_connection_name(name_, slot).c_str());
+	}
+	shm_unlink(name_.c_str());
+	munmap(control_, sizeof(shm_control));
+}
+
+// whether the control segment name was left behind by a listener that no longer runs
+static bool shm_control_stale(const std::string& name) {
+	errno = 0;
+	auto control = static_cast<shm_control*>(shm_map(name, O_RDWR, sizeof(shm_control), false));
+	if (control == nullptr) {
+		// removed in the meantime, or not sized yet by a listener that is being created
+		return errno == ENOENT;
+	}
+	pid_t owner = control->owner.load();
+	munmap(control, sizeof(shm_control));
+	// a listener that is still being created counts as alive
+	return owner != 0 && kill(owner, 0) != 0 && errno == ESRCH;
+}
+
+std::unique_ptr<ShmListener> ShmListener::Create(uint16_t port, bool verbose) {
+	std::string name = shm_control_name(port);
+	void* control = shm_map(name, O_CREAT | O_EXCL | O_RDWR, sizeof(shm_control), false);
+	int error = errno;
+	if (control == nullptr && error == EEXIST && shm_control_stale(name)) {
+		shm_unlink(name.c_str());
+		control = shm_map(name, O_CREAT | O_EXCL | O_RDWR, sizeof(shm_control), false);
+		error = errno;
+	}
+	if (control == nullptr) {
+		if (verbose) {
+			std::cerr << "shm listen on port " << port << " failed: "
+					<< (error == EEXIST ? "the port is in use" : std::strerror(error)) << "\n";
+		}
+		return nullptr;
+	}
+	static_cast<shm_control*>(control)->owner.store(getpid());
+	return std::unique_ptr<ShmListener>(new ShmListener(name, static_cast<shm_control*>(control), verbose));
+}
+
+std::unique_ptr<CTransport> ShmListener::Accept(int timeout_ms) {
+	if (accepted_ >= SHM_MAX_CONNECTIONS) {
+		if (verbose_) {
+			std::cerr << "shm accept failed: more than " << SHM_MAX_CONNECTIONS << " connections\n";
+		}
+		return nullptr;
+	}
+	uint32_t slot = accepted_;
+	if (!shm_wait(control_->ready_seq, control_->ready_waiting, [&] {
+		return control_->ready[slot].load() != SHM_SLOT_PENDING;
+	}, timeout_ms)) {
+		return nullptr;
+	}
+	accepted_++;
+	if (control_->ready[slot].load() == SHM_SLOT_FAILED) {
+		// the connecting process gave up on this slot
+		return Accept(timeout_ms);
+	}
+	std::string name = shm_connection_name(name_, slot);
+	void* conn = shm_map(name, O_RDWR, sizeof(shm_connection), verbose_);
+	// both sides have it mapped now, the name is not needed anymore
+	shm_unlink(name.c_str());
+	if (conn == nullptr) {
+		return nullptr;
+	}
+	return std::make_unique<ShmTransport>(static_cast<shm_connection*>(conn), true);
+}
+
+std::unique_ptr<CTransport> ShmConnect(uint16_t port, bool verbose) {
+	std::string control_name = shm_control_name(port);
+	auto control = static_cast<shm_control*>(shm_map(control_name, O_RDWR, sizeof(shm_control), verbose));
+	if (control == nullptr) {
+		return nullptr;
+	}
+	uint32_t slot = control->next_slot.fetch_add(1);
+	if (slot >= SHM_MAX_CONNECTIONS) {
+		if (verbose) {
+			std::cerr << "shm connect failed: listener has no free slots\n";
+		}
+		munmap(control, sizeof(shm_control));
+		return nullptr;
+	}
+	std::string name = shm_connection_name(control_name, slot);
+	void* conn = shm_map(name, O_CREAT | O_EXCL | O_RDWR, sizeof(shm_connection), verbose);
+	control->ready[slot].store(conn != nullptr ? SHM_SLOT_READY : SHM_SLOT_FAILED);
+	shm_notify(control->ready_seq, control->ready_waiting);
+	munmap(control, sizeof(shm_control));
+	if (conn == nullptr) {
+		return nullptr;
+	}
+	return std::make_unique<ShmTransport>(static_cast<shm_connection*>(conn), false);
+}
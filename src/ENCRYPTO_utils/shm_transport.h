@@ -0,0 +1,62 @@
+/**
+ \file 		shm_transport.h
+ \copyright	ABY - A Framework for Efficient Mixed-protocol Secure Two-party Computation
+			Copyright (C) 2019 ENCRYPTO Group, TU Darmstadt
+			This program is free software: you can redistribute it and/or modify
+            it under the terms of the GNU Lesser General Public License as published
+            by the Free Software Foundation, either version 3 of the License, or
+            (at your option) any later version.
+            ABY is distributed in the hope that it will be useful,
+            but WITHOUT ANY WARRANTY; without even the implied warranty of
+            MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+            GNU Lesser General Public License for more details.
+            You should have received a copy of the GNU Lesser General Public License
+            along with this program. If not, see <http://www.gnu.org/licenses/>.
+ \brief		Shared-memory transport for parties on the same host
+ */
+
+#ifndef SHM_TRANSPORT_H_
+#define SHM_TRANSPORT_H_
+
+#include "transport.h"
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#define SHM_RING_SIZE (1 << 22) //bytes per direction and connection
+#define SHM_MAX_CONNECTIONS 4096 //connections that can be accepted by one listener
+
+struct shm_control;
+
+/**
+ * Counterpart of a listening TCP socket: a shared control segment named after the port,
+ * in which connecting processes claim connection slots.
+ */
+class ShmListener {
+public:
+	~ShmListener();
+
+	/**
+	 * creates the control segment. Fails if another listener of port is alive, a segment left by
+	 * a crashed process is replaced.
+	 */
+	static std::unique_ptr<ShmListener> Create(uint16_t port, bool verbose);
+
+	// waits for the next connection, at most timeout_ms if it is not negative
+	std::unique_ptr<CTransport> Accept(int timeout_ms = -1);
+
+private:
+	ShmListener(const std::string& name, shm_control* control, bool verbose);
+
+	std::string name_;
+	shm_control* control_;
+	uint32_t accepted_;
+	bool verbose_;
+};
+
+/**
+ * connect to the ShmListener for port, returns nullptr if there is none (yet)
+ */
+std::unique_ptr<CTransport> ShmConnect(uint16_t port, bool verbose);
+
+#endif /* SHM_TRANSPORT_H_ */
@@ -20,12 +20,16 @@
 #include "sndthread.h"
 #include "socket.h"
 #include "constants.h"
+#include "frame.h"
+#include <algorithm>
 #include <cassert>
+#include <chrono>
 #include <cstring>
 
 
 SndThread::SndThread(CSocket* sock, CLock *glock)
-: mysock(sock), sndlock(glock), send(std::make_unique<CEvent>())
+: mysock(sock), sndlock(glock), send(std::make_unique<CEvent>()),
+max_queued_bytes(0), queued_bytes(0), peak_queued_bytes(0), stall_ns(0), channels()
 {
 }
 
@@ -46,15 +50,71 @@ void SndThread::setlock(CLock *glock) {
 	sndlock = glock;
 }
 
+void SndThread::wait_stalled(std::unique_lock<CLock>& lock, uint32_t channelid, const std::function<bool()>& ready) {
+	if(ready()) {
+		return;
+	}
+	auto start = std::chrono::steady_clock::now();
+	space_available.wait(lock, ready);
+	uint64_t waited = std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now() - start).count();
+	stall_ns += waited;
+	channels[channelid].stall_ns += waited;
+}
+
+SndThread::channel_ctx& SndThread::context(uint32_t channelid) {
+	channel_ctx& ctx = channels[channelid];
+	if(!ctx.configured) {
+		ctx.configured = true;
+		ctx.priority = SND_DEFAULT_PRIORITY;
+		ctx.weight = 1;
+	}
+	return ctx;
+}
+
 void SndThread::push_task(std::unique_ptr<snd_task> task)
 {
-	sndlock->Lock();
-	send_tasks.push(std::move(task));
-	sndlock->Unlock();
+	uint64_t bytelen = task->snd_buf.size();
+	std::unique_lock<CLock> lock(*sndlock);
+	//admin messages are never delayed, otherwise credit grants could deadlock both parties
+	if(task->channelid == ADMIN_CHANNEL) {
+		queued_bytes += bytelen;
+		peak_queued_bytes = std::max(peak_queued_bytes, queued_bytes);
+		if(task->snd_buf[0] != ADMIN_FIN) {
+			admin_tasks.push_back(std::move(task));
+		} else if(!fin_task) {
+			fin_task = std::move(task);
+		}
+		lock.unlock();
+		send->Set();
+		return;
+	}
+
+	channel_ctx& ctx = context(task->channelid);
+	wait_stalled(lock, task->channelid, [&] {
+		return ctx.window == 0 || bytelen == 0
+				|| ctx.available >= (int64_t) std::min(bytelen, ctx.window);
+	});
+	if(ctx.window > 0) {
+		ctx.available -= bytelen;
+	}
+	//a single message that exceeds the bound is let through once the queue is empty
+	wait_stalled(lock, task->channelid, [&] {
+		return max_queued_bytes == 0 || queued_bytes == 0 || queued_bytes + bytelen <= max_queued_bytes;
+	});
+	queued_bytes += bytelen;
+	peak_queued_bytes = std::max(peak_queued_bytes, queued_bytes);
+	task->sent = 0;
+	task->enqueued = std::chrono::steady_clock::now();
+	if(ctx.queue.empty()) {
+		active[ctx.priority].push_back(task->channelid);
+	}
+	ctx.queue.push_back(std::move(task));
+	lock.unlock();
 	send->Set();
 }
 
-void SndThread::add_event_snd_task_start_len(CEvent* eventcaller, uint8_t channelid, uint64_t sndbytes, uint8_t* sndbuf, uint64_t startid, uint64_t len) {
+void SndThread::add_event_snd_task_start_len(CEvent* eventcaller, uint32_t channelid, uint64_t sndbytes, uint8_t* sndbuf, uint64_t startid, uint64_t len) {
 	assert(channelid != ADMIN_CHANNEL);
 	auto task = std::make_unique<snd_task>();
 	task->channelid = channelid;
@@ -69,13 +129,13 @@ void SndThread::add_event_snd_task_start_len(CEvent* eventcaller, uint8_t channe
 	push_task(std::move(task));
 }
 
-void SndThread::add_snd_task_start_len(uint8_t channelid, uint64_t sndbytes, uint8_t* sndbuf, uint64_t startid, uint64_t len) {
+void SndThread::add_snd_task_start_len(uint32_t channelid, uint64_t sndbytes, uint8_t* sndbuf, uint64_t startid, uint64_t len) {
 	//Call the method blocking but since callback is nullptr nobody gets notified, other functionallity is equal
 	add_event_snd_task_start_len(nullptr, channelid, sndbytes, sndbuf, startid, len);
 }
 
 
-void SndThread::add_event_snd_task(CEvent* eventcaller, uint8_t channelid, uint64_t sndbytes, uint8_t* sndbuf) {
+void SndThread::add_event_snd_task(CEvent* eventcaller, uint32_t channelid, uint64_t sndbytes, uint8_t* sndbuf) {
 	assert(channelid != ADMIN_CHANNEL);
 	auto task = std::make_unique<snd_task>();
 	task->channelid = channelid;
@@ -88,12 +148,12 @@ void SndThread::add_event_snd_task(CEvent* eventcaller, uint8_t channelid, uint6
 
 }
 
-void SndThread::add_snd_task(uint8_t channelid, uint64_t sndbytes, uint8_t* sndbuf) {
+void SndThread::add_snd_task(uint32_t channelid, uint64_t sndbytes, uint8_t* sndbuf) {
 	//Call the method blocking but since callback is nullptr nobody gets notified, other functionallity is equal
 	add_event_snd_task(nullptr, channelid, sndbytes, sndbuf);
 }
 
-void SndThread::signal_end(uint8_t channelid) {
+void SndThread::signal_end(uint32_t channelid) {
 	add_snd_task(channelid, 0, nullptr);
 	//std::cout << "Signalling end on channel " << (uint32_t) channelid << std::endl;
 }
@@ -101,7 +161,7 @@ void SndThread::signal_end(uint8_t channelid) {
 void SndThread::kill_task() {
 	auto task = std::make_unique<snd_task>();
 	task->channelid = ADMIN_CHANNEL;
-	task->snd_buf = {0};
+	task->snd_buf = {ADMIN_FIN};
 
 	push_task(std::move(task));
 #ifdef DEBUG_SEND_THREAD
@@ -109,50 +169,302 @@ void SndThread::kill_task() {
 #endif
 }
 
+void SndThread::set_max_queued_bytes(uint64_t maxbytes) {
+	std::lock_guard<CLock> lock(*sndlock);
+	max_queued_bytes = maxbytes;
+	space_available.notify_all();
+}
+
+void SndThread::enable_credits(uint32_t channelid, uint64_t window) {
+	assert(channelid != ADMIN_CHANNEL);
+	std::lock_guard<CLock> lock(*sndlock);
+	channels[channelid].window = window;
+	channels[channelid].available = window;
+	space_available.notify_all();
+}
+
+void SndThread::add_credit(uint32_t channelid, uint64_t nbytes) {
+	std::lock_guard<CLock> lock(*sndlock);
+	channels[channelid].available += nbytes;
+	space_available.notify_all();
+}
+
+void SndThread::grant_credit(uint32_t channelid, uint64_t nbytes) {
+	auto task = std::make_unique<snd_task>();
+	task->channelid = ADMIN_CHANNEL;
+	task->eventcaller = nullptr;
+	task->snd_buf.resize(1 + sizeof(uint32_t) + sizeof(uint64_t));
+	task->snd_buf[0] = ADMIN_CREDIT;
+	memcpy(task->snd_buf.data() + 1, &channelid, sizeof(uint32_t));
+	memcpy(task->snd_buf.data() + 1 + sizeof(uint32_t), &nbytes, sizeof(uint64_t));
+
+	push_task(std::move(task));
+}
+
+uint64_t SndThread::get_queued_bytes() const {
+	std::lock_guard<CLock> lock(*sndlock);
+	return queued_bytes;
+}
+
+uint64_t SndThread::get_peak_queued_bytes() const {
+	std::lock_guard<CLock> lock(*sndlock);
+	return peak_queued_bytes;
+}
+
+uint64_t SndThread::get_stall_ns() const {
+	std::lock_guard<CLock> lock(*sndlock);
+	return stall_ns;
+}
+
+uint64_t SndThread::get_stall_ns(uint32_t channelid) const {
+	std::lock_guard<CLock> lock(*sndlock);
+	channel_ctx* ctx = channels.find(channelid);
+	return ctx ? ctx->stall_ns : 0;
+}
+
+int64_t SndThread::get_available_credit(uint32_t channelid) const {
+	std::lock_guard<CLock> lock(*sndlock);
+	channel_ctx* ctx = channels.find(channelid);
+	return ctx ? ctx->available : 0;
+}
+
+void SndThread::set_compression(uint32_t channelid, uint64_t min_bytes) {
+	assert(channelid != ADMIN_CHANNEL);
+	std::lock_guard<CLock> lock(*sndlock);
+	channels[channelid].compress_min_bytes = min_bytes;
+}
+
+compression_stats SndThread::get_compression_stats(uint32_t channelid) const {
+	std::lock_guard<CLock> lock(*sndlock);
+	channel_ctx* ctx = channels.find(channelid);
+	return ctx ? ctx->compression : compression_stats{0, 0, 0};
+}
+
+void SndThread::release_channel(uint32_t channelid) {
+	std::lock_guard<CLock> lock(*sndlock);
+	channel_ctx* ctx = channels.find(channelid);
+	if(ctx == nullptr) {
+		return;
+	}
+	if(ctx->queue.empty()) {
+		channels.erase(channelid);
+		traffic.retire(channelid);
+	} else {
+		//the remaining messages are still sent, next_fragment erases the context afterwards
+		ctx->released = true;
+	}
+}
+
+void SndThread::set_priority(uint32_t channelid, uint8_t priority, uint32_t weight) {
+	assert(channelid != ADMIN_CHANNEL);
+	assert(priority < SND_NUM_PRIORITIES);
+	assert(weight > 0);
+	std::lock_guard<CLock> lock(*sndlock);
+	channel_ctx& ctx = context(channelid);
+	if(ctx.priority != priority && !ctx.queue.empty()) {
+		auto& from = active[ctx.priority];
+		from.erase(std::find(from.begin(), from.end(), channelid));
+		active[priority].push_back(channelid);
+	}
+	ctx.priority = priority;
+	ctx.weight = weight;
+}
+
+snd_queue_stats SndThread::get_queue_stats(uint32_t channelid) const {
+	std::lock_guard<CLock> lock(*sndlock);
+	channel_ctx* ctx = channels.find(channelid);
+	return ctx ? ctx->queue_stats : snd_queue_stats{0, 0, 0};
+}
+
+bool SndThread::next_fragment(fragment& frag) {
+	if(!admin_tasks.empty()) {
+		frag.owned = std::move(admin_tasks.front());
+		admin_tasks.pop_front();
+		frag.task = frag.owned.get();
+		frag.offset = 0;
+		frag.len = frag.task->snd_buf.size();
+		frag.more = false;
+		return true;
+	}
+	for(auto& ring : active) {
+		while(!ring.empty()) {
+			uint32_t channelid = ring.front();
+			channel_ctx& ctx = *channels.find(channelid);
+			snd_task* task = ctx.queue.front().get();
+			uint64_t len = std::min<uint64_t>(task->snd_buf.size() - task->sent, SND_FRAGMENT_SIZE);
+			if(!ctx.has_turn) {
+				ctx.deficit += (uint64_t) ctx.weight * SND_DRR_QUANTUM;
+				ctx.has_turn = true;
+			}
+			if(len > ctx.deficit) {
+				//the budget of this turn is used up, the next channel of the class follows
+				ctx.has_turn = false;
+				ring.pop_front();
+				ring.push_back(channelid);
+				continue;
+			}
+			ctx.deficit -= len;
+
+			if(task->sent == 0) {
+				uint64_t delay = std::chrono::duration_cast<std::chrono::nanoseconds>(
+						std::chrono::steady_clock::now() - task->enqueued).count();
+				ctx.queue_stats.msgs++;
+				ctx.queue_stats.delay_ns += delay;
+				ctx.queue_stats.max_delay_ns = std::max(ctx.queue_stats.max_delay_ns, delay);
+			}
+			frag.task = task;
+			frag.offset = task->sent;
+			frag.len = len;
+			task->sent += len;
+			frag.more = task->sent < task->snd_buf.size();
+			if(!frag.more) {
+				frag.owned = std::move(ctx.queue.front());
+				ctx.queue.pop_front();
+				if(ctx.queue.empty()) {
+					//an idle channel does not save up budget
+					ctx.deficit = 0;
+					ctx.has_turn = false;
+					ring.pop_front();
+					if(ctx.released) {
+						channels.erase(channelid);
+						traffic.retire(channelid);
+					}
+				}
+			}
+			return true;
+		}
+	}
+	if(fin_task) {
+		frag.owned = std::move(fin_task);
+		frag.task = frag.owned.get();
+		frag.offset = 0;
+		frag.len = frag.task->snd_buf.size();
+		frag.more = false;
+		return true;
+	}
+	return false;
+}
+
+void SndThread::add_frame(const fragment& frag, size_t i) {
+	uint32_t channelid = frag.task->channelid;
+	const uint8_t* payload = frag.task->snd_buf.data() + frag.offset;
+	uint64_t wirelen = frag.len;
+	uint64_t bytelen = frag.len;
+
+	sndlock->Lock();
+	//the channel may already be released while its last frames are queued
+	channel_ctx* ctx = channels.find(channelid);
+	uint64_t compress_min_bytes = ctx ? ctx->compress_min_bytes : 0;
+	bool released = ctx == nullptr;
+	sndlock->Unlock();
+
+	if(compress_min_bytes > 0 && frag.len >= compress_min_bytes && channelid != ADMIN_CHANNEL) {
+		auto start = std::chrono::steady_clock::now();
+		uint64_t complen = zrle_compress(payload, frag.len, compress_bufs[i]);
+		uint64_t elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(
+				std::chrono::steady_clock::now() - start).count();
+
+		sndlock->Lock();
+		ctx = channels.find(channelid);
+		if(ctx) {
+			compression_stats& stats = ctx->compression;
+			stats.raw_bytes += frag.len;
+			stats.wire_bytes += complen > 0 ? complen : frag.len;
+			stats.cpu_ns += elapsed;
+		}
+		sndlock->Unlock();
+
+		if(complen > 0) {
+			payload = compress_bufs[i].data();
+			wirelen = complen;
+			bytelen = complen | FRAME_FLAG_COMPRESSED;
+		}
+	}
+	if(frag.more) {
+		bytelen |= FRAME_FLAG_MORE;
+	}
+
+	size_t headerlen = write_frame_header(headers[i].data(), channelid, bytelen);
+	iovs.push_back({headers[i].data(), headerlen});
+	if(wirelen > 0) {
+		iovs.push_back({const_cast<uint8_t*>(payload), wirelen});
+	}
+	if(released) {
+		traffic.add_retired(channelid, headerlen + wirelen);
+	} else {
+		traffic.add(channelid, headerlen + wirelen);
+	}
+}
+
+void SndThread::send_batch(const std::vector<fragment>& batch) {
+	if(headers.size() < batch.size()) {
+		headers.resize(batch.size());
+		compress_bufs.resize(batch.size());
+	}
+	iovs.clear();
+	for(size_t i = 0; i < batch.size(); i++) {
+		add_frame(batch[i], i);
+	}
+	mysock->SendV(iovs.data(), iovs.size());
+}
+
+traffic_counters SndThread::get_traffic(uint32_t channelid) const {
+	return traffic.get(channelid);
+}
+
+traffic_counters SndThread::get_total_traffic() const {
+	return traffic.total();
+}
+
 void SndThread::ThreadMain() {
-	uint8_t channelid;
-	uint32_t iters;
 	bool run = true;
-	bool empty = true;
+	std::vector<fragment> batch;
 	while(run) {
+		//frames are scheduled one by one, so a message on a higher priority channel overtakes
+		//the remaining fragments of a large message at the next batch
+		uint64_t batchbytes = 0;
 		sndlock->Lock();
-		empty = send_tasks.empty();
+		while(batch.size() < SND_BATCH_MAX_FRAMES && batchbytes < SND_BATCH_MAX_BYTES) {
+			batch.emplace_back();
+			if(!next_fragment(batch.back())) {
+				batch.pop_back();
+				break;
+			}
+			batchbytes += batch.back().len;
+			if(batch.back().task->channelid == ADMIN_CHANNEL && batch.back().task->snd_buf[0] == ADMIN_FIN) {
+				//nothing is sent after the shutdown message
+				break;
+			}
+		}
 		sndlock->Unlock();
 
-		if(empty){
+		if(batch.empty()) {
 			send->Wait();
+			continue;
 		}
-		//std::cout << "Awoken" << std::endl;
+		send_batch(batch);
 
 		sndlock->Lock();
-		iters = send_tasks.size();
+		queued_bytes -= batchbytes;
 		sndlock->Unlock();
+		space_available.notify_all();
 
-		while((iters--) && run) {
-			sndlock->Lock();
-			auto task = std::move(send_tasks.front());
-			send_tasks.pop();
-			sndlock->Unlock();
-			channelid = task->channelid;
-			mysock->Send(&channelid, sizeof(uint8_t));
-			uint64_t bytelen = task->snd_buf.size();
-			mysock->Send(&bytelen, sizeof(bytelen));
-			if(bytelen > 0) {
-				mysock->Send(task->snd_buf.data(), task->snd_buf.size());
+		for(auto& frag : batch) {
+			if(!frag.owned) {
+				continue; //more fragments of this message follow
 			}
-
+			uint32_t channelid = frag.owned->channelid;
 #ifdef DEBUG_SEND_THREAD
-			std::cout << "Sending on channel " <<  (uint32_t) channelid << " a message of " << task->bytelen << " bytes length" << std::endl;
+			std::cout << "Sent on channel " <<  (uint32_t) channelid << " a message of " << frag.owned->snd_buf.size() << " bytes length" << std::endl;
 #endif
-
-			if(channelid == ADMIN_CHANNEL) {
+			if(channelid == ADMIN_CHANNEL && frag.owned->snd_buf[0] == ADMIN_FIN) {
 				//delete sndlock;
 				run = false;
 			}
-			if(task->eventcaller != nullptr) {
-				task->eventcaller->Set();
+			if(frag.owned->eventcaller != nullptr) {
+				frag.owned->eventcaller->Set();
 			}
 		}
+		batch.clear();
 	}
 }
-;
@@ -21,12 +21,27 @@
 #ifndef SND_THREAD_H_
 #define SND_THREAD_H_
 
+#include "channel_map.h"
+#include "compression.h"
+#include "constants.h"
 #include "thread.h"
+#include "traffic.h"
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
 #include <memory>
-#include <queue>
+#include <sys/uio.h>
 
 class CSocket;
 
+struct snd_queue_stats {
+	uint64_t msgs; //messages that started transmission
+	uint64_t delay_ns; //sum of the times these messages waited in the send queue
+	uint64_t max_delay_ns;
+};
+
 
 class SndThread: public CThread {
 public:
@@ -40,33 +55,130 @@ public:
 
     void setlock(CLock *glock);
 
-	void add_snd_task_start_len(uint8_t channelid, uint64_t sndbytes, uint8_t* sndbuf, uint64_t startid, uint64_t len);
+	void add_snd_task_start_len(uint32_t channelid, uint64_t sndbytes, uint8_t* sndbuf, uint64_t startid, uint64_t len);
+
+	void add_event_snd_task_start_len(CEvent* eventcaller, uint32_t channelid, uint64_t sndbytes, uint8_t* sndbuf, uint64_t startid, uint64_t len);
 
-	void add_event_snd_task_start_len(CEvent* eventcaller, uint8_t channelid, uint64_t sndbytes, uint8_t* sndbuf, uint64_t startid, uint64_t len);
+	void add_snd_task(uint32_t channelid, uint64_t sndbytes, uint8_t* sndbuf);
 
-	void add_snd_task(uint8_t channelid, uint64_t sndbytes, uint8_t* sndbuf);
+	void add_event_snd_task(CEvent* eventcaller, uint32_t channelid, uint64_t sndbytes, uint8_t* sndbuf);
 
-	void add_event_snd_task(CEvent* eventcaller, uint8_t channelid, uint64_t sndbytes, uint8_t* sndbuf);
+	void signal_end(uint32_t channelid);
 
-	void signal_end(uint8_t channelid);
+	//drops the flow control and compression settings of a channel that is no longer used
+	void release_channel(uint32_t channelid);
 
 	void kill_task();
 
+	//bound the number of bytes that are queued but not yet written to the socket, add_*_snd_task blocks while the bound is reached. 0 = unbounded
+	void set_max_queued_bytes(uint64_t maxbytes);
+
+	//enable credit-based flow control on a channel: at most window bytes may be unacknowledged by the receiving channel
+	void enable_credits(uint32_t channelid, uint64_t window);
+
+	//called by the receiver thread when the other party granted new credit on a channel
+	void add_credit(uint32_t channelid, uint64_t nbytes);
+
+	//tell the other party that nbytes on a channel have been consumed and may be sent again
+	void grant_credit(uint32_t channelid, uint64_t nbytes);
+
+	uint64_t get_queued_bytes() const;
+	uint64_t get_peak_queued_bytes() const;
+	//total time in nanoseconds that callers have been blocked by the queue bound or missing credit
+	uint64_t get_stall_ns() const;
+	uint64_t get_stall_ns(uint32_t channelid) const;
+	int64_t get_available_credit(uint32_t channelid) const;
+
+	//compress messages of at least min_bytes on a channel before sending them. 0 disables compression
+	void set_compression(uint32_t channelid, uint64_t min_bytes);
+	compression_stats get_compression_stats(uint32_t channelid) const;
+
+	/**
+	 * Schedule a channel in a strict priority class (0 is served first, up to SND_NUM_PRIORITIES-1)
+	 * and give it weight times SND_DRR_QUANTUM bytes per deficit round-robin turn within its class.
+	 * Messages larger than SND_FRAGMENT_SIZE are interleaved with other channels at fragment boundaries.
+	 */
+	void set_priority(uint32_t channelid, uint8_t priority, uint32_t weight = 1);
+
+	//how long messages on a channel waited before their transmission started
+	snd_queue_stats get_queue_stats(uint32_t channelid) const;
+
+	//bytes and frames written to the socket per channel id, lock-free
+	traffic_counters get_traffic(uint32_t channelid) const;
+	traffic_counters get_total_traffic() const;
+
 	void ThreadMain();
 
 private:
 	struct snd_task {
-		uint8_t channelid;
+		uint32_t channelid;
 		std::vector<uint8_t> snd_buf;
 		CEvent* eventcaller;
+		uint64_t sent; //payload bytes already scheduled in fragments
+		std::chrono::steady_clock::time_point enqueued;
+	};
+
+	struct channel_ctx {
+		uint64_t window; //0 if flow control is disabled on this channel
+		int64_t available; //can become negative when a message larger than the window is sent
+		uint64_t stall_ns;
+		uint64_t compress_min_bytes; //0 if compression is disabled on this channel
+		compression_stats compression;
+		bool configured; //priority and weight were initialized
+		uint8_t priority;
+		uint32_t weight;
+		std::deque<std::unique_ptr<snd_task>> queue; //messages of this channel in sending order
+		uint64_t deficit; //deficit round-robin byte budget
+		bool has_turn; //the quantum of the current turn was added to deficit
+		bool released; //erase the context once the queue is drained
+		snd_queue_stats queue_stats;
+	};
+
+	//a part of a message that is sent as one frame. The task is owned by the last fragment
+	struct fragment {
+		snd_task* task;
+		std::unique_ptr<snd_task> owned;
+		uint64_t offset;
+		uint64_t len;
+		bool more;
 	};
 
+	//the context of channelid with priority and weight initialized, requires sndlock
+	channel_ctx& context(uint32_t channelid);
+
+	//picks the next frame to send according to the priorities and removes it from the queues, requires sndlock
+	bool next_fragment(fragment& frag);
+
+	//appends the frame header and payload of the i-th fragment of a batch to iovs, compressing the payload if enabled
+	void add_frame(const fragment& frag, size_t i);
+
+	//writes the frames of all fragments with a single gathering send
+	void send_batch(const std::vector<fragment>& batch);
+
 	void push_task(std::unique_ptr<snd_task> task);
 
+	//wait on sndlock until ready() holds and add the waiting time to the stall counters
+	void wait_stalled(std::unique_lock<CLock>& lock, uint32_t channelid, const std::function<bool()>& ready);
+
 	CSocket* mysock;
 	CLock* sndlock;
 	std::unique_ptr<CEvent> send;
-	std::queue<std::unique_ptr<snd_task>> send_tasks;
+	std::deque<std::unique_ptr<snd_task>> admin_tasks; //sent before any channel, except the final ADMIN_FIN
+	std::unique_ptr<snd_task> fin_task; //sent once everything else was
+	std::array<std::deque<uint32_t>, SND_NUM_PRIORITIES> active; //channels with queued messages, per class in round-robin order
+
+	std::condition_variable_any space_available;
+	uint64_t max_queued_bytes;
+	uint64_t queued_bytes;
+	uint64_t peak_queued_bytes;
+	uint64_t stall_ns;
+	channel_map<channel_ctx> channels; //created on first use, guarded by sndlock
+	channel_traffic traffic;
+
+	//per-batch buffers of the send thread, kept to reuse their capacity
+	std::vector<std::array<uint8_t, FRAME_HEADER_MAX_SIZE>> headers;
+	std::vector<std::vector<uint8_t>> compress_bufs;
+	std::vector<iovec> iovs;
 };
 
 
@@ -18,14 +18,29 @@ along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
 
 #include "socket.h"
+#include "shm_transport.h"
+#include "uring_transport.h"
 #include "utils.h"
 
 
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <climits>
 #include <cstdint>
 #include <cstring>
 #include <iostream>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <numeric>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <vector>
+#ifdef __linux__
+#include <linux/errqueue.h>
+#endif
 
-#include <boost/asio/connect.hpp>
 #include <boost/asio/io_context.hpp>
 #include <boost/asio/ip/address.hpp>
 #include <boost/asio/ip/tcp.hpp>
@@ -34,6 +49,75 @@ along with this program. If not, see <http://www.gnu.org/licenses/>.
 #include <boost/asio/write.hpp>
 using boost::asio::ip::tcp;
 
+#if defined(__linux__) && defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+#define HAVE_MSG_ZEROCOPY
+#endif
+
+socket_options socket_options::from_profile(socket_profile profile) {
+	socket_options options;
+	switch (profile) {
+	case SOCKET_PROFILE_LATENCY:
+		options.busy_poll_us = 50;
+		options.quickack = true;
+		break;
+	case SOCKET_PROFILE_THROUGHPUT:
+		options.sndbuf = 4 << 20;
+		options.rcvbuf = 4 << 20;
+		options.zerocopy_min_bytes = 1 << 20;
+		break;
+	case SOCKET_PROFILE_WAN:
+		options.sndbuf = 32 << 20;
+		options.rcvbuf = 32 << 20;
+		break;
+	case SOCKET_PROFILE_DEFAULT:
+		break;
+	}
+	return options;
+}
+
+static void set_int_option(int fd, int level, int name, int value, const char* optname, bool verbose) {
+	if (setsockopt(fd, level, name, &value, sizeof(value)) != 0 && verbose) {
+		std::cerr << "socket set option " << optname << " failed: " << std::strerror(errno) << "\n";
+	}
+}
+
+// options that have to be set before connecting or listening
+static void apply_buffer_options(int fd, const socket_options& options, bool verbose) {
+	if (options.sndbuf > 0) {
+		set_int_option(fd, SOL_SOCKET, SO_SNDBUF, options.sndbuf, "SO_SNDBUF", verbose);
+	}
+	if (options.rcvbuf > 0) {
+		set_int_option(fd, SOL_SOCKET, SO_RCVBUF, options.rcvbuf, "SO_RCVBUF", verbose);
+	}
+}
+
+// options of a connected socket, returns whether MSG_ZEROCOPY may be used
+static bool apply_connected_options(int fd, const socket_options& options, bool verbose) {
+	apply_buffer_options(fd, options, verbose);
+#ifdef SO_BUSY_POLL
+	if (options.busy_poll_us > 0) {
+		set_int_option(fd, SOL_SOCKET, SO_BUSY_POLL, options.busy_poll_us, "SO_BUSY_POLL", verbose);
+	}
+#endif
+#ifdef TCP_QUICKACK
+	if (options.quickack) {
+		set_int_option(fd, IPPROTO_TCP, TCP_QUICKACK, 1, "TCP_QUICKACK", verbose);
+	}
+#endif
+#ifdef HAVE_MSG_ZEROCOPY
+	if (options.zerocopy_min_bytes > 0) {
+		int one = 1;
+		if (setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0) {
+			return true;
+		}
+		if (verbose) {
+			std::cerr << "socket set option SO_ZEROCOPY failed: " << std::strerror(errno) << "\n";
+		}
+	}
+#endif
+	return false;
+}
+
 
 struct CSocket::CSocketImpl {
 	CSocketImpl(std::shared_ptr<boost::asio::io_context> io_context,
@@ -49,43 +133,171 @@ struct CSocket::CSocketImpl {
 	std::shared_ptr<boost::asio::io_context> io_context;
 	tcp::socket socket;
 	tcp::acceptor acceptor;
+	// used instead of socket and acceptor unless the type is TRANSPORT_TCP
+	std::unique_ptr<CTransport> transport;
+	std::unique_ptr<ShmListener> shm_listener;
+	uint16_t shm_port = 0;
+
+	socket_options options;
+	bool zerocopy = false; //SO_ZEROCOPY is enabled on socket
+	uint32_t zerocopy_issued = 0; //MSG_ZEROCOPY sends ...
+	uint32_t zerocopy_completed = 0; //... and their completion notifications
+	std::atomic<uint64_t> zerocopy_sends{0}; //total of zerocopy_issued, for statistics
+
+#ifdef HAVE_MSG_ZEROCOPY
+	// reads completion notifications from the error queue, waiting for at least one. False on error
+	bool reap_zerocopy_completions() {
+		int fd = socket.native_handle();
+		pollfd pfd = {fd, 0, 0}; // POLLERR is always reported
+		if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+			return false;
+		}
+		while (true) {
+			char control[128];
+			msghdr msg = {};
+			msg.msg_control = control;
+			msg.msg_controllen = sizeof(control);
+			if (recvmsg(fd, &msg, MSG_ERRQUEUE) < 0) {
+				return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+			}
+			for (cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm != nullptr; cm = CMSG_NXTHDR(&msg, cm)) {
+				if (!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR)
+						|| (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))) {
+					continue;
+				}
+				sock_extended_err serr;
+				memcpy(&serr, CMSG_DATA(cm), sizeof(serr));
+				if (serr.ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+					continue;
+				}
+				// notifications cover the range [ee_info, ee_data] of send calls
+				zerocopy_completed += serr.ee_data - serr.ee_info + 1;
+				if (serr.ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+					// the kernel had to copy anyway (e.g. loopback), zerocopy only adds overhead
+					zerocopy = false;
+				}
+			}
+		}
+	}
+
+	// returns once the kernel does not reference the buffers anymore, such that the caller may reuse them
+	size_t send_zerocopy(const iovec* iov, int iovcnt, bool verbose) {
+		int fd = socket.native_handle();
+		// the remaining part of the buffers, advanced past what was sent
+		std::vector<iovec> rest(iov, iov + iovcnt);
+		size_t first = 0;
+		size_t sent = 0;
+		while (first < rest.size()) {
+			msghdr msg = {};
+			msg.msg_iov = rest.data() + first;
+			msg.msg_iovlen = std::min<size_t>(rest.size() - first, IOV_MAX);
+			ssize_t ret = ::sendmsg(fd, &msg, MSG_ZEROCOPY | MSG_NOSIGNAL);
+			if (ret >= 0) {
+				sent += ret;
+				zerocopy_issued++;
+				zerocopy_sends.fetch_add(1, std::memory_order_relaxed);
+				size_t n = ret;
+				while (first < rest.size() && n >= rest[first].iov_len) {
+					n -= rest[first].iov_len;
+					first++;
+				}
+				if (n > 0) {
+					rest[first].iov_base = static_cast<uint8_t*>(rest[first].iov_base) + n;
+					rest[first].iov_len -= n;
+				}
+			} else if (errno == ENOBUFS) {
+				// too many outstanding notifications, consume some
+				if (!reap_zerocopy_completions()) {
+					break;
+				}
+			} else if (errno != EINTR) {
+				if (verbose) {
+					std::cerr << "zerocopy write failed: " << std::strerror(errno) << "\n";
+				}
+				break;
+			}
+		}
+		while (zerocopy_completed != zerocopy_issued) {
+			if (!reap_zerocopy_completions()) {
+				break;
+			}
+		}
+		return sent;
+	}
+#endif
 };
 
 CSocket::CSocket(bool verbose)
-	: impl_(std::make_unique<CSocketImpl>()), send_count_(0), recv_count_(0),
+	: CSocket(TRANSPORT_TCP, verbose)
+{}
+
+CSocket::CSocket(transport_type type, bool verbose)
+	: impl_(std::make_unique<CSocketImpl>()), type_(type), send_count_(0), recv_count_(0),
 	verbose_(verbose)
 {}
 
+CSocket::CSocket(std::unique_ptr<CTransport> transport, bool verbose)
+	: impl_(std::make_unique<CSocketImpl>()), type_(TRANSPORT_CUSTOM), send_count_(0), recv_count_(0),
+	verbose_(verbose)
+{
+	impl_->transport = std::move(transport);
+}
+
 CSocket::~CSocket() {
 	Close();
 }
 
 uint64_t CSocket::getSndCnt() const {
-	std::lock_guard<std::mutex> lock(send_count_mutex_);
-	return send_count_;
+	return send_count_.load(std::memory_order_relaxed);
 }
 uint64_t CSocket::getRcvCnt() const {
-	std::lock_guard<std::mutex> lock(recv_count_mutex_);
-	return recv_count_;
+	return recv_count_.load(std::memory_order_relaxed);
 }
 void CSocket::ResetSndCnt() {
-	std::lock_guard<std::mutex> lock(send_count_mutex_);
-	send_count_ = 0;
+	send_count_.store(0, std::memory_order_relaxed);
 }
 void CSocket::ResetRcvCnt() {
-	std::lock_guard<std::mutex> lock(recv_count_mutex_);
-	recv_count_ = 0;
+	recv_count_.store(0, std::memory_order_relaxed);
 }
 
 bool CSocket::Socket() {
 	return true;
 }
 
+void CSocket::SetOptions(const socket_options& options) {
+	impl_->options = options;
+	if (type_ == TRANSPORT_CUSTOM) {
+		impl_->transport->SetOptions(options);
+	} else if (type_ != TRANSPORT_SHM && impl_->socket.is_open()) {
+		impl_->zerocopy = apply_connected_options(impl_->socket.native_handle(), options, verbose_);
+	}
+}
+
+const socket_options& CSocket::GetOptions() const {
+	return impl_->options;
+}
+
 void CSocket::Close() {
+	if (impl_->transport) {
+		impl_->transport->Close();
+	}
+	impl_->shm_listener.reset();
 	impl_->socket.close();
 }
 
+void CSocket::Shutdown() {
+	if (impl_->transport) {
+		impl_->transport->Close();
+		return;
+	}
+	boost::system::error_code ec;
+	impl_->socket.shutdown(tcp::socket::shutdown_both, ec);
+}
+
 std::string CSocket::GetIP() const {
+	if (type_ == TRANSPORT_CUSTOM) {
+		return impl_->transport->GetIP();
+	}
 	boost::system::error_code ec;
 	auto endpoint = impl_->socket.local_endpoint(ec);
 	if (ec) {
@@ -95,6 +307,12 @@ std::string CSocket::GetIP() const {
 }
 
 uint16_t CSocket::GetPort() const {
+	if (type_ == TRANSPORT_SHM) {
+		return impl_->shm_port;
+	}
+	if (type_ == TRANSPORT_CUSTOM) {
+		return impl_->transport->GetPort();
+	}
 	boost::system::error_code ec;
 	auto endpoint = impl_->socket.local_endpoint(ec);
 	if (ec) {
@@ -104,6 +322,15 @@ uint16_t CSocket::GetPort() const {
 }
 
 bool CSocket::Bind(const std::string& ip, uint16_t port) {
+	if (type_ == TRANSPORT_CUSTOM) {
+		// wrapped transports are connected already
+		return false;
+	}
+	if (type_ == TRANSPORT_SHM) {
+		// the port only names the shared memory segment
+		impl_->shm_port = port;
+		return true;
+	}
 	boost::system::error_code ec;
 	boost::asio::ip::address address;
 
@@ -132,6 +359,8 @@ bool CSocket::Bind(const std::string& ip, uint16_t port) {
 		}
 		return false;
 	}
+	// inherited by accepted sockets
+	apply_buffer_options(impl_->acceptor.native_handle(), impl_->options, verbose_);
 
 	// Use dual stack IPv4 and IPv6
 	if (endpoint.protocol() == tcp::v6()) {
@@ -178,6 +407,13 @@ bool CSocket::Bind(const std::string& ip, uint16_t port) {
 }
 
 bool CSocket::Listen(int backlog) {
+	if (type_ == TRANSPORT_CUSTOM) {
+		return false;
+	}
+	if (type_ == TRANSPORT_SHM) {
+		impl_->shm_listener = ShmListener::Create(impl_->shm_port, verbose_);
+		return impl_->shm_listener != nullptr;
+	}
 	boost::system::error_code ec;
 	impl_->acceptor.listen(backlog);
 	if (ec) {
@@ -190,7 +426,35 @@ bool CSocket::Listen(int backlog) {
 	return true;
 }
 
-std::unique_ptr<CSocket> CSocket::Accept() {
+// waits until fd becomes readable, false on timeout
+static bool poll_readable(int fd, int timeout_ms) {
+	pollfd pfd = {fd, POLLIN, 0};
+	int ret;
+	do {
+		ret = poll(&pfd, 1, timeout_ms);
+	} while (ret < 0 && errno == EINTR);
+	// errors are reported by the subsequent read or accept
+	return ret != 0;
+}
+
+std::unique_ptr<CSocket> CSocket::Accept(int timeout_ms) {
+	if (type_ == TRANSPORT_SHM) {
+		auto transport = impl_->shm_listener ? impl_->shm_listener->Accept(timeout_ms) : nullptr;
+		if (!transport) {
+			return nullptr;
+		}
+		auto csocket = std::make_unique<CSocket>(std::move(transport), verbose_);
+		csocket->type_ = TRANSPORT_SHM;
+		csocket->impl_->shm_port = impl_->shm_port;
+		return csocket;
+	}
+	if (type_ == TRANSPORT_CUSTOM) {
+		return nullptr;
+	}
+	if (timeout_ms >= 0 && impl_->acceptor.is_open()
+			&& !poll_readable(impl_->acceptor.native_handle(), timeout_ms)) {
+		return nullptr;
+	}
 	boost::system::error_code ec;
 	auto socket = impl_->acceptor.accept(ec);
 	if (ec) {
@@ -200,12 +464,22 @@ std::unique_ptr<CSocket> CSocket::Accept() {
 		}
 		return nullptr;
 	}
-	auto csocket = std::make_unique<CSocket>();
+	auto csocket = std::make_unique<CSocket>(type_, verbose_);
 	csocket->impl_ = std::make_unique<CSocketImpl>(impl_->io_context, std::move(socket));
+	csocket->SetOptions(impl_->options);
+	csocket->AttachUring();
 	return csocket;
 }
 
 bool CSocket::Connect(const std::string& host, uint16_t port) {
+	if (type_ == TRANSPORT_CUSTOM) {
+		return false;
+	}
+	if (type_ == TRANSPORT_SHM) {
+		impl_->shm_port = port;
+		impl_->transport = ShmConnect(port, verbose_);
+		return impl_->transport != nullptr;
+	}
 	boost::system::error_code ec;
 	tcp::resolver resolver(*impl_->io_context);
 
@@ -217,7 +491,20 @@ bool CSocket::Connect(const std::string& host, uint16_t port) {
 		return false;
 	}
 
-	boost::asio::connect(impl_->socket, endpoints, ec);
+	// like boost::asio::connect, but the buffer sizes have to be set between opening and connecting
+	ec = boost::asio::error::not_found;
+	for (const auto& entry : endpoints) {
+		impl_->socket.close();
+		impl_->socket.open(entry.endpoint().protocol(), ec);
+		if (ec) {
+			continue;
+		}
+		apply_buffer_options(impl_->socket.native_handle(), impl_->options, verbose_);
+		impl_->socket.connect(entry.endpoint(), ec);
+		if (!ec) {
+			break;
+		}
+	}
 	if (ec) {
 		if (verbose_) {
 			std::cerr << "connect failed: " << ec.message() << "\n";
@@ -233,33 +520,117 @@ bool CSocket::Connect(const std::string& host, uint16_t port) {
 		}
 		return false;
 	}
+	impl_->zerocopy = apply_connected_options(impl_->socket.native_handle(), impl_->options, verbose_);
+	AttachUring();
 	return true;
 }
 
-size_t CSocket::Receive(void* buf, size_t bytes) {
-	boost::system::error_code ec;
-	auto bytes_transferred =
-		boost::asio::read(impl_->socket, boost::asio::buffer(buf, bytes), ec);
-	if (ec && verbose_) {
-		std::cerr << "read failed: " << ec.message() << "\n";
+void CSocket::AttachUring() {
+	if (type_ == TRANSPORT_TCP_URING) {
+		// stays on the asio path if io_uring cannot be used
+		impl_->transport = CreateUringTransport(impl_->socket.native_handle(), verbose_);
 	}
-	{
-		std::lock_guard<std::mutex> lock(recv_count_mutex_);
-		recv_count_ += bytes_transferred;
+}
+
+size_t CSocket::Receive(void* buf, size_t bytes) {
+	size_t bytes_transferred;
+	if (impl_->transport) {
+		bytes_transferred = impl_->transport->Receive(buf, bytes);
+	} else {
+		boost::system::error_code ec;
+		bytes_transferred =
+			boost::asio::read(impl_->socket, boost::asio::buffer(buf, bytes), ec);
+		if (ec && verbose_) {
+			std::cerr << "read failed: " << ec.message() << "\n";
+		}
+#ifdef TCP_QUICKACK
+		if (impl_->options.quickack && !ec) {
+			set_int_option(impl_->socket.native_handle(), IPPROTO_TCP, TCP_QUICKACK, 1, "TCP_QUICKACK", verbose_);
+		}
+#endif
 	}
+	recv_count_.fetch_add(bytes_transferred, std::memory_order_relaxed);
 	return bytes_transferred;
 }
 
+bool CSocket::Poll(int timeout_ms) {
+	if (impl_->transport) {
+		return impl_->transport->Poll(timeout_ms);
+	}
+	if (!impl_->socket.is_open()) {
+		return true;
+	}
+	return poll_readable(impl_->socket.native_handle(), timeout_ms);
+}
+
 size_t CSocket::Send(const void* buf, size_t bytes) {
-	boost::system::error_code ec;
-	auto bytes_transferred =
-		boost::asio::write(impl_->socket, boost::asio::buffer(buf, bytes), ec);
-	if (ec && verbose_) {
-		std::cerr << "write failed: " << ec.message() << "\n";
+	size_t bytes_transferred;
+	if (impl_->transport) {
+		bytes_transferred = impl_->transport->Send(buf, bytes);
+#ifdef HAVE_MSG_ZEROCOPY
+	} else if (impl_->zerocopy && bytes >= impl_->options.zerocopy_min_bytes) {
+		iovec iov = {const_cast<void*>(buf), bytes};
+		bytes_transferred = impl_->send_zerocopy(&iov, 1, verbose_);
+#endif
+	} else {
+		boost::system::error_code ec;
+		bytes_transferred =
+			boost::asio::write(impl_->socket, boost::asio::buffer(buf, bytes), ec);
+		if (ec && verbose_) {
+			std::cerr << "write failed: " << ec.message() << "\n";
+		}
 	}
-	{
-		std::lock_guard<std::mutex> lock(send_count_mutex_);
-		send_count_ += bytes_transferred;
+	send_count_.fetch_add(bytes_transferred, std::memory_order_relaxed);
+	return bytes_transferred;
+}
+
+size_t CSocket::SendV(const iovec* iov, int iovcnt) {
+	size_t bytes_transferred;
+	if (impl_->transport) {
+		bytes_transferred = impl_->transport->SendV(iov, iovcnt);
+#ifdef HAVE_MSG_ZEROCOPY
+	} else if (impl_->zerocopy && std::accumulate(iov, iov + iovcnt, uint64_t(0), [](uint64_t sum, const iovec& v) {
+			return sum + v.iov_len; }) >= impl_->options.zerocopy_min_bytes) {
+		// the threshold applies to the whole batch, the send thread splits messages into fragments
+		bytes_transferred = impl_->send_zerocopy(iov, iovcnt, verbose_);
+#endif
+	} else {
+		std::vector<boost::asio::const_buffer> buffers;
+		buffers.reserve(iovcnt);
+		for (int i = 0; i < iovcnt; i++) {
+			buffers.emplace_back(iov[i].iov_base, iov[i].iov_len);
+		}
+		boost::system::error_code ec;
+		bytes_transferred = boost::asio::write(impl_->socket, buffers, ec);
+		if (ec && verbose_) {
+			std::cerr << "write failed: " << ec.message() << "\n";
+		}
 	}
+	send_count_.fetch_add(bytes_transferred, std::memory_order_relaxed);
 	return bytes_transferred;
-}
\ No newline at end of file
+}
+
+bool CSocket::UsesZerocopy() const {
+	return impl_->zerocopy;
+}
+
+uint64_t CSocket::getZerocopySends() const {
+	return impl_->zerocopy_sends.load(std::memory_order_relaxed);
+}
+
+bool CSocket::UsesUring() const {
+	return type_ == TRANSPORT_TCP_URING && impl_->transport != nullptr;
+}
+
+int CSocket::ReleaseNativeHandle() {
+	if (impl_->transport || !impl_->socket.is_open()) {
+		return -1;
+	}
+	// duplicate instead of asio's release(), which is not available in all supported Boost versions
+	int fd = ::dup(impl_->socket.native_handle());
+	if (fd < 0 && verbose_) {
+		std::cerr << "dup failed: " << std::strerror(errno) << "\n";
+	}
+	Close();
+	return fd;
+}
@@ -19,15 +19,49 @@ along with this program. If not, see <http://www.gnu.org/licenses/>.
 #ifndef __SOCKET_H__BY_SGCHOI
 #define __SOCKET_H__BY_SGCHOI
 
+#include <atomic>
 #include <cstdint>
 #include <memory>
-#include <mutex>
 #include <string>
+#include <sys/uio.h>
 
 
+class CTransport;
+
+enum transport_type {
+	TRANSPORT_TCP, //TCP via boost::asio
+	TRANSPORT_SHM, //shared-memory rings, only for parties on the same host. The port identifies the listener
+	TRANSPORT_TCP_URING, //TCP driven through io_uring, TRANSPORT_TCP is used if io_uring is not available
+	TRANSPORT_CUSTOM //a connected CTransport handed to CSocket, e.g. network emulation or a resumable session
+};
+
+enum socket_profile {
+	SOCKET_PROFILE_DEFAULT, //operating system defaults, only TCP_NODELAY
+	SOCKET_PROFILE_LATENCY, //LAN ping-pong: busy polling and immediate ACKs
+	SOCKET_PROFILE_THROUGHPUT, //LAN bulk transfers: larger buffers, MSG_ZEROCOPY for large sends
+	SOCKET_PROFILE_WAN //high bandwidth-delay product links: very large buffers
+};
+
+/**
+ * TCP tuning applied by CSocket. Options the operating system does not support or rejects
+ * (e.g. buffer sizes beyond net.core.[rw]mem_max) are skipped, they never fail the connection.
+ */
+struct socket_options {
+	int sndbuf = 0; //SO_SNDBUF in bytes, 0 keeps the system default
+	int rcvbuf = 0; //SO_RCVBUF in bytes, set before connecting such that the window scale is large enough
+	int busy_poll_us = 0; //SO_BUSY_POLL, 0 disables busy polling
+	bool quickack = false; //TCP_QUICKACK, re-armed after every receive as the kernel clears it
+	uint64_t zerocopy_min_bytes = 0; //sends of at least this many bytes use MSG_ZEROCOPY, 0 disables it
+
+	static socket_options from_profile(socket_profile profile);
+};
+
 class CSocket {
 public:
 	CSocket(bool verbose=false);
+	CSocket(transport_type type, bool verbose=false);
+	//wrap an already connected transport, of type TRANSPORT_CUSTOM. GetIP, GetPort and SetOptions are forwarded to it
+	CSocket(std::unique_ptr<CTransport> transport, bool verbose=false);
 	~CSocket();
 
 	uint64_t getSndCnt() const;
@@ -37,8 +71,15 @@ public:
 
 	bool Socket();
 
+	//takes effect on the next Bind/Connect, on connected sockets immediately. Accepted sockets inherit the options of the listener
+	void SetOptions(const socket_options& options);
+	const socket_options& GetOptions() const;
+
 	void Close();
 
+	//ends the connection in both directions, such that calls blocked in other threads return. Close is still required
+	void Shutdown();
+
 	std::string GetIP() const;
 
 	uint16_t GetPort() const;
@@ -47,20 +88,44 @@ public:
 
 	bool Listen(int nQLen = 5);
 
-	std::unique_ptr<CSocket> Accept();
+	//waits at most timeout_ms for a connection if timeout_ms is not negative, nullptr on timeout
+	std::unique_ptr<CSocket> Accept(int timeout_ms = -1);
 
 	bool Connect(const std::string& host, uint16_t port);
 
 	size_t Receive(void* buf, size_t bytes);
 
+	//waits until data can be received or the connection was closed, false after timeout_ms
+	bool Poll(int timeout_ms);
+
 	size_t Send(const void* buf, size_t bytes);
 
+	//writes all iovcnt buffers, as few system calls as possible
+	size_t SendV(const iovec* iov, int iovcnt);
+
+	/**
+	 * Hand the underlying OS socket over to the caller, e.g., to drive it from a shared event loop.
+	 * This CSocket is closed afterwards. Returns -1 if the socket is not connected.
+	 */
+	int ReleaseNativeHandle();
+
+	//whether the connection is driven by io_uring, only possible with TRANSPORT_TCP_URING
+	bool UsesUring() const;
+
+	//whether large sends use MSG_ZEROCOPY, which is turned off once the kernel reports that it copied the data anyway
+	bool UsesZerocopy() const;
+	//number of MSG_ZEROCOPY system calls on this socket
+	uint64_t getZerocopySends() const;
+
 private:
+	//with TRANSPORT_TCP_URING, switch the connected socket over to io_uring
+	void AttachUring();
+
 	struct CSocketImpl;
 	std::unique_ptr<CSocketImpl> impl_;
-	uint64_t send_count_, recv_count_;
-	mutable std::mutex send_count_mutex_;
-	mutable std::mutex recv_count_mutex_;
+	transport_type type_;
+	//only used for statistics, hence relaxed atomics without any ordering
+	std::atomic<uint64_t> send_count_, recv_count_;
 	bool verbose_;
 };
 
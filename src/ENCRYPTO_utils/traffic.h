@@ -0,0 +1,122 @@
+/**
+ \file 		traffic.h
+ \copyright	ABY - A Framework for Efficient Mixed-protocol Secure Two-party Computation
+			Copyright (C) 2019 ENCRYPTO Group, TU Darmstadt
+			This program is free software: you can redistribute it and/or modify
+            it under the terms of the GNU Lesser General Public License as published
+            by the Free Software Foundation, either version 3 of the License, or
+            (at your option) any later version.
+            ABY is distributed in the hope that it will be useful,
+            but WITHOUT ANY WARRANTY; without even the implied warranty of
+            MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+            GNU Lesser General Public License for more details.
+            You should have received a copy of the GNU Lesser General Public License
+            along with this program. If not, see <http://www.gnu.org/licenses/>.
+ \brief		Per-channel traffic accounting
+ */
+
+#ifndef TRAFFIC_H_
+#define TRAFFIC_H_
+
+#include "channel_map.h"
+#include "constants.h"
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+
+struct traffic_counters {
+	uint64_t bytes; //bytes on the wire, including frame headers
+	uint64_t msgs; //frames
+};
+
+/**
+ * Byte and message counters for every channel id. They are written by the send or receive
+ * thread only and can be read from any thread, so the counters may be sampled before and
+ * after a protocol stage to attribute its bandwidth. Channels below MAX_NUM_COMM_CHANNELS are
+ * counted without locking, larger ids in a sparse table behind a mutex. The entries of released
+ * large ids are folded into a single retired counter, so the table does not grow with every channel.
+ */
+class channel_traffic {
+public:
+	channel_traffic() {
+		for(uint32_t i = 0; i < MAX_NUM_COMM_CHANNELS; i++) {
+			m_nBytes[i].store(0, std::memory_order_relaxed);
+			m_nMsgs[i].store(0, std::memory_order_relaxed);
+		}
+	}
+
+	void add(uint32_t channelid, uint64_t bytes) {
+		if(channelid < MAX_NUM_COMM_CHANNELS) {
+			m_nBytes[channelid].fetch_add(bytes, std::memory_order_relaxed);
+			m_nMsgs[channelid].fetch_add(1, std::memory_order_relaxed);
+			return;
+		}
+		std::lock_guard<std::mutex> lock(m_mSparse);
+		traffic_counters& c = m_mSparseCounters[channelid];
+		c.bytes += bytes;
+		c.msgs++;
+	}
+
+	//traffic of a channel that was released already, only counted in total()
+	void add_retired(uint32_t channelid, uint64_t bytes) {
+		if(channelid < MAX_NUM_COMM_CHANNELS) {
+			add(channelid, bytes);
+			return;
+		}
+		std::lock_guard<std::mutex> lock(m_mSparse);
+		m_sRetired.bytes += bytes;
+		m_sRetired.msgs++;
+	}
+
+	//called when a channel is released, get() starts from zero if the id is used again
+	void retire(uint32_t channelid) {
+		if(channelid < MAX_NUM_COMM_CHANNELS) {
+			return;
+		}
+		std::lock_guard<std::mutex> lock(m_mSparse);
+		traffic_counters* c = m_mSparseCounters.find(channelid);
+		if(c) {
+			m_sRetired.bytes += c->bytes;
+			m_sRetired.msgs += c->msgs;
+			m_mSparseCounters.erase(channelid);
+		}
+	}
+
+	traffic_counters get(uint32_t channelid) const {
+		if(channelid < MAX_NUM_COMM_CHANNELS) {
+			return {m_nBytes[channelid].load(std::memory_order_relaxed),
+				m_nMsgs[channelid].load(std::memory_order_relaxed)};
+		}
+		std::lock_guard<std::mutex> lock(m_mSparse);
+		traffic_counters* c = m_mSparseCounters.find(channelid);
+		return c ? *c : traffic_counters{0, 0};
+	}
+
+	//sum over all channels, including the admin channel
+	traffic_counters total() const {
+		traffic_counters sum = {0, 0};
+		for(uint32_t i = 0; i < MAX_NUM_COMM_CHANNELS; i++) {
+			sum.bytes += m_nBytes[i].load(std::memory_order_relaxed);
+			sum.msgs += m_nMsgs[i].load(std::memory_order_relaxed);
+		}
+		std::lock_guard<std::mutex> lock(m_mSparse);
+		sum.bytes += m_sRetired.bytes;
+		sum.msgs += m_sRetired.msgs;
+		m_mSparseCounters.for_each([&sum](uint32_t, const traffic_counters& c) {
+			sum.bytes += c.bytes;
+			sum.msgs += c.msgs;
+		});
+		return sum;
+	}
+
+private:
+	std::array<std::atomic<uint64_t>, MAX_NUM_COMM_CHANNELS> m_nBytes;
+	std::array<std::atomic<uint64_t>, MAX_NUM_COMM_CHANNELS> m_nMsgs;
+	//counters of larger channel ids, those of released channels are kept in m_sRetired such that total() matches the socket
+	mutable std::mutex m_mSparse;
+	channel_map<traffic_counters> m_mSparseCounters;
+	traffic_counters m_sRetired = {0, 0};
+};
+
+#endif /* TRAFFIC_H_ */
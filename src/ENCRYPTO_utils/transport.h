@@ -0,0 +1,73 @@
+/**
+ \file 		transport.h
+ \copyright	ABY - A Framework for Efficient Mixed-protocol Secure Two-party Computation
+			Copyright (C) 2019 ENCRYPTO Group, TU Darmstadt
+			This program is free software: you can redistribute it and/or modify
+            it under the terms of the GNU Lesser General Public License as published
+            by the Free Software Foundation, either version 3 of the License, or
+            (at your option) any later version.
+            ABY is distributed in the hope that it will be useful,
+            but WITHOUT ANY WARRANTY; without even the implied warranty of
+            MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+            GNU Lesser General Public License for more details.
+            You should have received a copy of the GNU Lesser General Public License
+            along with this program. If not, see <http://www.gnu.org/licenses/>.
+ \brief		Byte stream transport underneath CSocket
+ */
+
+#ifndef TRANSPORT_H_
+#define TRANSPORT_H_
+
+#include "socket.h"
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <sys/uio.h>
+
+/**
+ * A connected, reliable byte stream. CSocket uses TCP via boost::asio unless it was created
+ * on top of another transport.
+ */
+class CTransport {
+public:
+	virtual ~CTransport() = default;
+
+	// blocks until all bytes are written, returns fewer only if the connection was closed
+	virtual size_t Send(const void* buf, size_t bytes) = 0;
+
+	// gathering send, transports that can write several buffers at once override it
+	virtual size_t SendV(const iovec* iov, int iovcnt) {
+		size_t sent = 0;
+		for (int i = 0; i < iovcnt; i++) {
+			size_t n = Send(iov[i].iov_base, iov[i].iov_len);
+			sent += n;
+			if (n != iov[i].iov_len) {
+				break;
+			}
+		}
+		return sent;
+	}
+
+	// blocks until all bytes are read, returns fewer only if the connection was closed
+	virtual size_t Receive(void* buf, size_t bytes) = 0;
+
+	// waits until data can be received or the connection was closed, false after timeout_ms
+	virtual bool Poll(int timeout_ms) = 0;
+
+	virtual void Close() = 0;
+
+	// local address of the underlying connection, for transports that wrap a socket
+	virtual std::string GetIP() const {
+		return "";
+	}
+	virtual uint16_t GetPort() const {
+		return 0;
+	}
+
+	// TCP tuning of the underlying connection, ignored by transports without one
+	virtual void SetOptions(const socket_options& options) {
+		(void) options;
+	}
+};
+
+#endif /* TRANSPORT_H_ */
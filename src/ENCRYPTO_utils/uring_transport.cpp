@@ -0,0 +1,455 @@
+/**
+ \file 		uring_transport.cpp
+ \copyright	ABY - A Framework for Efficient Mixed-protocol Secure Two-party Computation
+			Copyright (C) 2019 ENCRYPTO Group, TU Darmstadt
+			This program is free software: you can redistribute it and/or modify
+            it under the terms of the GNU Lesser General Public License as published
+            by the Free Software Foundation, either version 3 of the License, or
+            (at your option) any later version.
+            ABY is distributed in the hope that it will be useful,
+            but WITHOUT ANY WARRANTY; without even the implied warranty of
+            MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+            GNU Lesser General Public License for more details.
+            You should have received a copy of the GNU Lesser General Public License
+            along with this program. If not, see <http://www.gnu.org/licenses/>.
+ \brief		io_uring transport for connected TCP sockets
+ */
+
+#include "uring_transport.h"
+
+#if defined(__linux__) && !defined(ENCRYPTO_UTILS_NO_IO_URING) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+// multishot receives into provided buffer rings need Linux 6.0
+#if defined(IORING_RECV_MULTISHOT) && defined(IORING_FEAT_EXT_ARG)
+#define HAVE_IO_URING
+#endif
+#endif
+
+#ifdef HAVE_IO_URING
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <vector>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// the ring indices are shared with the kernel
+template<class T>
+static T load_acquire(const T* p) {
+	return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+template<class T>
+static void store_release(T* p, T v) {
+	__atomic_store_n(p, v, __ATOMIC_RELEASE);
+}
+
+/**
+ * One io_uring instance, used by a single thread. Only the few operations needed by
+ * UringTransport are implemented on top of the system calls.
+ */
+class uring_queue {
+public:
+	~uring_queue() {
+		if (sqes != MAP_FAILED) {
+			munmap(sqes, sqes_size);
+		}
+		if (ring != MAP_FAILED) {
+			munmap(ring, ring_size);
+		}
+		if (fd >= 0) {
+			close(fd);
+		}
+	}
+
+	bool init(unsigned entries) {
+		io_uring_params p;
+		memset(&p, 0, sizeof(p));
+		fd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &p));
+		if (fd < 0) {
+			return false;
+		}
+		if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_EXT_ARG)) {
+			errno = ENOTSUP;
+			return false;
+		}
+		ring_size = std::max<size_t>(p.sq_off.array + p.sq_entries * sizeof(unsigned),
+				p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe));
+		ring = mmap(nullptr, ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+		if (ring == MAP_FAILED) {
+			return false;
+		}
+		sqes_size = p.sq_entries * sizeof(io_uring_sqe);
+		sqes = static_cast<io_uring_sqe*>(mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES));
+		if (sqes == MAP_FAILED) {
+			return false;
+		}
+		uint8_t* base = static_cast<uint8_t*>(ring);
+		sq_head = reinterpret_cast<unsigned*>(base + p.sq_off.head);
+		sq_tail = reinterpret_cast<unsigned*>(base + p.sq_off.tail);
+		sq_mask = *reinterpret_cast<unsigned*>(base + p.sq_off.ring_mask);
+		sq_array = reinterpret_cast<unsigned*>(base + p.sq_off.array);
+		sq_entries = p.sq_entries;
+		cq_head = reinterpret_cast<unsigned*>(base + p.cq_off.head);
+		cq_tail = reinterpret_cast<unsigned*>(base + p.cq_off.tail);
+		cq_mask = *reinterpret_cast<unsigned*>(base + p.cq_off.ring_mask);
+		cqes = reinterpret_cast<io_uring_cqe*>(base + p.cq_off.cqes);
+		sqe_tail = *sq_tail;
+		return true;
+	}
+
+	// a zeroed submission entry, nullptr if the submission queue is full
+	io_uring_sqe* get_sqe() {
+		if (sqe_tail - load_acquire(sq_head) >= sq_entries) {
+			return nullptr;
+		}
+		unsigned idx = sqe_tail & sq_mask;
+		io_uring_sqe* sqe = &sqes[idx];
+		memset(sqe, 0, sizeof(*sqe));
+		sq_array[idx] = idx;
+		sqe_tail++;
+		return sqe;
+	}
+
+	// submits the prepared entries and waits for min_complete completions, at most timeout_ms if
+	// it is not negative. Returns false with errno set on error, ETIME on timeout
+	bool submit_and_wait(unsigned min_complete, int timeout_ms = -1) {
+		store_release(sq_tail, sqe_tail);
+		__kernel_timespec ts;
+		ts.tv_sec = timeout_ms / 1000;
+		ts.tv_nsec = (timeout_ms % 1000) * 1000000LL;
+		io_uring_getevents_arg arg;
+		memset(&arg, 0, sizeof(arg));
+		arg.sigmask_sz = _NSIG / 8;
+		arg.ts = reinterpret_cast<uint64_t>(&ts);
+		unsigned flags = (timeout_ms < 0 ? 0 : IORING_ENTER_EXT_ARG) | (min_complete > 0 ? IORING_ENTER_GETEVENTS : 0);
+		while (true) {
+			unsigned to_submit = sqe_tail - load_acquire(sq_head);
+			long ret = syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+					timeout_ms < 0 ? nullptr : &arg, sizeof(arg));
+			if (ret >= 0) {
+				return true;
+			}
+			if (errno != EINTR) {
+				return false;
+			}
+		}
+	}
+
+	io_uring_cqe* peek_cqe() {
+		unsigned head = *cq_head;
+		if (head == load_acquire(cq_tail)) {
+			return nullptr;
+		}
+		return &cqes[head & cq_mask];
+	}
+
+	void cqe_seen() {
+		store_release(cq_head, *cq_head + 1);
+	}
+
+	bool register_op(unsigned opcode, const void* arg, unsigned nr) {
+		return syscall(__NR_io_uring_register, fd, opcode, arg, nr) >= 0;
+	}
+
+private:
+	int fd = -1;
+	void* ring = MAP_FAILED;
+	size_t ring_size = 0;
+	io_uring_sqe* sqes = static_cast<io_uring_sqe*>(MAP_FAILED);
+	size_t sqes_size = 0;
+	unsigned* sq_head = nullptr;
+	unsigned* sq_tail = nullptr;
+	unsigned* sq_array = nullptr;
+	unsigned sq_mask = 0;
+	unsigned sq_entries = 0;
+	unsigned sqe_tail = 0; // entries up to here are prepared, they are published on submit
+	unsigned* cq_head = nullptr;
+	unsigned* cq_tail = nullptr;
+	unsigned cq_mask = 0;
+	io_uring_cqe* cqes = nullptr;
+};
+
+
+// Send and SendV are called by the send thread, Receive and Poll by the receive thread,
+// hence each side has its own ring.
+class UringTransport : public CTransport {
+public:
+	UringTransport(int fd, bool verbose)
+		: fd_(fd), verbose_(verbose), tx_buf_(new uint8_t[URING_TX_BUF_SIZE]),
+		rx_bufs_(new uint8_t[URING_RX_BUFS * URING_RX_BUF_SIZE]),
+		buf_ring_tail_(0), rx_armed_(false), rx_eof_(false), closed_(false)
+	{}
+
+	bool init() {
+		if (!tx_.init(8) || !rx_.init(64)) {
+			return fail("io_uring_setup");
+		}
+		// fixed files spare the lookup of the descriptor on every operation
+		if (!tx_.register_op(IORING_REGISTER_FILES, &fd_, 1) || !rx_.register_op(IORING_REGISTER_FILES, &fd_, 1)) {
+			return fail("IORING_REGISTER_FILES");
+		}
+		iovec txbuf = {tx_buf_.get(), URING_TX_BUF_SIZE};
+		if (!tx_.register_op(IORING_REGISTER_BUFFERS, &txbuf, 1)) {
+			return fail("IORING_REGISTER_BUFFERS");
+		}
+		// the buffer ring has to be page aligned
+		buf_ring_.addr = mmap(nullptr, buf_ring_.size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+		if (buf_ring_.addr == MAP_FAILED) {
+			return fail("mmap");
+		}
+		io_uring_buf_reg reg;
+		memset(&reg, 0, sizeof(reg));
+		reg.ring_addr = reinterpret_cast<uint64_t>(buf_ring_.addr);
+		reg.ring_entries = URING_RX_BUFS;
+		reg.bgid = 0;
+		if (!rx_.register_op(IORING_REGISTER_PBUF_RING, &reg, 1)) {
+			return fail("IORING_REGISTER_PBUF_RING");
+		}
+		for (uint16_t bid = 0; bid < URING_RX_BUFS; bid++) {
+			recycle(bid);
+		}
+		return true;
+	}
+
+	size_t Send(const void* buf, size_t bytes) override {
+		iovec iov = {const_cast<void*>(buf), bytes};
+		return SendV(&iov, 1);
+	}
+
+	size_t SendV(const iovec* iov, int iovcnt) override {
+		size_t total = 0;
+		for (int i = 0; i < iovcnt; i++) {
+			total += iov[i].iov_len;
+		}
+		if (total <= URING_TX_BUF_SIZE) {
+			// small frames are gathered into the registered buffer
+			size_t off = 0;
+			for (int i = 0; i < iovcnt; i++) {
+				memcpy(tx_buf_.get() + off, iov[i].iov_base, iov[i].iov_len);
+				off += iov[i].iov_len;
+			}
+			size_t sent = 0;
+			while (sent < total) {
+				io_uring_sqe* sqe = tx_.get_sqe();
+				sqe->opcode = IORING_OP_WRITE_FIXED;
+				sqe->fd = 0;
+				sqe->flags = IOSQE_FIXED_FILE;
+				sqe->addr = reinterpret_cast<uint64_t>(tx_buf_.get() + sent);
+				sqe->len = total - sent;
+				sqe->buf_index = 0;
+				int res = complete_tx();
+				if (res <= 0) {
+					return sent;
+				}
+				sent += res;
+			}
+			return sent;
+		}
+
+		std::vector<iovec> remaining(iov, iov + iovcnt);
+		size_t first = 0, sent = 0;
+		while (sent < total) {
+			msghdr msg;
+			memset(&msg, 0, sizeof(msg));
+			msg.msg_iov = remaining.data() + first;
+			msg.msg_iovlen = remaining.size() - first;
+			io_uring_sqe* sqe = tx_.get_sqe();
+			sqe->opcode = IORING_OP_SENDMSG;
+			sqe->fd = 0;
+			sqe->flags = IOSQE_FIXED_FILE;
+			sqe->addr = reinterpret_cast<uint64_t>(&msg);
+			sqe->len = 1;
+			sqe->msg_flags = MSG_NOSIGNAL;
+			int res = complete_tx();
+			if (res <= 0) {
+				return sent;
+			}
+			sent += res;
+			// skip what was written after a short send
+			size_t n = res;
+			while (first < remaining.size() && n >= remaining[first].iov_len) {
+				n -= remaining[first++].iov_len;
+			}
+			if (n > 0) {
+				remaining[first].iov_base = static_cast<uint8_t*>(remaining[first].iov_base) + n;
+				remaining[first].iov_len -= n;
+			}
+		}
+		return sent;
+	}
+
+	size_t Receive(void* buf, size_t bytes) override {
+		uint8_t* dst = static_cast<uint8_t*>(buf);
+		size_t received = 0;
+		while (received < bytes) {
+			if (pending_.empty()) {
+				wait_data(-1);
+				if (pending_.empty()) {
+					break;
+				}
+			}
+			rx_chunk& chunk = pending_.front();
+			size_t n = std::min<size_t>(chunk.len - chunk.off, bytes - received);
+			memcpy(dst + received, rx_bufs_.get() + chunk.bid * URING_RX_BUF_SIZE + chunk.off, n);
+			chunk.off += n;
+			received += n;
+			if (chunk.off == chunk.len) {
+				recycle(chunk.bid);
+				pending_.pop_front();
+			}
+		}
+		return received;
+	}
+
+	bool Poll(int timeout_ms) override {
+		return wait_data(timeout_ms);
+	}
+
+	void Close() override {
+		if (!closed_.exchange(true)) {
+			// completes the outstanding receive, the descriptor itself belongs to the caller
+			shutdown(fd_, SHUT_RDWR);
+		}
+	}
+
+private:
+	struct rx_chunk {
+		uint16_t bid;
+		uint32_t len;
+		uint32_t off;
+	};
+
+	struct buf_ring_mapping {
+		void* addr = MAP_FAILED;
+		size_t size = URING_RX_BUFS * sizeof(io_uring_buf);
+		~buf_ring_mapping() {
+			if (addr != MAP_FAILED) {
+				munmap(addr, size);
+			}
+		}
+	};
+
+	bool fail(const char* what) {
+		if (verbose_) {
+			std::cerr << "io_uring unavailable, " << what << " failed: " << std::strerror(errno) << "\n";
+		}
+		return false;
+	}
+
+	// submits the prepared send and returns its result
+	int complete_tx() {
+		io_uring_cqe* cqe;
+		do {
+			if (!tx_.submit_and_wait(1)) {
+				return -errno;
+			}
+		} while ((cqe = tx_.peek_cqe()) == nullptr);
+		int res = cqe->res;
+		tx_.cqe_seen();
+		if (res < 0 && verbose_) {
+			std::cerr << "io_uring write failed: " << std::strerror(-res) << "\n";
+		}
+		return res;
+	}
+
+	// hands buffer bid back to the kernel
+	void recycle(uint16_t bid) {
+		io_uring_buf_ring* br = static_cast<io_uring_buf_ring*>(buf_ring_.addr);
+		// not br->bufs, the flexible array member is misplaced when the kernel header is compiled as C++
+		io_uring_buf& b = static_cast<io_uring_buf*>(buf_ring_.addr)[buf_ring_tail_ & (URING_RX_BUFS - 1)];
+		b.addr = reinterpret_cast<uint64_t>(rx_bufs_.get() + bid * URING_RX_BUF_SIZE);
+		b.len = URING_RX_BUF_SIZE;
+		b.bid = bid;
+		buf_ring_tail_++;
+		store_release(&br->tail, buf_ring_tail_);
+	}
+
+	// a single receive request keeps delivering data until it runs out of buffers
+	void arm_receive() {
+		io_uring_sqe* sqe = rx_.get_sqe();
+		sqe->opcode = IORING_OP_RECV;
+		sqe->fd = 0;
+		sqe->flags = IOSQE_FIXED_FILE | IOSQE_BUFFER_SELECT;
+		sqe->ioprio = IORING_RECV_MULTISHOT;
+		sqe->buf_group = 0;
+		rx_armed_ = true;
+	}
+
+	void reap_receives() {
+		while (io_uring_cqe* cqe = rx_.peek_cqe()) {
+			if (cqe->res > 0) {
+				pending_.push_back({static_cast<uint16_t>(cqe->flags >> IORING_CQE_BUFFER_SHIFT),
+						static_cast<uint32_t>(cqe->res), 0});
+			} else if (cqe->res != -ENOBUFS) {
+				// end of stream or error. ENOBUFS only means that all buffers are in use
+				if (cqe->res < 0 && verbose_) {
+					std::cerr << "io_uring read failed: " << std::strerror(-cqe->res) << "\n";
+				}
+				rx_eof_ = true;
+			}
+			if (!(cqe->flags & IORING_CQE_F_MORE)) {
+				rx_armed_ = false;
+			}
+			rx_.cqe_seen();
+		}
+	}
+
+	// true once data is pending or the connection was closed, false on timeout
+	bool wait_data(int timeout_ms) {
+		reap_receives();
+		while (pending_.empty() && !rx_eof_) {
+			if (!rx_armed_) {
+				arm_receive();
+			}
+			if (!rx_.submit_and_wait(1, timeout_ms)) {
+				if (errno == ETIME) {
+					reap_receives();
+					return !pending_.empty() || rx_eof_;
+				}
+				fail("io_uring_enter");
+				rx_eof_ = true;
+			}
+			reap_receives();
+		}
+		return true;
+	}
+
+	int fd_;
+	bool verbose_;
+	// declared before the rings, such that the rings are torn down before the memory they use is released
+	std::unique_ptr<uint8_t[]> tx_buf_;
+	std::unique_ptr<uint8_t[]> rx_bufs_;
+	buf_ring_mapping buf_ring_;
+	uring_queue tx_;
+	uring_queue rx_;
+	uint16_t buf_ring_tail_;
+	std::deque<rx_chunk> pending_;
+	bool rx_armed_;
+	bool rx_eof_;
+	std::atomic<bool> closed_;
+};
+
+std::unique_ptr<CTransport> CreateUringTransport(int fd, bool verbose) {
+	auto transport = std::make_unique<UringTransport>(fd, verbose);
+	if (!transport->init()) {
+		return nullptr;
+	}
+	return transport;
+}
+
+#else
+
+std::unique_ptr<CTransport> CreateUringTransport(int, bool) {
+	return nullptr;
+}
+
+#endif
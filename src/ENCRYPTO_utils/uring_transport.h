@@ -0,0 +1,37 @@
+/**
+ \file 		uring_transport.h
+ \copyright	ABY - A Framework for Efficient Mixed-protocol Secure Two-party Computation
+			Copyright (C) 2019 ENCRYPTO Group, TU Darmstadt
+			This program is free software: you can redistribute it and/or modify
+            it under the terms of the GNU Lesser General Public License as published
+            by the Free Software Foundation, either version 3 of the License, or
+            (at your option) any later version.
+            ABY is distributed in the hope that it will be useful,
+            but WITHOUT ANY WARRANTY; without even the implied warranty of
+            MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+            GNU Lesser General Public License for more details.
+            You should have received a copy of the GNU Lesser General Public License
+            along with this program. If not, see <http://www.gnu.org/licenses/>.
+ \brief		io_uring transport for connected TCP sockets
+ */
+
+#ifndef URING_TRANSPORT_H_
+#define URING_TRANSPORT_H_
+
+#include "transport.h"
+#include <memory>
+
+#define URING_TX_BUF_SIZE (1 << 18) //registered staging buffer, smaller sends are gathered into it
+#define URING_RX_BUFS 64 //provided buffers for multishot receives, a power of two
+#define URING_RX_BUF_SIZE (1 << 14)
+
+/**
+ * Drive the connected socket fd through io_uring: receives are served from a multishot receive
+ * into provided buffers, gathered sends of small frames go through a registered buffer. fd stays
+ * owned by the caller and has to outlive the transport.
+ * Returns nullptr if io_uring is not available, because it was disabled at build time or the
+ * kernel does not support (or forbids) the required features.
+ */
+std::unique_ptr<CTransport> CreateUringTransport(int fd, bool verbose);
+
+#endif /* URING_TRANSPORT_H_ */
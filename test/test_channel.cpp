@@ -0,0 +1,849 @@
+
+#include <gtest/gtest.h>
+#include "ENCRYPTO_utils/async_connection.h"
+#include "ENCRYPTO_utils/channel.h"
+#include "ENCRYPTO_utils/compression.h"
+#include "ENCRYPTO_utils/connection.h"
+#include "ENCRYPTO_utils/frame.h"
+#include "ENCRYPTO_utils/netem_transport.h"
+#include "ENCRYPTO_utils/rcvthread.h"
+#include "ENCRYPTO_utils/resume_transport.h"
+#include "ENCRYPTO_utils/shm_transport.h"
+#include "ENCRYPTO_utils/sndthread.h"
+#include "ENCRYPTO_utils/socket.h"
+#include "ENCRYPTO_utils/uring_transport.h"
+#include <algorithm>
+#include <arpa/inet.h>
+#include <atomic>
+#include <chrono>
+#include <fcntl.h>
+#include <mutex>
+#include <numeric>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+// Two parties connected over loopback, each with its own send and receive thread
+class TestChannel : public ::testing::Test {
+protected:
+	struct party {
+		std::unique_ptr<CSocket> sock;
+		CLock lock;
+		std::unique_ptr<RcvThread> rcv;
+		std::unique_ptr<SndThread> snd;
+	};
+
+	virtual transport_type transport() const {
+		return TRANSPORT_TCP;
+	}
+
+	void SetUp() override {
+		static uint16_t port = 7766;
+		port++;
+		std::thread server([this] { parties[0].sock = Listen("127.0.0.1", port, transport()); });
+		parties[1].sock = Connect("127.0.0.1", port, transport());
+		server.join();
+		ASSERT_TRUE(parties[0].sock);
+		ASSERT_TRUE(parties[1].sock);
+		for (auto& p : parties) {
+			p.rcv = std::make_unique<RcvThread>(p.sock.get(), &p.lock);
+			p.snd = std::make_unique<SndThread>(p.sock.get(), &p.lock);
+			p.rcv->Start();
+			p.snd->Start();
+		}
+	}
+
+	void TearDown() override {
+		for (auto& p : parties) {
+			p.snd.reset();
+		}
+		for (auto& p : parties) {
+			p.rcv.reset();
+		}
+	}
+
+	std::unique_ptr<channel> make_channel(size_t party, uint32_t id) {
+		return std::make_unique<channel>(id, parties[party].rcv.get(), parties[party].snd.get());
+	}
+
+	// both sides have to synchronize concurrently, as each waits for the other's end signal
+	static void finish(channel& a, channel& b) {
+		std::thread t([&a] { a.synchronize_end(); });
+		b.synchronize_end();
+		t.join();
+	}
+
+	party parties[2];
+};
+
+TEST_F(TestChannel, ReceiveAcrossMessages) {
+	auto snd = make_channel(0, 1);
+	auto rcv = make_channel(1, 1);
+
+	std::vector<uint8_t> data(1000);
+	std::iota(data.begin(), data.end(), 0);
+	// many small messages that have to be combined into one receive
+	for (size_t i = 0; i < data.size(); i += 10) {
+		snd->send(data.data() + i, 10);
+	}
+
+	std::vector<uint8_t> result(data.size());
+	// receive a prefix that ends in the middle of a message, then the rest
+	rcv->blocking_receive(result.data(), 15);
+	rcv->blocking_receive(result.data() + 15, result.size() - 15);
+	ASSERT_EQ(result, data);
+
+	// every message is accounted with its frame header on both sides
+	auto sent = snd->get_traffic().snd;
+	auto received = rcv->get_traffic().rcv;
+	ASSERT_EQ(sent.msgs, data.size() / 10);
+	ASSERT_EQ(sent.bytes, data.size() + sent.msgs * FRAME_HEADER_SIZE);
+	ASSERT_EQ(received.msgs, sent.msgs);
+	ASSERT_EQ(received.bytes, sent.bytes);
+	ASSERT_EQ(parties[0].snd->get_total_traffic().bytes, parties[0].sock->getSndCnt());
+
+	finish(*snd, *rcv);
+}
+
+TEST_F(TestChannel, ManyChannelsWithLargeIds) {
+	std::vector<uint32_t> ids = {FRAME_ID_EXTENDED, ADMIN_CHANNEL + 1, 70000, UINT32_MAX};
+	for (uint32_t id = 1000; id < 3000; id++) {
+		ids.push_back(id);
+	}
+	for (int round = 0; round < 2; round++) {
+		// the second round registers the same ids again after they were released
+		std::vector<std::unique_ptr<channel>> snd, rcv;
+		for (uint32_t id : ids) {
+			snd.push_back(make_channel(0, id));
+			rcv.push_back(make_channel(1, id));
+			snd.back()->send(reinterpret_cast<uint8_t*>(&id), sizeof(id));
+		}
+		for (size_t i = 0; i < ids.size(); i++) {
+			uint32_t id;
+			rcv[i]->blocking_receive(reinterpret_cast<uint8_t*>(&id), sizeof(id));
+			ASSERT_EQ(id, ids[i]);
+		}
+		// only the extended ids pay for their varint
+		ASSERT_EQ(frame_header_size(ADMIN_CHANNEL - 2), FRAME_HEADER_SIZE);
+		ASSERT_EQ(frame_header_size(70000), FRAME_HEADER_SIZE + 3);
+		// released ids start counting from zero again
+		ASSERT_EQ(rcv[2]->get_traffic().rcv.bytes, FRAME_HEADER_SIZE + 3 + sizeof(uint32_t));
+		ASSERT_EQ(frame_header_size(UINT32_MAX), FRAME_HEADER_MAX_SIZE);
+		for (size_t i = 0; i < ids.size(); i++) {
+			finish(*snd[i], *rcv[i]);
+		}
+	}
+	// the traffic of the released channels is still part of the total
+	ASSERT_EQ(parties[0].snd->get_total_traffic().bytes, parties[0].sock->getSndCnt());
+}
+
+TEST_F(TestChannel, PriorityOvertakesLargeMessage) {
+	auto bulk_snd = make_channel(0, 20);
+	auto bulk_rcv = make_channel(1, 20);
+	auto urgent_snd = make_channel(0, 21);
+	auto urgent_rcv = make_channel(1, 21);
+	bulk_snd->set_priority(SND_NUM_PRIORITIES - 1);
+	urgent_snd->set_priority(0);
+
+	std::vector<uint8_t> data(64 << 20);
+	std::iota(data.begin(), data.end(), 0);
+	bulk_snd->send(data.data(), data.size());
+	uint8_t ping = 42;
+	urgent_snd->send(&ping, 1);
+
+	// the small message is sent between the fragments of the large one
+	uint8_t pong;
+	urgent_rcv->blocking_receive(&pong, 1);
+	ASSERT_EQ(pong, ping);
+	ASSERT_FALSE(bulk_rcv->data_available());
+	std::vector<uint8_t> result(data.size());
+	bulk_rcv->blocking_receive(result.data(), result.size());
+	ASSERT_EQ(result, data);
+	ASSERT_EQ(bulk_snd->get_traffic().snd.msgs, data.size() / SND_FRAGMENT_SIZE);
+	ASSERT_EQ(urgent_snd->get_flow_stats().snd_msgs, 1u);
+
+	// compressed fragments are reassembled as well
+	std::vector<uint8_t> sparse(3 * SND_FRAGMENT_SIZE + 5, 0);
+	for (size_t i = 0; i < sparse.size(); i += 1000) {
+		sparse[i] = static_cast<uint8_t>(i);
+	}
+	bulk_snd->set_compression(1);
+	bulk_snd->send(sparse.data(), sparse.size());
+	result.resize(sparse.size());
+	bulk_rcv->blocking_receive(result.data(), result.size());
+	ASSERT_EQ(result, sparse);
+
+	finish(*bulk_snd, *bulk_rcv);
+	finish(*urgent_snd, *urgent_rcv);
+}
+
+TEST_F(TestChannel, PartialBlockThenWholeBlock) {
+	auto snd = make_channel(0, 2);
+	auto rcv = make_channel(1, 2);
+
+	uint8_t data[8] = {1, 2, 3, 4, 5, 6, 7, 8};
+	snd->send(data, sizeof(data));
+
+	uint8_t first[3];
+	rcv->blocking_receive(first, sizeof(first));
+	ASSERT_EQ(first[2], 3);
+
+	uint64_t nbytes;
+	uint8_t* rest = rcv->blocking_receive_chunk(&nbytes);
+	ASSERT_EQ(nbytes, 5u);
+	ASSERT_EQ(rest[0], 4);
+	ASSERT_EQ(rest[4], 8);
+	free(rest);
+
+	finish(*snd, *rcv);
+}
+
+TEST_F(TestChannel, SendChunked) {
+	auto snd = make_channel(0, 3);
+	auto rcv = make_channel(1, 3);
+
+	std::vector<uint8_t> data(100000);
+	for (size_t i = 0; i < data.size(); i++) {
+		data[i] = static_cast<uint8_t>(i * 7);
+	}
+	snd->send_chunked(data.data(), data.size(), 4096);
+
+	std::vector<uint8_t> result(data.size());
+	uint64_t expected_offset = 0;
+	size_t chunks = 0;
+	rcv->blocking_receive_chunked(result.data(), result.size(),
+		[&](uint8_t* chunk, uint64_t offset, uint64_t nbytes) {
+			ASSERT_EQ(offset, expected_offset);
+			ASSERT_EQ(chunk, result.data() + offset);
+			ASSERT_LE(nbytes, 4096u);
+			expected_offset += nbytes;
+			chunks++;
+		});
+	ASSERT_EQ(expected_offset, data.size());
+	ASSERT_EQ(chunks, (data.size() + 4095) / 4096);
+	ASSERT_EQ(result, data);
+
+	finish(*snd, *rcv);
+}
+
+TEST_F(TestChannel, FlowControlBoundsReceiveQueue) {
+	const uint64_t window = 4000;
+	auto snd = make_channel(0, 4);
+	auto rcv = make_channel(1, 4);
+	snd->set_flow_control(window);
+	rcv->set_flow_control(window);
+
+	std::vector<uint8_t> data(100 * 1000);
+	std::iota(data.begin(), data.end(), 0);
+	std::thread sender([&] {
+		for (size_t i = 0; i < data.size(); i += 1000) {
+			snd->send(data.data() + i, 1000);
+		}
+	});
+
+	// give the sender time to run into the window before consuming anything
+	std::this_thread::sleep_for(std::chrono::milliseconds(50));
+	ASSERT_LE(rcv->get_flow_stats().rcv_queued_bytes, window);
+
+	std::vector<uint8_t> result(data.size());
+	rcv->blocking_receive(result.data(), result.size());
+	sender.join();
+	ASSERT_EQ(result, data);
+
+	ASSERT_LE(rcv->get_flow_stats().rcv_peak_queued_bytes, window);
+	ASSERT_GT(snd->get_flow_stats().snd_stall_ns, 0u);
+
+	finish(*snd, *rcv);
+}
+
+TEST_F(TestChannel, PostedReceiveSkipsQueue) {
+	auto snd = make_channel(0, 5);
+	auto rcv = make_channel(1, 5);
+
+	// a large message that arrives after the buffers were posted is never queued
+	std::vector<uint8_t> data(3 * SND_FRAGMENT_SIZE + 17);
+	std::iota(data.begin(), data.end(), 0);
+	std::vector<uint8_t> head(1000), tail(data.size() - head.size());
+	rcv->post_receive(head.data(), head.size());
+	rcv->post_receive(tail.data(), tail.size());
+	snd->send(data.data(), data.size());
+	rcv->wait_for_posted();
+	ASSERT_TRUE(std::equal(head.begin(), head.end(), data.begin()));
+	ASSERT_TRUE(std::equal(tail.begin(), tail.end(), data.begin() + head.size()));
+	ASSERT_EQ(rcv->get_flow_stats().rcv_peak_queued_bytes, 0u);
+
+	// the part of a message beyond the posted buffer is queued as usual
+	snd->send(data.data(), data.size());
+	rcv->post_receive(head.data(), head.size());
+	rcv->wait_for_posted();
+	uint64_t nbytes;
+	uint8_t* rest = rcv->blocking_receive_chunk(&nbytes);
+	ASSERT_EQ(nbytes, data.size() - head.size());
+	ASSERT_TRUE(std::equal(rest, rest + nbytes, data.begin() + head.size()));
+	free(rest);
+
+	finish(*snd, *rcv);
+}
+
+TEST(TestAsyncConnection, InteroperatesWithChannel) {
+	const uint16_t port = 7700;
+	std::unique_ptr<CSocket> server_sock;
+	std::thread server([&] { server_sock = Listen("127.0.0.1", port); });
+	auto client_sock = Connect("127.0.0.1", port);
+	server.join();
+	ASSERT_TRUE(server_sock);
+	ASSERT_TRUE(client_sock);
+
+	// the server serves its connection from a shared event loop
+	AsyncIOContext context;
+	context.run(2);
+	auto conn = std::make_unique<AsyncConnection>(context, std::move(server_sock));
+
+	// the client uses the thread-based interface
+	CLock lock;
+	auto rcv = std::make_unique<RcvThread>(client_sock.get(), &lock);
+	auto snd = std::make_unique<SndThread>(client_sock.get(), &lock);
+	rcv->Start();
+	snd->Start();
+	auto chan = std::make_unique<channel>(5, rcv.get(), snd.get());
+
+	std::vector<uint8_t> ping = {1, 2, 3, 4};
+	auto received = conn->async_receive(5);
+	chan->send(ping.data(), ping.size());
+	ASSERT_EQ(received.get(), ping);
+
+	std::vector<uint8_t> pong(3000, 42);
+	conn->async_send(5, pong.data(), pong.size()).get();
+	std::vector<uint8_t> result(pong.size());
+	chan->blocking_receive(result.data(), result.size());
+	ASSERT_EQ(result, pong);
+
+	// channel ids beyond one byte are understood by both interfaces
+	auto wide = std::make_unique<channel>(300000, rcv.get(), snd.get());
+	received = conn->async_receive(300000);
+	wide->send(ping.data(), ping.size());
+	ASSERT_EQ(received.get(), ping);
+	conn->async_send(300000, pong.data(), pong.size()).get();
+	wide->blocking_receive(result.data(), result.size());
+	ASSERT_EQ(result, pong);
+	wide.reset();
+
+	// ending the channel fails outstanding receives
+	auto pending = conn->async_receive(5);
+	chan->signal_end();
+	ASSERT_THROW(pending.get(), std::runtime_error);
+	ASSERT_TRUE(conn->is_finished(5));
+
+	conn->signal_end(5);
+	chan->wait_for_fin();
+
+	// receives still outstanding when the other party shuts down fail, their handlers may query the connection
+	std::promise<bool> finished;
+	AsyncConnection* c = conn.get();
+	conn->async_receive(6, [&finished, c](bool success, std::vector<uint8_t>) {
+		finished.set_value(!success && c->is_finished(6));
+	});
+
+	// channels release their state in the threads, so they go first
+	chan.reset();
+	snd.reset();
+	ASSERT_TRUE(finished.get_future().get());
+	conn.reset();
+	rcv.reset();
+	context.stop();
+}
+
+TEST(TestConnection, ParallelSocketsWithBackoff) {
+	const uint16_t port = 7701;
+	const size_t nsockets = 16;
+	std::vector<std::unique_ptr<CSocket>> client(nsockets);
+	std::vector<std::vector<std::unique_ptr<CSocket>>> server(2);
+	server[0].resize(nsockets);
+	server[1].resize(nsockets);
+
+	connection_options options;
+	options.timeout_ms = 5000;
+	connection_report client_report, server_report;
+	// the client starts first and has to retry until the server listens
+	std::thread t([&] { ASSERT_TRUE(Connect("127.0.0.1", port, client, 1, options, &client_report)); });
+	std::this_thread::sleep_for(std::chrono::milliseconds(50));
+	ASSERT_TRUE(Listen("127.0.0.1", port, server, nsockets, 0, options, &server_report));
+	t.join();
+
+	ASSERT_GT(client_report.attempts, nsockets);
+	ASSERT_FALSE(client_report.timed_out);
+	ASSERT_EQ(server_report.attempts, nsockets);
+	for (size_t i = 0; i < nsockets; i++) {
+		ASSERT_TRUE(server[1][i]);
+		// the handshake placed each socket at the index of its peer
+		uint32_t val = static_cast<uint32_t>(i);
+		client[i]->Send(&val, sizeof(val));
+		server[1][i]->Receive(&val, sizeof(val));
+		ASSERT_EQ(val, i);
+	}
+
+	// nobody listens: the deadline bounds the attempts
+	std::vector<std::unique_ptr<CSocket>> unconnected(2);
+	options.timeout_ms = 100;
+	auto begin = std::chrono::steady_clock::now();
+	ASSERT_FALSE(Connect("127.0.0.1", port + 1, unconnected, 1, options, &client_report));
+	ASSERT_TRUE(client_report.timed_out);
+	ASSERT_LT(std::chrono::steady_clock::now() - begin, std::chrono::seconds(2));
+
+	// nobody connects: the deadline bounds a single accept as well
+	begin = std::chrono::steady_clock::now();
+	ASSERT_FALSE(Listen("127.0.0.1", port + 2, options));
+	ASSERT_LT(std::chrono::steady_clock::now() - begin, std::chrono::seconds(2));
+}
+
+TEST(TestSocketOptions, ProfilesTransferData) {
+	uint16_t port = 7720;
+	std::vector<uint8_t> data(8 << 20);
+	std::iota(data.begin(), data.end(), 0);
+	for (socket_profile profile : {SOCKET_PROFILE_LATENCY, SOCKET_PROFILE_THROUGHPUT, SOCKET_PROFILE_WAN}) {
+		connection_options options;
+		options.socket = socket_options::from_profile(profile);
+		std::unique_ptr<CSocket> server;
+		std::thread t([&] { server = Listen("127.0.0.1", port, options); });
+		auto client = Connect("127.0.0.1", port, options);
+		t.join();
+		port++;
+		ASSERT_TRUE(server);
+		ASSERT_TRUE(client);
+		ASSERT_EQ(server->GetOptions().sndbuf, options.socket.sndbuf);
+
+		// large sends take the MSG_ZEROCOPY path with the throughput profile
+		std::thread sender([&] { client->Send(data.data(), data.size()); });
+		std::vector<uint8_t> result(data.size());
+		ASSERT_EQ(server->Receive(result.data(), result.size()), result.size());
+		sender.join();
+		ASSERT_EQ(result, data);
+	}
+}
+
+TEST(TestSocketOptions, ChannelTrafficUsesZerocopy) {
+	const uint16_t port = 7730;
+	connection_options options;
+	options.socket = socket_options::from_profile(SOCKET_PROFILE_THROUGHPUT);
+	std::unique_ptr<CSocket> socks[2];
+	std::thread t([&] { socks[0] = Listen("127.0.0.1", port, options); });
+	socks[1] = Connect("127.0.0.1", port, options);
+	t.join();
+	ASSERT_TRUE(socks[0]);
+	ASSERT_TRUE(socks[1]);
+	if (!socks[1]->UsesZerocopy()) {
+		GTEST_SKIP() << "MSG_ZEROCOPY is not available";
+	}
+
+	CLock locks[2];
+	std::unique_ptr<RcvThread> rcv[2];
+	std::unique_ptr<SndThread> snd[2];
+	std::unique_ptr<channel> chans[2];
+	for (int i = 0; i < 2; i++) {
+		rcv[i] = std::make_unique<RcvThread>(socks[i].get(), &locks[i]);
+		snd[i] = std::make_unique<SndThread>(socks[i].get(), &locks[i]);
+		rcv[i]->Start();
+		snd[i]->Start();
+		chans[i] = std::make_unique<channel>(1, rcv[i].get(), snd[i].get());
+	}
+
+	// the message is split into fragments below the threshold, the batch of them is sent with MSG_ZEROCOPY
+	std::vector<uint8_t> data(8 << 20);
+	std::iota(data.begin(), data.end(), 0);
+	chans[1]->send(data.data(), data.size());
+	std::vector<uint8_t> result(data.size());
+	chans[0]->blocking_receive(result.data(), result.size());
+	ASSERT_EQ(result, data);
+	ASSERT_GT(socks[1]->getZerocopySends(), 0u);
+
+	std::thread fin([&] { chans[0]->synchronize_end(); });
+	chans[1]->synchronize_end();
+	fin.join();
+	for (int i = 0; i < 2; i++) {
+		chans[i].reset();
+		snd[i].reset();
+	}
+	for (int i = 0; i < 2; i++) {
+		rcv[i].reset();
+	}
+}
+
+TEST(TestNetem, DelaysAndLimitsBandwidth) {
+	uint16_t port = 7740;
+	std::unique_ptr<CSocket> server;
+	std::thread t([&] { server = Listen("127.0.0.1", port); });
+	auto client = Connect("127.0.0.1", port);
+	t.join();
+	ASSERT_TRUE(server);
+	ASSERT_TRUE(client);
+	netem_options options;
+	options.rtt_us = 20000;
+	options.bandwidth_bps = 80000000;
+	options.reorder_probability = 0.1;
+	options.seed = 1;
+	uint16_t client_port = client->GetPort();
+	server = EmulateNetwork(std::move(server), options);
+	client = EmulateNetwork(std::move(client), options);
+	// the emulated sockets report the addresses of the TCP connections they wrap
+	ASSERT_EQ(server->GetPort(), port);
+	ASSERT_EQ(client->GetPort(), client_port);
+	ASSERT_EQ(client->GetIP(), "127.0.0.1");
+
+	using clock = std::chrono::steady_clock;
+	uint8_t ping = 42;
+	auto begin = clock::now();
+	client->Send(&ping, 1);
+	server->Receive(&ping, 1);
+	server->Send(&ping, 1);
+	client->Receive(&ping, 1);
+	ASSERT_GE(clock::now() - begin, std::chrono::microseconds(options.rtt_us));
+
+	// 1 MB takes at least 100 ms at 80 Mbit/s and arrives intact despite late chunks
+	std::vector<uint8_t> data(1000000);
+	std::iota(data.begin(), data.end(), 0);
+	begin = clock::now();
+	std::thread sender([&] { client->Send(data.data(), data.size()); });
+	std::vector<uint8_t> result(data.size());
+	ASSERT_EQ(server->Receive(result.data(), result.size()), result.size());
+	sender.join();
+	ASSERT_GE(clock::now() - begin, std::chrono::milliseconds(100));
+	ASSERT_EQ(result, data);
+}
+
+// forwards TCP connections to another port, kill() drops all of them like a network outage would
+class BlipProxy {
+public:
+	BlipProxy(uint16_t port, uint16_t target) : target_(target) {
+		listen_fd_ = socket(AF_INET, SOCK_STREAM, 0);
+		int one = 1;
+		setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		sockaddr_in addr = {};
+		addr.sin_family = AF_INET;
+		addr.sin_port = htons(port);
+		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		bind(listen_fd_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr));
+		listen(listen_fd_, 4);
+		acceptor_ = std::thread([this] { AcceptMain(); });
+	}
+
+	~BlipProxy() {
+		stop_ = true;
+		acceptor_.join();
+		kill();
+		for (auto& t : pumps_) {
+			t.join();
+		}
+		for (int fd : fds_) {
+			close(fd);
+		}
+		close(listen_fd_);
+	}
+
+	void kill() {
+		std::lock_guard<std::mutex> lock(mtx_);
+		for (int fd : fds_) {
+			shutdown(fd, SHUT_RDWR);
+		}
+	}
+
+	int accepted() const {
+		return accepted_;
+	}
+
+private:
+	void AcceptMain() {
+		while (!stop_) {
+			pollfd pfd = {listen_fd_, POLLIN, 0};
+			if (poll(&pfd, 1, 20) <= 0) {
+				continue;
+			}
+			int client = accept(listen_fd_, nullptr, nullptr);
+			sockaddr_in addr = {};
+			addr.sin_family = AF_INET;
+			addr.sin_port = htons(target_);
+			addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+			// the target may not listen yet
+			int server;
+			while (true) {
+				server = socket(AF_INET, SOCK_STREAM, 0);
+				if (connect(server, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0) {
+					break;
+				}
+				close(server);
+				std::this_thread::sleep_for(std::chrono::milliseconds(5));
+			}
+			std::lock_guard<std::mutex> lock(mtx_);
+			accepted_++;
+			fds_.push_back(client);
+			fds_.push_back(server);
+			pumps_.emplace_back([client, server] { Pump(client, server); });
+			pumps_.emplace_back([client, server] { Pump(server, client); });
+		}
+	}
+
+	static void Pump(int from, int to) {
+		std::vector<char> buf(1 << 16);
+		ssize_t n;
+		while ((n = recv(from, buf.data(), buf.size(), 0)) > 0) {
+			for (ssize_t sent = 0; sent < n;) {
+				ssize_t m = send(to, buf.data() + sent, n - sent, MSG_NOSIGNAL);
+				if (m <= 0) {
+					return;
+				}
+				sent += m;
+			}
+		}
+		shutdown(to, SHUT_WR);
+	}
+
+	uint16_t target_;
+	int listen_fd_;
+	std::atomic<bool> stop_{false};
+	std::atomic<int> accepted_{0};
+	std::mutex mtx_;
+	std::vector<int> fds_;
+	std::vector<std::thread> pumps_;
+	std::thread acceptor_;
+};
+
+TEST(TestResume, ChannelsSurviveConnectionLoss) {
+	const uint16_t port = 7750;
+	BlipProxy proxy(port + 1, port);
+	resume_options options;
+	options.max_unacked_bytes = 4 << 20;
+	std::unique_ptr<CSocket> socks[2];
+	std::thread t([&] { socks[0] = ListenResumable("127.0.0.1", port, options); });
+	socks[1] = ConnectResumable("127.0.0.1", port + 1, options);
+	t.join();
+	ASSERT_TRUE(socks[0]);
+	ASSERT_TRUE(socks[1]);
+	ASSERT_EQ(socks[0]->GetPort(), port);
+
+	CLock locks[2];
+	std::unique_ptr<RcvThread> rcv[2];
+	std::unique_ptr<SndThread> snd[2];
+	std::unique_ptr<channel> chans[2];
+	for (int i = 0; i < 2; i++) {
+		rcv[i] = std::make_unique<RcvThread>(socks[i].get(), &locks[i]);
+		snd[i] = std::make_unique<SndThread>(socks[i].get(), &locks[i]);
+		rcv[i]->Start();
+		snd[i]->Start();
+		chans[i] = std::make_unique<channel>(1, rcv[i].get(), snd[i].get());
+	}
+
+	// the connection is dropped while messages are in flight, the stream continues after the reconnect
+	std::vector<uint8_t> data(1 << 20);
+	std::iota(data.begin(), data.end(), 0);
+	const int nmsgs = 16;
+	std::thread sender([&] {
+		for (int i = 0; i < nmsgs; i++) {
+			chans[0]->send(data.data(), data.size());
+		}
+	});
+	std::vector<uint8_t> result(data.size());
+	std::unique_ptr<CSocket> stray;
+	auto killed = std::chrono::steady_clock::now();
+	for (int i = 0; i < nmsgs; i++) {
+		chans[1]->blocking_receive(result.data(), result.size());
+		ASSERT_EQ(result, data);
+		if (i == 3) {
+			// a connection that never sends a handshake is queued before the one of the other party
+			stray = Connect("127.0.0.1", port);
+			ASSERT_TRUE(stray);
+			killed = std::chrono::steady_clock::now();
+			proxy.kill();
+		}
+	}
+	ASSERT_LT(std::chrono::steady_clock::now() - killed, std::chrono::seconds(5));
+	sender.join();
+	ASSERT_EQ(proxy.accepted(), 2);
+
+	// and in the other direction
+	uint8_t ping = 42, pong = 0;
+	chans[1]->send(&ping, 1);
+	chans[0]->blocking_receive(&pong, 1);
+	ASSERT_EQ(pong, ping);
+
+	std::thread fin([&] { chans[0]->synchronize_end(); });
+	chans[1]->synchronize_end();
+	fin.join();
+	for (int i = 0; i < 2; i++) {
+		chans[i].reset();
+		snd[i].reset();
+	}
+	for (int i = 0; i < 2; i++) {
+		rcv[i].reset();
+	}
+}
+
+TEST(TestCompression, ZeroRunRoundTrip) {
+	std::vector<std::vector<uint8_t>> inputs;
+	inputs.push_back(std::vector<uint8_t>(4096, 0));
+	// sparse data: a few set bytes between long zero runs, ending in a literal and in a zero run
+	std::vector<uint8_t> sparse(10000, 0);
+	for (size_t i = 0; i < sparse.size(); i += 97) {
+		sparse[i] = static_cast<uint8_t>(i);
+	}
+	inputs.push_back(sparse);
+	sparse.back() = 0xff;
+	inputs.push_back(sparse);
+
+	std::vector<uint8_t> out;
+	for (auto& in : inputs) {
+		uint64_t complen = zrle_compress(in.data(), in.size(), out);
+		ASSERT_GT(complen, 0u);
+		ASSERT_LT(complen, in.size());
+		uint64_t rawlen;
+		ASSERT_TRUE(zrle_decompressed_size(out.data(), complen, &rawlen));
+		ASSERT_EQ(rawlen, in.size());
+		std::vector<uint8_t> result(rawlen);
+		ASSERT_TRUE(zrle_decompress(out.data(), complen, result.data(), rawlen));
+		ASSERT_EQ(result, in);
+		// truncated input must be rejected
+		ASSERT_FALSE(zrle_decompress(out.data(), complen - 1, result.data(), rawlen));
+	}
+
+	// incompressible data is reported as such
+	std::vector<uint8_t> dense(1000);
+	std::iota(dense.begin(), dense.end(), 1);
+	ASSERT_EQ(zrle_compress(dense.data(), dense.size(), out), 0u);
+}
+
+TEST_F(TestChannel, CompressedMessages) {
+	auto snd = make_channel(0, 6);
+	auto rcv = make_channel(1, 6);
+	snd->set_compression(64);
+
+	std::vector<uint8_t> sparse(100000, 0);
+	for (size_t i = 0; i < sparse.size(); i += 1000) {
+		sparse[i] = 1;
+	}
+	std::vector<uint8_t> dense(1000);
+	std::iota(dense.begin(), dense.end(), 1);
+	uint8_t tiny[4] = {0, 0, 0, 0};
+
+	snd->send(sparse.data(), sparse.size());
+	snd->send(dense.data(), dense.size());
+	snd->send(tiny, sizeof(tiny));
+
+	std::vector<uint8_t> result(sparse.size());
+	rcv->blocking_receive(result.data(), result.size());
+	ASSERT_EQ(result, sparse);
+	result.resize(dense.size());
+	rcv->blocking_receive(result.data(), result.size());
+	ASSERT_EQ(result, dense);
+	result.resize(sizeof(tiny));
+	rcv->blocking_receive(result.data(), result.size());
+	ASSERT_EQ(result[0], 0);
+
+	auto snd_stats = snd->get_compression_stats().snd;
+	auto rcv_stats = rcv->get_compression_stats().rcv;
+	// the tiny message is below the threshold, the dense one is sent uncompressed
+	ASSERT_EQ(snd_stats.raw_bytes, sparse.size() + dense.size());
+	ASSERT_LT(snd_stats.wire_bytes, sparse.size() / 10 + dense.size());
+	ASSERT_EQ(rcv_stats.raw_bytes, sparse.size());
+	ASSERT_EQ(rcv_stats.wire_bytes + dense.size(), snd_stats.wire_bytes);
+
+	finish(*snd, *rcv);
+}
+
+class TestShmChannel : public TestChannel {
+protected:
+	transport_type transport() const override {
+		return TRANSPORT_SHM;
+	}
+};
+
+class TestUringChannel : public TestChannel {
+protected:
+	transport_type transport() const override {
+		return TRANSPORT_TCP_URING;
+	}
+};
+
+TEST_F(TestUringChannel, ManySmallAndLargeMessages) {
+	if (!parties[0].sock->UsesUring()) {
+		GTEST_SKIP() << "io_uring is not available";
+	}
+	auto snd = make_channel(0, 1);
+	auto rcv = make_channel(1, 1);
+
+	// small messages are batched by the send thread and received from shared buffers,
+	// the large one exceeds both the registered send buffer and the provided receive buffers
+	std::vector<uint8_t> data(URING_TX_BUF_SIZE * 8 + 77);
+	std::iota(data.begin(), data.end(), 0);
+	for (size_t i = 0; i < 10000; i++) {
+		snd->send(data.data() + i, 3);
+	}
+	snd->send(data.data(), data.size());
+
+	std::vector<uint8_t> result(3);
+	for (size_t i = 0; i < 10000; i++) {
+		rcv->blocking_receive(result.data(), result.size());
+		ASSERT_TRUE(std::equal(result.begin(), result.end(), data.begin() + i));
+	}
+	result.resize(data.size());
+	rcv->blocking_receive(result.data(), result.size());
+	ASSERT_EQ(result, data);
+
+	finish(*snd, *rcv);
+}
+
+TEST_F(TestShmChannel, MessagesLargerThanRing) {
+	auto snd = make_channel(0, 1);
+	auto rcv = make_channel(1, 1);
+	auto back_snd = make_channel(1, 2);
+	auto back_rcv = make_channel(0, 2);
+
+	std::vector<uint8_t> data(3 * SHM_RING_SIZE + 12345);
+	for (size_t i = 0; i < data.size(); i++) {
+		data[i] = static_cast<uint8_t>(i * 7 + (i >> 13));
+	}
+	snd->send(data.data(), data.size());
+	for (size_t i = 0; i < 100; i++) {
+		back_snd->send(data.data() + i, 1);
+	}
+
+	std::vector<uint8_t> result(data.size());
+	rcv->blocking_receive(result.data(), result.size());
+	ASSERT_EQ(result, data);
+	result.resize(100);
+	back_rcv->blocking_receive(result.data(), result.size());
+	ASSERT_TRUE(std::equal(result.begin(), result.end(), data.begin()));
+
+	finish(*snd, *rcv);
+	finish(*back_snd, *back_rcv);
+}
+
+TEST(TestShm, ListenerOwnsItsPort) {
+	const uint16_t port = 7790;
+	auto listener = ShmListener::Create(port, false);
+	ASSERT_TRUE(listener);
+	// a live listener is not taken over
+	ASSERT_FALSE(ShmListener::Create(port, false));
+
+	// a claimed but never accepted slot does not outlive the listener
+	auto client = ShmConnect(port, false);
+	ASSERT_TRUE(client);
+	std::string slot = "/encrypto_utils_shm_" + std::to_string(port) + "_0";
+	int fd = shm_open(slot.c_str(), O_RDONLY, 0);
+	ASSERT_GE(fd, 0);
+	close(fd);
+	listener.reset();
+	ASSERT_LT(shm_open(slot.c_str(), O_RDONLY, 0), 0);
+
+	// the segment of a listener that died without cleaning up is replaced
+	pid_t child = fork();
+	if (child == 0) {
+		_exit(ShmListener::Create(port, false).release() ? 0 : 1);
+	}
+	int status;
+	ASSERT_EQ(waitpid(child, &status, 0), child);
+	ASSERT_EQ(WEXITSTATUS(status), 0);
+	listener = ShmListener::Create(port, false);
+	ASSERT_TRUE(listener);
+}
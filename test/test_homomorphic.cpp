@@ -0,0 +1,490 @@
+
+#include <gtest/gtest.h>
+#include "ENCRYPTO_utils/crypto/batch.h"
+#include "ENCRYPTO_utils/crypto/dgk.h"
+#include "ENCRYPTO_utils/crypto/djn.h"
+#include "ENCRYPTO_utils/crypto/prime_search.h"
+#include "ENCRYPTO_utils/utils.h"
+#include <gmp.h>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <sys/stat.h>
+#include <thread>
+#include <vector>
+
+
+// values that are initialized and cleared with the test
+struct mpz_array {
+	explicit mpz_array(size_t n) : n(n), v((mpz_t*) malloc(sizeof(mpz_t) * n)) {
+		for(size_t i = 0; i < n; i++) {
+			mpz_init(v[i]);
+		}
+	}
+	~mpz_array() {
+		for(size_t i = 0; i < n; i++) {
+			mpz_clear(v[i]);
+		}
+		free(v);
+	}
+	size_t n;
+	mpz_t* v;
+};
+
+TEST(TestHomomorphic, DJNEncryptBatch) {
+	djn_pubkey_t* pub;
+	djn_prvkey_t* prv;
+	djn_keygen(1024, &pub, &prv);
+
+	const size_t n = 40;
+	mpz_array pt(n), ct(n);
+	mpz_t dec;
+	mpz_init(dec);
+	for(size_t i = 0; i < n; i++) {
+		aby_prng(pt.v[i], 1000);
+	}
+
+	thread_pool pool(3);
+	randomizer_pipeline randomizers(pub->h_s, pub->n_squared, pub->rbits, n / 2);
+	randomizers.wait();
+
+	for(djn_prvkey_t* key : {prv, static_cast<djn_prvkey_t*>(nullptr)}) {
+		for(randomizer_pipeline* rp : {static_cast<randomizer_pipeline*>(nullptr), &randomizers}) {
+			djn_encrypt_batch(ct.v, pub, key, pt.v, n, &pool, rp);
+			for(size_t i = 0; i < n; i++) {
+				djn_decrypt(dec, pub, prv, ct.v[i]);
+				ASSERT_EQ(mpz_cmp(dec, pt.v[i]), 0) << i;
+			}
+		}
+	}
+	// the randomizers were used up by the first batch that asked for them
+	ASSERT_EQ(randomizers.available(), 0u);
+
+	mpz_clear(dec);
+	djn_freepubkey(pub);
+	djn_freeprvkey(prv);
+}
+
+TEST(TestHomomorphic, RandomizerPool) {
+	djn_pubkey_t* pub;
+	djn_prvkey_t* prv;
+	djn_keygen(1024, &pub, &prv);
+
+	randomizer_pool_options options;
+	options.capacity = 16;
+	randomizer_pool pool(pub->h_s, pub->n_squared, pub->rbits, options);
+	pool.wait();
+	ASSERT_EQ(pool.available(), 16u);
+
+	// more encryptions than ready randomizers, the rest is computed online
+	mpz_t pt, ct, dec;
+	mpz_inits(pt, ct, dec, NULL);
+	for(int i = 0; i < 20; i++) {
+		aby_prng(pt, 1000);
+		djn_encrypt_pool(ct, pub, pool, pt);
+		djn_decrypt(dec, pub, prv, ct);
+		ASSERT_EQ(mpz_cmp(dec, pt), 0);
+	}
+
+	// persisted randomizers move to another pool of the same key exactly once
+	const char* path = "test_randomizers.bin";
+	pool.wait();
+	ASSERT_TRUE(pool.store(path));
+	randomizer_pipeline loaded(pub->h_s, pub->n_squared, pub->rbits, 0);
+	ASSERT_TRUE(loaded.load(path));
+	ASSERT_EQ(loaded.available(), 16u);
+	ASSERT_FALSE(loaded.load(path));
+	for(int i = 0; i < 16; i++) {
+		aby_prng(pt, 1000);
+		djn_encrypt_pool(ct, pub, loaded, pt);
+		djn_decrypt(dec, pub, prv, ct);
+		ASSERT_EQ(mpz_cmp(dec, pt), 0);
+	}
+	ASSERT_EQ(loaded.available(), 0u);
+
+	// randomizers of another key are rejected
+	ASSERT_TRUE(loaded.store(path));
+	randomizer_pipeline other(pub->h, pub->n_squared, pub->rbits, 0);
+	ASSERT_FALSE(other.load(path));
+
+	// as are files other users could have read
+	struct stat st;
+	ASSERT_EQ(stat(path, &st), 0);
+	ASSERT_EQ(st.st_mode & 0777, 0600u);
+	ASSERT_EQ(chmod(path, 0644), 0);
+	ASSERT_FALSE(loaded.load(path));
+	remove(path);
+
+	mpz_clears(pt, ct, dec, NULL);
+	djn_freepubkey(pub);
+	djn_freeprvkey(prv);
+}
+
+// dgk_keygen may create faulty keys, these are detected by trial encryptions as in createKeys()
+static void dgk_keygen_valid(unsigned int modulusbits, unsigned int lbits, dgk_pubkey_t** pub, dgk_prvkey_t** prv) {
+	mpz_t msg, ct, dec;
+	mpz_inits(msg, ct, dec, NULL);
+	for(bool valid = false; !valid;) {
+		dgk_keygen(modulusbits, lbits, pub, prv);
+		valid = true;
+		for(int i = 0; i < 20 && valid; i++) {
+			aby_prng(msg, (*pub)->lbits);
+			dgk_encrypt_plain(ct, *pub, msg);
+			dgk_decrypt(dec, *pub, *prv, ct);
+			valid = mpz_cmp(msg, dec) == 0;
+		}
+		if(!valid) {
+			dgk_freepubkey(*pub);
+			dgk_freeprvkey(*prv);
+		}
+	}
+	mpz_clears(msg, ct, dec, NULL);
+}
+
+TEST(TestHomomorphic, DGKEncryptBatch) {
+	dgk_pubkey_t* pub;
+	dgk_prvkey_t* prv;
+	dgk_keygen_valid(1024, 16, &pub, &prv);
+
+	const size_t n = 40;
+	mpz_array pt(n), ct(n);
+	mpz_t dec;
+	mpz_init(dec);
+	for(size_t i = 0; i < n; i++) {
+		aby_prng(pt.v[i], 16);
+	}
+
+	randomizer_pipeline randomizers(pub->h, pub->n, DGK_RANDOM_BITS, n, 2);
+	randomizers.wait();
+
+	for(dgk_prvkey_t* key : {prv, static_cast<dgk_prvkey_t*>(nullptr)}) {
+		dgk_encrypt_batch(ct.v, pub, key, pt.v, n);
+		for(size_t i = 0; i < n; i++) {
+			dgk_decrypt(dec, pub, prv, ct.v[i]);
+			ASSERT_EQ(mpz_cmp(dec, pt.v[i]), 0) << i;
+		}
+	}
+	thread_pool pool(2);
+	dgk_encrypt_batch(ct.v, pub, nullptr, pt.v, n, &pool, &randomizers);
+	for(size_t i = 0; i < n; i++) {
+		dgk_decrypt(dec, pub, prv, ct.v[i]);
+		ASSERT_EQ(mpz_cmp(dec, pt.v[i]), 0) << i;
+	}
+	ASSERT_EQ(randomizers.available(), 0u);
+
+	mpz_clear(dec);
+	dgk_freepubkey(pub);
+	dgk_freeprvkey(prv);
+}
+
+TEST(TestHomomorphic, DGKDecryptTables) {
+	// single table lookups up to 18 bit plaintext spaces (l = 4, 8), windows above (l = 16, 32)
+	for(unsigned int l : {4u, 8u, 16u, 32u}) {
+		dgk_pubkey_t* pub;
+		dgk_prvkey_t* prv;
+		dgk_keygen_valid(1024, l, &pub, &prv);
+
+		const size_t n = 24;
+		mpz_array pt(n), ct(n), dec(n);
+		for(size_t i = 0; i < n; i++) {
+			aby_prng(pt.v[i], pub->lbits);
+		}
+		mpz_set_ui(pt.v[0], 0);
+		mpz_set_ui(pt.v[1], 0);
+		mpz_setbit(pt.v[1], pub->lbits);
+		mpz_sub_ui(pt.v[1], pt.v[1], 1);
+
+		dgk_encrypt_batch(ct.v, pub, prv, pt.v, n);
+		thread_pool pool(2);
+		dgk_decrypt_batch(dec.v, pub, prv, ct.v, n, &pool);
+		for(size_t i = 0; i < n; i++) {
+			ASSERT_EQ(mpz_cmp(dec.v[i], pt.v[i]), 0) << "l = " << l << ", i = " << i;
+			dgk_decrypt(dec.v[i], pub, prv, ct.v[i]);
+			ASSERT_EQ(mpz_cmp(dec.v[i], pt.v[i]), 0) << "l = " << l << ", i = " << i;
+		}
+
+		dgk_freepubkey(pub);
+		dgk_freeprvkey(prv);
+	}
+}
+
+TEST(TestHomomorphic, DGKZeroTest) {
+	dgk_pubkey_t* pub;
+	dgk_prvkey_t* prv;
+	dgk_keygen_valid(1024, 16, &pub, &prv);
+
+	const size_t n = 32;
+	mpz_array pt(n), ct(n);
+	for(size_t i = 0; i < n; i++) {
+		mpz_set_ui(pt.v[i], i % 5 == 3 ? 0 : i + 1);
+	}
+	dgk_encrypt_batch(ct.v, pub, prv, pt.v, n);
+
+	thread_pool pool(3);
+	bool zero[n];
+	dgk_is_zero_batch(zero, pub, prv, ct.v, n, &pool);
+	for(size_t i = 0; i < n; i++) {
+		ASSERT_EQ(zero[i], i % 5 == 3) << i;
+		ASSERT_EQ(dgk_is_zero(pub, prv, ct.v[i]), i % 5 == 3) << i;
+	}
+
+	size_t index = n;
+	ASSERT_TRUE(dgk_any_zero(pub, prv, ct.v, n, &pool, &index));
+	ASSERT_EQ(index % 5, 3u);
+	// the ciphertexts at 0, 1 and 2 are non-zero
+	ASSERT_FALSE(dgk_any_zero(pub, prv, ct.v, 3, &pool, &index));
+
+	dgk_freepubkey(pub);
+	dgk_freeprvkey(prv);
+}
+
+TEST(TestHomomorphic, KeygenOptions) {
+	keygen_options options;
+	options.threads = 3;
+	std::vector<std::string> done;
+	options.progress = [&done](const keygen_progress& progress) {
+		if(progress.done) {
+			done.push_back(progress.stage);
+			ASSERT_GT(progress.tests, 0u);
+			ASSERT_GE(progress.candidates, progress.tests / 2);
+		}
+	};
+
+	djn_pubkey_t* djn_pub;
+	djn_prvkey_t* djn_prv;
+	ASSERT_TRUE(djn_keygen(1024, &djn_pub, &djn_prv, options));
+	ASSERT_GE(done.size(), 2u);
+	ASSERT_EQ(done[0], "p");
+	ASSERT_EQ(done[1], "q");
+	ASSERT_EQ(mpz_fdiv_ui(djn_prv->p, 4), 3u);
+	ASSERT_EQ(mpz_fdiv_ui(djn_prv->q, 4), 3u);
+	mpz_t pt, ct, dec;
+	mpz_inits(pt, ct, dec, NULL);
+	aby_prng(pt, 1000);
+	djn_encrypt_crt(ct, djn_pub, djn_prv, pt);
+	djn_decrypt(dec, djn_pub, djn_prv, ct);
+	ASSERT_EQ(mpz_cmp(dec, pt), 0);
+	djn_freepubkey(djn_pub);
+	djn_freeprvkey(djn_prv);
+
+	done.clear();
+	dgk_pubkey_t* dgk_pub;
+	dgk_prvkey_t* dgk_prv;
+	ASSERT_TRUE(dgk_keygen(1024, 16, &dgk_pub, &dgk_prv, options));
+	ASSERT_EQ(done, std::vector<std::string>({"p", "q"}));
+	ASSERT_TRUE(mpz_probab_prime_p(dgk_prv->p, 25));
+	ASSERT_TRUE(mpz_probab_prime_p(dgk_prv->q, 25));
+	dgk_freepubkey(dgk_pub);
+	dgk_freeprvkey(dgk_prv);
+
+	// a cancelled key generation returns no keys
+	std::atomic<bool> cancel(true);
+	options.cancel = &cancel;
+	ASSERT_FALSE(djn_keygen(2048, &djn_pub, &djn_prv, options));
+	ASSERT_EQ(djn_pub, nullptr);
+	ASSERT_FALSE(dgk_keygen(2048, 16, &dgk_pub, &dgk_prv, options));
+	ASSERT_EQ(dgk_prv, nullptr);
+
+	mpz_clears(pt, ct, dec, NULL);
+}
+
+TEST(TestHomomorphic, KeyFiles) {
+	dgk_pubkey_t* pub;
+	dgk_prvkey_t* prv;
+	dgk_keygen_valid(1024, 16, &pub, &prv);
+	const char* path = "test_key.bin";
+	ASSERT_TRUE(dgk_write_keyfile(path, pub, prv));
+	// the private key is only readable by its owner
+	struct stat st;
+	ASSERT_EQ(stat(path, &st), 0);
+	ASSERT_EQ(st.st_mode & 0777, 0600u);
+
+	dgk_pubkey_t* pub2;
+	dgk_prvkey_t* prv2;
+	std::unique_ptr<FixedBasePowmod> fb_g, fb_h;
+	ASSERT_TRUE(dgk_read_keyfile(path, &pub2, &prv2, &fb_g, &fb_h));
+	ASSERT_NE(prv2, nullptr);
+	ASSERT_EQ(pub2->bits, pub->bits);
+	ASSERT_EQ(pub2->lbits, pub->lbits);
+	for(auto v : {std::make_pair(pub->n, pub2->n), {pub->g, pub2->g}, {pub->h, pub2->h}, {prv->p, prv2->p},
+			{prv->vq, prv2->vq}, {prv->qinv, prv2->qinv}}) {
+		ASSERT_EQ(mpz_cmp(v.first, v.second), 0);
+	}
+	mpz_t pt, ct, dec;
+	mpz_inits(pt, ct, dec, NULL);
+	for(int i = 0; i < 10; i++) {
+		aby_prng(pt, pub->lbits);
+		dgk_encrypt_fb(ct, pub2, *fb_g, *fb_h, pt);
+		dgk_decrypt(dec, pub2, prv2, ct);
+		ASSERT_EQ(mpz_cmp(dec, pt), 0);
+	}
+	dgk_freepubkey(pub2);
+	dgk_freeprvkey(prv2);
+
+	// public key only
+	ASSERT_TRUE(dgk_write_keyfile(path, pub, nullptr));
+	ASSERT_TRUE(dgk_read_keyfile(path, &pub2, &prv2));
+	ASSERT_EQ(prv2, nullptr);
+	ASSERT_EQ(mpz_cmp(pub->h, pub2->h), 0);
+	dgk_freepubkey(pub2);
+	dgk_freepubkey(pub);
+	dgk_freeprvkey(prv);
+
+	djn_pubkey_t* djn_pub;
+	djn_prvkey_t* djn_prv;
+	djn_keygen(1024, &djn_pub, &djn_prv);
+	ASSERT_TRUE(djn_write_keyfile(path, djn_pub, djn_prv));
+	// a DJN file is no DGK key
+	ASSERT_FALSE(dgk_read_keyfile(path, &pub2, &prv2));
+	djn_pubkey_t* djn_pub2;
+	djn_prvkey_t* djn_prv2;
+	std::unique_ptr<FixedBasePowmod> fb_hs;
+	ASSERT_TRUE(djn_read_keyfile(path, &djn_pub2, &djn_prv2, &fb_hs));
+	ASSERT_EQ(djn_pub2->rbits, djn_pub->rbits);
+	aby_prng(pt, 1000);
+	djn_encrypt_fb(ct, djn_pub2, *fb_hs, pt);
+	djn_decrypt(dec, djn_pub2, djn_prv2, ct);
+	ASSERT_EQ(mpz_cmp(dec, pt), 0);
+	djn_encrypt_crt(ct, djn_pub2, djn_prv2, pt);
+	djn_decrypt(dec, djn_pub, djn_prv, ct);
+	ASSERT_EQ(mpz_cmp(dec, pt), 0);
+	djn_freepubkey(djn_pub2);
+	djn_freeprvkey(djn_prv2);
+
+	// a flipped bit is detected by the checksum
+	FILE* fp = fopen(path, "r+b");
+	ASSERT_NE(fp, nullptr);
+	fseek(fp, 200, SEEK_SET);
+	int c = fgetc(fp);
+	fseek(fp, 200, SEEK_SET);
+	fputc(c ^ 1, fp);
+	fclose(fp);
+	ASSERT_FALSE(djn_read_keyfile(path, &djn_pub2, &djn_prv2));
+	remove(path);
+
+	mpz_clears(pt, ct, dec, NULL);
+	djn_freepubkey(djn_pub);
+	djn_freeprvkey(djn_prv);
+}
+
+TEST(TestHomomorphic, Contexts) {
+	// two DGK keys in use at once, the process-wide tables belong to the second one
+	std::vector<std::unique_ptr<dgk_context>> dgk;
+	for(unsigned l : {16u, 24u}) {
+		dgk_pubkey_t* pub;
+		dgk_prvkey_t* prv;
+		dgk_keygen_valid(1024, l, &pub, &prv);
+		dgk.push_back(std::make_unique<dgk_context>(pub, prv));
+	}
+	const size_t n = 16;
+	std::vector<std::thread> threads;
+	std::vector<int> failures(4, 0);
+	for(size_t t = 0; t < 4; t++) {
+		threads.emplace_back([&, t] {
+			const dgk_context& ctx = *dgk[t % 2];
+			mpz_array pt(n), ct(n), dec(n);
+			for(size_t i = 0; i < n; i++) {
+				aby_prng(pt.v[i], ctx.pub()->lbits);
+				ctx.encrypt(ct.v[i], pt.v[i]);
+				ctx.decrypt(dec.v[i], ct.v[i]);
+				failures[t] += mpz_cmp(dec.v[i], pt.v[i]) != 0;
+			}
+			thread_pool pool(1);
+			ctx.encrypt_batch(ct.v, pt.v, n, &pool);
+			ctx.decrypt_batch(dec.v, ct.v, n, &pool);
+			for(size_t i = 0; i < n; i++) {
+				failures[t] += mpz_cmp(dec.v[i], pt.v[i]) != 0;
+			}
+		});
+	}
+	for(auto& t : threads) {
+		t.join();
+	}
+	for(int f : failures) {
+		ASSERT_EQ(f, 0);
+	}
+
+	mpz_t pt, ct, dec;
+	mpz_inits(pt, ct, dec, NULL);
+	const char* path = "test_context_key.bin";
+	ASSERT_TRUE(dgk[0]->write_keyfile(path));
+	auto loaded = dgk_context::read_keyfile(path);
+	ASSERT_NE(loaded, nullptr);
+	aby_prng(pt, 16);
+	loaded->encrypt(ct, pt);
+	dgk[0]->decrypt(dec, ct);
+	ASSERT_EQ(mpz_cmp(dec, pt), 0);
+	remove(path);
+
+	auto djn = djn_context::keygen(1024);
+	ASSERT_NE(djn, nullptr);
+	ASSERT_TRUE(djn->write_keyfile(path));
+	auto djn_loaded = djn_context::read_keyfile(path);
+	ASSERT_NE(djn_loaded, nullptr);
+	aby_prng(pt, 1000);
+	djn_loaded->encrypt(ct, pt);
+	djn->decrypt(dec, ct);
+	ASSERT_EQ(mpz_cmp(dec, pt), 0);
+	mpz_array pts(n), cts(n), decs(n);
+	for(size_t i = 0; i < n; i++) {
+		aby_prng(pts.v[i], 1000);
+	}
+	djn->encrypt_batch(cts.v, pts.v, n);
+	for(size_t i = 0; i < n; i++) {
+		djn_loaded->decrypt(decs.v[i], cts.v[i]);
+		ASSERT_EQ(mpz_cmp(decs.v[i], pts.v[i]), 0);
+	}
+	remove(path);
+	mpz_clears(pt, ct, dec, NULL);
+}
+
+TEST(TestHomomorphic, DJNEvaluator) {
+	auto ctx = djn_context::keygen(1024);
+	ASSERT_NE(ctx, nullptr);
+	djn_evaluator ev(*ctx);
+	const size_t n = 20;
+	mpz_array pt(n), k(n), ct(n), dec(n);
+	mpz_t expected, tmp;
+	mpz_inits(expected, tmp, NULL);
+	for(size_t i = 0; i < n; i++) {
+		aby_prng(pt.v[i], 1000);
+		aby_prng(k.v[i], 16 + 50 * i);
+		ctx->encrypt(ct.v[i], pt.v[i]);
+	}
+	// a negative scalar is taken modulo n
+	mpz_neg(k.v[3], k.v[3]);
+	std::vector<mp_limb_t> c = ev.alloc(n), r = ev.alloc(2);
+	ev.import_ct(c.data(), ct.v, n);
+
+	ev.add(r.data(), c.data(), c.data() + ev.limbs());
+	ev.sub(r.data(), r.data(), c.data() + 2 * ev.limbs());
+	ev.add_plain(r.data(), r.data(), k.v[0]);
+	ev.rerandomize(r.data() + ev.limbs(), r.data());
+	ev.export_ct(ct.v, r.data(), 2);
+	mpz_add(expected, pt.v[0], pt.v[1]);
+	mpz_sub(expected, expected, pt.v[2]);
+	mpz_add(expected, expected, k.v[0]);
+	mpz_mod(expected, expected, ctx->pub()->n);
+	ctx->decrypt(dec.v[0], ct.v[0]);
+	ctx->decrypt(dec.v[1], ct.v[1]);
+	ASSERT_EQ(mpz_cmp(dec.v[0], expected), 0);
+	ASSERT_EQ(mpz_cmp(dec.v[1], expected), 0);
+	ASSERT_NE(mpz_cmp(ct.v[0], ct.v[1]), 0);
+
+	mpz_set_ui(expected, 0);
+	for(size_t i = 0; i < n; i++) {
+		ev.scalar_mul(r.data(), c.data() + i * ev.limbs(), k.v[i]);
+		ev.export_ct(ct.v[0], r.data());
+		ctx->decrypt(dec.v[0], ct.v[0]);
+		mpz_mul(tmp, pt.v[i], k.v[i]);
+		mpz_mod(tmp, tmp, ctx->pub()->n);
+		ASSERT_EQ(mpz_cmp(dec.v[0], tmp), 0) << "scalar " << i;
+		mpz_add(expected, expected, tmp);
+	}
+	mpz_mod(expected, expected, ctx->pub()->n);
+	ev.inner_product(r.data(), c.data(), k.v, n);
+	ev.export_ct(ct.v[0], r.data());
+	ctx->decrypt(dec.v[0], ct.v[0]);
+	ASSERT_EQ(mpz_cmp(dec.v[0], expected), 0);
+	mpz_clears(expected, tmp, NULL);
+}
@@ -0,0 +1,222 @@
+
+#include <gtest/gtest.h>
+#include "ENCRYPTO_utils/crypto/batch.h"
+#include "ENCRYPTO_utils/powmod.h"
+#include <atomic>
+#include <gmp.h>
+#include <thread>
+#include <vector>
+
+
+class TestPowmod : public ::testing::Test {
+protected:
+	void SetUp() override {
+		gmp_randinit_default(rnd);
+		gmp_randseed_ui(rnd, 42);
+		mpz_inits(base, mod, exp, expected, result, NULL);
+	}
+
+	void TearDown() override {
+		mpz_clears(base, mod, exp, expected, result, NULL);
+		gmp_randclear(rnd);
+	}
+
+	// compares the table against mpz_powm for random exponents of up to bitsize bits
+	void check(const FixedBasePowmod& fb, size_t bitsize, int iterations) {
+		for(int i = 0; i < iterations; i++) {
+			mpz_urandomb(exp, rnd, bitsize - i % 3);
+			fb.pow(result, exp);
+			mpz_powm(expected, base, exp, mod);
+			ASSERT_EQ(mpz_cmp(result, expected), 0) << "exponent " << mpz_get_str(nullptr, 16, exp);
+		}
+	}
+
+	gmp_randstate_t rnd;
+	mpz_t base, mod, exp, expected, result;
+};
+
+TEST_F(TestPowmod, FixedBaseMatchesPowm) {
+	for(unsigned bits : {64u, 1024u, 2048u}) {
+		mpz_urandomb(mod, rnd, bits);
+		mpz_setbit(mod, bits - 1);
+		mpz_setbit(mod, 0);
+		mpz_urandomm(base, rnd, mod);
+		for(unsigned window : {0u, 1u, 3u, 8u}) {
+			for(unsigned blocks : {1u, 2u, 5u}) {
+				FixedBasePowmod fb(base, mod, 400, window, blocks);
+				check(fb, 400, 10);
+			}
+		}
+	}
+
+	// even moduli do not use Montgomery form
+	mpz_urandomb(mod, rnd, 1024);
+	mpz_setbit(mod, 1023);
+	mpz_clrbit(mod, 0);
+	mpz_urandomm(base, rnd, mod);
+	FixedBasePowmod fb(base, mod, 160);
+	check(fb, 160, 20);
+
+	// special exponents: zero, all ones and too long for the table
+	mpz_set_ui(exp, 0);
+	fb.pow(result, exp);
+	ASSERT_EQ(mpz_cmp_ui(result, 1), 0);
+	for(size_t bits : {160, 161, 500}) {
+		mpz_set_ui(exp, 0);
+		mpz_setbit(exp, bits);
+		mpz_sub_ui(exp, exp, 1);
+		fb.pow(result, exp);
+		mpz_powm(expected, base, exp, mod);
+		ASSERT_EQ(mpz_cmp(result, expected), 0);
+	}
+
+	// result aliasing the exponent
+	mpz_urandomb(exp, rnd, 160);
+	mpz_powm(expected, base, exp, mod);
+	fb.pow(exp, exp);
+	ASSERT_EQ(mpz_cmp(exp, expected), 0);
+}
+
+TEST_F(TestPowmod, ConcurrentInstances) {
+	mpz_t base2, mod2;
+	mpz_inits(base2, mod2, NULL);
+	mpz_urandomb(mod, rnd, 1024);
+	mpz_setbit(mod, 0);
+	mpz_urandomm(base, rnd, mod);
+	mpz_urandomb(mod2, rnd, 2048);
+	mpz_setbit(mod2, 0);
+	mpz_urandomm(base2, rnd, mod2);
+
+	FixedBasePowmod fb1(base, mod, 256);
+	FixedBasePowmod fb2(base2, mod2, 256);
+
+	// both tables are shared by several threads
+	std::vector<std::thread> threads;
+	std::atomic<int> mismatches(0);
+	for(int t = 0; t < 4; t++) {
+		threads.emplace_back([&, t] {
+			mpz_t e, r, x;
+			mpz_inits(e, r, x, NULL);
+			for(int i = 0; i < 20; i++) {
+				mpz_set_ui(e, 1000003 * (t + 1) + i);
+				mpz_mul(e, e, e);
+				const FixedBasePowmod& fb = (i % 2) ? fb1 : fb2;
+				fb.pow(r, e);
+				mpz_powm(x, (i % 2) ? base : base2, e, (i % 2) ? mod : mod2);
+				if(mpz_cmp(r, x)) {
+					mismatches++;
+				}
+			}
+			mpz_clears(e, r, x, NULL);
+		});
+	}
+	for(auto& t : threads) {
+		t.join();
+	}
+	ASSERT_EQ(mismatches, 0);
+	mpz_clears(base2, mod2, NULL);
+}
+
+TEST_F(TestPowmod, DoubleBaseMatchesPowm) {
+	mpz_t base2, exp2, tmp;
+	mpz_inits(base2, exp2, tmp, NULL);
+	mpz_urandomb(mod, rnd, 1024);
+	mpz_setbit(mod, 0);
+	mpz_urandomm(base, rnd, mod);
+	mpz_urandomm(base2, rnd, mod);
+	DoubleBasePowmod db(base, base2, mod);
+	for(int i = 0; i < 10; i++) {
+		mpz_urandomb(exp, rnd, 32 * (i + 1));
+		mpz_urandomb(exp2, rnd, 400);
+		db.pow(result, exp, exp2);
+		mpz_powm(expected, base, exp, mod);
+		mpz_powm(tmp, base2, exp2, mod);
+		mpz_mul(expected, expected, tmp);
+		mpz_mod(expected, expected, mod);
+		ASSERT_EQ(mpz_cmp(result, expected), 0);
+	}
+	mpz_clears(base2, exp2, tmp, NULL);
+}
+
+TEST_F(TestPowmod, MontgomeryMatchesPowm) {
+	const size_t count = 7;
+	for(bool odd : {true, false}) {
+		mpz_urandomb(mod, rnd, 2048);
+		mpz_setbit(mod, 2047);
+		odd ? mpz_setbit(mod, 0) : mpz_clrbit(mod, 0);
+		MontgomeryContext mc(mod);
+		std::vector<mp_limb_t> a(count * mc.limbs()), r(mc.limbs());
+		mpz_t exps[count];
+		mpz_set_ui(expected, 1);
+		for(size_t i = 0; i < count; i++) {
+			mpz_init(exps[i]);
+			mpz_urandomm(base, rnd, mod);
+			mpz_urandomb(exps[i], rnd, i == 0 ? 0 : 100 * i);
+			mc.import(a.data() + i * mc.limbs(), base);
+			mc.pow(r.data(), a.data() + i * mc.limbs(), exps[i]);
+			mc.to_mpz(result, r.data());
+			mpz_powm(exp, base, exps[i], mod);
+			ASSERT_EQ(mpz_cmp(result, exp), 0);
+			mpz_mul(expected, expected, exp);
+			mpz_mod(expected, expected, mod);
+		}
+		mc.pow_product(r.data(), a.data(), exps, count);
+		mc.to_mpz(result, r.data());
+		ASSERT_EQ(mpz_cmp(result, expected), 0);
+		for(size_t i = 0; i < count; i++) {
+			mpz_clear(exps[i]);
+		}
+	}
+}
+
+TEST_F(TestPowmod, MultiExpMatchesPowm) {
+	thread_pool pool(3);
+	const size_t count = 300;
+	mpz_t bases[count], exps[count];
+	for(size_t i = 0; i < count; i++) {
+		mpz_inits(bases[i], exps[i], NULL);
+	}
+	// a prime, a square as the DJN n^2 and an even modulus
+	for(int m = 0; m < 3; m++) {
+		mpz_urandomb(mod, rnd, 1024);
+		mpz_setbit(mod, 1023);
+		if(m == 0) {
+			mpz_nextprime(mod, mod);
+		} else if(m == 1) {
+			mpz_setbit(mod, 0);
+			mpz_mul(mod, mod, mod);
+		} else {
+			mpz_clrbit(mod, 0);
+		}
+		// Straus for few bases, Pippenger for many
+		for(size_t n : {size_t(1), size_t(2), size_t(5), size_t(40), count}) {
+			mpz_set_ui(expected, 1);
+			for(size_t i = 0; i < n; i++) {
+				mpz_urandomm(bases[i], rnd, mod);
+				mpz_urandomb(exps[i], rnd, (i % 4 == 3) ? 10 : 512);
+				mpz_powm(exp, bases[i], exps[i], mod);
+				mpz_mul(expected, expected, exp);
+				mpz_mod(expected, expected, mod);
+			}
+			multipowmod(result, bases, exps, n, mod);
+			ASSERT_EQ(mpz_cmp(result, expected), 0) << "modulus " << m << ", " << n << " bases";
+			multipowmod(result, bases, exps, n, mod, &pool);
+			ASSERT_EQ(mpz_cmp(result, expected), 0) << "modulus " << m << ", " << n << " bases on a pool";
+		}
+	}
+	// a loop nested in a loop of the same pool runs on the calling thread instead of waiting for the pool
+	mpz_t nested[4];
+	pool.parallel_for(4, [&](unsigned, size_t begin, size_t end) {
+		for(size_t i = begin; i < end; i++) {
+			mpz_init(nested[i]);
+			multipowmod(nested[i], bases, exps, count, mod, &pool);
+		}
+	});
+	for(size_t i = 0; i < 4; i++) {
+		ASSERT_EQ(mpz_cmp(nested[i], expected), 0);
+		mpz_clear(nested[i]);
+	}
+	for(size_t i = 0; i < count; i++) {
+		mpz_clears(bases[i], exps[i], NULL);
+	}
+}